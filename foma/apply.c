@@ -20,8 +20,17 @@
 #include <time.h>
 #include <string.h>
 #include <limits.h>
+#include <float.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "foma.h"
 
+/* Vectorized arc search on x86 unless built with -DFOMA_NO_SIMD */
+#if !defined(FOMA_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define APPLY_USE_SIMD
+#include <immintrin.h>
+#endif
+
 #define RANDOM 1
 #define ENUMERATE 2
 #define MATCH 4
@@ -39,6 +48,14 @@
 
 #define APPLY_BINSEARCH_THRESHOLD 10
 
+/* Default path length bound for uniform sampling of cyclic nets, and */
+/* the number of draws rejected by flags or dead ends before giving up */
+#define APPLY_SAMPLE_LENGTH 32
+#define APPLY_SAMPLE_TRIES 1000
+#define APPLY_ACCEPT_MAX_STATES 1000000
+/* Search nodes a completion expands when the caller gives no bound */
+#define APPLY_CURSOR_MAX_NODES 100000
+
 #define BITMASK(b) (1 << ((b) & 7))
 #define BITSLOT(b) ((b) >> 3)
 #define BITSET(a,b) ((a)[BITSLOT(b)] |= BITMASK(b))
@@ -50,241 +67,2869 @@
 
 static int apply_append(struct apply_handle *h, int cptr, int sym);
 static char *apply_net(struct apply_handle *h);
-static void apply_create_statemap(struct apply_handle *h,struct fsm *net);
-static void apply_create_sigarray(struct apply_handle *h,struct fsm *net);
+static void apply_create_arcarrays(struct apply_shared *sh,struct fsm *net);
+static void apply_create_sigarray(struct apply_shared *sh,struct fsm *net);
 static void apply_create_sigmatch(struct apply_handle *h);
+static void apply_create_tokenizer(struct apply_shared *sh, struct fsm *net);
 int apply_match_length(struct apply_handle *h, int symbol);
 static int apply_match_str(struct apply_handle *h,int symbol, int position);
-static void apply_add_flag(struct apply_handle *h,char *name);
-static int apply_check_flag(struct apply_handle *h,int type, char *name, char *value);
+static void apply_intern_flags(struct apply_shared *sh);
+static int apply_check_flag(struct apply_handle *h,int type, int name, int value);
 static void apply_clear_flags(struct apply_handle *h);
 void apply_set_iptr(struct apply_handle *h);
-void apply_mark_flagstates(struct apply_handle *h);
-void apply_clear_index(struct apply_handle *h);
+void apply_mark_flagstates(struct apply_shared *sh);
+void apply_clear_index(struct apply_shared *sh);
+static void apply_clear_compact_index(struct apply_compact_index *ci);
+static void apply_set_cidx(struct apply_handle *h, struct apply_compact_index *ci);
+static void apply_cache_flush(struct apply_handle *h);
+static void apply_select_search(struct apply_shared *sh);
+static void apply_cache_abandon(struct apply_handle *h);
 
 static void apply_stack_clear(struct apply_handle *h);
 static int apply_stack_isempty(struct apply_handle *h);
 static void apply_stack_pop (struct apply_handle *h);
-static void apply_stack_push (struct apply_handle *h, int vmark, char *sflagname, char *sflagvalue, int sflagneg);
+static void apply_stack_push (struct apply_handle *h, int vmark, int sflagreg, int sflagold);
 static void apply_force_clear_stack(struct apply_handle *h);
+static void apply_limit_start(struct apply_handle *h);
+static int apply_limit_step(struct apply_handle *h);
+static int apply_limit_result(struct apply_handle *h);
+static void apply_enum_task(struct apply_handle *h);
+static void apply_prune_prepare(struct apply_handle *h);
 
 
+/* The output settings change what a lookup returns, so they */
+/* invalidate any cached results                              */
+
 void apply_set_obey_flags(struct apply_handle *h, int value) {
     h->obey_flags = value;
+    apply_cache_flush(h);
+}
+
+void apply_set_show_flags(struct apply_handle *h, int value) {
+    h->show_flags = value;
+    apply_cache_flush(h);
+}
+
+void apply_set_print_space(struct apply_handle *h, int value) {
+    h->print_space = value;
+    h->space_symbol = " ";
+    apply_cache_flush(h);
+}
+
+void apply_set_space_symbol(struct apply_handle *h, char *space) {
+    h->space_symbol = space;
+    h->print_space = 1;
+    apply_cache_flush(h);
+}
+
+void apply_set_print_pairs(struct apply_handle *h, int value) {
+    h->print_pairs = value;
+    apply_cache_flush(h);
+}
+
+/* Result cache for apply_up()/apply_down().  A miss runs the search */
+/* as usual and collects the results as they are handed out; once   */
+/* the caller has iterated to the end, the complete list is stored. */
+/* A hit replays the stored list through the same iterator calls.   */
+/* Searches abandoned before the end are not cached.                */
+
+static unsigned int apply_cache_hashf(char *word, int mode) {
+    unsigned int hash;
+    for (hash = mode; *word != '\0'; word++) {
+	hash = hash * 101 + (unsigned char) *word;
+    }
+    return hash;
+}
+
+static void apply_cache_unlink(struct apply_cache *c, struct apply_cache_entry *e) {
+    if (e->prev != NULL)
+	e->prev->next = e->next;
+    else
+	c->lru_head = e->next;
+    if (e->next != NULL)
+	e->next->prev = e->prev;
+    else
+	c->lru_tail = e->prev;
+}
+
+static void apply_cache_link_head(struct apply_cache *c, struct apply_cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->lru_head;
+    if (c->lru_head != NULL)
+	c->lru_head->prev = e;
+    else
+	c->lru_tail = e;
+    c->lru_head = e;
+}
+
+static void apply_cache_evict(struct apply_cache *c) {
+    struct apply_cache_entry *e, **ep;
+    e = c->lru_tail;
+    for (ep = c->table + (e->hash & c->tablemask); *ep != e; ep = &((*ep)->hnext)) { }
+    *ep = e->hnext;
+    apply_cache_unlink(c, e);
+    c->used_bytes -= e->size;
+    xxfree(e);
+}
+
+static void apply_cache_flush(struct apply_handle *h) {
+    if (h->cache == NULL)
+	return;
+    apply_cache_abandon(h);
+    while (h->cache->lru_tail != NULL) {
+	apply_cache_evict(h->cache);
+    }
+}
+
+static void apply_cache_abandon(struct apply_handle *h) {
+    if (h->cache == NULL)
+	return;
+    h->cache->replay = NULL;
+    h->cache->recording = 0;
+}
+
+/* Sets the cache size in bytes, 0 disables the cache */
+void apply_set_cache(struct apply_handle *h, size_t max_bytes) {
+    unsigned int tablesize;
+    if (h->cache != NULL) {
+	apply_cache_flush(h);
+	xxfree(h->cache->table);
+	xxfree(h->cache->rec);
+	xxfree(h->cache);
+	h->cache = NULL;
+    }
+    if (max_bytes == 0)
+	return;
+    /* Aim for roughly one bucket per expected entry */
+    for (tablesize = 256; tablesize < max_bytes / 128 && tablesize < (1 << 22); tablesize <<= 1) { }
+    h->cache = xxcalloc(1, sizeof(struct apply_cache));
+    h->cache->table = xxcalloc(tablesize, sizeof(struct apply_cache_entry *));
+    h->cache->tablemask = tablesize - 1;
+    h->cache->max_bytes = max_bytes;
+    h->cache->rec_size = 256;
+    h->cache->rec = xxmalloc(h->cache->rec_size);
+}
+
+void apply_get_cache_stats(struct apply_handle *h, unsigned long *hits, unsigned long *misses) {
+    *hits = h->cache != NULL ? h->cache->hits : 0;
+    *misses = h->cache != NULL ? h->cache->misses : 0;
+}
+
+/* Without any limit set the search counts nothing */
+void apply_set_limits(struct apply_handle *h, long max_steps, int max_results, int max_length, int max_msec) {
+    if (max_steps <= 0 && max_results <= 0 && max_length <= 0 && max_msec <= 0) {
+	if (h->limits != NULL) {
+	    xxfree(h->limits);
+	    h->limits = NULL;
+	}
+	return;
+    }
+    if (h->limits == NULL) {
+	h->limits = xxcalloc(1, sizeof(struct apply_limits));
+    }
+    h->limits->max_steps = max_steps > 0 ? max_steps : 0;
+    h->limits->max_results = max_results > 0 ? max_results : 0;
+    h->limits->max_length = max_length > 0 ? max_length : 0;
+    h->limits->max_msec = max_msec > 0 ? max_msec : 0;
+}
+
+int apply_get_status(struct apply_handle *h) {
+    return(h->status);
+}
+
+double apply_limit_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Resets the counts for a new word */
+static void apply_limit_start(struct apply_handle *h) {
+    struct apply_limits *l;
+    h->status = APPLY_OK;
+    h->stopped = 0;
+    if ((l = h->limits) == NULL) {
+	return;
+    }
+    l->steps = 0;
+    l->numresults = 0;
+    if (l->max_msec) {
+	l->deadline = apply_limit_clock() + l->max_msec / 1000.0;
+    }
+}
+
+/* Abandons the search, leaving the marks and stack clean */
+static void apply_limit_stop(struct apply_handle *h, int status) {
+    h->status = status;
+    h->stopped = 1;
+    *(h->marks+h->state) = 0;
+    apply_force_clear_stack(h);
+}
+
+/* Counts one step of the search, returns 1 if it has to stop */
+static int apply_limit_step(struct apply_handle *h) {
+    struct apply_limits *l;
+    l = h->limits;
+    l->steps++;
+    if (l->max_steps && l->steps > l->max_steps) {
+	apply_limit_stop(h, APPLY_LIMIT_STEPS);
+	return 1;
+    }
+    if (l->max_msec && l->steps % APPLY_CLOCK_INTERVAL == 0 && apply_limit_clock() > l->deadline) {
+	apply_limit_stop(h, APPLY_LIMIT_TIME);
+	return 1;
+    }
+    return 0;
+}
+
+/* Counts a result about to be output, returns 1 if it has to stop */
+static int apply_limit_result(struct apply_handle *h) {
+    struct apply_limits *l;
+    l = h->limits;
+    if (l->max_results && l->numresults == l->max_results) {
+	apply_limit_stop(h, APPLY_LIMIT_RESULTS);
+	return 1;
+    }
+    l->numresults++;
+    return 0;
+}
+
+static struct apply_cache_entry *apply_cache_find(struct apply_handle *h, char *word) {
+    struct apply_cache *c;
+    struct apply_cache_entry *e;
+    unsigned int hash;
+    c = h->cache;
+    hash = apply_cache_hashf(word, h->mode);
+    for (e = *(c->table + (hash & c->tablemask)); e != NULL; e = e->hnext) {
+	if (e->hash == hash && e->mode == h->mode && strcmp(e->data, word) == 0) {
+	    apply_cache_unlink(c, e);
+	    apply_cache_link_head(c, e);
+	    return e;
+	}
+    }
+    return NULL;
+}
+
+static void apply_cache_rec_add(struct apply_cache *c, char *str) {
+    size_t len;
+    len = strlen(str) + 1;
+    if (sizeof(struct apply_cache_entry) + c->rec_used + len > c->max_bytes) {
+	c->recording = 0;  /* Too large to ever fit */
+	return;
+    }
+    while (c->rec_used + len > c->rec_size) {
+	c->rec_size *= 2;
+	c->rec = xxrealloc(c->rec, c->rec_size);
+    }
+    memcpy(c->rec + c->rec_used, str, len);
+    c->rec_used += len;
+}
+
+static void apply_cache_record_start(struct apply_handle *h, char *word) {
+    struct apply_cache *c;
+    c = h->cache;
+    c->recording = 1;
+    c->rec_used = 0;
+    c->rec_count = 0;
+    apply_cache_rec_add(c, word);
+}
+
+/* Called with each result of a search being recorded, and with NULL */
+/* when the search is exhausted                                       */
+static void apply_cache_record(struct apply_handle *h, char *result) {
+    struct apply_cache *c;
+    struct apply_cache_entry *e, **ep;
+    size_t size;
+    c = h->cache;
+    if (result != NULL) {
+	apply_cache_rec_add(c, result);
+	c->rec_count++;
+	return;
+    }
+    c->recording = 0;
+    size = sizeof(struct apply_cache_entry) + c->rec_used;
+    while (c->used_bytes + size > c->max_bytes && c->lru_tail != NULL) {
+	apply_cache_evict(c);
+    }
+    e = xxmalloc(size);
+    memcpy(e->data, c->rec, c->rec_used);
+    e->hash = apply_cache_hashf(e->data, h->mode);
+    e->mode = h->mode;
+    e->numresults = c->rec_count;
+    e->size = size;
+    ep = c->table + (e->hash & c->tablemask);
+    e->hnext = *ep;
+    *ep = e;
+    apply_cache_link_head(c, e);
+    c->used_bytes += size;
+}
+
+static char *apply_cache_next(struct apply_handle *h) {
+    struct apply_cache *c;
+    char *result;
+    c = h->cache;
+    if (h->limits != NULL && h->limits->max_results && c->replay_left > 0 && h->limits->numresults == h->limits->max_results) {
+	h->status = APPLY_LIMIT_RESULTS;
+	c->replay_left = 0;
+    }
+    if (c->replay_left == 0) {
+	c->replay = NULL;
+	return NULL;
+    }
+    result = c->replay_ptr;
+    c->replay_ptr += strlen(result) + 1;
+    c->replay_left--;
+    if (h->limits != NULL) {
+	h->limits->numresults++;
+    }
+    return result;
+}
+
+static void apply_force_clear_stack(struct apply_handle *h) {
+    /* Make sure stack is empty and marks reset */
+    if (!apply_stack_isempty(h)) {
+	*(h->marks+h->state) = 0;
+	while (!apply_stack_isempty(h)) {
+	    apply_stack_pop(h);
+	    *(h->marks+h->state) = 0;
+	}
+	h->iterator = 0;
+	h->iterate_old = 0;
+	apply_stack_clear(h);
+    }
+}
+
+char *apply_enumerate(struct apply_handle *h) {
+
+    char *result = NULL;
+    
+    if (h->last_net == NULL || h->last_net->finalcount == 0) {
+	return (NULL);
+    }
+    h->binsearch = 0;
+    h->prune = 0;
+    apply_cache_abandon(h);
+    if (h->iterator == 0) {
+        h->iterate_old = 0;
+	apply_force_clear_stack(h);
+        result = apply_net(h);
+	if ((h->mode & RANDOM) != RANDOM)
+	  (h->iterator)++;
+    } else {
+        h->iterate_old = 1;
+        result = apply_net(h);
+    }
+    return(result);
+}
+
+char *apply_words(struct apply_handle *h) {
+    h->mode = DOWN + ENUMERATE + LOWER + UPPER;
+    return(apply_enumerate(h));
+}
+
+char *apply_upper_words(struct apply_handle *h) {
+    h->mode = DOWN + ENUMERATE + UPPER;
+    return(apply_enumerate(h));
+}
+
+char *apply_lower_words(struct apply_handle *h) {
+    h->mode = DOWN + ENUMERATE + LOWER;
+    return(apply_enumerate(h));
+}
+
+/* A random walk that runs into a dead end gives nothing, and is */
+/* started over                                                   */
+static char *apply_random(struct apply_handle *h, int mode) {
+    char *result;
+    int tries;
+    for (tries = 0; tries < APPLY_SAMPLE_TRIES; tries++) {
+	apply_clear_flags(h);
+	h->mode = mode;
+	if ((result = apply_enumerate(h)) != NULL) {
+	    return(result);
+	}
+    }
+    return(NULL);
+}
+
+char *apply_random_words(struct apply_handle *h) {
+    return(apply_random(h, DOWN + ENUMERATE + LOWER + UPPER + RANDOM));
+}
+
+char *apply_random_lower(struct apply_handle *h) {
+    return(apply_random(h, DOWN + ENUMERATE + LOWER + RANDOM));
+}
+
+char *apply_random_upper(struct apply_handle *h) {
+    return(apply_random(h, DOWN + ENUMERATE + UPPER + RANDOM));
+}
+
+/* Each handle draws from its own generator (splitmix64), so handles */
+/* in different threads neither race nor share a sequence            */
+static uint64_t apply_rand_next(struct apply_handle *h) {
+    uint64_t z;
+    z = (h->rand_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return(z ^ (z >> 31));
+}
+
+/* Uniform in [0,1) */
+static double apply_rand_double(struct apply_handle *h) {
+    return((apply_rand_next(h) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+void apply_set_seed(struct apply_handle *h, unsigned long seed) {
+    h->rand_state = (uint64_t) seed;
+}
+
+static struct apply_sampler *apply_get_sampler(struct apply_handle *h) {
+    if (h->sampler == NULL) {
+	h->sampler = xxcalloc(1, sizeof(struct apply_sampler));
+	h->sampler->length = APPLY_SAMPLE_LENGTH;
+    }
+    return(h->sampler);
+}
+
+void apply_set_sample_length(struct apply_handle *h, int length) {
+    struct apply_sampler *sm;
+    sm = apply_get_sampler(h);
+    if (length < 0 || length == sm->length) {
+	return;
+    }
+    sm->length = length;
+    if (sm->counts != NULL && sm->rows > 1) {
+	xxfree(sm->counts);
+	sm->counts = NULL;
+    }
+}
+
+/* Counts the accepting paths leaving each state.  If the reachable  */
+/* part of the net is acyclic this is one row computed in reverse    */
+/* topological order; otherwise row k holds the paths of at most k   */
+/* arcs, for k = 0 ... length.  Returns 0 if there is nothing        */
+/* to draw.                                                          */
+
+static int apply_sample_prepare(struct apply_handle *h) {
+    struct apply_sampler *sm;
+    int i, s, t, k, statecount, numreach, head, tail, *order, *indegree;
+    uint8_t *reach;
+    double *counts, *row, *prev, total;
+
+    statecount = h->last_net->statecount;
+    sm = apply_get_sampler(h);
+    if (sm->counts == NULL) {
+	if (h->last_net->finalcount == 0 || statecount == 0) {
+	    return 0;
+	}
+	order = xxmalloc(sizeof(int)*statecount);
+	indegree = xxcalloc(statecount, sizeof(int));
+	reach = xxcalloc(BITNSLOTS(statecount+1), sizeof(uint8_t));
+	/* Reachable states, used as a stack */
+	*order = h->shared->start_state;
+	BITSET(reach, *order);
+	for (numreach = 1, tail = 1; tail > 0; ) {
+	    s = *(order+(--tail));
+	    for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+		t = *(h->arc_target+i);
+		(*(indegree+t))++;
+		if (!BITTEST(reach, t)) {
+		    BITSET(reach, t);
+		    *(order+(tail++)) = t;
+		    numreach++;
+		}
+	    }
+	}
+	/* Kahn's algorithm: order becomes a topological order if acyclic */
+	*order = h->shared->start_state;
+	tail = *(indegree+*order) ? 0 : 1;
+	for (head = 0; head < tail; head++) {
+	    s = *(order+head);
+	    for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+		t = *(h->arc_target+i);
+		if (--(*(indegree+t)) == 0) {
+		    *(order+(tail++)) = t;
+		}
+	    }
+	}
+	if (tail == numreach) {
+	    sm->rows = 1;
+	    counts = xxcalloc(statecount, sizeof(double));
+	    for (head = tail-1; head >= 0; head--) {
+		s = *(order+head);
+		total = BITTEST(h->finals, s) ? 1.0 : 0.0;
+		for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+		    total += *(counts+*(h->arc_target+i));
+		}
+		*(counts+s) = total;
+	    }
+	} else {
+	    sm->rows = sm->length+1;
+	    counts = xxmalloc(sizeof(double)*statecount*sm->rows);
+	    for (s = 0; s < statecount; s++) {
+		*(counts+s) = BITTEST(h->finals, s) ? 1.0 : 0.0;
+	    }
+	    for (k = 1; k < sm->rows; k++) {
+		row = counts+(size_t)k*statecount;
+		prev = row-statecount;
+		for (s = 0; s < statecount; s++) {
+		    total = BITTEST(h->finals, s) ? 1.0 : 0.0;
+		    for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+			total += *(prev+*(h->arc_target+i));
+		    }
+		    *(row+s) = total;
+		}
+	    }
+	}
+	sm->counts = counts;
+	xxfree(order);
+	xxfree(indegree);
+	xxfree(reach);
+    }
+    total = *(sm->counts+(size_t)(sm->rows-1)*statecount+h->shared->start_state);
+    /* Nothing to draw, or more paths than a double holds */
+    return(total > 0 && total <= DBL_MAX);
+}
+
+/* Walks from the start state choosing each step with probability    */
+/* proportional to the number of paths it leads to, which makes the  */
+/* whole path uniform.  Paths that fail a flag diacritic are thrown  */
+/* away and drawn again, which keeps the valid ones uniform.         */
+
+static char *apply_uniform(struct apply_handle *h, int mode) {
+    int i, pick, state, row, nrow, statecount, tries, symin;
+    double r, c, *counts;
+
+    h->mode = mode;
+    apply_cache_abandon(h);
+    if (h->last_net == NULL || !apply_sample_prepare(h)) {
+	return(NULL);
+    }
+    statecount = h->last_net->statecount;
+    counts = h->sampler->counts;
+    for (tries = 0; tries < APPLY_SAMPLE_TRIES; tries++) {
+	apply_clear_flags(h);
+	state = h->shared->start_state;
+	row = h->sampler->rows-1;
+	h->opos = 0;
+	for (;;) {
+	    r = apply_rand_double(h) * *(counts+(size_t)row*statecount+state);
+	    if (BITTEST(h->finals, state)) {
+		if (r < 1.0) {
+		    *(h->outstring+h->opos) = '\0';
+		    return(h->outstring);
+		}
+		r -= 1.0;
+	    }
+	    /* Acyclic counts have one row, otherwise row 0 allows no more arcs */
+	    nrow = row > 0 ? row-1 : 0;
+	    pick = -1;
+	    for (i = *(h->arc_offsets+state); (row > 0 || h->sampler->rows == 1) && i < *(h->arc_offsets+state+1); i++) {
+		c = *(counts+(size_t)nrow*statecount+*(h->arc_target+i));
+		if (c == 0) {
+		    continue;
+		}
+		pick = i;
+		if (r < c) {
+		    break;
+		}
+		r -= c;
+	    }
+	    if (pick == -1) {
+		/* Only rounding gets us here */
+		if (BITTEST(h->finals, state)) {
+		    *(h->outstring+h->opos) = '\0';
+		    return(h->outstring);
+		}
+		break;
+	    }
+	    symin = *(h->arc_in+pick);
+	    if (h->has_flags && h->obey_flags && (h->flag_lookup+symin)->type) {
+		if (apply_check_flag(h, (h->flag_lookup+symin)->type, (h->flag_lookup+symin)->name_id, (h->flag_lookup+symin)->value_id) == FAIL) {
+		    break;
+		}
+	    }
+	    h->opos += apply_append(h, pick, symin);
+	    state = *(h->arc_target+pick);
+	    row = nrow;
+	}
+    }
+    return(NULL);
+}
+
+char *apply_uniform_words(struct apply_handle *h) {
+    return(apply_uniform(h, DOWN + ENUMERATE + LOWER + UPPER));
+}
+
+char *apply_uniform_upper(struct apply_handle *h) {
+    return(apply_uniform(h, DOWN + ENUMERATE + UPPER));
+}
+
+char *apply_uniform_lower(struct apply_handle *h) {
+    return(apply_uniform(h, DOWN + ENUMERATE + LOWER));
+}
+
+/* Frees the network tables built by apply_shared_init() */
+/* All handles using them must have been cleared first   */
+void apply_shared_clear(struct apply_shared *sh) {
+    int i;
+    if (sh->tokenizer != NULL) {
+	xxfree(sh->tokenizer->first);
+	xxfree(sh->tokenizer->bytes);
+	xxfree(sh->tokenizer->sym);
+	xxfree(sh->tokenizer);
+	sh->tokenizer = NULL;
+    }
+    if (sh->arc_offsets != NULL) {
+        xxfree(sh->arc_offsets);
+        xxfree(sh->arc_in);
+        xxfree(sh->arc_out);
+        xxfree(sh->arc_target);
+        xxfree(sh->finals);
+        sh->arc_offsets = NULL;
+    }
+    if (sh->sigs != NULL) {
+        xxfree(sh->sigs);
+        sh->sigs = NULL;
+    }
+    if (sh->flag_lookup != NULL) {
+	for (i = 0; i < sh->sigma_size; i++) {
+	    if ((sh->flag_lookup+i)->name != NULL)
+		xxfree((sh->flag_lookup+i)->name);
+	    if ((sh->flag_lookup+i)->value != NULL)
+		xxfree((sh->flag_lookup+i)->value);
+	}
+        xxfree(sh->flag_lookup);
+        sh->flag_lookup = NULL;
+    }
+    if (sh->flagstates != NULL) {
+	xxfree(sh->flagstates);
+	sh->flagstates = NULL;
+    }
+    apply_clear_index(sh);
+    sh->last_net = NULL;
+    xxfree(sh);
+}
+
+/* Frees memory associated with applies */
+void apply_clear(struct apply_handle *h) {
+    int i;
+    apply_set_cache(h, 0);
+    if (h->marks != NULL) {
+        xxfree(h->marks);
+        h->marks = NULL;
+    }
+    if (h->searchstack != NULL) {
+        xxfree(h->searchstack);
+        h->searchstack = NULL;
+    }
+    if (h->sigmatch_array != NULL) {
+	xxfree(h->sigmatch_array);
+	h->sigmatch_array = NULL;
+    }
+    if (h->flag_regs != NULL) {
+	xxfree(h->flag_regs);
+	h->flag_regs = NULL;
+    }
+    if (h->visitor != NULL) {
+	xxfree(h->visitor->syms);
+	xxfree(h->visitor->ids_in);
+	xxfree(h->visitor);
+	h->visitor = NULL;
+    }
+    apply_set_limits(h, 0, 0, 0, 0);
+    if (h->sampler != NULL) {
+	xxfree(h->sampler->counts);
+	xxfree(h->sampler);
+	h->sampler = NULL;
+    }
+    if (h->counter != NULL) {
+	for (i = 0; i < 2; i++) {
+	    xxfree(h->counter->rank[i]);
+	}
+	xxfree(h->counter->cur);
+	xxfree(h->counter->next);
+	xxfree(h->counter->heap);
+	xxfree(h->counter->list);
+	xxfree(h->counter);
+	h->counter = NULL;
+    }
+    if (h->pruner != NULL) {
+	apply_set_subset_cache(h, 0);
+	for (i = 0; i < 2; i++) {
+	    xxfree(h->pruner->live_mark[i]);
+	}
+	xxfree(h->pruner->work);
+	xxfree(h->pruner->live_states);
+	xxfree(h->pruner->live_first);
+	xxfree(h->pruner->layers);
+	xxfree(h->pruner->lattice_states);
+	xxfree(h->pruner);
+	h->pruner = NULL;
+    }
+    if (h->acceptors != NULL) {
+	apply_set_accept_limit(h, 0);
+	xxfree(h->acceptors);
+	h->acceptors = NULL;
+    }
+    if (h->owns_shared) {
+	apply_shared_clear(h->shared);
+    }
+    h->shared = NULL;
+    h->last_net = NULL;
+    h->iterator = 0;
+    xxfree(h->outstring);
+    xxfree(h);
+}
+
+char *apply_updown(struct apply_handle *h, char *word) {
+
+    char *result = NULL;
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+        return (NULL);
+
+    if (h->cache != NULL) {
+	if (word != NULL) {
+	    h->cache->replay = apply_cache_find(h, word);
+	    if (h->cache->replay != NULL) {
+		apply_limit_start(h);
+		h->cache->hits++;
+		h->cache->recording = 0;
+		h->cache->replay_ptr = h->cache->replay->data + strlen(word) + 1;
+		h->cache->replay_left = h->cache->replay->numresults;
+		return(apply_cache_next(h));
+	    }
+	    h->cache->misses++;
+	    apply_cache_record_start(h, word);
+	} else if (h->cache->replay != NULL) {
+	    return(apply_cache_next(h));
+	}
+    }
+    
+    if (word == NULL) {
+        h->iterate_old = 1;
+        result = apply_net(h);
+    }
+    else if (word != NULL) {
+        h->iterate_old = 0;
+        h->instring = word;
+        apply_create_sigmatch(h);
+	apply_prune_prepare(h);
+
+	/* Remove old marks if necessary TODO: only pop marks */
+	apply_force_clear_stack(h);
+        result = apply_net(h);
+    }
+    if (h->cache != NULL && h->cache->recording) {
+	/* Results cut short by a limit are not kept */
+	if (result == NULL && h->status != APPLY_OK) {
+	    apply_cache_abandon(h);
+	} else {
+	    apply_cache_record(h, result);
+	}
+    }
+    return(result);
+}
+
+static void apply_set_direction(struct apply_handle *h, int direction) {
+    h->mode = direction;
+    if (direction == DOWN) {
+	h->indexed = h->shared->index_in ? 1 : 0;
+	h->binsearch = (h->last_net->arcs_sorted_in == 1) ? 1 : 0;
+    } else {
+	h->indexed = h->shared->index_out ? 1 : 0;
+	h->binsearch = (h->last_net->arcs_sorted_out == 1) ? 1 : 0;
+    }
+}
+
+char *apply_down(struct apply_handle *h, char *word) {
+    apply_set_direction(h, DOWN);
+    return(apply_updown(h, word));
+}
+
+char *apply_up(struct apply_handle *h, char *word) {
+    apply_set_direction(h, UP);
+    return(apply_updown(h, word));
+}
+
+static struct apply_visitor *apply_get_visitor(struct apply_handle *h) {
+    if (h->visitor == NULL) {
+	h->visitor = xxcalloc(1, sizeof(struct apply_visitor));
+    }
+    return(h->visitor);
+}
+
+/* Whether results go to a visitor rather than through the iterator */
+static inline int apply_visiting(struct apply_handle *h) {
+    return(h->visitor != NULL && (h->visitor->visit != NULL || h->visitor->visit_symbols != NULL || h->visitor->count_only));
+}
+
+/* Hands the result at the current final state to the visitor */
+/* Returns nonzero if the visitor wants the search stopped     */
+
+static int apply_visit(struct apply_handle *h) {
+    struct apply_visitor *v;
+    int i, n, sym;
+    v = h->visitor;
+    v->count++;
+    if (v->count_only) {
+	return(0);
+    }
+    if (v->visit_symbols != NULL) {
+	if (h->apply_stack_ptr > v->syms_size) {
+	    v->syms_size = next_power_of_two(h->apply_stack_ptr);
+	    v->syms = xxrealloc(v->syms, sizeof(int) * v->syms_size);
+	}
+	for (i = 0, n = 0; i < h->apply_stack_ptr; i++) {
+	    sym = ((h->mode) & DOWN) == DOWN ? *(h->arc_out+(h->searchstack+i)->offset) : *(h->arc_in+(h->searchstack+i)->offset);
+	    if (sym == EPSILON || (h->has_flags && !h->show_flags && (h->flag_lookup+sym)->type)) {
+		continue;
+	    }
+	    if (sym == IDENTITY && v->in != NULL) {
+		sym = *(v->in+(h->searchstack+i)->ipos);
+	    } else if (v->out_map != NULL) {
+		sym = *(v->out_map+sym);
+	    }
+	    *(v->syms+n) = sym;
+	    n++;
+	}
+	return(v->visit_symbols(v->syms, n, v->data));
+    }
+    *(h->outstring+h->opos) = '\0';
+    if (h->cache != NULL && h->cache->recording) {
+	apply_cache_record(h, h->outstring);
+    }
+    return(v->visit(h->outstring, h->opos, v->data));
+}
+
+/* Runs a whole search, pushing each result to a visitor instead of */
+/* returning it through the iterator.  A cache hit is replayed to   */
+/* string visitors directly.                                        */
+
+static int apply_foreach(struct apply_handle *h, char *word, int (*visit)(char *result, int length, void *userdata), int (*visit_symbols)(int *symbols, int length, void *userdata), void *userdata) {
+    struct apply_visitor *v;
+    struct apply_cache_entry *e;
+    char *result;
+    int i, len, stopped;
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+
+    apply_cache_abandon(h);
+    if (h->cache != NULL && visit != NULL) {
+	if ((e = apply_cache_find(h, word)) != NULL) {
+	    h->status = APPLY_OK;
+	    h->cache->hits++;
+	    result = e->data + strlen(word) + 1;
+	    for (i = 0; i < e->numresults; ) {
+		if (h->limits != NULL && h->limits->max_results && i == h->limits->max_results) {
+		    h->status = APPLY_LIMIT_RESULTS;
+		    break;
+		}
+		len = strlen(result);
+		i++;
+		if (visit(result, len, userdata))
+		    break;
+		result += len + 1;
+	    }
+	    return(i);
+	}
+	h->cache->misses++;
+	apply_cache_record_start(h, word);
+    }
+
+    v = apply_get_visitor(h);
+    v->visit = visit;
+    v->visit_symbols = visit_symbols;
+    v->data = userdata;
+    v->count = 0;
+    h->iterate_old = 0;
+    h->instring = word;
+    apply_create_sigmatch(h);
+    apply_prune_prepare(h);
+    apply_force_clear_stack(h);
+    /* apply_net() only returns a string if a visitor stopped it */
+    stopped = apply_net(h) != NULL;
+    if (stopped) {
+	apply_force_clear_stack(h);
+	apply_cache_abandon(h);
+    } else if (h->status != APPLY_OK) {
+	apply_cache_abandon(h);
+    } else if (h->cache != NULL && h->cache->recording) {
+	apply_cache_record(h, NULL);
+    }
+    v->visit = NULL;
+    v->visit_symbols = NULL;
+    v->data = NULL;
+    return(v->count);
+}
+
+int apply_down_foreach(struct apply_handle *h, char *word, int (*visit)(char *result, int length, void *userdata), void *userdata) {
+    apply_set_direction(h, DOWN);
+    return(apply_foreach(h, word, visit, NULL, userdata));
+}
+
+int apply_up_foreach(struct apply_handle *h, char *word, int (*visit)(char *result, int length, void *userdata), void *userdata) {
+    apply_set_direction(h, UP);
+    return(apply_foreach(h, word, visit, NULL, userdata));
+}
+
+int apply_down_foreach_symbols(struct apply_handle *h, char *word, int (*visit)(int *symbols, int length, void *userdata), void *userdata) {
+    apply_set_direction(h, DOWN);
+    return(apply_foreach(h, word, NULL, visit, userdata));
+}
+
+int apply_up_foreach_symbols(struct apply_handle *h, char *word, int (*visit)(int *symbols, int length, void *userdata), void *userdata) {
+    apply_set_direction(h, UP);
+    return(apply_foreach(h, word, NULL, visit, userdata));
+}
+
+/* Orders the states so that every input-side epsilon (or flag) arc */
+/* goes from a lower to a higher rank.  Returns NULL if these arcs   */
+/* form a cycle, in which case paths can't be counted this way.      */
+
+static int *apply_epsilon_ranks(struct apply_handle *h, int d) {
+    int i, s, t, head, tail, statecount, sym, *indegree, *queue, *rank;
+    short int *arc_insym;
+
+    statecount = h->last_net->statecount;
+    arc_insym = d == 0 ? h->arc_in : h->arc_out;
+    indegree = xxcalloc(statecount, sizeof(int));
+    queue = xxmalloc(sizeof(int)*statecount);
+    rank = xxmalloc(sizeof(int)*statecount);
+    for (s = 0; s < statecount; s++) {
+	for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+	    sym = *(arc_insym+i);
+	    if (sym == EPSILON || (h->has_flags && (h->flag_lookup+sym)->type)) {
+		(*(indegree+*(h->arc_target+i)))++;
+	    }
+	}
+    }
+    for (s = 0, tail = 0; s < statecount; s++) {
+	if (*(indegree+s) == 0) {
+	    *(queue+(tail++)) = s;
+	}
+    }
+    for (head = 0; head < tail; head++) {
+	s = *(queue+head);
+	*(rank+s) = head;
+	for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+	    sym = *(arc_insym+i);
+	    if (sym == EPSILON || (h->has_flags && (h->flag_lookup+sym)->type)) {
+		t = *(h->arc_target+i);
+		if (--(*(indegree+t)) == 0) {
+		    *(queue+(tail++)) = t;
+		}
+	    }
+	}
+    }
+    xxfree(indegree);
+    xxfree(queue);
+    if (tail < statecount) {
+	xxfree(rank);
+	return(NULL);
+    }
+    return(rank);
+}
+
+static void apply_count_push(int *heap, int *rank, int *heapsize, int s) {
+    int i, parent;
+    for (i = (*heapsize)++; i > 0; i = parent) {
+	parent = (i-1)/2;
+	if (*(rank+*(heap+parent)) <= *(rank+s)) {
+	    break;
+	}
+	*(heap+i) = *(heap+parent);
+    }
+    *(heap+i) = s;
+}
+
+static int apply_count_pop(int *heap, int *rank, int *heapsize) {
+    int i, child, top, last;
+    top = *heap;
+    last = *(heap+(--(*heapsize)));
+    for (i = 0; (child = 2*i+1) < *heapsize; i = child) {
+	if (child+1 < *heapsize && *(rank+*(heap+child+1)) < *(rank+*(heap+child))) {
+	    child++;
+	}
+	if (*(rank+last) <= *(rank+*(heap+child))) {
+	    break;
+	}
+	*(heap+i) = *(heap+child);
+    }
+    *(heap+i) = last;
+    return(top);
+}
+
+static inline void apply_count_add(long *a, long b) {
+    *a = (*a > LONG_MAX - b) ? LONG_MAX : *a + b;
+}
+
+/* Counts the paths (state, ipos) by (state, ipos).  Every input   */
+/* position has exactly one token, so the search moves layer by    */
+/* layer: epsilons are followed within the layer in rank order,    */
+/* consuming arcs feed the next layer.                              */
+
+static long apply_count_dp(struct apply_handle *h, int d) {
+    struct apply_counter *co;
+    int i, s, t, sym, ipos, heapsize, numnext, signumber, consumes, *rank;
+    long c, total, *swapc;
+    short int *arc_insym;
+
+    co = h->counter;
+    rank = co->rank[d];
+    arc_insym = d == 0 ? h->arc_in : h->arc_out;
+    total = 0;
+    heapsize = 0;
+    numnext = 0;
+    *(co->cur+h->shared->start_state) = 1;
+    apply_count_push(co->heap, rank, &heapsize, h->shared->start_state);
+    for (ipos = 0; heapsize > 0; ) {
+	signumber = (h->sigmatch_array+ipos)->signumber;
+	consumes = (h->sigmatch_array+ipos)->consumes;
+	while (heapsize > 0) {
+	    s = apply_count_pop(co->heap, rank, &heapsize);
+	    c = *(co->cur+s);
+	    *(co->cur+s) = 0;
+	    if (ipos == h->current_instring_length && BITTEST(h->finals, s)) {
+		apply_count_add(&total, c);
+	    }
+	    for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+		sym = *(arc_insym+i);
+		t = *(h->arc_target+i);
+		if (sym == EPSILON || (h->has_flags && (h->flag_lookup+sym)->type)) {
+		    if (*(co->cur+t) == 0) {
+			apply_count_push(co->heap, rank, &heapsize, t);
+		    }
+		    apply_count_add(co->cur+t, c);
+		} else if (ipos < h->current_instring_length && (sym == signumber || ((sym == IDENTITY || sym == UNKNOWN) && signumber == IDENTITY))) {
+		    if (*(co->next+t) == 0) {
+			*(co->list+(numnext++)) = t;
+		    }
+		    apply_count_add(co->next+t, c);
+		}
+	    }
+	}
+	if (numnext == 0) {
+	    break;
+	}
+	/* The next layer becomes current */
+	swapc = co->cur; co->cur = co->next; co->next = swapc;
+	for (i = 0; i < numnext; i++) {
+	    apply_count_push(co->heap, rank, &heapsize, *(co->list+i));
+	}
+	numnext = 0;
+	ipos += consumes;
+    }
+    return(total);
+}
+
+static long apply_count(struct apply_handle *h, char *word, int direction) {
+    struct apply_counter *co;
+    int d, statecount;
+    long count;
+
+    apply_set_direction(h, direction);
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+    if (h->counter == NULL) {
+	h->counter = xxcalloc(1, sizeof(struct apply_counter));
+    }
+    co = h->counter;
+    d = direction == DOWN ? 0 : 1;
+    /* Flags that are obeyed make the count depend on the path */
+    if (co->dp[d] == 0 && !(h->has_flags && h->obey_flags)) {
+	co->rank[d] = apply_epsilon_ranks(h, d);
+	co->dp[d] = co->rank[d] != NULL ? 1 : -1;
+    }
+    if (co->dp[d] == 1 && !(h->has_flags && h->obey_flags)) {
+	if (co->cur == NULL) {
+	    statecount = h->last_net->statecount;
+	    co->cur = xxcalloc(statecount, sizeof(long));
+	    co->next = xxcalloc(statecount, sizeof(long));
+	    co->heap = xxmalloc(sizeof(int)*statecount);
+	    co->list = xxmalloc(sizeof(int)*statecount);
+	}
+	apply_cache_abandon(h);
+	h->status = APPLY_OK;
+	h->instring = word;
+	h->prune = 0;
+	apply_create_sigmatch(h);
+	return(apply_count_dp(h, d));
+    }
+    /* Otherwise the usual search, with nothing written out */
+    apply_get_visitor(h)->count_only = 1;
+    count = apply_foreach(h, word, NULL, NULL, NULL);
+    h->visitor->count_only = 0;
+    return(count);
+}
+
+long apply_count_down(struct apply_handle *h, char *word) {
+    return(apply_count(h, word, DOWN));
+}
+
+long apply_count_up(struct apply_handle *h, char *word) {
+    return(apply_count(h, word, UP));
+}
+
+/* Subset-cached pruning.  Before a search, the word is run through a */
+/* DFA for the input side, built lazily from subsets of states, which */
+/* gives the states reachable at each input position.  A backward     */
+/* pass keeps those from which the rest of the word can be accepted,  */
+/* and apply_net() backs out of any other state as soon as it enters  */
+/* it.  Flags count as epsilons here, so nothing valid is pruned.     */
+/* Without the cache, or once a word takes it past its budget, the    */
+/* lattice mode finds the same reachable sets directly for the word,  */
+/* keeping nothing between words.  Nets with input epsilon cycles are */
+/* not pruned: how often a search goes round a cycle depends on the   */
+/* states it has been through, dead ones included.                    */
+
+static void apply_dfa_free(struct apply_dfa *dfa) {
+    xxfree(dfa->pool);
+    xxfree(dfa->subsets);
+    xxfree(dfa->buckets);
+    xxfree(dfa->trans);
+    xxfree(dfa->seen);
+    xxfree(dfa->work);
+    xxfree(dfa);
+}
+
+static struct apply_dfa *apply_dfa_init(int statecount) {
+    struct apply_dfa *dfa;
+    int i;
+    dfa = xxcalloc(1, sizeof(struct apply_dfa));
+    dfa->pool_size = 1024;
+    dfa->pool = xxmalloc(sizeof(int)*dfa->pool_size);
+    dfa->subsets_size = 64;
+    dfa->subsets = xxmalloc(sizeof(struct apply_dfa_subset)*dfa->subsets_size);
+    dfa->bucketmask = 63;
+    dfa->buckets = xxmalloc(sizeof(int)*(dfa->bucketmask+1));
+    for (i = 0; i <= (int) dfa->bucketmask; i++) {
+	*(dfa->buckets+i) = -1;
+    }
+    dfa->transmask = 127;
+    dfa->trans = xxmalloc(sizeof(struct apply_dfa_trans)*(dfa->transmask+1));
+    for (i = 0; i <= (int) dfa->transmask; i++) {
+	(dfa->trans+i)->from = -1;
+    }
+    dfa->seen = xxcalloc(statecount+1, sizeof(int));
+    dfa->work = xxmalloc(sizeof(int)*(statecount+1));
+    dfa->initial = -1;
+    return(dfa);
+}
+
+static size_t apply_dfa_bytes(struct apply_dfa *dfa) {
+    return(sizeof(int)*dfa->pool_size + sizeof(struct apply_dfa_subset)*dfa->subsets_size + sizeof(int)*(dfa->bucketmask+1) + sizeof(struct apply_dfa_trans)*(dfa->transmask+1));
+}
+
+/* What the DFA would take after adding a subset of n states */
+
+static size_t apply_dfa_grown_bytes(struct apply_dfa *dfa, int n) {
+    size_t bytes, pool_size;
+    bytes = apply_dfa_bytes(dfa);
+    for (pool_size = dfa->pool_size; dfa->pool_used + n > pool_size; pool_size *= 2) { }
+    bytes += sizeof(int)*(pool_size - dfa->pool_size);
+    if (dfa->numsubsets == dfa->subsets_size) {
+	bytes += sizeof(struct apply_dfa_subset)*dfa->subsets_size;
+    }
+    if ((unsigned int) dfa->numsubsets+1 > dfa->bucketmask) {
+	bytes += sizeof(int)*(dfa->bucketmask+1);
+    }
+    return(bytes);
+}
+
+static inline int apply_dfa_epsilon(struct apply_handle *h, int sym) {
+    return(sym == EPSILON || (h->has_flags && (h->flag_lookup+sym)->type));
+}
+
+/* Adds to the n states in states (all with seen[s] == stamp) the    */
+/* states reachable from them on input epsilons, returns the new count */
+
+static int apply_prune_close(struct apply_handle *h, short int *arc_insym, int *states, int n, int *seen, int stamp) {
+    int j, s, t, a;
+    for (j = 0; j < n; j++) {
+	s = *(states+j);
+	for (a = *(h->arc_offsets+s); a < *(h->arc_offsets+s+1); a++) {
+	    if (apply_dfa_epsilon(h, *(arc_insym+a))) {
+		t = *(h->arc_target+a);
+		if (*(seen+t) != stamp) {
+		    *(seen+t) = stamp;
+		    *(states+(n++)) = t;
+		}
+	    }
+	}
+    }
+    return(n);
+}
+
+/* Stores in to the states reached from the n states in from on input */
+/* symbol sym, marking them with stamp in seen, returns their count    */
+
+static int apply_prune_step(struct apply_handle *h, short int *arc_insym, int *from, int n, int sym, int *to, int *seen, int stamp) {
+    int j, s, t, a, insym, count;
+    for (j = 0, count = 0; j < n; j++) {
+	s = *(from+j);
+	for (a = *(h->arc_offsets+s); a < *(h->arc_offsets+s+1); a++) {
+	    insym = *(arc_insym+a);
+	    if (insym == sym || ((insym == IDENTITY || insym == UNKNOWN) && sym == IDENTITY)) {
+		t = *(h->arc_target+a);
+		if (*(seen+t) != stamp) {
+		    *(seen+t) = stamp;
+		    *(to+(count++)) = t;
+		}
+	    }
+	}
+    }
+    return(count);
+}
+
+/* Closes the n states in work (all marked seen) under epsilons and */
+/* returns the number of the subset, adding it if it is new, or -1  */
+/* if adding it would take the DFA past its budget                  */
+
+static int apply_dfa_intern(struct apply_handle *h, struct apply_dfa *dfa, short int *arc_insym, int n) {
+    struct apply_dfa_subset *sub;
+    unsigned int hash, i;
+    int j, k;
+
+    n = apply_prune_close(h, arc_insym, dfa->work, n, dfa->seen, dfa->stamp);
+    for (j = 0, hash = n; j < n; j++) {
+	hash += ((unsigned int) *(dfa->work+j) + 1) * 2654435761U;
+    }
+    for (j = *(dfa->buckets+(hash & dfa->bucketmask)); j != -1; j = sub->next) {
+	sub = dfa->subsets+j;
+	if (sub->hash == hash && sub->size == n) {
+	    for (k = 0; k < n && *(dfa->seen+*(dfa->pool+sub->begin+k)) == (int) dfa->stamp; k++) { }
+	    if (k == n) {
+		return(j);
+	    }
+	}
+    }
+    if (apply_dfa_grown_bytes(dfa, n) > h->pruner->dfa_max_bytes) {
+	return(-1);
+    }
+    while (dfa->pool_used + n > dfa->pool_size) {
+	dfa->pool_size *= 2;
+	dfa->pool = xxrealloc(dfa->pool, sizeof(int)*dfa->pool_size);
+    }
+    memcpy(dfa->pool+dfa->pool_used, dfa->work, sizeof(int)*n);
+    if (dfa->numsubsets == dfa->subsets_size) {
+	dfa->subsets_size *= 2;
+	dfa->subsets = xxrealloc(dfa->subsets, sizeof(struct apply_dfa_subset)*dfa->subsets_size);
+    }
+    sub = dfa->subsets+dfa->numsubsets;
+    sub->begin = dfa->pool_used;
+    sub->size = n;
+    sub->hash = hash;
+    sub->next = *(dfa->buckets+(hash & dfa->bucketmask));
+    *(dfa->buckets+(hash & dfa->bucketmask)) = dfa->numsubsets;
+    dfa->pool_used += n;
+    dfa->numsubsets++;
+    if ((unsigned int) dfa->numsubsets > dfa->bucketmask) {
+	dfa->bucketmask = dfa->bucketmask*2+1;
+	dfa->buckets = xxrealloc(dfa->buckets, sizeof(int)*(dfa->bucketmask+1));
+	for (i = 0; i <= dfa->bucketmask; i++) {
+	    *(dfa->buckets+i) = -1;
+	}
+	for (j = 0; j < dfa->numsubsets; j++) {
+	    sub = dfa->subsets+j;
+	    sub->next = *(dfa->buckets+(sub->hash & dfa->bucketmask));
+	    *(dfa->buckets+(sub->hash & dfa->bucketmask)) = j;
+	}
+    }
+    return(dfa->numsubsets-1);
+}
+
+static inline unsigned int apply_dfa_trans_hash(int from, int sym) {
+    return(((unsigned int) from * 2654435761U) ^ ((unsigned int) sym * 40503U));
+}
+
+/* The subset reached from subset from on input symbol sym, or -1 */
+/* if the DFA has no room left for it                              */
+
+static int apply_dfa_next(struct apply_handle *h, struct apply_dfa *dfa, short int *arc_insym, int from, int sym) {
+    struct apply_dfa_trans *tr, *old;
+    struct apply_dfa_subset *sub;
+    unsigned int i, j, oldmask;
+    int n, to;
+
+    for (i = apply_dfa_trans_hash(from, sym) & dfa->transmask; (dfa->trans+i)->from != -1; i = (i+1) & dfa->transmask) {
+	tr = dfa->trans+i;
+	if (tr->from == from && tr->sym == sym) {
+	    return(tr->to);
+	}
+    }
+    if (dfa->stamp == INT_MAX) {
+	memset(dfa->seen, 0, sizeof(int)*(h->last_net->statecount+1));
+	dfa->stamp = 0;
+    }
+    dfa->stamp++;
+    sub = dfa->subsets+from;
+    n = apply_prune_step(h, arc_insym, dfa->pool+sub->begin, sub->size, sym, dfa->work, dfa->seen, dfa->stamp);
+    to = apply_dfa_intern(h, dfa, arc_insym, n);
+    if (to == -1) {
+	return(-1);
+    }
+    if ((unsigned int) (dfa->numtrans+1) * 2 > dfa->transmask) {
+	if (apply_dfa_bytes(dfa) + sizeof(struct apply_dfa_trans)*(dfa->transmask+1) > h->pruner->dfa_max_bytes) {
+	    return(-1);
+	}
+	old = dfa->trans;
+	oldmask = dfa->transmask;
+	dfa->transmask = dfa->transmask*2+1;
+	dfa->trans = xxmalloc(sizeof(struct apply_dfa_trans)*(dfa->transmask+1));
+	for (i = 0; i <= dfa->transmask; i++) {
+	    (dfa->trans+i)->from = -1;
+	}
+	for (j = 0; j <= oldmask; j++) {
+	    if ((old+j)->from == -1) {
+		continue;
+	    }
+	    for (i = apply_dfa_trans_hash((old+j)->from, (old+j)->sym) & dfa->transmask; (dfa->trans+i)->from != -1; i = (i+1) & dfa->transmask) { }
+	    *(dfa->trans+i) = *(old+j);
+	}
+	xxfree(old);
+    }
+    for (i = apply_dfa_trans_hash(from, sym) & dfa->transmask; (dfa->trans+i)->from != -1; i = (i+1) & dfa->transmask) { }
+    tr = dfa->trans+i;
+    tr->from = from;
+    tr->sym = sym;
+    tr->to = to;
+    dfa->numtrans++;
+    return(to);
+}
+
+static int apply_int_cmp(const void *a, const void *b) {
+    return(*(const int *) a - *(const int *) b);
+}
+
+/* Finds the live states for the word in the sigmatch array */
+
+static void apply_prune_live(struct apply_handle *h) {
+    struct apply_pruner *pr;
+    struct apply_dfa *dfa;
+    struct apply_dfa_subset *sub;
+    short int *arc_insym;
+    int d, i, j, k, n, a, s, t, p, len, ntok, total, top, changed, live, sym, stamp, nextstamp, statecount, *pool, *layer_begin, *layer_count, *layer_start, *layer_pos;
+
+    h->prune = 0;
+    pr = h->pruner;
+    if (pr == NULL || (pr->dfa_max_bytes == 0 && !pr->use_lattice) || h->last_net == NULL) {
+	return;
+    }
+    statecount = h->last_net->statecount;
+    d = ((h->mode) & DOWN) == DOWN ? 0 : 1;
+    arc_insym = d == 0 ? h->arc_in : h->arc_out;
+    len = h->current_instring_length;
+    if (len + 2 > pr->layer_size) {
+	pr->layer_size = next_power_of_two(len + 2);
+	pr->layers = xxrealloc(pr->layers, sizeof(int)*pr->layer_size*4);
+    }
+    layer_begin = pr->layers;
+    layer_count = pr->layers + pr->layer_size;
+    layer_start = pr->layers + pr->layer_size*2;
+    layer_pos = pr->layers + pr->layer_size*3;
+    if (pr->live_mark[0] == NULL) {
+	pr->live_mark[0] = xxcalloc(statecount+1, sizeof(int));
+	pr->live_mark[1] = xxcalloc(statecount+1, sizeof(int));
+	pr->work = xxmalloc(sizeof(int)*(statecount+1));
+    }
+    if (pr->live_stamp > INT_MAX - 2*len - 4) {
+	memset(pr->live_mark[0], 0, sizeof(int)*(statecount+1));
+	memset(pr->live_mark[1], 0, sizeof(int)*(statecount+1));
+	pr->live_stamp = 0;
+    }
+    for (p = 0, ntok = 0; p < len; p += (h->sigmatch_array+p)->consumes) {
+	*(layer_pos+(ntok++)) = p;
+    }
+
+    /* Forward: the states reachable at each token, as subsets from  */
+    /* the cached DFA for as long as it has room, and then built      */
+    /* afresh for the rest of the word                                */
+    i = 0;
+    k = -1;
+    dfa = NULL;
+    if (pr->dfa_max_bytes) {
+	if (pr->dfa[d] == NULL) {
+	    pr->dfa[d] = apply_dfa_init(statecount);
+	}
+	dfa = pr->dfa[d];
+	if (dfa->initial == -1) {
+	    dfa->stamp++;
+	    *(dfa->work) = h->shared->start_state;
+	    *(dfa->seen+h->shared->start_state) = dfa->stamp;
+	    dfa->initial = apply_dfa_intern(h, dfa, arc_insym, 1);
+	}
+	for (k = dfa->initial; k != -1; i++) {
+	    sub = dfa->subsets+k;
+	    *(layer_begin+i) = sub->begin;
+	    *(layer_count+i) = sub->size;
+	    if (i == ntok)
+		break;
+	    k = apply_dfa_next(h, dfa, arc_insym, k, (h->sigmatch_array+*(layer_pos+i))->signumber);
+	}
+    }
+    if (dfa != NULL && k != -1) {
+	pool = dfa->pool;
+    } else {
+	/* The DFA is full: the layers so far move out of it, and it */
+	/* is flushed to start over with the next word               */
+	for (j = 0, k = 0; j < i; j++) {
+	    if (k + *(layer_count+j) + 1 > pr->lattice_states_size) {
+		pr->lattice_states_size = next_power_of_two(k + *(layer_count+j) + 1);
+		pr->lattice_states = xxrealloc(pr->lattice_states, sizeof(int)*pr->lattice_states_size);
+	    }
+	    memcpy(pr->lattice_states+k, dfa->pool+*(layer_begin+j), sizeof(int)*(*(layer_count+j)));
+	    *(layer_begin+j) = k;
+	    k += *(layer_count+j);
+	}
+	if (dfa != NULL) {
+	    apply_dfa_free(dfa);
+	    pr->dfa[d] = NULL;
+	}
+	for ( ; i <= ntok; i++) {
+	    if (k + statecount + 1 > pr->lattice_states_size) {
+		pr->lattice_states_size = next_power_of_two(k + statecount + 1);
+		pr->lattice_states = xxrealloc(pr->lattice_states, sizeof(int)*pr->lattice_states_size);
+	    }
+	    stamp = ++(pr->live_stamp);
+	    if (i == 0) {
+		*(pr->lattice_states) = h->shared->start_state;
+		*(pr->live_mark[0]+h->shared->start_state) = stamp;
+		n = 1;
+	    } else {
+		n = apply_prune_step(h, arc_insym, pr->lattice_states+*(layer_begin+i-1), *(layer_count+i-1), (h->sigmatch_array+*(layer_pos+i-1))->signumber, pr->lattice_states+k, pr->live_mark[0], stamp);
+	    }
+	    n = apply_prune_close(h, arc_insym, pr->lattice_states+k, n, pr->live_mark[0], stamp);
+	    *(layer_begin+i) = k;
+	    *(layer_count+i) = n;
+	    k += n;
+	}
+	pool = pr->lattice_states;
+    }
+    for (i = 0, total = 0; i <= ntok; i++) {
+	total += *(layer_count+i);
+    }
+    if (total > pr->live_states_size) {
+	pr->live_states_size = next_power_of_two(total + 1);
+	pr->live_states = xxrealloc(pr->live_states, sizeof(int)*pr->live_states_size);
+    }
+    if (len + 2 > pr->live_first_size) {
+	pr->live_first_size = next_power_of_two(len + 2);
+	pr->live_first = xxrealloc(pr->live_first, sizeof(int)*pr->live_first_size);
+    }
+
+    /* Backward: states of each layer with a way to the end.  Within */
+    /* a layer, epsilon targets tend to come after their sources, so */
+    /* going through it backwards mostly settles it in one pass.     */
+    top = total;
+    nextstamp = 0;
+    for (i = ntok; i >= 0; i--) {
+	stamp = ++(pr->live_stamp);
+	sym = i < ntok ? (h->sigmatch_array+*(layer_pos+i))->signumber : EPSILON;
+	n = 0;
+	for (changed = 1; changed; ) {
+	    changed = 0;
+	    for (j = *(layer_count+i)-1; j >= 0; j--) {
+		s = *(pool+*(layer_begin+i)+j);
+		if (*(pr->live_mark[i&1]+s) == stamp) {
+		    continue;
+		}
+		live = (i == ntok && BITTEST(h->finals, s));
+		for (a = *(h->arc_offsets+s); !live && a < *(h->arc_offsets+s+1); a++) {
+		    k = *(arc_insym+a);
+		    t = *(h->arc_target+a);
+		    if (apply_dfa_epsilon(h, k)) {
+			live = *(pr->live_mark[i&1]+t) == stamp;
+		    } else if (i < ntok && (k == sym || ((k == IDENTITY || k == UNKNOWN) && sym == IDENTITY))) {
+			live = *(pr->live_mark[(i+1)&1]+t) == nextstamp;
+		    }
+		}
+		if (live) {
+		    *(pr->live_mark[i&1]+s) = stamp;
+		    *(pr->work+(n++)) = s;
+		    changed = 1;
+		}
+	    }
+	}
+	top -= n;
+	memcpy(pr->live_states+top, pr->work, sizeof(int)*n);
+	qsort(pr->live_states+top, n, sizeof(int), apply_int_cmp);
+	*(layer_start+i) = top;
+	nextstamp = stamp;
+    }
+
+    /* A position inside a multicharacter symbol gets an empty range */
+    for (i = 0; i < ntok; i++) {
+	*(pr->live_first+*(layer_pos+i)) = *(layer_start+i);
+	for (p = *(layer_pos+i)+1; p < (i+1 < ntok ? *(layer_pos+i+1) : len); p++) {
+	    *(pr->live_first+p) = *(layer_start+i+1);
+	}
+    }
+    *(pr->live_first+len) = *(layer_start+ntok);
+    *(pr->live_first+len+1) = total;
+    h->prune = 1;
+}
+
+/* As above, unless the net has input epsilon cycles */
+
+static void apply_prune_prepare(struct apply_handle *h) {
+    struct apply_pruner *pr;
+    int d, *rank;
+
+    h->prune = 0;
+    pr = h->pruner;
+    if (pr == NULL || (pr->dfa_max_bytes == 0 && !pr->use_lattice) || h->last_net == NULL) {
+	return;
+    }
+    d = ((h->mode) & DOWN) == DOWN ? 0 : 1;
+    if (pr->acyclic[d] == 0) {
+	rank = apply_epsilon_ranks(h, d);
+	pr->acyclic[d] = rank != NULL ? 1 : -1;
+	xxfree(rank);
+    }
+    if (pr->acyclic[d] == 1) {
+	apply_prune_live(h);
+    }
+}
+
+/* Index of state in live_states at input position ipos, or -1 */
+
+static inline int apply_live_find(struct apply_handle *h, int ipos, int state) {
+    struct apply_pruner *pr;
+    int lo, hi, mid;
+    pr = h->pruner;
+    lo = *(pr->live_first+ipos);
+    hi = *(pr->live_first+ipos+1) - 1;
+    while (lo <= hi) {
+	mid = (lo+hi)/2;
+	if (*(pr->live_states+mid) == state) {
+	    return mid;
+	} else if (*(pr->live_states+mid) < state) {
+	    lo = mid+1;
+	} else {
+	    hi = mid-1;
+	}
+    }
+    return -1;
+}
+
+static inline int apply_live(struct apply_handle *h) {
+    return(apply_live_find(h, h->ipos, h->state) != -1);
+}
+
+static struct apply_pruner *apply_get_pruner(struct apply_handle *h) {
+    if (h->pruner == NULL) {
+	h->pruner = xxcalloc(1, sizeof(struct apply_pruner));
+    }
+    return(h->pruner);
+}
+
+void apply_set_subset_cache(struct apply_handle *h, size_t max_bytes) {
+    struct apply_pruner *pr;
+    int d;
+    if (h->pruner == NULL && max_bytes == 0) {
+	return;
+    }
+    pr = apply_get_pruner(h);
+    pr->dfa_max_bytes = max_bytes;
+    if (max_bytes == 0) {
+	for (d = 0; d < 2; d++) {
+	    if (pr->dfa[d] != NULL) {
+		apply_dfa_free(pr->dfa[d]);
+		pr->dfa[d] = NULL;
+	    }
+	}
+	h->prune = 0;
+    }
+}
+
+void apply_set_lattice(struct apply_handle *h, int value) {
+    struct apply_pruner *pr;
+    if (h->pruner == NULL && value == 0) {
+	return;
+    }
+    pr = apply_get_pruner(h);
+    pr->use_lattice = value;
+    if (value == 0 && pr->dfa_max_bytes == 0) {
+	h->prune = 0;
+    }
+}
+
+/* Builds the outputs for word as an automaton over the live states */
+/* of its lattice: each live (state, position) pair is a state, and  */
+/* each arc between live pairs carries the output symbol.  The pairs */
+/* are numbered by their index in live_states, except that the start */
+/* pair trades numbers with pair 0, as foma expects start state 0.   */
+/* Outputs of identity arcs are the input symbol itself, and unknown */
+/* outputs are IDENTITY over the sigma of the net.  Obeyed flags are */
+/* kept as arcs and then compiled away with flag_eliminate().        */
+
+static inline int apply_fsm_state(int x, int start) {
+    return(x == start ? 0 : x == 0 ? start : x);
+}
+
+static struct fsm *apply_to_fsm(struct apply_handle *h, char *word, int direction) {
+    struct apply_pruner *pr;
+    struct fsm_construct_handle *ch;
+    struct fsm *net;
+    short int *arc_insym, *arc_outsym;
+    char *literal;
+    int p, q, x, y, a, s, t, insym, outsym, sym, start, len, hasflags, use_lattice, numidarcs, idarcs_size, numliterals, literals_size, *idarcs, *literals;
+
+    apply_set_direction(h, direction);
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(fsm_empty_set());
+    apply_cache_abandon(h);
+    h->instring = word;
+    apply_create_sigmatch(h);
+    pr = apply_get_pruner(h);
+    use_lattice = pr->use_lattice;
+    pr->use_lattice = 1;
+    apply_prune_live(h);
+    pr->use_lattice = use_lattice;
+    h->prune = 0;
+    start = apply_live_find(h, 0, h->shared->start_state);
+    if (start == -1)
+	return(fsm_empty_set());
+
+    arc_insym = direction == DOWN ? h->arc_in : h->arc_out;
+    arc_outsym = direction == DOWN ? h->arc_out : h->arc_in;
+    len = h->current_instring_length;
+    literal = xxmalloc(len+1);
+    idarcs_size = literals_size = 16;
+    idarcs = xxmalloc(sizeof(int)*idarcs_size);
+    literals = xxmalloc(sizeof(int)*literals_size);
+    numidarcs = numliterals = hasflags = 0;
+
+    ch = fsm_construct_init(h->last_net->name);
+    fsm_construct_copy_sigma(ch, h->last_net->sigma);
+    fsm_construct_set_initial(ch, 0);
+    for (p = 0; ; p = q) {
+	q = p < len ? p + (h->sigmatch_array+p)->consumes : p;
+	sym = p < len ? (h->sigmatch_array+p)->signumber : EPSILON;
+	for (x = *(pr->live_first+p); x < *(pr->live_first+p+1); x++) {
+	    s = *(pr->live_states+x);
+	    if (p == len && BITTEST(h->finals, s)) {
+		fsm_construct_set_final(ch, apply_fsm_state(x, start));
+	    }
+	    for (a = *(h->arc_offsets+s); a < *(h->arc_offsets+s+1); a++) {
+		insym = *(arc_insym+a);
+		outsym = *(arc_outsym+a);
+		t = *(h->arc_target+a);
+		if (h->has_flags && (h->flag_lookup+insym)->type) {
+		    if ((y = apply_live_find(h, p, t)) == -1)
+			continue;
+		    if (h->obey_flags) {
+			fsm_construct_add_arc_nums(ch, apply_fsm_state(x, start), apply_fsm_state(y, start), insym, insym);
+			hasflags = 1;
+		    } else {
+			fsm_construct_add_arc_nums(ch, apply_fsm_state(x, start), apply_fsm_state(y, start), EPSILON, EPSILON);
+		    }
+		    continue;
+		}
+		if (insym == EPSILON) {
+		    y = apply_live_find(h, p, t);
+		} else if (p < len && (insym == sym || ((insym == IDENTITY || insym == UNKNOWN) && sym == IDENTITY))) {
+		    y = apply_live_find(h, q, t);
+		} else {
+		    continue;
+		}
+		if (y == -1)
+		    continue;
+		if (outsym == IDENTITY) {
+		    /* The input symbol is not in sigma: add it as is */
+		    memcpy(literal, h->instring+p, q-p);
+		    *(literal+q-p) = '\0';
+		    if ((outsym = fsm_construct_check_symbol(ch, literal)) == -1) {
+			outsym = fsm_construct_add_symbol(ch, literal);
+			if (numliterals == literals_size) {
+			    literals_size *= 2;
+			    literals = xxrealloc(literals, sizeof(int)*literals_size);
+			}
+			*(literals+(numliterals++)) = outsym;
+		    }
+		} else if (outsym == UNKNOWN) {
+		    outsym = IDENTITY;
+		    if (numidarcs*2 == idarcs_size) {
+			idarcs_size *= 2;
+			idarcs = xxrealloc(idarcs, sizeof(int)*idarcs_size);
+		    }
+		    *(idarcs+(numidarcs*2)) = apply_fsm_state(x, start);
+		    *(idarcs+(numidarcs++)*2+1) = apply_fsm_state(y, start);
+		}
+		fsm_construct_add_arc_nums(ch, apply_fsm_state(x, start), apply_fsm_state(y, start), outsym, outsym);
+	    }
+	}
+	if (p == len)
+	    break;
+    }
+    /* Symbols added above are no longer covered by IDENTITY */
+    for (x = 0; x < numidarcs; x++) {
+	for (y = 0; y < numliterals; y++) {
+	    fsm_construct_add_arc_nums(ch, *(idarcs+x*2), *(idarcs+x*2+1), *(literals+y), *(literals+y));
+	}
+    }
+    xxfree(idarcs);
+    xxfree(literals);
+    xxfree(literal);
+
+    /* The result is an automaton: no arc is left with UNKNOWN, and   */
+    /* IDENTITY stays only for unknown outputs.  Without IDENTITY arcs */
+    /* no unused symbol has to stay in sigma to keep them from matching */
+    net = fsm_construct_done(ch);
+    net->sigma = sigma_remove_num(UNKNOWN, net->sigma);
+    net->sigma = sigma_remove_num(IDENTITY, net->sigma);
+    if (net->sigma == NULL) {
+	net->sigma = sigma_create();
+    }
+    if (numidarcs > 0) {
+	sigma_add_special(IDENTITY, net->sigma);
+    }
+    net = fsm_minimize(net);
+    if (hasflags) {
+	net = flag_eliminate(net, NULL);
+    }
+    sigma_cleanup(net, 0);
+    fsm_compact(net);
+    sigma_sort(net);
+    return(net);
+}
+
+struct fsm *apply_down_to_fsm(struct apply_handle *h, char *word) {
+    return(apply_to_fsm(h, word, DOWN));
+}
+
+struct fsm *apply_up_to_fsm(struct apply_handle *h, char *word) {
+    return(apply_to_fsm(h, word, UP));
+}
+
+/* Accept-only lookup.  The side of the net the word is read on is */
+/* projected with fsm_upper()/fsm_lower() and minimized; membership */
+/* is then one walk over it.  Nets with flags keep the search, as   */
+/* flag_eliminate() differs from the runtime on unset R flags.      */
+
+static void apply_acceptor_free(struct apply_acceptor *acc) {
+    xxfree(acc->offsets);
+    xxfree(acc->syms);
+    xxfree(acc->targets);
+    xxfree(acc->finals);
+    xxfree(acc->map);
+    xxfree(acc);
+}
+
+static int apply_reaches_final(struct apply_handle *h) {
+    int i, s, t, tail, found, *stack;
+    uint8_t *seen;
+
+    if (h->last_net->finalcount == 0 || h->last_net->statecount == 0) {
+	return 0;
+    }
+    stack = xxmalloc(sizeof(int)*h->last_net->statecount);
+    seen = xxcalloc(BITNSLOTS(h->last_net->statecount+1), sizeof(uint8_t));
+    *stack = h->shared->start_state;
+    BITSET(seen, *stack);
+    for (tail = 1, found = 0; tail > 0 && !found; ) {
+	s = *(stack+(--tail));
+	found = BITTEST(h->finals, s) ? 1 : 0;
+	for (i = *(h->arc_offsets+s); i < *(h->arc_offsets+s+1); i++) {
+	    t = *(h->arc_target+i);
+	    if (!BITTEST(seen, t)) {
+		BITSET(seen, t);
+		*(stack+(tail++)) = t;
+	    }
+	}
+    }
+    xxfree(stack);
+    xxfree(seen);
+    return(found);
+}
+
+static int apply_acceptor_arc_cmp(const void *a, const void *b) {
+    return(((const struct fsm_state *) a)->in - ((const struct fsm_state *) b)->in);
+}
+
+static struct apply_acceptor *apply_acceptor_build(struct apply_handle *h, int direction) {
+    struct apply_acceptor *acc;
+    struct fsm *net;
+    struct fsm_state *fsm;
+    struct sigma *sig;
+    int i, j, numarcs, aborted, max_states, *fill;
+
+    max_states = h->acceptors->max_states;
+    if (max_states && h->last_net->statecount > max_states)
+	return(NULL);
+    /* Trimming assumes the start state is coaccessible, so an empty */
+    /* (possibly hand-constructed) net is handled up front           */
+    if (!apply_reaches_final(h)) {
+	net = fsm_empty_set();
+    } else {
+	net = fsm_copy(h->last_net);
+	/* Projecting turns UNKNOWN into IDENTITY, which needs a slot */
+	if (sigma_find_number(UNKNOWN, net->sigma) != -1 && sigma_find_number(IDENTITY, net->sigma) == -1) {
+	    sigma_add_special(IDENTITY, net->sigma);
+	}
+	/* The subset construction stops at the same bound, leaving the */
+	/* empty language where the side can't be; the abort flag is    */
+	/* left as the caller had it                                     */
+	aborted = fsm_subset_aborted();
+	fsm_set_subset_max_states(max_states);
+	net = fsm_minimize(direction == DOWN ? fsm_upper(net) : fsm_lower(net));
+	fsm_set_subset_max_states(0);
+	if (net->finalcount == 0) {
+	    if (!aborted)
+		fsm_subset_clear_aborted();
+	    fsm_destroy(net);
+	    return(NULL);
+	}
+    }
+    if (max_states && net->statecount > max_states) {
+	fsm_destroy(net);
+	return(NULL);
+    }
+    acc = xxcalloc(1, sizeof(struct apply_acceptor));
+    acc->offsets = xxcalloc(net->statecount+1, sizeof(int));
+    acc->finals = xxcalloc(BITNSLOTS(net->statecount+1), sizeof(uint8_t));
+    acc->start = 0;
+    for (fsm = net->states, numarcs = 0; fsm->state_no != -1; fsm++) {
+	if (fsm->target != -1) {
+	    (*(acc->offsets+fsm->state_no+1))++;
+	    numarcs++;
+	}
+	if (fsm->final_state) {
+	    BITSET(acc->finals, fsm->state_no);
+	}
+	if (fsm->start_state) {
+	    acc->start = fsm->state_no;
+	}
+    }
+    for (i = 0; i < net->statecount; i++) {
+	*(acc->offsets+i+1) += *(acc->offsets+i);
+    }
+    /* Lines of a state are contiguous: sort each state's arcs in place */
+    for (fsm = net->states, i = 0; (fsm+i)->state_no != -1; i = j) {
+	for (j = i; (fsm+j)->state_no == (fsm+i)->state_no; j++) { }
+	if (j - i > 1) {
+	    qsort(fsm+i, j - i, sizeof(struct fsm_state), apply_acceptor_arc_cmp);
+	}
+    }
+    acc->syms = xxmalloc(sizeof(int)*(*(acc->offsets+net->statecount)+1));
+    acc->targets = xxmalloc(sizeof(int)*(*(acc->offsets+net->statecount)+1));
+    /* States need not come in numerical order */
+    fill = xxmalloc(sizeof(int)*(net->statecount+1));
+    memcpy(fill, acc->offsets, sizeof(int)*(net->statecount+1));
+    for (fsm = net->states; fsm->state_no != -1; fsm++) {
+	if (fsm->target != -1) {
+	    i = (*(fill+fsm->state_no))++;
+	    *(acc->syms+i) = fsm->in;
+	    *(acc->targets+i) = fsm->target;
+	}
+    }
+    xxfree(fill);
+    acc->mapsize = sigma_max(h->last_net->sigma)+1;
+    if (acc->mapsize <= IDENTITY) {
+	acc->mapsize = IDENTITY+1;
+    }
+    acc->map = xxmalloc(sizeof(int)*acc->mapsize);
+    for (i = 0; i < acc->mapsize; i++) {
+	*(acc->map+i) = -1;
+    }
+    if (net->sigma != NULL) {
+	for (sig = h->last_net->sigma; sig != NULL && sig->number != -1; sig = sig->next) {
+	    if (sig->number > IDENTITY) {
+		*(acc->map+sig->number) = sigma_find(sig->symbol, net->sigma);
+	    }
+	}
+	*(acc->map+IDENTITY) = sigma_find_number(IDENTITY, net->sigma) != -1 ? IDENTITY : -1;
+    }
+    fsm_destroy(net);
+    return(acc);
+}
+
+static int apply_accept_visit(char *result, int length, void *userdata) {
+    return(1);
+}
+
+static struct apply_acceptors *apply_get_acceptors(struct apply_handle *h) {
+    if (h->acceptors == NULL) {
+	h->acceptors = xxcalloc(1, sizeof(struct apply_acceptors));
+	h->acceptors->max_states = APPLY_ACCEPT_MAX_STATES;
+    }
+    return(h->acceptors);
+}
+
+static int apply_accepts(struct apply_handle *h, char *word, int direction) {
+    struct apply_acceptors *ac;
+    struct apply_acceptor *acc;
+    int d, p, s, sym, lo, hi, mid;
+
+    apply_set_direction(h, direction);
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+    d = direction == DOWN ? 0 : 1;
+    ac = apply_get_acceptors(h);
+    if (ac->built[d] == 0 && !h->has_flags) {
+	ac->dfa[d] = apply_acceptor_build(h, direction);
+	ac->built[d] = ac->dfa[d] != NULL ? 1 : -1;
+    }
+    if (ac->built[d] != 1 || h->has_flags) {
+	return(apply_foreach(h, word, apply_accept_visit, NULL, NULL) > 0);
+    }
+    acc = ac->dfa[d];
+    apply_cache_abandon(h);
+    h->instring = word;
+    apply_create_sigmatch(h);
+    for (p = 0, s = acc->start; p < h->current_instring_length; p += (h->sigmatch_array+p)->consumes) {
+	sym = (h->sigmatch_array+p)->signumber;
+	if (sym < 0 || sym >= acc->mapsize || (sym = *(acc->map+sym)) == -1)
+	    return(0);
+	lo = *(acc->offsets+s);
+	hi = *(acc->offsets+s+1) - 1;
+	while (lo <= hi) {
+	    mid = (lo+hi)/2;
+	    if (*(acc->syms+mid) < sym) {
+		lo = mid+1;
+	    } else {
+		hi = mid-1;
+	    }
+	}
+	if (lo > *(acc->offsets+s+1) - 1 || *(acc->syms+lo) != sym)
+	    return(0);
+	s = *(acc->targets+lo);
+    }
+    return(BITTEST(acc->finals, s) ? 1 : 0);
+}
+
+int apply_down_accepts(struct apply_handle *h, char *word) {
+    return(apply_accepts(h, word, DOWN));
+}
+
+int apply_up_accepts(struct apply_handle *h, char *word) {
+    return(apply_accepts(h, word, UP));
+}
+
+void apply_set_accept_limit(struct apply_handle *h, int max_states) {
+    struct apply_acceptors *ac;
+    int d;
+    ac = apply_get_acceptors(h);
+    ac->max_states = max_states;
+    for (d = 0; d < 2; d++) {
+	if (ac->dfa[d] != NULL) {
+	    apply_acceptor_free(ac->dfa[d]);
+	    ac->dfa[d] = NULL;
+	}
+	ac->built[d] = 0;
+    }
+}
+
+/* A scan first runs the text once from left to right over pairs of */
+/* (start, state), to find how far a match from each start can reach. */
+/* Flags are taken as epsilons there, and starts that meet in a state */
+/* share their ends, so this may overshoot but never misses a match.  */
+/* Then only the starts that can match are searched, over the         */
+/* sigmatch array cut off at that end, collecting matches through a   */
+/* visitor that reads the end of each match off h->ipos.  While a     */
+/* search runs, h->scan makes it start at start and accept anywhere.  */
+
+struct apply_scan {
+    struct apply_handle *h;
+    int mode;
+    int start;
+    int longest;                /* End of the longest match at start */
+    char *outputs;              /* Its outputs, NUL-separated */
+    size_t used;
+    size_t size;
+    int numoutputs;
+    int found;
+    int stopped;
+    int (*visit)(int offset, int length, char *output, void *userdata);
+    void *userdata;
+};
+
+static int apply_scan_visit(char *result, int length, void *userdata) {
+    struct apply_scan *sc;
+    int end;
+    sc = userdata;
+    end = sc->h->ipos;
+    if (end == sc->start) {
+	return 0;
+    }
+    if (sc->mode == APPLY_SCAN_ALL) {
+	sc->found++;
+	sc->stopped = sc->visit(sc->start, end - sc->start, result, sc->userdata);
+	return(sc->stopped);
+    }
+    if (end < sc->longest) {
+	return 0;
+    }
+    if (end > sc->longest) {
+	sc->longest = end;
+	sc->used = 0;
+	sc->numoutputs = 0;
+    }
+    if (sc->used + length + 1 > sc->size) {
+	sc->size = next_power_of_two(sc->used + length + 1);
+	sc->outputs = xxrealloc(sc->outputs, sc->size);
+    }
+    memcpy(sc->outputs+sc->used, result, length+1);
+    sc->used += length + 1;
+    sc->numoutputs++;
+    return 0;
+}
+
+struct apply_scan_pass {
+    struct apply_handle *h;
+    short int *arc_insym;
+    int *states;                /* The states of the layer */
+    int *starts;                /* and the start each came from */
+    int size;
+    int *next_states;
+    int *next_starts;
+    int next_size;
+    int *seen;                  /* Stamp of the layer a state is in */
+    int *where;                 /* and its index there */
+    int stamp;
+    int *parent;                /* Starts merged by sharing a state */
+    int *maxend;
+};
+
+static int apply_scan_find(struct apply_scan_pass *sp, int start) {
+    int root, up;
+    for (root = start; *(sp->parent+root) != root; root = *(sp->parent+root)) { }
+    for ( ; start != root; start = up) {
+	up = *(sp->parent+start);
+	*(sp->parent+start) = root;
+    }
+    return(root);
+}
+
+/* Adds (start, state) to the next layer.  If the state is there  */
+/* already, the two starts have the same paths from here on, and  */
+/* are merged into one with the furthest end of either.           */
+
+static void apply_scan_add(struct apply_scan_pass *sp, int start, int state) {
+    int a, b;
+    if (*(sp->seen+state) == sp->stamp) {
+	a = apply_scan_find(sp, start);
+	b = apply_scan_find(sp, *(sp->next_starts+*(sp->where+state)));
+	if (a != b) {
+	    if (*(sp->maxend+a) > *(sp->maxend+b)) {
+		*(sp->maxend+b) = *(sp->maxend+a);
+	    }
+	    *(sp->parent+a) = b;
+	}
+	return;
+    }
+    *(sp->seen+state) = sp->stamp;
+    *(sp->where+state) = sp->next_size;
+    *(sp->next_states+sp->next_size) = state;
+    *(sp->next_starts+sp->next_size) = start;
+    sp->next_size++;
+}
+
+/* Follows input epsilons and flags within the next layer */
+
+static void apply_scan_closure(struct apply_scan_pass *sp) {
+    struct apply_handle *h;
+    int i, a, sym, state;
+    h = sp->h;
+    for (i = 0; i < sp->next_size; i++) {
+	state = *(sp->next_states+i);
+	for (a = *(h->arc_offsets+state); a < *(h->arc_offsets+state+1); a++) {
+	    sym = *(sp->arc_insym+a);
+	    if (sym == EPSILON || (h->has_flags && (h->flag_lookup+sym)->type)) {
+		apply_scan_add(sp, *(sp->next_starts+i), *(h->arc_target+a));
+	    }
+	}
+    }
+}
+
+/* Sets maxend[p] for every symbol position p to at least the end of */
+/* the longest match from p, or to no more than p if there is none.  */
+/* A layer has each state at most once, so the pass is linear in the */
+/* text.                                                             */
+
+static void apply_scan_ends(struct apply_handle *h, int d, int *maxend) {
+    struct apply_scan_pass sp;
+    int i, a, sym, pos, root, signumber, statecount, *swap;
+
+    statecount = h->last_net->statecount;
+    sp.h = h;
+    sp.arc_insym = d == 0 ? h->arc_in : h->arc_out;
+    sp.states = xxmalloc(sizeof(int)*statecount);
+    sp.starts = xxmalloc(sizeof(int)*statecount);
+    sp.next_states = xxmalloc(sizeof(int)*statecount);
+    sp.next_starts = xxmalloc(sizeof(int)*statecount);
+    sp.seen = xxcalloc(statecount, sizeof(int));
+    sp.where = xxmalloc(sizeof(int)*statecount);
+    sp.parent = xxmalloc(sizeof(int)*(h->current_instring_length+1));
+    sp.maxend = maxend;
+    sp.stamp = 1;
+    sp.size = sp.next_size = 0;
+    for (pos = 0; ; pos += (h->sigmatch_array+pos)->consumes) {
+	*(sp.parent+pos) = pos;
+	*(maxend+pos) = -1;
+	if (pos < h->current_instring_length) {
+	    apply_scan_add(&sp, pos, h->shared->start_state);
+	}
+	apply_scan_closure(&sp);
+	swap = sp.states; sp.states = sp.next_states; sp.next_states = swap;
+	swap = sp.starts; sp.starts = sp.next_starts; sp.next_starts = swap;
+	sp.size = sp.next_size;
+	sp.next_size = 0;
+	sp.stamp++;
+	for (i = 0; i < sp.size; i++) {
+	    if (BITTEST(h->finals, *(sp.states+i))) {
+		root = apply_scan_find(&sp, *(sp.starts+i));
+		*(maxend+root) = pos;
+	    }
+	}
+	if (pos >= h->current_instring_length) {
+	    break;
+	}
+	signumber = (h->sigmatch_array+pos)->signumber;
+	for (i = 0; i < sp.size; i++) {
+	    for (a = *(h->arc_offsets+*(sp.states+i)); a < *(h->arc_offsets+*(sp.states+i)+1); a++) {
+		sym = *(sp.arc_insym+a);
+		if (sym == signumber || ((sym == IDENTITY || sym == UNKNOWN) && signumber == IDENTITY)) {
+		    apply_scan_add(&sp, *(sp.starts+i), *(h->arc_target+a));
+		}
+	    }
+	}
+    }
+    for (pos = 0; pos < h->current_instring_length; pos += (h->sigmatch_array+pos)->consumes) {
+	*(maxend+pos) = *(maxend+apply_scan_find(&sp, pos));
+    }
+    xxfree(sp.states);
+    xxfree(sp.starts);
+    xxfree(sp.next_states);
+    xxfree(sp.next_starts);
+    xxfree(sp.seen);
+    xxfree(sp.where);
+    xxfree(sp.parent);
+}
+
+static int apply_scan(struct apply_handle *h, int direction, char *text, int mode, int (*visit)(int offset, int length, char *output, void *userdata), void *userdata) {
+    struct apply_scan sc;
+    struct apply_visitor *v;
+    char *output;
+    int i, pos, next, status, length, *maxend;
+
+    apply_set_direction(h, direction);
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+    apply_cache_abandon(h);
+    sc.h = h;
+    sc.mode = mode;
+    sc.outputs = NULL;
+    sc.used = sc.size = 0;
+    sc.found = 0;
+    sc.stopped = 0;
+    sc.visit = visit;
+    sc.userdata = userdata;
+    v = apply_get_visitor(h);
+    v->visit = apply_scan_visit;
+    v->visit_symbols = NULL;
+    v->data = &sc;
+    h->instring = text;
+    apply_create_sigmatch(h);
+    h->prune = 0;
+    length = h->current_instring_length;
+    maxend = xxmalloc(sizeof(int)*(length+1));
+    apply_scan_ends(h, direction == DOWN ? 0 : 1, maxend);
+    h->scan = &sc;
+    status = APPLY_OK;
+    for (pos = 0; pos < length && !sc.stopped; pos = next) {
+	next = pos + (h->sigmatch_array+pos)->consumes;
+	if (*(maxend+pos) <= pos) {
+	    continue;
+	}
+	sc.start = sc.longest = pos;
+	sc.used = 0;
+	sc.numoutputs = 0;
+	h->iterate_old = 0;
+	apply_force_clear_stack(h);
+	h->current_instring_length = *(maxend+pos);
+	apply_net(h);
+	h->current_instring_length = length;
+	if (h->status != APPLY_OK && status == APPLY_OK) {
+	    status = h->status;
+	}
+	if (mode == APPLY_SCAN_LONGEST && sc.longest > pos) {
+	    for (i = 0, output = sc.outputs; i < sc.numoutputs && !sc.stopped; i++) {
+		sc.found++;
+		sc.stopped = visit(pos, sc.longest - pos, output, userdata);
+		output += strlen(output) + 1;
+	    }
+	    next = sc.longest;
+	}
+    }
+    apply_force_clear_stack(h);
+    h->status = status;
+    h->scan = NULL;
+    v->visit = NULL;
+    v->data = NULL;
+    xxfree(sc.outputs);
+    xxfree(maxend);
+    return(sc.found);
+}
+
+int apply_down_scan(struct apply_handle *h, char *text, int mode, int (*visit)(int offset, int length, char *output, void *userdata), void *userdata) {
+    return(apply_scan(h, DOWN, text, mode, visit, userdata));
+}
+
+int apply_up_scan(struct apply_handle *h, char *text, int mode, int (*visit)(int offset, int length, char *output, void *userdata), void *userdata) {
+    return(apply_scan(h, UP, text, mode, visit, userdata));
+}
+
+/* Runs a search on input that is already split into symbols.  The     */
+/* symbols are in the caller's numbering, which in_map translates into */
+/* sigma numbers (IDENTITY for symbols outside the alphabet); out_map  */
+/* translates output sigma numbers back.  Outputs of identity arcs are */
+/* the caller's input symbol.  Either map may be NULL to use sigma     */
+/* numbers directly.                                                   */
+
+static int apply_symbols_foreach(struct apply_handle *h, int direction, int *symbols, int length, int *in_map, int *out_map, int (*visit)(int *symbols, int length, void *userdata), void *userdata) {
+    struct apply_visitor *v;
+    int i;
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+    apply_cache_abandon(h);
+    apply_set_direction(h, direction);
+    if (length >= h->sigmatch_array_size) {
+	xxfree(h->sigmatch_array);
+	h->sigmatch_array_size = next_power_of_two(length);
+	h->sigmatch_array = xxmalloc(sizeof(struct sigmatch_array)*(h->sigmatch_array_size));
+    }
+    for (i = 0; i < length; i++) {
+	(h->sigmatch_array+i)->signumber = in_map != NULL ? *(in_map+*(symbols+i)) : *(symbols+i);
+	(h->sigmatch_array+i)->consumes = 1;
+    }
+    (h->sigmatch_array+length)->signumber = EPSILON;
+    (h->sigmatch_array+length)->consumes = 0;
+    h->current_instring_length = length;
+    apply_prune_prepare(h);
+
+    v = apply_get_visitor(h);
+    v->visit = NULL;
+    v->visit_symbols = visit;
+    v->data = userdata;
+    v->in = symbols;
+    v->out_map = out_map;
+    v->count = 0;
+    h->iterate_old = 0;
+    apply_force_clear_stack(h);
+    if (apply_net(h) != NULL) {
+	apply_force_clear_stack(h);
+    }
+    v->visit_symbols = NULL;
+    v->data = NULL;
+    v->in = NULL;
+    v->out_map = NULL;
+    return(v->count);
+}
+
+int apply_down_symbols_foreach(struct apply_handle *h, int *symbols, int length, int *in_map, int *out_map, int (*visit)(int *symbols, int length, void *userdata), void *userdata) {
+    return(apply_symbols_foreach(h, DOWN, symbols, length, in_map, out_map, visit, userdata));
+}
+
+int apply_up_symbols_foreach(struct apply_handle *h, int *symbols, int length, int *in_map, int *out_map, int (*visit)(int *symbols, int length, void *userdata), void *userdata) {
+    return(apply_symbols_foreach(h, UP, symbols, length, in_map, out_map, visit, userdata));
+}
+
+/* Iterates over the results for input given as sigma numbers.  The */
+/* search stops at each result, which apply_visit() leaves in the    */
+/* visitor's syms, and resumes from there on the next call.          */
+
+static int apply_ids_visit(int *symbols, int length, void *userdata) {
+    *((int *) userdata) = length;
+    return(1);
+}
+
+static int *apply_ids(struct apply_handle *h, int direction, int *symbols, int length, int *outlength) {
+    struct apply_visitor *v;
+    int i, sym;
+    char *result;
+
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(NULL);
+    apply_set_direction(h, direction);
+    v = apply_get_visitor(h);
+    if (symbols != NULL) {
+	apply_cache_abandon(h);
+	if (length >= h->sigmatch_array_size) {
+	    xxfree(h->sigmatch_array);
+	    h->sigmatch_array_size = next_power_of_two(length+1);
+	    h->sigmatch_array = xxmalloc(sizeof(struct sigmatch_array)*(h->sigmatch_array_size));
+	}
+	if (length > v->ids_in_size) {
+	    v->ids_in_size = next_power_of_two(length);
+	    v->ids_in = xxrealloc(v->ids_in, sizeof(int)*(v->ids_in_size));
+	}
+	/* Anything that is not an alphabet symbol matches as unknown */
+	for (i = 0; i < length; i++) {
+	    sym = *(symbols+i);
+	    if (sym <= UNKNOWN || sym >= h->sigma_size || (h->sigs+sym)->symbol == NULL) {
+		sym = IDENTITY;
+	    }
+	    *(v->ids_in+i) = sym;
+	    (h->sigmatch_array+i)->signumber = sym;
+	    (h->sigmatch_array+i)->consumes = 1;
+	}
+	(h->sigmatch_array+length)->signumber = EPSILON;
+	(h->sigmatch_array+length)->consumes = 0;
+	h->current_instring_length = length;
+	apply_prune_prepare(h);
+	apply_force_clear_stack(h);
+	h->iterate_old = 0;
+    } else {
+	h->iterate_old = 1;
+    }
+    /* Results are returned through syms, even empty ones */
+    if (v->syms == NULL) {
+	v->syms_size = 16;
+	v->syms = xxmalloc(sizeof(int) * v->syms_size);
+    }
+    v->visit_symbols = apply_ids_visit;
+    v->data = &v->ids_length;
+    v->in = v->ids_in;
+    result = apply_net(h);
+    v->visit_symbols = NULL;
+    v->data = NULL;
+    v->in = NULL;
+    if (result == NULL)
+	return(NULL);
+    *outlength = v->ids_length;
+    return(v->syms);
+}
+
+int *apply_down_ids(struct apply_handle *h, int *symbols, int length, int *outlength) {
+    return(apply_ids(h, DOWN, symbols, length, outlength));
 }
 
-void apply_set_show_flags(struct apply_handle *h, int value) {
-    h->show_flags = value;
+int *apply_up_ids(struct apply_handle *h, int *symbols, int length, int *outlength) {
+    return(apply_ids(h, UP, symbols, length, outlength));
 }
 
-void apply_set_print_space(struct apply_handle *h, int value) {
-    h->print_space = value;
-    h->space_symbol = " ";
+/* Looks symbol up in the tokenizer trie: its sigma number, or -1 if */
+/* it is not a symbol of the alphabet                                */
+
+int apply_symbol_id(struct apply_handle *h, char *symbol) {
+    struct apply_tokenizer *tok;
+    unsigned char *str;
+    int j, node, lo, hi;
+
+    tok = h->tokenizer;
+    str = (unsigned char *) symbol;
+    if (tok == NULL || *str == '\0')
+	return(-1);
+    for (node = tok->root_next[*str], j = 1; node != 0 && *(str+j) != '\0'; j++) {
+	lo = *(tok->first+node);
+	hi = *(tok->first+node+1);
+	for ( ; lo < hi && *(tok->bytes+lo) < *(str+j); lo++) { }
+	node = (lo < hi && *(tok->bytes+lo) == *(str+j)) ? lo : 0;
+    }
+    return(node != 0 && *(tok->sym+node) != 0 ? *(tok->sym+node) : -1);
 }
 
-void apply_set_space_symbol(struct apply_handle *h, char *space) {
-    h->space_symbol = space;
-    h->print_space = 1;
+char *apply_symbol_name(struct apply_handle *h, int id) {
+    if (id <= IDENTITY || id >= h->sigma_size)
+	return(NULL);
+    return((h->sigs+id)->symbol);
 }
 
-void apply_set_print_pairs(struct apply_handle *h, int value) {
-    h->print_pairs = value;
+int apply_sigma_size(struct apply_handle *h) {
+    return(h->sigma_size);
 }
 
-static void apply_force_clear_stack(struct apply_handle *h) {
-    /* Make sure stack is empty and marks reset */
-    if (!apply_stack_isempty(h)) {
-	*(h->marks+(h->gstates+h->ptr)->state_no) = 0;
-	while (!apply_stack_isempty(h)) {
-	    apply_stack_pop(h);
-	    *(h->marks+(h->gstates+h->ptr)->state_no) = 0;
-	}
-	h->iterator = 0;
-	h->iterate_old = 0;
-	apply_stack_clear(h);
+/* Splits word into symbols the way apply_down() and apply_up() do.   */
+/* Symbol i is sigma number symbols[i] (IDENTITY if not in the        */
+/* alphabet), spelled by lengths[i] bytes.  Both arrays need room for */
+/* strlen(word) entries.  Returns the number of symbols.               */
+
+int apply_tokenize(struct apply_handle *h, char *word, int *symbols, int *lengths) {
+    int i, n, mode;
+    mode = h->mode;
+    h->mode = DOWN;
+    h->instring = word;
+    apply_create_sigmatch(h);
+    h->mode = mode;
+    for (i = 0, n = 0; i < h->current_instring_length; i += (h->sigmatch_array+i)->consumes, n++) {
+	*(symbols+n) = (h->sigmatch_array+i)->signumber;
+	*(lengths+n) = (h->sigmatch_array+i)->consumes;
     }
+    return(n);
 }
 
-char *apply_enumerate(struct apply_handle *h) {
-
-    char *result = NULL;
-    
+/* Applies a whole array of words in one call.  All results are copied   */
+/* into the caller's arena as NUL-terminated strings, indexed by word     */
+/* through b->word_results.  Returns the number of words processed.  If   */
+/* the arena or results table fills up, processing stops before the word */
+/* that did not fit, so the caller can consume what is there and call    */
+/* again with the rest.  It also stops after a word that ran into one of  */
+/* the apply_set_limits(), which is then the last word processed and      */
+/* apply_get_status() tells which limit cut its results short.           */
+
+static int apply_batch(struct apply_handle *h, char **words, int nwords, struct apply_batch *b) {
+    char *result;
+    int i, len, oldnumresults;
+    size_t oldused;
+
+    b->arena_used = 0;
+    b->numresults = 0;
+    b->arena_needed = 0;
+    b->results_needed = 0;
+    b->word_results[0] = 0;
+    apply_cache_abandon(h);
+    h->status = APPLY_OK;
     if (h->last_net == NULL || h->last_net->finalcount == 0) {
-	return (NULL);
+	for (i = 0; i < nwords; i++) {
+	    b->word_results[i+1] = 0;
+	}
+	return(nwords);
     }
-    h->binsearch = 0;
-    if (h->iterator == 0) {
-        h->iterate_old = 0;
-	apply_force_clear_stack(h);
-        result = apply_net(h);
-	if ((h->mode & RANDOM) != RANDOM)
-	  (h->iterator)++;
-    } else {
-        h->iterate_old = 1;
-        result = apply_net(h);
+    apply_force_clear_stack(h);
+    for (i = 0; i < nwords; i++) {
+	oldused = b->arena_used;
+	oldnumresults = b->numresults;
+	h->iterate_old = 0;
+	h->instring = words[i];
+	apply_create_sigmatch(h);
+	apply_prune_prepare(h);
+	for (result = apply_net(h); result != NULL; result = apply_net(h)) {
+	    len = h->opos;
+	    if (b->numresults == b->results_size || b->arena_used + len + 1 > b->arena_size) {
+		/* Doesn't fit: roll back this word, and count what it */
+		/* needs so the caller can make room for it            */
+		b->arena_needed = b->arena_used - oldused;
+		b->results_needed = b->numresults - oldnumresults;
+		for ( ; result != NULL; result = apply_net(h)) {
+		    b->arena_needed += h->opos + 1;
+		    b->results_needed++;
+		    h->iterate_old = 1;
+		}
+		b->arena_used = oldused;
+		b->numresults = oldnumresults;
+		apply_force_clear_stack(h);
+		return(i);
+	    }
+	    memcpy(b->arena + b->arena_used, result, len);
+	    *(b->arena + b->arena_used + len) = '\0';
+	    b->results[b->numresults++] = b->arena_used;
+	    b->arena_used += len + 1;
+	    h->iterate_old = 1;
+	}
+	b->word_results[i+1] = b->numresults;
+	if (h->status != APPLY_OK) {
+	    return(i+1);
+	}
     }
-    return(result);
-}
-
-char *apply_words(struct apply_handle *h) {
-    h->mode = DOWN + ENUMERATE + LOWER + UPPER;
-    return(apply_enumerate(h));
+    return(nwords);
 }
 
-char *apply_upper_words(struct apply_handle *h) {
-    h->mode = DOWN + ENUMERATE + UPPER;
-    return(apply_enumerate(h));
+int apply_down_batch(struct apply_handle *h, char **words, int nwords, struct apply_batch *b) {
+    apply_set_direction(h, DOWN);
+    return(apply_batch(h, words, nwords, b));
 }
 
-char *apply_lower_words(struct apply_handle *h) {
-    h->mode = DOWN + ENUMERATE + LOWER;
-    return(apply_enumerate(h));
+int apply_up_batch(struct apply_handle *h, char **words, int nwords, struct apply_batch *b) {
+    apply_set_direction(h, UP);
+    return(apply_batch(h, words, nwords, b));
 }
 
-char *apply_random_words(struct apply_handle *h) {
-    apply_clear_flags(h);
-    h->mode = DOWN + ENUMERATE + LOWER + UPPER + RANDOM;
-    return(apply_enumerate(h));
+/* Parallel enumeration.  The calling handle first runs the search    */
+/* cut off at split arcs: words found above the cut are kept, and      */
+/* every path reaching it becomes a task, in the order the serial      */
+/* search would have gone down them.  Worker threads run the tasks on  */
+/* their own handles over the same shared tables, each following its   */
+/* task's path and searching the subtree below it, and the calling     */
+/* thread passes the results on strictly in task order.  Workers stay  */
+/* at most a window of tasks ahead of the merge, which bounds the      */
+/* results held in memory.                                             */
+
+#define APPLY_ENUM_MAX_DEPTH 8
+#define APPLY_ENUM_TASKS_PER_THREAD 16
+#define APPLY_ENUM_WINDOW_PER_THREAD 4
+
+struct apply_enum_output {
+    char *buf;
+    size_t used;
+    size_t size;
+    int count;
+    int done;
+};
+
+struct apply_enum_job {
+    struct apply_handle *source;
+    int depth;
+    int *items;                 /* Task number, or -1-offset of a word in words */
+    int numitems;
+    int items_size;
+    char *words;
+    size_t words_used;
+    size_t words_size;
+    int *paths;                 /* depth arcs per task */
+    int numtasks;
+    int tasks_size;
+    struct apply_enum_output *outputs;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next_task;
+    int merged;                 /* Tasks whose results were visited */
+    int window;
+    volatile int stop;          /* Set when the caller asks to stop, by atomics only */
+};
+
+/* While enumerating in parallel h->enum_cut points to one of these:  */
+/* the splitting handle hands off every path that is split arcs deep  */
+/* as a task of job, a worker follows prefix_len arcs of prefix first */
+
+struct apply_enum_cut {
+    int split;
+    int *prefix;
+    int prefix_len;
+    struct apply_enum_job *job;
+};
+
+struct apply_enum_worker {
+    struct apply_enum_job *job;
+    struct apply_enum_output *out;
+    pthread_t thread;
+};
+
+static void apply_enum_append(char **buf, size_t *used, size_t *size, char *word, int length) {
+    while (*used + length + 1 > *size) {
+	*size *= 2;
+	*buf = xxrealloc(*buf, *size);
+    }
+    memcpy(*buf + *used, word, length);
+    *(*buf + *used + length) = '\0';
+    *used += length + 1;
 }
 
-char *apply_random_lower(struct apply_handle *h) {
-    apply_clear_flags(h);
-    h->mode = DOWN + ENUMERATE + LOWER + RANDOM;    
-    return(apply_enumerate(h));
+static void apply_enum_item(struct apply_enum_job *job, int item) {
+    if (job->numitems == job->items_size) {
+	job->items_size *= 2;
+	job->items = xxrealloc(job->items, sizeof(int) * job->items_size);
+    }
+    *(job->items+job->numitems) = item;
+    job->numitems++;
 }
 
-char *apply_random_upper(struct apply_handle *h) {
-    apply_clear_flags(h);
-    h->mode = DOWN + ENUMERATE + UPPER + RANDOM;
-    return(apply_enumerate(h));
+/* A word found above the cut */
+static int apply_enum_word(char *result, int length, void *userdata) {
+    struct apply_enum_job *job;
+    job = userdata;
+    apply_enum_item(job, -1 - (int) job->words_used);
+    apply_enum_append(&job->words, &job->words_used, &job->words_size, result, length);
+    return 0;
 }
 
-/* Frees memory associated with applies */
-void apply_clear(struct apply_handle *h) {
-    struct sigma_trie_arrays *sta, *stap;
-    for (sta = h->sigma_trie_arrays; sta != NULL; ) {
-	stap = sta;
-	xxfree(sta->arr);
-	sta = sta->next;
-	xxfree(stap);
-    }
-    h->sigma_trie_arrays = NULL;
-    if (h->statemap != NULL) {
-        xxfree(h->statemap);
-        h->statemap = NULL;
-    }
-    if (h->numlines != NULL) {
-        xxfree(h->numlines);
-        h->numlines = NULL;
-    }
-    if (h->marks != NULL) {
-        xxfree(h->marks);
-        h->marks = NULL;
-    }
-    if (h->searchstack != NULL) {
-        xxfree(h->searchstack);
-        h->searchstack = NULL;
-    }
-    if (h->sigs != NULL) {
-        xxfree(h->sigs);
-        h->sigs = NULL;
-    }
-    if (h->flag_lookup != NULL) {
-        xxfree(h->flag_lookup);
-        h->flag_lookup = NULL;
-    }
-    if (h->sigmatch_array != NULL) {
-	xxfree(h->sigmatch_array);
-	h->sigmatch_array = NULL;
+/* A path reaching the cut */
+static void apply_enum_task(struct apply_handle *h) {
+    struct apply_enum_job *job;
+    int i;
+    job = h->enum_cut->job;
+    if (job->numtasks == job->tasks_size) {
+	job->tasks_size *= 2;
+	job->paths = xxrealloc(job->paths, sizeof(int) * APPLY_ENUM_MAX_DEPTH * job->tasks_size);
     }
-    if (h->flagstates != NULL) {
-	xxfree(h->flagstates);
-	h->flagstates = NULL;
+    for (i = 0; i < job->depth; i++) {
+	*(job->paths + job->numtasks * job->depth + i) = (h->searchstack+i)->offset;
     }
-    apply_clear_index(h);
-    h->last_net = NULL;
-    h->iterator = 0;
-    xxfree(h->outstring);
-    xxfree(h);
+    apply_enum_item(job, job->numtasks);
+    job->numtasks++;
 }
 
-char *apply_updown(struct apply_handle *h, char *word) {
+/* A word found by a worker */
+static int apply_enum_collect(char *result, int length, void *userdata) {
+    struct apply_enum_worker *wk;
+    wk = userdata;
+    apply_enum_append(&wk->out->buf, &wk->out->used, &wk->out->size, result, length);
+    wk->out->count++;
+    return(__sync_fetch_and_add(&wk->job->stop, 0));
+}
 
-    char *result = NULL;
+static void *apply_enum_work(void *arg) {
+    struct apply_enum_worker *wk;
+    struct apply_enum_job *job;
+    struct apply_enum_cut cut;
+    struct apply_visitor *v;
+    struct apply_handle *h, *src;
+    int t;
+
+    wk = arg;
+    job = wk->job;
+    src = job->source;
+    h = apply_init_shared(src->shared);
+    h->mode = src->mode;
+    h->indexed = src->indexed;
+    h->binsearch = 0;
+    h->obey_flags = src->obey_flags;
+    h->show_flags = src->show_flags;
+    h->print_space = src->print_space;
+    h->space_symbol = src->space_symbol;
+    h->print_pairs = src->print_pairs;
+    memset(&cut, 0, sizeof(struct apply_enum_cut));
+    cut.prefix_len = job->depth;
+    h->enum_cut = &cut;
+    v = apply_get_visitor(h);
+    v->visit = apply_enum_collect;
+    v->data = wk;
+    for (;;) {
+	pthread_mutex_lock(&job->lock);
+	while (!__sync_fetch_and_add(&job->stop, 0) && job->next_task < job->numtasks && job->next_task >= job->merged + job->window) {
+	    pthread_cond_wait(&job->cond, &job->lock);
+	}
+	if (__sync_fetch_and_add(&job->stop, 0) || job->next_task == job->numtasks) {
+	    pthread_mutex_unlock(&job->lock);
+	    break;
+	}
+	t = job->next_task++;
+	pthread_mutex_unlock(&job->lock);
 
-    if (h->last_net == NULL || h->last_net->finalcount == 0)
-        return (NULL);
-    
-    if (word == NULL) {
-        h->iterate_old = 1;
-        result = apply_net(h);
+	wk->out = job->outputs + t;
+	wk->out->size = 256;
+	wk->out->buf = xxmalloc(wk->out->size);
+	cut.prefix = job->paths + t * job->depth;
+	h->iterate_old = 0;
+	apply_net(h);
+	apply_force_clear_stack(h);
+
+	pthread_mutex_lock(&job->lock);
+	wk->out->done = 1;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
     }
-    else if (word != NULL) {
-        h->iterate_old = 0;
-        h->instring = word;
-        apply_create_sigmatch(h);
+    h->enum_cut = NULL;
+    apply_clear(h);
+    return(NULL);
+}
 
-	/* Remove old marks if necessary TODO: only pop marks */
+static void apply_enum_free(struct apply_enum_job *job, struct apply_enum_worker *workers) {
+    int t;
+    for (t = 0; t < job->numtasks; t++) {
+	if ((job->outputs+t)->buf != NULL)
+	    xxfree((job->outputs+t)->buf);
+    }
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    xxfree(workers);
+    xxfree(job->outputs);
+    xxfree(job->items);
+    xxfree(job->words);
+    xxfree(job->paths);
+}
+
+static int apply_words_serial(struct apply_handle *h, int (*visit)(char *result, int length, void *userdata), void *userdata) {
+    struct apply_visitor *v;
+    v = apply_get_visitor(h);
+    v->visit = visit;
+    v->data = userdata;
+    v->count = 0;
+    if (apply_net(h) != NULL) {
 	apply_force_clear_stack(h);
-        result = apply_net(h);
     }
-    return(result);
+    v->visit = NULL;
+    v->data = NULL;
+    return(v->count);
 }
 
-char *apply_down(struct apply_handle *h, char *word) {
+int apply_words_parallel(struct apply_handle *h, int side, int numthreads, int (*visit)(char *result, int length, void *userdata), void *userdata) {
+    struct apply_enum_job job;
+    struct apply_enum_cut cut;
+    struct apply_enum_worker *workers;
+    struct apply_enum_output *out;
+    struct apply_visitor *v;
+    char *word;
+    int i, j, t, len, count;
 
-    h->mode = DOWN;
-    if (h->index_in) { 
-	h->indexed = 1;
-    } else {
-	h->indexed = 0;
+    if (h->last_net == NULL || h->last_net->finalcount == 0)
+	return(0);
+    if (numthreads <= 0)
+	numthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (numthreads <= 0)
+	numthreads = 1;
+
+    h->mode = DOWN + ENUMERATE + ((side & M_UPPER) ? UPPER : 0) + ((side & M_LOWER) ? LOWER : 0);
+    h->binsearch = 0;
+    h->prune = 0;
+    apply_cache_abandon(h);
+    apply_force_clear_stack(h);
+    h->iterator = 0;
+    h->iterate_old = 0;
+
+    /* Limits count across the whole search, so they need the serial one */
+    if (numthreads == 1 || h->limits != NULL) {
+	return(apply_words_serial(h, visit, userdata));
     }
-    h->binsearch = (h->last_net->arcs_sorted_in == 1) ? 1 : 0;
-    return(apply_updown(h, word));
-}
 
-char *apply_up(struct apply_handle *h, char *word) {
+    memset(&job, 0, sizeof(struct apply_enum_job));
+    job.source = h;
+    job.items_size = 256;
+    job.items = xxmalloc(sizeof(int) * job.items_size);
+    job.words_size = 256;
+    job.words = xxmalloc(job.words_size);
+    job.tasks_size = 256;
+    job.paths = xxmalloc(sizeof(int) * APPLY_ENUM_MAX_DEPTH * job.tasks_size);
+
+    /* Cut deeper until there are enough tasks to share out */
+    v = apply_get_visitor(h);
+    v->visit = apply_enum_word;
+    v->data = &job;
+    memset(&cut, 0, sizeof(struct apply_enum_cut));
+    cut.job = &job;
+    h->enum_cut = &cut;
+    for (job.depth = 1; ; job.depth++) {
+	job.numitems = 0;
+	job.words_used = 0;
+	job.numtasks = 0;
+	cut.split = job.depth;
+	h->iterate_old = 0;
+	apply_net(h);
+	if (job.numtasks == 0 || job.numtasks >= numthreads * APPLY_ENUM_TASKS_PER_THREAD || job.depth == APPLY_ENUM_MAX_DEPTH)
+	    break;
+    }
+    h->enum_cut = NULL;
+    v->visit = NULL;
+    v->data = NULL;
+
+    job.outputs = xxcalloc(job.numtasks + 1, sizeof(struct apply_enum_output));
+    job.window = numthreads * APPLY_ENUM_WINDOW_PER_THREAD;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    if (numthreads > job.numtasks)
+	numthreads = job.numtasks;
+    workers = xxcalloc(numthreads + 1, sizeof(struct apply_enum_worker));
+    for (i = 0; i < numthreads; i++) {
+	(workers+i)->job = &job;
+	if (pthread_create(&(workers+i)->thread, NULL, apply_enum_work, workers+i) != 0)
+	    break;
+    }
+    /* The threads that did start run all the tasks between them; */
+    /* with none, nothing has been visited yet and the serial     */
+    /* search can start over                                      */
+    numthreads = i;
+    if (numthreads == 0) {
+	apply_enum_free(&job, workers);
+	return(apply_words_serial(h, visit, userdata));
+    }
 
-    h->mode = UP;
-    if (h->index_out) {
-	h->indexed = 1;
-    } else {
-	h->indexed = 0;
+    for (i = 0, count = 0; i < job.numitems && !__sync_fetch_and_add(&job.stop, 0); i++) {
+	if (*(job.items+i) < 0) {
+	    word = job.words - 1 - *(job.items+i);
+	    count++;
+	    if (visit(word, strlen(word), userdata))
+		__sync_fetch_and_or(&job.stop, 1);
+	    continue;
+	}
+	t = *(job.items+i);
+	out = job.outputs + t;
+	pthread_mutex_lock(&job.lock);
+	while (!out->done) {
+	    pthread_cond_wait(&job.cond, &job.lock);
+	}
+	pthread_mutex_unlock(&job.lock);
+	for (j = 0, word = out->buf; j < out->count; j++, word += len + 1) {
+	    len = strlen(word);
+	    count++;
+	    if (visit(word, len, userdata)) {
+		__sync_fetch_and_or(&job.stop, 1);
+		break;
+	    }
+	}
+	xxfree(out->buf);
+	out->buf = NULL;
+	pthread_mutex_lock(&job.lock);
+	job.merged++;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.lock);
     }
-    h->binsearch = (h->last_net->arcs_sorted_out == 1) ? 1 : 0;
-    return(apply_updown(h, word));
+
+    pthread_mutex_lock(&job.lock);
+    __sync_fetch_and_or(&job.stop, 1);
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for (i = 0; i < numthreads; i++) {
+	pthread_join((workers+i)->thread, NULL);
+    }
+    apply_enum_free(&job, workers);
+    return(count);
 }
 
-struct apply_handle *apply_init(struct fsm *net) {
+/* Builds the read-only lookup tables for a network */
+struct apply_shared *apply_shared_init(struct fsm *net) {
+    struct apply_shared *sh;
+
+    sh = xxcalloc(1,sizeof(struct apply_shared));
+    sh->last_net = net;
+    sh->gstates = net->states;
+    sh->gsigma = net->sigma;
+    apply_create_arcarrays(sh, net);
+    apply_select_search(sh);
+    apply_create_sigarray(sh, net);
+    return(sh);
+}
+
+/* Creates a handle with its own search state on top of existing tables */
+/* Handles sharing tables may be used concurrently from several threads */
+struct apply_handle *apply_init_shared(struct apply_shared *sh) {
     struct apply_handle *h;
 
-    srand((unsigned int) time(NULL));
-    h = calloc(1,sizeof(struct apply_handle));
+    h = xxcalloc(1,sizeof(struct apply_handle));
     /* Init */
 
     h->iterate_old = 0;
     h->iterator = 0;
     h->instring = NULL;
-    h->flag_list = NULL;
-    h->flag_lookup = NULL;
+    h->flag_regs = NULL;
     h->obey_flags = 1;
     h->show_flags = 0;
     h->print_space = 0;
     h->print_pairs = 0;
-
-    h->last_net = net;
+    h->rand_state = (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) h;
+
+    h->shared = sh;
+    h->owns_shared = 0;
+    h->last_net = sh->last_net;
+    h->gsigma = sh->gsigma;
+    h->arc_offsets = sh->arc_offsets;
+    h->arc_in = sh->arc_in;
+    h->arc_out = sh->arc_out;
+    h->arc_target = sh->arc_target;
+    h->finals = sh->finals;
+    h->tokenizer = sh->tokenizer;
+    h->sigs = sh->sigs;
+    h->sigma_size = sh->sigma_size;
+    h->has_flags = sh->has_flags;
+    h->flag_lookup = sh->flag_lookup;
+    h->flagstates = sh->flagstates;
 
     h->outstring = xxmalloc(sizeof(char)*DEFAULT_OUTSTRING_SIZE);
     h->outstringtop = DEFAULT_OUTSTRING_SIZE;
     *(h->outstring) = '\0';
-    h->gstates = net->states;
-    h->gsigma = net->sigma;
     h->printcount = 1;
-    apply_create_statemap(h, net);
+    h->marks = xxcalloc(h->last_net->statecount, sizeof(int));
     h->searchstack = xxmalloc(sizeof(struct searchstack) * DEFAULT_STACK_SIZE);
     h->apply_stack_top = DEFAULT_STACK_SIZE;
     apply_stack_clear(h);
-    apply_create_sigarray(h, net);
+    // Default size created at init, resized later if necessary
+    h->sigmatch_array = xxcalloc(1024,sizeof(struct sigmatch_array));
+    h->sigmatch_array_size = 1024;
+    /* Each handle keeps its own flag registers */
+    if (h->has_flags) {
+	h->flag_regs = xxcalloc(sh->flag_name_count+1, sizeof(int));
+    }
+    return(h);
+}
+
+struct apply_handle *apply_init(struct fsm *net) {
+    struct apply_handle *h;
+
+    h = apply_init_shared(apply_shared_init(net));
+    h->owns_shared = 1;
     return(h);
 }
 
@@ -300,34 +2945,30 @@ void apply_stack_clear (struct apply_handle *h) {
 }
 
 void apply_stack_pop (struct apply_handle *h) {
-    struct flag_list *flist;
     struct searchstack *ss;
     (h->apply_stack_ptr)--;
     ss = h->searchstack+h->apply_stack_ptr;
 
     h->iptr =  ss->iptr;
+    h->cidx_pos = ss->cidx_pos;
+    h->cidx_end = ss->cidx_end;
+    h->cidx_eps_pos = ss->cidx_eps_pos;
+    h->cidx_eps_end = ss->cidx_eps_end;
     h->ptr  =  ss->offset;
+    h->state = ss->state;
     h->ipos =  ss->ipos;
     h->opos =  ss->opos;
     h->state_has_index = ss->state_has_index;
     /* Restore mark */
-    *(h->marks+(h->gstates+h->ptr)->state_no) = ss->visitmark;
+    *(h->marks+h->state) = ss->visitmark;
 
-    if (h->has_flags && ss->flagname != NULL) {
+    if (h->has_flags && ss->flagreg != -1) {
 	/* Restore flag */
-	for (flist = h->flag_list; flist != NULL; flist = flist->next) {
-	    if (strcmp(flist->name, ss->flagname) == 0) {
-		break;
-	    }
-	}
-	if (flist == NULL)
-	    perror("***Nothing to pop\n");
-	flist->value = ss->flagvalue;
-	flist->neg = ss->flagneg;
+	*(h->flag_regs+ss->flagreg) = ss->flagold;
     }
 }
 
-static void apply_stack_push (struct apply_handle *h, int vmark, char *sflagname, char *sflagvalue, int sflagneg) {
+static void apply_stack_push (struct apply_handle *h, int vmark, int sflagreg, int sflagold) {
     struct searchstack *ss;
     if (h->apply_stack_ptr == h->apply_stack_top) {
 	h->searchstack = xxrealloc(h->searchstack, sizeof(struct searchstack)* ((h->apply_stack_top)*2));
@@ -339,15 +2980,19 @@ static void apply_stack_push (struct apply_handle *h, int vmark, char *sflagname
     }
     ss = h->searchstack+h->apply_stack_ptr;
     ss->offset     = h->curr_ptr;
+    ss->state      = h->state;
     ss->ipos       = h->ipos;
     ss->opos       = h->opos;
     ss->visitmark  = vmark;
     ss->iptr       = h->iptr;
+    ss->cidx_pos   = h->cidx_pos;
+    ss->cidx_end   = h->cidx_end;
+    ss->cidx_eps_pos = h->cidx_eps_pos;
+    ss->cidx_eps_end = h->cidx_eps_end;
     ss->state_has_index = h->state_has_index;
     if (h->has_flags) {
-	ss->flagname   = sflagname;
-	ss->flagvalue  = sflagvalue;
-	ss->flagneg    = sflagneg;
+	ss->flagreg    = sflagreg;
+	ss->flagold    = sflagold;
     }
     (h->apply_stack_ptr)++;
 }
@@ -362,19 +3007,19 @@ void apply_reset_enumerator(struct apply_handle *h) {
     h->iterate_old = 0;
 }
 
-void apply_clear_index_list(struct apply_handle *h, struct apply_state_index **index) {
+void apply_clear_index_list(struct apply_shared *sh, struct apply_state_index **index) {
     int i, j, statecount;
     struct apply_state_index *iptr, *iptr_tmp, *iptr_zero;
     if (index == NULL)
 	return;
-    statecount = h->last_net->statecount;
+    statecount = sh->last_net->statecount;
     for (i = 0; i < statecount; i++) {
 	iptr = *(index+i);
 	if (iptr == NULL) {
 	    continue;
 	}
 	iptr_zero = *(index+i);
-	for (j = h->sigma_size - 1 ; j >= 0; j--) { /* Make sure to not free the list in EPSILON    */
+	for (j = sh->sigma_size - 1 ; j >= 0; j--) { /* Make sure to not free the list in EPSILON    */
 	    iptr = *(index+i) + j;                  /* as the other states lists' tails point to it */
 	    for (iptr = iptr->next ; iptr != NULL && iptr != iptr_zero; iptr = iptr_tmp) {
 		iptr_tmp = iptr->next;
@@ -385,24 +3030,38 @@ void apply_clear_index_list(struct apply_handle *h, struct apply_state_index **i
     }
 }
 
-void apply_clear_index(struct apply_handle *h) {
-    if (h->index_in) {
-	apply_clear_index_list(h, h->index_in);
-	xxfree(h->index_in);
-	h->index_in = NULL;
+void apply_clear_index(struct apply_shared *sh) {
+    if (sh->index_in) {
+	apply_clear_index_list(sh, sh->index_in);
+	xxfree(sh->index_in);
+	sh->index_in = NULL;
     }
-    if (h->index_out) {
-	apply_clear_index_list(h, h->index_out);
-	xxfree(h->index_out);
-	h->index_out = NULL;
+    if (sh->index_out) {
+	apply_clear_index_list(sh, sh->index_out);
+	xxfree(sh->index_out);
+	sh->index_out = NULL;
     }
+    apply_clear_compact_index(sh->cindex_in);
+    apply_clear_compact_index(sh->cindex_out);
+    sh->cindex_in = sh->cindex_out = NULL;
+}
+
+static void apply_clear_compact_index(struct apply_compact_index *ci) {
+    if (ci == NULL)
+	return;
+    xxfree(ci->state_keys);
+    xxfree(ci->indexed);
+    xxfree(ci->keys);
+    xxfree(ci->ranges);
+    xxfree(ci->arcs);
+    xxfree(ci);
 }
 
+/* The index lives in the shared tables, so it must be built before */
+/* handles sharing them are used concurrently                       */
 void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only) {
-    struct fsm_state *fsm;
     unsigned int cnt = 0;
-    int i, j, maxtrans, numtrans, laststate, sym;
-    fsm = h->gstates;
+    int i, j, maxtrans, numtrans, state, statecount, sym;
 
     struct apply_state_index **indexptr, *iptr, *tempiptr;
 
@@ -413,16 +3072,18 @@ void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_l
     if (flags_only && !h->has_flags) {
 	return;
     }
+    statecount = h->last_net->statecount;
+    if (inout == APPLY_INDEX_INPUT) {
+	apply_clear_compact_index(h->shared->cindex_in);
+	h->shared->cindex_in = NULL;
+    } else {
+	apply_clear_compact_index(h->shared->cindex_out);
+	h->shared->cindex_out = NULL;
+    }
     /* get numtrans */
-    for (i=0, laststate = 0, maxtrans = 0, numtrans = 0; (fsm+i)->state_no != -1; i++) {
-	if ((fsm+i)->state_no != laststate) {
-	    maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
-	    numtrans = 0;
-	}
-	if ((fsm+i)->target != -1) {
-	    numtrans++;
-	}
-	laststate = (fsm+i)->state_no;
+    for (state = 0, maxtrans = 0; state < statecount; state++) {
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
     }
 
     pre_index = xxcalloc(maxtrans+1, sizeof(struct pre_index));
@@ -434,40 +3095,27 @@ void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_l
     /* so that later, we can traverse them in order densest first, in case we  */
     /* only want to index to some predefined maximum memory usage.             */
 
-    for (i = 0, laststate = 0, maxtrans = 0, numtrans = 0; (fsm+i)->state_no != -1; i++) {
-	if ((fsm+i)->state_no != laststate) {
-	    if ((pre_index+numtrans)->state_no == -1) {
-		(pre_index+numtrans)->state_no = laststate;
-	    } else {
-		tp = xxcalloc(1, sizeof(struct pre_index));
-		tp->state_no = laststate;
-		tp->next = (pre_index+numtrans)->next;
-		(pre_index+numtrans)->next = tp;
-	    }
-	    maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
-	    numtrans = 0;
-	}
-	if ((fsm+i)->target != -1) {
-	    numtrans++;
+    for (state = 0; state < statecount; state++) {
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	if ((pre_index+numtrans)->state_no == -1) {
+	    (pre_index+numtrans)->state_no = state;
+	} else {
+	    tp = xxcalloc(1, sizeof(struct pre_index));
+	    tp->state_no = state;
+	    tp->next = (pre_index+numtrans)->next;
+	    (pre_index+numtrans)->next = tp;
 	}
-	laststate = (fsm+i)->state_no;
     }
     indexptr = NULL;
-    cnt += round_up_to_power_of_two(h->last_net->statecount*sizeof(struct apply_state_index *));
+    cnt += round_up_to_power_of_two(statecount*sizeof(struct apply_state_index *));
 
     if (cnt > mem_limit) {
-	cnt -= round_up_to_power_of_two(h->last_net->statecount*sizeof(struct apply_state_index *));
+	cnt -= round_up_to_power_of_two(statecount*sizeof(struct apply_state_index *));
 	goto memlimitnoindex;
     }
 
-    indexptr = xxcalloc(h->last_net->statecount, sizeof(struct apply_state_index *));
+    indexptr = xxcalloc(statecount, sizeof(struct apply_state_index *));
 
-    if (h->has_flags && flags_only) {
-	/* Mark states that have flags */
-	if (!(h->flagstates)) {
-	    apply_mark_flagstates(h);
-	}
-    }
 
     for (i = maxtrans; i >= 0; i--) {
 	for (tp = pre_index+i; tp != NULL; tp = tp->next) {
@@ -499,61 +3147,353 @@ void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_l
 	}
     }
 
- memlimit:
+ memlimit:
+
+    for (state = 0; state < statecount; state++) {
+	iptr = *(indexptr + state);
+	if (iptr == NULL) {
+	    continue;
+	}
+	for (i = *(h->arc_offsets+state); i < *(h->arc_offsets+state+1); i++) {
+	    sym = inout == APPLY_INDEX_INPUT ? *(h->arc_in+i) : *(h->arc_out+i);
+	    
+	    if (h->has_flags && (h->flag_lookup+sym)->type) {
+		sym = EPSILON;
+	    }
+	    if (sym == UNKNOWN) {  /* We make the index of UNKNOWN point to IDENTITY */
+		sym = IDENTITY;    /* since these are really the same symbol         */
+	    }
+	    if ((iptr+sym)->fsmptr == -1) {
+		(iptr+sym)->fsmptr = i;
+	    } else {
+		cnt += round_up_to_power_of_two(sizeof(struct apply_state_index));
+		tempiptr = xxcalloc(1, sizeof(struct apply_state_index));
+		
+		tempiptr->next = (iptr+sym)->next;
+		tempiptr->fsmptr =  i;
+		(iptr+sym)->next = tempiptr;
+	    }
+	}
+    }
+
+    /* Free preindex */
+
+ memlimitnoindex:
+
+    for (i = maxtrans; i >= 0; i--) {
+	for (tp = (pre_index+i)->next; tp != NULL; tp = tpp) {
+	    tpp = tp->next;
+	    xxfree(tp);
+	}
+    }
+    xxfree(pre_index);
+
+    if (inout == APPLY_INDEX_INPUT) {
+	h->shared->index_in = indexptr;
+    } else {
+	h->shared->index_out = indexptr;
+    }
+}
+
+/* An alternative to apply_index() that stores the index of each  */
+/* state as a sorted array of the symbols on its arcs, with the    */
+/* arcs for each symbol kept in one contiguous range.  Lookup is a */
+/* binary search over the symbols actually present in the state,   */
+/* and memory is proportional to the number of arcs indexed rather */
+/* than to sigma size.  The arguments are as for apply_index().    */
+
+struct apply_cidx_pair {
+    short int key;
+    int arc;
+};
+
+static int apply_cidx_pair_cmp(const void *a, const void *b) {
+    const struct apply_cidx_pair *pa = a, *pb = b;
+    if (pa->key != pb->key)
+	return pa->key - pb->key;
+    return pa->arc - pb->arc;
+}
+
+void apply_index_compact(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only) {
+    struct apply_compact_index *ci;
+    struct apply_cidx_pair *pairs;
+    int i, j, state, statecount, numtrans, maxtrans, totalarcs, nkeys, *bucket, *order;
+    unsigned int cnt, cost;
+    short int sym, *arcsym;
+
+    if (flags_only && !h->has_flags) {
+	return;
+    }
+    statecount = h->last_net->statecount;
+    arcsym = inout == APPLY_INDEX_INPUT ? h->arc_in : h->arc_out;
+
+    /* Sort states densest first so that a memory limit spends */
+    /* its budget on the states with the most arcs             */
+    for (state = 0, maxtrans = 0; state < statecount; state++) {
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	maxtrans = numtrans > maxtrans ? numtrans : maxtrans;
+    }
+    bucket = xxcalloc(maxtrans+2, sizeof(int));
+    order = xxmalloc(sizeof(int)*(statecount+1));
+    for (state = 0; state < statecount; state++) {
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	(*(bucket+maxtrans-numtrans+1))++;
+    }
+    for (i = 1; i <= maxtrans+1; i++) {
+	*(bucket+i) += *(bucket+i-1);
+    }
+    for (state = 0; state < statecount; state++) {
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	*(order + (*(bucket+maxtrans-numtrans))++) = state;
+    }
+    xxfree(bucket);
+
+    ci = xxcalloc(1, sizeof(struct apply_compact_index));
+    ci->indexed = xxcalloc(BITNSLOTS(statecount+1), sizeof(uint8_t));
+    cnt = (statecount+1) * sizeof(int);
+    for (i = 0, totalarcs = 0; i < statecount; i++) {
+	state = *(order+i);
+	numtrans = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	if (numtrans == 0) {
+	    break;
+	}
+	if (numtrans < densitycutoff) {
+	    if (!(h->has_flags && flags_only && BITTEST(h->flagstates, state))) {
+		continue;
+	    }
+	}
+	cost = numtrans * (sizeof(short int) + 2 * sizeof(int));
+	if (cnt + cost > (unsigned int) mem_limit) {
+	    break;
+	}
+	cnt += cost;
+	BITSET(ci->indexed, state);
+	totalarcs += numtrans;
+    }
+    xxfree(order);
+
+    ci->state_keys = xxmalloc(sizeof(int)*(statecount+1));
+    ci->keys = xxmalloc(sizeof(short int)*(totalarcs+1));
+    ci->ranges = xxmalloc(sizeof(int)*(totalarcs+1));
+    ci->arcs = xxmalloc(sizeof(int)*(totalarcs+1));
+    pairs = xxmalloc(sizeof(struct apply_cidx_pair)*(maxtrans+1));
+
+    for (state = 0, nkeys = 0, totalarcs = 0; state < statecount; state++) {
+	*(ci->state_keys+state) = nkeys;
+	if (!BITTEST(ci->indexed, state)) {
+	    continue;
+	}
+	for (i = *(h->arc_offsets+state), j = 0; i < *(h->arc_offsets+state+1); i++, j++) {
+	    sym = *(arcsym+i);
+	    if (h->has_flags && (h->flag_lookup+sym)->type) {
+		sym = EPSILON;
+	    }
+	    if (sym == UNKNOWN) {  /* UNKNOWN and IDENTITY match the same input */
+		sym = IDENTITY;
+	    }
+	    (pairs+j)->key = sym;
+	    (pairs+j)->arc = i;
+	}
+	qsort(pairs, j, sizeof(struct apply_cidx_pair), apply_cidx_pair_cmp);
+	for (i = 0; i < j; i++) {
+	    if (i == 0 || (pairs+i)->key != (pairs+i-1)->key) {
+		*(ci->keys+nkeys) = (pairs+i)->key;
+		*(ci->ranges+nkeys) = totalarcs;
+		nkeys++;
+	    }
+	    *(ci->arcs+totalarcs++) = (pairs+i)->arc;
+	}
+    }
+    *(ci->state_keys+statecount) = nkeys;
+    *(ci->ranges+nkeys) = totalarcs;
+    xxfree(pairs);
+
+    if (inout == APPLY_INDEX_INPUT) {
+	apply_clear_index_list(h->shared, h->shared->index_in);
+	xxfree(h->shared->index_in);
+	h->shared->index_in = NULL;
+	apply_clear_compact_index(h->shared->cindex_in);
+	h->shared->cindex_in = ci;
+    } else {
+	apply_clear_index_list(h->shared, h->shared->index_out);
+	xxfree(h->shared->index_out);
+	h->shared->index_out = NULL;
+	apply_clear_compact_index(h->shared->cindex_out);
+	h->shared->cindex_out = ci;
+    }
+}
+
+/* Points the compact index cursor at the arcs for the current */
+/* input symbol, to be followed by the EPSILON (and flag) arcs */
+
+static void apply_set_cidx(struct apply_handle *h, struct apply_compact_index *ci) {
+    int first, last, mid, seeksym;
+    if (!BITTEST(ci->indexed, h->state)) {
+	return;
+    }
+    h->cidx = ci;
+    h->state_has_index = 2;
+    h->cidx_pos = h->cidx_end = h->cidx_eps_pos = h->cidx_eps_end = 0;
+    first = *(ci->state_keys+h->state);
+    last = *(ci->state_keys+h->state+1) - 1;
+    if (first <= last && *(ci->keys+first) == EPSILON) {
+	h->cidx_eps_pos = *(ci->ranges+first);
+	h->cidx_eps_end = *(ci->ranges+first+1);
+	first++;
+    }
+    if (h->ipos < h->current_instring_length) {
+	seeksym = (h->sigmatch_array+h->ipos)->signumber;
+	while (first <= last) {
+	    mid = (first+last)/2;
+	    if (seeksym < *(ci->keys+mid)) {
+		last = mid - 1;
+	    } else if (seeksym > *(ci->keys+mid)) {
+		first = mid + 1;
+	    } else {
+		h->cidx_pos = *(ci->ranges+mid);
+		h->cidx_end = *(ci->ranges+mid+1);
+		break;
+	    }
+	}
+    }
+    if (h->cidx_pos == h->cidx_end) {
+	h->cidx_pos = h->cidx_eps_pos;
+	h->cidx_end = h->cidx_eps_end;
+	h->cidx_eps_pos = h->cidx_eps_end = 0;
+    }
+}
+
+/* The arc the index cursor is on, or -1 if there are no more */
+static inline int apply_index_arc(struct apply_handle *h) {
+    if (h->state_has_index == 2) {
+	return h->cidx_pos < h->cidx_end ? *(h->cidx->arcs+h->cidx_pos) : -1;
+    }
+    return (h->iptr != NULL && h->iptr->fsmptr != -1) ? h->iptr->fsmptr : -1;
+}
 
-    for (i=0; (fsm+i)->state_no != -1; i++) {
-	iptr = *(indexptr + (fsm+i)->state_no);
-	if (iptr == NULL || (fsm+i)->target == -1) {
-	    continue;
+static inline void apply_index_next(struct apply_handle *h) {
+    if (h->state_has_index == 2) {
+	if (++(h->cidx_pos) >= h->cidx_end) {
+	    h->cidx_pos = h->cidx_eps_pos;
+	    h->cidx_end = h->cidx_eps_end;
+	    h->cidx_eps_pos = h->cidx_eps_end = 0;
 	}
-	sym = inout == APPLY_INDEX_INPUT ? (fsm+i)->in : (fsm+i)->out;
+    } else {
+	h->iptr = h->iptr->next;
+    }
+}
 
-	if (h->has_flags && (h->flag_lookup+sym)->type) {
-	    sym = EPSILON;
-	}
-	if (sym == UNKNOWN) {  /* We make the index of UNKNOWN point to IDENTITY */
-	    sym = IDENTITY;    /* since these are really the same symbol         */
-	}
-	if ((iptr+sym)->fsmptr == -1) {
-	    (iptr+sym)->fsmptr = i;
-	} else {
-	    cnt += round_up_to_power_of_two(sizeof(struct apply_state_index));
-	    tempiptr = xxcalloc(1, sizeof(struct apply_state_index));
+/* Lower bound search over a sorted run of 16-bit arc symbols: returns */
+/* the first i in [lo, hi) with syms[i] >= target, or hi if none.      */
+/* The vector kernels narrow large ranges by bisection and then scan   */
+/* 8 (SSE2) or 16 (AVX2) symbols per compare; which one is used is     */
+/* decided per network at run time by apply_select_search().           */
 
-	    tempiptr->next = (iptr+sym)->next;
-	    tempiptr->fsmptr =  i;
-	    (iptr+sym)->next = tempiptr;
-	}
-    }
+#define APPLY_SIMD_WINDOW 64
 
-    /* Free preindex */
+static int apply_lower_bound_scalar(short int *syms, int lo, int hi, int target) {
+    int mid;
+    if (hi - lo < APPLY_BINSEARCH_THRESHOLD) {
+	for ( ; lo < hi && *(syms+lo) < target; lo++) { }
+	return lo;
+    }
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (*(syms+mid) < target)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
 
- memlimitnoindex:
+#if defined(APPLY_USE_SIMD)
+
+static int apply_lower_bound_sse2(short int *syms, int lo, int hi, int target) {
+    __m128i t, v;
+    int mid, mask;
+    while (hi - lo > APPLY_SIMD_WINDOW) {
+	mid = lo + (hi - lo) / 2;
+	if (*(syms+mid) < target)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    t = _mm_set1_epi16((short) target);
+    for ( ; lo + 8 <= hi; lo += 8) {
+	v = _mm_loadu_si128((__m128i *) (syms+lo));
+	mask = _mm_movemask_epi8(_mm_cmplt_epi16(v, t));
+	if (mask != 0xffff) {
+	    return lo + (__builtin_ctz(~mask) >> 1);
+	}
+    }
+    for ( ; lo < hi && *(syms+lo) < target; lo++) { }
+    return lo;
+}
 
-    for (i = maxtrans; i >= 0; i--) {
-	for (tp = (pre_index+i)->next; tp != NULL; tp = tpp) {
-	    tpp = tp->next;
-	    xxfree(tp);
+__attribute__((target("avx2")))
+static int apply_lower_bound_avx2(short int *syms, int lo, int hi, int target) {
+    __m256i t, v;
+    int mid;
+    unsigned int mask;
+    while (hi - lo > APPLY_SIMD_WINDOW) {
+	mid = lo + (hi - lo) / 2;
+	if (*(syms+mid) < target)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    t = _mm256_set1_epi16((short) target);
+    for ( ; lo + 16 <= hi; lo += 16) {
+	v = _mm256_loadu_si256((__m256i *) (syms+lo));
+	mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpgt_epi16(t, v));
+	if (mask != 0xffffffffU) {
+	    return lo + (__builtin_ctz(~mask) >> 1);
 	}
     }
-    xxfree(pre_index);
+    return apply_lower_bound_sse2(syms, lo, hi, target);
+}
 
-    if (inout == APPLY_INDEX_INPUT) {
-	h->index_in = indexptr;
+#endif /* APPLY_USE_SIMD */
+
+static void apply_select_search(struct apply_shared *sh) {
+    sh->lower_bound = apply_lower_bound_scalar;
+#if defined(APPLY_USE_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	sh->lower_bound = apply_lower_bound_avx2;
     } else {
-	h->index_out = indexptr;
+	sh->lower_bound = apply_lower_bound_sse2;
+    }
+#endif
+}
+
+int apply_search_kernels(int (**kernels)(short int *syms, int lo, int hi, int target)) {
+    int n;
+    n = 0;
+    *(kernels+n++) = apply_lower_bound_scalar;
+#if defined(APPLY_USE_SIMD)
+    *(kernels+n++) = apply_lower_bound_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	*(kernels+n++) = apply_lower_bound_avx2;
     }
+#endif
+    return n;
 }
 
 int apply_binarysearch(struct apply_handle *h) {
-    int thisstate, nextsym, seeksym, thisptr, lastptr, midptr;
+    int nextsym, seeksym, thisptr, lastptr;
+    short int *arcsym;
 
+    arcsym = (((h->mode) & DOWN) == DOWN) ? h->arc_in : h->arc_out;
     thisptr = h->curr_ptr = h->ptr;
-    nextsym  = (((h->mode) & DOWN) == DOWN) ? (h->gstates+h->curr_ptr)->in  : (h->gstates+h->curr_ptr)->out;
+    lastptr = *(h->arc_offsets+h->state+1)-1;
+    if (thisptr > lastptr)
+	return 0;
+    nextsym = *(arcsym+thisptr);
     if (nextsym == EPSILON)
 	return 1;
-    if (nextsym == -1)
-	return 0;
     if (h->ipos >= h->current_instring_length) {
 	return 0;
     }
@@ -561,48 +3501,20 @@ int apply_binarysearch(struct apply_handle *h) {
     if (seeksym == nextsym || (nextsym == UNKNOWN && seeksym == IDENTITY))
 	return 1;
 
-    thisstate = (h->gstates+thisptr)->state_no;
-    lastptr = *(h->statemap+thisstate)+*(h->numlines+thisstate)-1;
-    thisptr++;
-
-    if (seeksym == IDENTITY || lastptr - thisptr < APPLY_BINSEARCH_THRESHOLD) {
-	for ( ; thisptr <= lastptr; thisptr++) {
-	    nextsym = (((h->mode) & DOWN) == DOWN) ? (h->gstates+thisptr)->in : (h->gstates+thisptr)->out;
-	    if ((nextsym == seeksym) || (nextsym == UNKNOWN && seeksym == IDENTITY)) {
-		h->curr_ptr = thisptr;
-		return 1;
-	    }
-	    if (nextsym > seeksym || nextsym == -1) {
-		return 0;
-	    }
-	}
+    /* UNKNOWN arcs also match an IDENTITY input and sort just before it */
+    thisptr = h->shared->lower_bound(arcsym, thisptr+1, lastptr+1, seeksym == IDENTITY ? UNKNOWN : seeksym);
+    if (thisptr > lastptr)
 	return 0;
+    nextsym = *(arcsym+thisptr);
+    if ((nextsym == seeksym) || (nextsym == UNKNOWN && seeksym == IDENTITY)) {
+	h->curr_ptr = thisptr;
+	return 1;
     }
-     
-    for (;;)  {
-	if (thisptr > lastptr) { return 0; }
-	midptr = (thisptr+lastptr)/2;
-	nextsym = (((h->mode) & DOWN) == DOWN) ? (h->gstates+midptr)->in : (h->gstates+midptr)->out;
-	if (seeksym < nextsym) {
-	    lastptr = midptr - 1;
-	    continue;
-	} else if (seeksym > nextsym) {
-	    thisptr = midptr + 1;
-	    continue;
-	} else {
-
-	    while (((((h->mode) & DOWN) == DOWN) ? (h->gstates+(midptr-1))->in : (h->gstates+(midptr-1))->out) == seeksym) {
-		midptr--; /* Find first match in case of ties */
-	    }
-	    h->curr_ptr = midptr;
-	    return 1;
-	}
-    }
+    return 0;
 }
 
 int apply_follow_next_arc(struct apply_handle *h) {
-    char *fname, *fvalue;
-    int eatupi, eatupo, symin, symout, fneg;
+    int eatupi, eatupo, symin, symout, freg, lastptr;
     int vcount, marksource, marktarget;
     
     /* Here we follow three possible search strategies:        */
@@ -614,56 +3526,55 @@ int apply_follow_next_arc(struct apply_handle *h) {
     /*     For those states that aren't flag-free, (3) is used */
 
     if (h->state_has_index) {
-	for ( ; h->iptr != NULL && h->iptr->fsmptr != -1; ) {
+	for ( ; apply_index_arc(h) != -1; ) {
 
-	    h->ptr = h->curr_ptr = h->iptr->fsmptr;
+	    h->ptr = h->curr_ptr = apply_index_arc(h);
 	    if (((h->mode) & DOWN) == DOWN) {
-		symin = (h->gstates+h->curr_ptr)->in;
-		symout = (h->gstates+h->curr_ptr)->out;
+		symin = *(h->arc_in+h->curr_ptr);
+		symout = *(h->arc_out+h->curr_ptr);
 	    } else {
-		symin = (h->gstates+h->curr_ptr)->out;
-		symout = (h->gstates+h->curr_ptr)->in;
+		symin = *(h->arc_out+h->curr_ptr);
+		symout = *(h->arc_in+h->curr_ptr);
 	    }
 	    
-	    marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
-	    marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
+	    marksource = *(h->marks+h->state);
+	    marktarget = *(h->marks+*(h->arc_target+h->curr_ptr));
 	    eatupi = apply_match_length(h, symin);
 	    if (!(eatupi == -1 || -1-(h->ipos)-eatupi == marktarget)) {     /* input 2x EPSILON loop check */
 		if ((eatupi = apply_match_str(h, symin, h->ipos)) != -1) {
 		    eatupo = apply_append(h, h->curr_ptr, symout);
 		    if (h->obey_flags && h->has_flags && ((h->flag_lookup+symin)->type & (FLAG_UNIFY|FLAG_CLEAR|FLAG_POSITIVE|FLAG_NEGATIVE))) {
-			fname = (h->flag_lookup+symin)->name;
-			fvalue = h->oldflagvalue;
-			fneg = h->oldflagneg;
+			freg = (h->flag_lookup+symin)->name_id;
 		    } else {
-			fname = fvalue = NULL;
-			fneg = 0;
+			freg = -1;
 		    }
 		    /* Push old position */
-		    apply_stack_push(h, marksource, fname, fvalue, fneg);
-		    h->ptr = *(h->statemap+(h->gstates+h->curr_ptr)->target);
+		    apply_stack_push(h, marksource, freg, h->oldflag);
+		    h->state = *(h->arc_target+h->curr_ptr);
+		    h->ptr = *(h->arc_offsets+h->state);
 		    h->ipos += eatupi;
 		    h->opos += eatupo;
 		    apply_set_iptr(h);
 		    return 1;
 		}
 	    }
-	    h->iptr = h->iptr->next;
+	    apply_index_next(h);
 	}
 	return 0;
-    } else if ((h->binsearch && !(h->has_flags)) || (h->binsearch && !(BITTEST(h->flagstates, (h->gstates+h->ptr)->state_no)))) {
+    } else if ((h->binsearch && !(h->has_flags)) || (h->binsearch && !(BITTEST(h->flagstates, h->state)))) {
+	lastptr = *(h->arc_offsets+h->state+1)-1;
 	for (;;) {
 	    if (apply_binarysearch(h)) {
 		if (((h->mode) & DOWN) == DOWN) {
-		    symin = (h->gstates+h->curr_ptr)->in;
-		    symout = (h->gstates+h->curr_ptr)->out;
+		    symin = *(h->arc_in+h->curr_ptr);
+		    symout = *(h->arc_out+h->curr_ptr);
 		} else {
-		    symin = (h->gstates+h->curr_ptr)->out;
-		    symout = (h->gstates+h->curr_ptr)->in;
+		    symin = *(h->arc_out+h->curr_ptr);
+		    symout = *(h->arc_in+h->curr_ptr);
 		}
 		
-		marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
-		marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
+		marksource = *(h->marks+h->state);
+		marktarget = *(h->marks+*(h->arc_target+h->curr_ptr));
 		
 		eatupi = apply_match_length(h, symin);
 		if (eatupi != -1 && -1-(h->ipos)-eatupi != marktarget) {
@@ -671,53 +3582,49 @@ int apply_follow_next_arc(struct apply_handle *h) {
 			eatupo = apply_append(h, h->curr_ptr, symout);
 			
 			/* Push old position */
-			apply_stack_push(h, marksource, NULL, NULL, 0);
+			apply_stack_push(h, marksource, -1, 0);
 			
 			/* Follow arc */
-			h->ptr = *(h->statemap+(h->gstates+h->curr_ptr)->target);
+			h->state = *(h->arc_target+h->curr_ptr);
+			h->ptr = *(h->arc_offsets+h->state);
 			h->ipos += eatupi;
 			h->opos += eatupo;
 			apply_set_iptr(h);
 			return 1;
 		    }
 		}
-		if ((h->gstates+h->curr_ptr)->state_no == (h->gstates+h->curr_ptr+1)->state_no) {
+		if (h->curr_ptr < lastptr) {
 		    h->curr_ptr++; 
 		    h->ptr = h->curr_ptr;
-		    if ((h->gstates+h->curr_ptr)-> target == -1) { 
-			return 0; 
-		    }
 		    continue;
 		}
 	    }
 	    return 0;
 	}
     } else {
-	for (h->curr_ptr = h->ptr; (h->gstates+h->curr_ptr)->state_no == (h->gstates+h->ptr)->state_no && (h->gstates+h->curr_ptr)-> in != -1; (h->curr_ptr)++) {
+	lastptr = *(h->arc_offsets+h->state+1)-1;
+	for (h->curr_ptr = h->ptr; h->curr_ptr <= lastptr; (h->curr_ptr)++) {
 	    
 	    /* Select one random arc to follow out of all outgoing arcs */	
 	    if ((h->mode & RANDOM) == RANDOM) {
-		vcount = 0;
-		for (h->curr_ptr = h->ptr;  (h->gstates+h->curr_ptr)->state_no == (h->gstates+h->ptr)->state_no && (h->gstates+h->curr_ptr)-> in != -1; (h->curr_ptr)++) {
-		    vcount++;
-		}
+		vcount = lastptr - h->ptr + 1;
 		if (vcount > 0) {
-		    h->curr_ptr = h->ptr + (rand() % vcount);
+		    h->curr_ptr = h->ptr + (int) (apply_rand_next(h) % vcount);
 		} else {
 		    h->curr_ptr = h->ptr;
 		}
 	    }
 	    
 	    if (((h->mode) & DOWN) == DOWN) {
-		symin = (h->gstates+h->curr_ptr)->in;
-		symout = (h->gstates+h->curr_ptr)->out;
+		symin = *(h->arc_in+h->curr_ptr);
+		symout = *(h->arc_out+h->curr_ptr);
 	    } else {
-		symin = (h->gstates+h->curr_ptr)->out;
-		symout = (h->gstates+h->curr_ptr)->in;
+		symin = *(h->arc_out+h->curr_ptr);
+		symout = *(h->arc_in+h->curr_ptr);
 	    }
 	    
-	    marksource = *(h->marks+(h->gstates+h->ptr)->state_no);
-	    marktarget = *(h->marks+(h->gstates+(*(h->statemap+(h->gstates+h->curr_ptr)->target)))->state_no);
+	    marksource = *(h->marks+h->state);
+	    marktarget = *(h->marks+*(h->arc_target+h->curr_ptr));
 
 	    eatupi = apply_match_length(h, symin);
 
@@ -725,20 +3632,17 @@ int apply_follow_next_arc(struct apply_handle *h) {
 	    if ((eatupi = apply_match_str(h, symin, h->ipos)) != -1) {
 		eatupo = apply_append(h, h->curr_ptr, symout);
 		if (h->obey_flags && h->has_flags && ((h->flag_lookup+symin)->type & (FLAG_UNIFY|FLAG_CLEAR|FLAG_POSITIVE|FLAG_NEGATIVE))) {
-		    
-		    fname = (h->flag_lookup+symin)->name;
-		    fvalue = h->oldflagvalue;
-		    fneg = h->oldflagneg;
+		    freg = (h->flag_lookup+symin)->name_id;
 		} else {
-		    fname = fvalue = NULL;
-		    fneg = 0;
+		    freg = -1;
 		}
 		
 		/* Push old position */
-		apply_stack_push(h, marksource, fname, fvalue, fneg);
+		apply_stack_push(h, marksource, freg, h->oldflag);
 		
 		/* Follow arc */
-		h->ptr = *(h->statemap+(h->gstates+h->curr_ptr)->target);
+		h->state = *(h->arc_target+h->curr_ptr);
+		h->ptr = *(h->arc_offsets+h->state);
 		h->ipos += eatupi;
 		h->opos += eatupo;
 		apply_set_iptr(h);
@@ -754,7 +3658,7 @@ char *apply_return_string(struct apply_handle *h) {
     *(h->outstring+h->opos) = '\0';
     if (((h->mode) & RANDOM) == RANDOM) {
 	/* To end or not to end */
-	if (!(rand() % 2)) {
+	if (apply_rand_next(h) & 1) {
 	    apply_stack_clear(h);
 	    h->iterator = 0;
 	    h->iterate_old = 0;
@@ -778,17 +3682,19 @@ void apply_mark_state(struct apply_handle *h) {
     /* 0 = unseen, +ipos = seen at ipos, -ipos = seen second time at ipos    */
 
     if ((h->mode & RANDOM) != RANDOM) {
-	if (*(h->marks+(h->gstates+h->ptr)->state_no) == h->ipos+1) {
-	    *(h->marks+(h->gstates+h->ptr)->state_no) = -(h->ipos+1);
+	if (*(h->marks+h->state) == h->ipos+1) {
+	    *(h->marks+h->state) = -(h->ipos+1);
 	} else {
-	    *(h->marks+(h->gstates+h->ptr)->state_no) = h->ipos+1;
+	    *(h->marks+h->state) = h->ipos+1;
 	}
     }
 }
 
 void apply_skip_this_arc(struct apply_handle *h) {
     /* If we have index ptr */
-    if (h->iptr) {
+    if (h->state_has_index == 2) {
+	apply_index_next(h);
+    } else if (h->iptr) {
 	h->ptr = h->iptr->fsmptr;
 	h->iptr = h->iptr->next;
 	/* Otherwise */
@@ -799,22 +3705,26 @@ void apply_skip_this_arc(struct apply_handle *h) {
 
 int apply_at_last_arc(struct apply_handle *h) {
     int seeksym, nextsym;
-    if (h->state_has_index) {
+    if (h->state_has_index == 2) {
+	if (h->cidx_pos+1 >= h->cidx_end && h->cidx_eps_pos >= h->cidx_eps_end) {
+	    return 1;
+	}
+    } else if (h->state_has_index) {
 	if (h->iptr->next == NULL || h->iptr->next->fsmptr == -1) {
 	    return 1;
 	}
     } else {
-	if  ((h->binsearch && !(h->has_flags)) || (h->binsearch && !(BITTEST(h->flagstates, (h->gstates+h->ptr)->state_no)))) {
-	    if ((h->gstates+h->ptr)->state_no != (h->gstates+h->ptr+1)->state_no) {
+	if  ((h->binsearch && !(h->has_flags)) || (h->binsearch && !(BITTEST(h->flagstates, h->state)))) {
+	    if (h->ptr+1 >= *(h->arc_offsets+h->state+1)) {
 		return 1;
 	    }
 	    seeksym = (h->sigmatch_array+h->ipos)->signumber;
-	    nextsym  = (((h->mode) & DOWN) == DOWN) ? (h->gstates+h->ptr)->in  : (h->gstates+h->ptr)->out;
-	    if (nextsym == -1 || seeksym < nextsym) {
+	    nextsym  = (((h->mode) & DOWN) == DOWN) ? *(h->arc_in+h->ptr) : *(h->arc_out+h->ptr);
+	    if (seeksym < nextsym) {
 		return 1;
 	    }
 	} else {
-	    if ((h->gstates+h->ptr)->state_no != (h->gstates+h->ptr+1)->state_no) {
+	    if (h->ptr+1 >= *(h->arc_offsets+h->state+1)) {
 		return 1;
 	    }
 	}
@@ -825,20 +3735,31 @@ int apply_at_last_arc(struct apply_handle *h) {
 /* map h->ptr (line pointer) to h->iptr (index pointer) */
 void apply_set_iptr(struct apply_handle *h) {
     struct apply_state_index **idx, *sidx;
-    int stateno, seeksym;
+    struct apply_compact_index *cidx;
+    int seeksym;
     /* Check if state has index */
-    if ((idx = ((h->mode) & DOWN) == DOWN ? (h->index_in) : (h->index_out)) == NULL) {
-	return;
+    if (((h->mode) & DOWN) == DOWN) {
+	idx = h->shared->index_in;
+	cidx = h->shared->cindex_in;
+    } else {
+	idx = h->shared->index_out;
+	cidx = h->shared->cindex_out;
     }
- 
+    /* Whatever the last lookup the other way left must not linger */
     h->iptr = NULL;
     h->state_has_index = 0;
-    stateno = (h->gstates+h->ptr)->state_no;
-    if (stateno < 0) {
+    if (idx == NULL && cidx == NULL) {
+	return;
+    }
+    /* There is no input to seek on when enumerating */
+    if ((h->mode & ENUMERATE) == ENUMERATE) {
+	return;
+    }
+    if (cidx != NULL) {
+	apply_set_cidx(h, cidx);
 	return;
     }
-   
-    sidx = *(idx + stateno);
+    sidx = *(idx + h->state);
     if (sidx == NULL) { return; }
     seeksym = (h->sigmatch_array+h->ipos)->signumber;
     h->state_has_index = 1;
@@ -877,13 +3798,18 @@ char *apply_net(struct apply_handle *h) {
 /*        store the global state of the search so we can resume it later to     */
 /*        to yield more possible output words with the same input string.       */
 
+    struct apply_enum_cut *cut;
     char *returnstring;
 
     if (h->iterate_old == 1) {     /* If called with NULL as the input word, this will be set */
+	if (h->stopped) {
+	    return(NULL);
+	}
         goto resume;
     }
+    apply_limit_start(h);
 
-    h->iptr = NULL; h->ptr = 0; h->ipos = 0; h->opos = 0;
+    h->iptr = NULL; h->state = h->shared->start_state; h->ptr = *(h->arc_offsets+h->state); h->ipos = h->scan != NULL ? h->scan->start : 0; h->opos = 0;
     apply_set_iptr(h);
 
     apply_stack_clear(h);
@@ -901,19 +3827,57 @@ char *apply_net(struct apply_handle *h) {
 	apply_stack_pop(h);
 	/* If last line was popped */
 	if (apply_at_last_arc(h)) {
-	    *(h->marks+(h->gstates+h->ptr)->state_no) = 0; /* Unmark   */
+	    *(h->marks+h->state) = 0; /* Unmark   */
 	    continue;                                      /* pop next */
 	}
 	apply_skip_this_arc(h);                            /* skip old pushed arc */
     L1:
+	if (h->limits != NULL && apply_limit_step(h)) {
+	    return(NULL);
+	}
 	if (!apply_follow_next_arc(h)) {
-	    *(h->marks+(h->gstates+h->ptr)->state_no) = 0; /* Unmark   */
+	    *(h->marks+h->state) = 0; /* Unmark   */
 	    continue;                                      /* pop next */
 	}
     L2:
+	/* Parallel enumeration: hand the subtree off as a task, or */
+	/* keep to the task's path until reaching its subtree       */
+	if ((cut = h->enum_cut) != NULL) {
+	    if (cut->split && h->apply_stack_ptr == cut->split) {
+		apply_enum_task(h);
+		continue;
+	    }
+	    if (cut->prefix_len && h->apply_stack_ptr <= cut->prefix_len) {
+		if (h->apply_stack_ptr > 0 && (h->searchstack+h->apply_stack_ptr-1)->offset != *(cut->prefix+h->apply_stack_ptr-1)) {
+		    continue;
+		}
+		if (h->apply_stack_ptr < cut->prefix_len) {
+		    goto resume;
+		}
+	    }
+	}
+	/* Back out of states from which the input can't be accepted */
+	if (h->prune && !apply_live(h)) {
+	    continue;
+	}
+	/* Back out of paths whose output has grown too long, noting it */
+	/* only if the path could have gone on or ended here            */
+	if (h->limits != NULL && h->limits->max_length && h->opos > h->limits->max_length) {
+	    if (*(h->arc_offsets+h->state) < *(h->arc_offsets+h->state+1) || (BITTEST(h->finals, h->state) && (h->ipos == h->current_instring_length || ((h->mode) & ENUMERATE) == ENUMERATE || h->scan != NULL))) {
+		h->status = APPLY_LIMIT_LENGTH;
+	    }
+	    continue;
+	}
 	/* Print accumulated string upon entry to state */
-	if ((h->gstates+h->ptr)->final_state == 1 && (h->ipos == h->current_instring_length || ((h->mode) & ENUMERATE) == ENUMERATE)) {
-	    if ((returnstring = (apply_return_string(h))) != NULL) {
+	if (BITTEST(h->finals, h->state) && (h->ipos == h->current_instring_length || ((h->mode) & ENUMERATE) == ENUMERATE || h->scan != NULL)) {
+	    if (h->limits != NULL && apply_limit_result(h)) {
+		return(NULL);
+	    }
+	    if (apply_visiting(h)) {
+		if (apply_visit(h)) {
+		    return(h->outstring);
+		}
+	    } else if ((returnstring = (apply_return_string(h))) != NULL) {
 		return(returnstring);
 	    }
 	}
@@ -922,11 +3886,10 @@ char *apply_net(struct apply_handle *h) {
        	apply_mark_state(h);  /* Mark upon arrival to new state */
 	goto L1;
     }
+    /* A random walk ends here only at a dead end */
     if ((h->mode & RANDOM) == RANDOM) {
-          apply_stack_clear(h);
           h->iterator = 0;
           h->iterate_old = 0;
-          return(h->outstring);
     }
     apply_stack_clear(h);
     return NULL;
@@ -936,9 +3899,14 @@ int apply_append(struct apply_handle *h, int cptr, int sym) {
 
     char *astring, *bstring, *pstring;
     int symin, symout, len, alen, blen, idlen;
+
+    /* Symbol visitors read the path off the stack instead */
+    if (h->visitor != NULL && (h->visitor->visit_symbols != NULL || h->visitor->count_only)) {
+	return(0);
+    }
     
-    symin = (h->gstates+cptr)->in;
-    symout = (h->gstates+cptr)->out;
+    symin = *(h->arc_in+cptr);
+    symout = *(h->arc_out+cptr);
     astring = ((h->sigs)+symin)->symbol;
     alen =  ((h->sigs)+symin)->length;
     bstring = ((h->sigs)+symout)->symbol;
@@ -995,14 +3963,23 @@ int apply_append(struct apply_handle *h, int cptr, int sym) {
 	/* Print pairs is ON and symbols are different */
 	if (h->print_pairs && (symin != symout)) {
 
-	    if (symin == UNKNOWN && ((h->mode) & DOWN) == DOWN)
-		strncpy(astring, h->instring+h->ipos, 1);
-	    if (symout == UNKNOWN && ((h->mode) & UP) == UP)
-		strncpy(bstring, h->instring+h->ipos, 1);
-	    strcpy(h->outstring+h->opos, "<");
-	    strcpy(h->outstring+h->opos+1, astring);
-	    strcpy(h->outstring+h->opos+alen+1,":");
-	    strcpy(h->outstring+h->opos+alen+2,bstring);
+	    /* The symbol table is shared, so unknown input symbols */
+	    /* are copied straight from the input string instead    */
+	    idlen = (h->sigmatch_array+h->ipos)->consumes;
+	    while (alen + blen + idlen + h->opos + 3 >= h->outstringtop) {
+		h->outstring = xxrealloc(h->outstring, sizeof(char) * ((h->outstringtop) * 2));
+		(h->outstringtop) *= 2;
+	    }
+	    if (symin == UNKNOWN && ((h->mode) & DOWN) == DOWN) {
+		astring = h->instring+h->ipos; alen = idlen;
+	    }
+	    if (symout == UNKNOWN && ((h->mode) & UP) == UP) {
+		bstring = h->instring+h->ipos; blen = idlen;
+	    }
+	    *(h->outstring+h->opos) = '<';
+	    memcpy(h->outstring+h->opos+1, astring, alen);
+	    *(h->outstring+h->opos+alen+1) = ':';
+	    memcpy(h->outstring+h->opos+alen+2, bstring, blen);
 	    strcpy(h->outstring+h->opos+alen+blen+2,">");
 	    len = alen+blen+3;
 	}
@@ -1068,7 +4045,7 @@ int apply_match_str(struct apply_handle *h, int symbol, int position) {
 	    if (!h->obey_flags) {
 		return 0;
 	    }
-	    if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name, (h->flag_lookup+symbol)->value) == SUCCEED) {
+	    if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name_id, (h->flag_lookup+symbol)->value_id) == SUCCEED) {
 		return 0;
 	    } else {
 		return -1;
@@ -1087,7 +4064,7 @@ int apply_match_str(struct apply_handle *h, int symbol, int position) {
 	if (!h->obey_flags) {
 	    return 0;
 	}
-	if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name, (h->flag_lookup+symbol)->value) == SUCCEED) {
+	if (apply_check_flag(h,(h->flag_lookup+symbol)->type, (h->flag_lookup+symbol)->name_id, (h->flag_lookup+symbol)->value_id) == SUCCEED) {
 	    return 0;
 	} else {
 	    return -1;
@@ -1108,148 +4085,293 @@ int apply_match_str(struct apply_handle *h, int symbol, int position) {
     return -1;
 }
 
-void apply_create_statemap(struct apply_handle *h, struct fsm *net) {
-    int i;
+/* Lays out the arcs for lookup: the arcs of state s are    */
+/* arc_offsets[s] ... arc_offsets[s+1]-1 in the packed       */
+/* arc_in/arc_out/arc_target arrays, in the original order   */
+/* (so sortedness is preserved), and finality is a bitmap.   */
+
+void apply_create_arcarrays(struct apply_shared *sh, struct fsm *net) {
+    int i, s, statecount, *numarcs, *statemap;
     struct fsm_state *fsm;
     fsm = net->states;
-    h->statemap = xxmalloc(sizeof(int)*net->statecount);
-    h->marks = xxmalloc(sizeof(int)*net->statecount);
-    h->numlines = xxmalloc(sizeof(int)*net->statecount);
+    statecount = net->statecount;
+    statemap = xxmalloc(sizeof(int)*(statecount+1));
+    numarcs = xxcalloc(statecount+1, sizeof(int));
+    sh->arc_offsets = xxmalloc(sizeof(int)*(statecount+1));
+    sh->finals = xxcalloc(BITNSLOTS(statecount+1), sizeof(uint8_t));
+    sh->start_state = fsm->state_no == -1 ? 0 : fsm->state_no;
 
-    for (i=0; i < net->statecount; i++) {
-	*(h->numlines+i) = 0;  /* Only needed in binary search */
-	*(h->statemap+i) = -1;
-	*(h->marks+i) = 0;
+    for (i=0; i < statecount; i++) {
+	*(statemap+i) = -1;
     }
     for (i=0; (fsm+i)->state_no != -1; i++) {
-	*(h->numlines+(fsm+i)->state_no) = *(h->numlines+(fsm+i)->state_no)+1;
-	if (*(h->statemap+(fsm+i)->state_no) == -1) {
-	    *(h->statemap+(fsm+i)->state_no) = i;
+	if (*(statemap+(fsm+i)->state_no) == -1) {
+	    *(statemap+(fsm+i)->state_no) = i;
+	}
+	if ((fsm+i)->target != -1) {
+	    (*(numarcs+(fsm+i)->state_no))++;
+	}
+	if ((fsm+i)->final_state == 1) {
+	    BITSET(sh->finals, (fsm+i)->state_no);
+	}
+    }
+    for (s = 0, i = 0; s < statecount; s++) {
+	*(sh->arc_offsets+s) = i;
+	i += *(numarcs+s);
+    }
+    *(sh->arc_offsets+statecount) = i;
+    sh->arc_in = xxmalloc(sizeof(short int)*(i+1));
+    sh->arc_out = xxmalloc(sizeof(short int)*(i+1));
+    sh->arc_target = xxmalloc(sizeof(int)*(i+1));
+    for (s = 0; s < statecount; s++) {
+	if (*(statemap+s) == -1) {
+	    continue;
+	}
+	for (i = *(sh->arc_offsets+s), fsm = net->states + *(statemap+s); fsm->state_no == s; fsm++) {
+	    if (fsm->target == -1) {
+		continue;
+	    }
+	    *(sh->arc_in+i) = fsm->in;
+	    *(sh->arc_out+i) = fsm->out;
+	    *(sh->arc_target+i) = fsm->target;
+	    i++;
 	}
     }
+    xxfree(statemap);
+    xxfree(numarcs);
 }
 
-void apply_add_sigma_trie(struct apply_handle *h, int number, char *symbol, int len) {
+struct apply_symbol_entry {
+    char *symbol;
+    int number;
+};
 
-    /* Create a trie of sigma symbols (prefixes) so we can    */
-    /* quickly (in O(n)) tokenize an arbitrary string into    */
-    /* integer sequences representing symbols, using longest- */
-    /* leftmost factorization.                                */
+static int apply_symbol_cmp(const void *a, const void *b) {
+    return strcmp(((struct apply_symbol_entry *) a)->symbol, ((struct apply_symbol_entry *) b)->symbol);
+}
 
-    int i;
-    struct sigma_trie *st;
-    struct sigma_trie_arrays *sta;
-
-    st = h->sigma_trie;
-    for (i = 0; i < len; i++) {
-	st = st+(unsigned char)*(symbol+i);
-	if (i == (len-1)) {
-	    st->signum = number;
-	} else {
-	    if (st->next == NULL) {
-		st->next = xxcalloc(256,sizeof(struct sigma_trie));		
-		st = st->next;
-		/* store these arrays to free them later */
-		sta = xxmalloc(sizeof(struct sigma_trie_arrays));
-		sta->arr = st;
-		sta->next = h->sigma_trie_arrays;
-		h->sigma_trie_arrays = sta;
-	    } else {
-		st = st->next;
+/* Builds the tokenizer trie over the alphabet symbols so we can  */
+/* quickly (in O(n)) tokenize an arbitrary string into integer    */
+/* sequences representing symbols, using longest-leftmost         */
+/* factorization.  The symbols are inserted in sorted order,      */
+/* which leaves each node's children in byte order, and the nodes */
+/* are then renumbered breadth-first so that siblings are         */
+/* contiguous.                                                    */
+
+static void apply_create_tokenizer(struct apply_shared *sh, struct fsm *net) {
+    struct apply_tokenizer *tok;
+    struct sigma *sig;
+    struct tmpnode {
+	int firstchild;
+	int lastchild;
+	int nextsibling;
+	unsigned char byte;
+	int sym;
+    } *tn;
+    struct apply_symbol_entry *symbols;
+    char *str;
+    int i, j, n, node, child, numsyms, numnodes, maxnodes, *queue, *newnum, head, tail;
+
+    for (sig = net->sigma, numsyms = 0, maxnodes = 1; sig != NULL && sig->number != -1; sig = sig->next) {
+	if (sig->number > IDENTITY) {
+	    numsyms++;
+	    maxnodes += strlen(sig->symbol);
+	}
+    }
+    symbols = xxmalloc(sizeof(struct apply_symbol_entry) * (numsyms+1));
+    for (sig = net->sigma, i = 0; sig != NULL && sig->number != -1; sig = sig->next) {
+	if (sig->number > IDENTITY) {
+	    (symbols+i)->symbol = sig->symbol;
+	    (symbols+i)->number = sig->number;
+	    i++;
+	}
+    }
+    qsort(symbols, numsyms, sizeof(struct apply_symbol_entry), apply_symbol_cmp);
+
+    tn = xxmalloc(sizeof(struct tmpnode) * maxnodes);
+    tn->firstchild = tn->lastchild = -1;
+    tn->sym = 0;
+    numnodes = 1;
+    for (i = 0; i < numsyms; i++) {
+	str = (symbols+i)->symbol;
+	for (j = 0, node = 0; *(str+j) != '\0'; j++) {
+	    child = (tn+node)->lastchild;
+	    if (child == -1 || (tn+child)->byte != (unsigned char) *(str+j)) {
+		child = numnodes++;
+		(tn+child)->firstchild = (tn+child)->lastchild = (tn+child)->nextsibling = -1;
+		(tn+child)->byte = (unsigned char) *(str+j);
+		(tn+child)->sym = 0;
+		if ((tn+node)->lastchild == -1)
+		    (tn+node)->firstchild = child;
+		else
+		    (tn+(tn+node)->lastchild)->nextsibling = child;
+		(tn+node)->lastchild = child;
 	    }
+	    node = child;
+	}
+	if (j > 0) {
+	    (tn+node)->sym = (symbols+i)->number;
+	}
+    }
+    xxfree(symbols);
+
+    tok = xxcalloc(1, sizeof(struct apply_tokenizer));
+    tok->numnodes = numnodes;
+    tok->first = xxmalloc(sizeof(int) * (numnodes+1));
+    tok->bytes = xxmalloc(sizeof(unsigned char) * numnodes);
+    tok->sym = xxmalloc(sizeof(int) * numnodes);
+    queue = xxmalloc(sizeof(int) * numnodes);
+    newnum = xxmalloc(sizeof(int) * numnodes);
+
+    /* Breadth-first renumbering */
+    queue[0] = 0;
+    newnum[0] = 0;
+    for (head = 0, tail = 1; head < tail; head++) {
+	node = queue[head];
+	n = newnum[node];
+	*(tok->first+n) = tail;
+	*(tok->bytes+n) = (tn+node)->byte;
+	*(tok->sym+n) = (tn+node)->sym;
+	for (child = (tn+node)->firstchild; child != -1; child = (tn+child)->nextsibling) {
+	    newnum[child] = tail;
+	    queue[tail++] = child;
+	}
+    }
+    *(tok->first+numnodes) = numnodes;
+    *(tok->sym) = 0;
+
+    for (child = tn->firstchild; child != -1; child = (tn+child)->nextsibling) {
+	tok->root_next[(tn+child)->byte] = newnum[child];
+    }
+    for (i = 0; i < 128; i++) {
+	node = tok->root_next[i];
+	if (node == 0) {
+	    tok->ascii_sym[i] = IDENTITY;
+	} else if (*(tok->first+node) == *(tok->first+node+1)) {
+	    tok->ascii_sym[i] = *(tok->sym+node) ? *(tok->sym+node) : IDENTITY;
+	} else {
+	    tok->ascii_sym[i] = -1;
 	}
     }
+    xxfree(queue);
+    xxfree(newnum);
+    xxfree(tn);
+    sh->tokenizer = tok;
 }
 
-void apply_mark_flagstates(struct apply_handle *h) {
+void apply_mark_flagstates(struct apply_shared *sh) {
     int i;
     struct fsm_state *fsm;
 
     /* Create bitarray with those states that have a flag symbol on an arc */
     /* This is needed to decide whether we can perform a binary search.    */
 
-    if (!h->has_flags || h->flag_lookup == NULL) {
+    if (!sh->has_flags || sh->flag_lookup == NULL) {
 	return;
     }
-    if (h->flagstates) {
-	xxfree(h->flagstates);
+    if (sh->flagstates) {
+	xxfree(sh->flagstates);
     }
-    h->flagstates = xxcalloc(BITNSLOTS(h->last_net->statecount), sizeof(uint8_t));
-    fsm = h->last_net->states;
+    sh->flagstates = xxcalloc(BITNSLOTS(sh->last_net->statecount), sizeof(uint8_t));
+    fsm = sh->last_net->states;
     for (i=0; (fsm+i)->state_no != -1; i++) {
 	if ((fsm+i)->target == -1) { 
 	    continue;
 	}
-	if ((h->flag_lookup+(fsm+i)->in)->type) {
-	    BITSET(h->flagstates,(fsm+i)->state_no);
+	if ((sh->flag_lookup+(fsm+i)->in)->type) {
+	    BITSET(sh->flagstates,(fsm+i)->state_no);
 	}
-	if ((h->flag_lookup+(fsm+i)->out)->type) {
-	    BITSET(h->flagstates,(fsm+i)->state_no);
+	if ((sh->flag_lookup+(fsm+i)->out)->type) {
+	    BITSET(sh->flagstates,(fsm+i)->state_no);
 	}
     }
 }
 
-void apply_create_sigarray(struct apply_handle *h, struct fsm *net) {
+void apply_create_sigarray(struct apply_shared *sh, struct fsm *net) {
     struct sigma *sig;
     int i, maxsigma;
     
     maxsigma = sigma_max(net->sigma);
-    h->sigma_size = maxsigma+1;
-    // Default size created at init, resized later if necessary
-    h->sigmatch_array = xxcalloc(1024,sizeof(struct sigmatch_array));
-    h->sigmatch_array_size = 1024;
-
-    h->sigs = xxmalloc(sizeof(struct sigs)*(maxsigma+1));
-    h->has_flags = 0;
-    h->flag_list = NULL;
+    sh->sigma_size = maxsigma+1;
 
-    /* Malloc first array of trie and store trie ptrs to be able to free later */
-    /* when apply_clear() is called.                                           */
+    sh->sigs = xxcalloc(maxsigma+1, sizeof(struct sigs));
+    sh->has_flags = 0;
 
-    h->sigma_trie = xxcalloc(256,sizeof(struct sigma_trie));
-    h->sigma_trie_arrays = xxmalloc(sizeof(struct sigma_trie_arrays));
-    h->sigma_trie_arrays->arr = h->sigma_trie;
-    h->sigma_trie_arrays->next = NULL;
-
-    for (i=0;i<256;i++)
-	(h->sigma_trie+i)->next = NULL;
-    for (sig = h->gsigma; sig != NULL && sig->number != -1; sig = sig->next) {
+    for (sig = sh->gsigma; sig != NULL && sig->number != -1; sig = sig->next) {
 	if (flag_check(sig->symbol)) {
-	    h->has_flags = 1;
-	    apply_add_flag(h, flag_get_name(sig->symbol));
-	}
-	(h->sigs+(sig->number))->symbol = sig->symbol;
-	(h->sigs+(sig->number))->length = strlen(sig->symbol);
-	/* Add sigma entry to trie */
-	if (sig->number > IDENTITY) {
-	    apply_add_sigma_trie(h, sig->number, sig->symbol, (h->sigs+(sig->number))->length);
+	    sh->has_flags = 1;
 	}
+	(sh->sigs+(sig->number))->symbol = sig->symbol;
+	(sh->sigs+(sig->number))->length = strlen(sig->symbol);
     }
+    apply_create_tokenizer(sh, net);
     if (maxsigma >= IDENTITY) {
-	(h->sigs+EPSILON)->symbol = "0";
-	(h->sigs+EPSILON)->length =  1;
-	(h->sigs+UNKNOWN)->symbol = "?";
-	(h->sigs+UNKNOWN)->length =  1;
-	(h->sigs+IDENTITY)->symbol = "@";
-	(h->sigs+IDENTITY)->length =  1;
+	(sh->sigs+EPSILON)->symbol = "0";
+	(sh->sigs+EPSILON)->length =  1;
+	(sh->sigs+UNKNOWN)->symbol = "?";
+	(sh->sigs+UNKNOWN)->length =  1;
+	(sh->sigs+IDENTITY)->symbol = "@";
+	(sh->sigs+IDENTITY)->length =  1;
     }
-    if (h->has_flags) {
+    if (sh->has_flags) {
 
-	h->flag_lookup = xxmalloc(sizeof(struct flag_lookup)*(maxsigma+1));
+	sh->flag_lookup = xxmalloc(sizeof(struct flag_lookup)*(maxsigma+1));
 	for (i=0; i <= maxsigma; i++) {
-	    (h->flag_lookup+i)->type = 0;
-	    (h->flag_lookup+i)->name = NULL;
-	    (h->flag_lookup+i)->value = NULL;
+	    (sh->flag_lookup+i)->type = 0;
+	    (sh->flag_lookup+i)->name = NULL;
+	    (sh->flag_lookup+i)->value = NULL;
 	}
-	for (sig = h->gsigma; sig != NULL ; sig = sig->next) {
+	for (sig = sh->gsigma; sig != NULL ; sig = sig->next) {
 	    if (flag_check(sig->symbol)) {
-		(h->flag_lookup+sig->number)->type = flag_get_type(sig->symbol);
-		(h->flag_lookup+sig->number)->name = flag_get_name(sig->symbol);
-		(h->flag_lookup+sig->number)->value = flag_get_value(sig->symbol);		
+		(sh->flag_lookup+sig->number)->type = flag_get_type(sig->symbol);
+		(sh->flag_lookup+sig->number)->name = flag_get_name(sig->symbol);
+		(sh->flag_lookup+sig->number)->value = flag_get_value(sig->symbol);		
 	    }
 	}
-	apply_mark_flagstates(h);
+	apply_intern_flags(sh);
+	apply_mark_flagstates(sh);
+    }
+}
+
+/* Numbers flag names from 0 and flag values from 1 (0 means no value) */
+/* so that the flag registers can be a plain int array.  For [E.F.G]   */
+/* flags the value is the name number of G, or -1 if G never occurs.   */
+
+static void apply_intern_flags(struct apply_shared *sh) {
+    struct sh_handle *names, *values;
+    struct flag_lookup *fl;
+    int i, nextvalue;
+    names = sh_init();
+    values = sh_init();
+    sh->flag_name_count = 0;
+    for (i = 0; i < sh->sigma_size; i++) {
+	fl = sh->flag_lookup+i;
+	if (!fl->type)
+	    continue;
+	if (sh_find_string(names, fl->name) != NULL) {
+	    fl->name_id = sh_get_value(names);
+	} else {
+	    fl->name_id = sh->flag_name_count++;
+	    sh_add_string(names, fl->name, fl->name_id);
+	}
     }
+    for (i = 0, nextvalue = 1; i < sh->sigma_size; i++) {
+	fl = sh->flag_lookup+i;
+	if (!fl->type)
+	    continue;
+	if (fl->type == FLAG_EQUAL) {
+	    fl->value_id = (fl->value != NULL && sh_find_string(names, fl->value) != NULL) ? sh_get_value(names) : -1;
+	} else if (fl->value == NULL) {
+	    fl->value_id = 0;
+	} else if (sh_find_string(values, fl->value) != NULL) {
+	    fl->value_id = sh_get_value(values);
+	} else {
+	    fl->value_id = nextvalue++;
+	    sh_add_string(values, fl->value, fl->value_id);
+	}
+    }
+    sh_done(names);
+    sh_done(values);
 }
 
 /* We need to know which symbols in sigma we can match for all positions           */
@@ -1262,48 +4384,76 @@ void apply_create_sigarray(struct apply_handle *h, struct fsm *net) {
 /* as well as how many symbols matching consumes                        */
 
 void apply_create_sigmatch(struct apply_handle *h) {
-    char *symbol;
-    struct sigma_trie *st;
-    int i, j, inlen, lastmatch, consumes, cons;
+    unsigned char *symbol;
+    struct apply_tokenizer *tok;
+    int i, j, inlen, lastmatch, lastlen, consumes, cons, node, lo, hi, mid, end, c;
     /* We create a sigmatch array only in case we match against a real string */
     if (((h->mode) & ENUMERATE) == ENUMERATE) {
 	return;
     }
-    symbol = h->instring;
-    inlen = strlen(symbol);
+    symbol = (unsigned char *) h->instring;
+    tok = h->tokenizer;
+    inlen = strlen(h->instring);
     h->current_instring_length = inlen;
     if (inlen >= h->sigmatch_array_size) {
 	xxfree(h->sigmatch_array);
-	h->sigmatch_array = xxmalloc(sizeof(struct sigmatch_array)*(inlen));
-	h->sigmatch_array_size = inlen;
+	h->sigmatch_array = xxmalloc(sizeof(struct sigmatch_array)*(inlen+1));
+	h->sigmatch_array_size = inlen+1;
     }
-    /* Find longest match in alphabet at current position */
-    /* by traversing the trie of alphabet symbols         */
+    /* Index lookups at the end of the input only find epsilons */
+    (h->sigmatch_array+inlen)->signumber = EPSILON;
+    (h->sigmatch_array+inlen)->consumes = 0;
     for (i=0; i < inlen; i += consumes ) {
-	st = h->sigma_trie;
-	for (j=0, lastmatch = 0; ; j++) {
-	    if (*(symbol+i+j) == '\0') {
-		break;
+
+	/* Fast path: an ASCII byte that begins no multicharacter */
+	/* symbol and is not followed by a combining character    */
+	/* (all of which start with a byte >= 0xcc)               */
+	if (*(symbol+i) < 0x80 && *(symbol+i+1) < 0xcc && (c = tok->ascii_sym[*(symbol+i)]) != -1) {
+	    (h->sigmatch_array+i)->signumber = c;
+	    (h->sigmatch_array+i)->consumes = consumes = 1;
+	    continue;
+	}
+
+	/* Find longest match in alphabet at current position */
+	/* by traversing the trie of alphabet symbols         */
+	node = tok->root_next[*(symbol+i)];
+	lastmatch = *(tok->sym+node);
+	lastlen = 1;
+	for (j = 1; node != 0 && *(symbol+i+j) != '\0'; j++) {
+	    c = *(symbol+i+j);
+	    lo = *(tok->first+node);
+	    end = hi = *(tok->first+node+1);
+	    /* Bisect while the children are many; the byte is then at */
+	    /* or after lo and at or before hi                          */
+	    while (hi - lo > 8) {
+		mid = (lo + hi) / 2;
+		if (*(tok->bytes+mid) < c)
+		    lo = mid + 1;
+		else
+		    hi = mid;
 	    }
-	    st = st+(unsigned char)*(symbol+i+j);
-	    if (st->signum != 0) {
-		lastmatch = st->signum;
-		if (st->next == NULL)
-		    break;
-		st = st->next;
-	    } else if (st->next != NULL) {
-		st = st->next;
-	    } else {
+	    for ( ; lo < hi && *(tok->bytes+lo) < c; lo++) { }
+	    if (lo == end || *(tok->bytes+lo) != c) {
 		break;
 	    }
+	    node = lo;
+	    if (*(tok->sym+node) != 0) {
+		lastmatch = *(tok->sym+node);
+		lastlen = j+1;
+	    }
 	}
 	if (lastmatch != 0) {
 	    (h->sigmatch_array+i)->signumber = lastmatch;
-	    consumes = (h->sigs+lastmatch)->length;
+	    consumes = lastlen;
 	} else {
 	    /* Not found in trie */
 	    (h->sigmatch_array+i)->signumber = IDENTITY;
-	    consumes = utf8skip(symbol+i)+1;
+	    consumes = utf8skip((char *) symbol+i)+1;
+	    /* Malformed UTF-8: step over one byte, and never past the end */
+	    if (consumes < 1)
+		consumes = 1;
+	    if (consumes > inlen - i)
+		consumes = inlen - i;
 	}
 
 	/* If we now find trailing unicode combining characters (0300-036F):      */
@@ -1317,122 +4467,96 @@ void apply_create_sigmatch(struct apply_handle *h) {
         /*     diacritic gets converted to a single ?, e.g.                       */
         /*     [TAG] + D => ? if [TAG] is in the alphabet, but [TAG]+D isn't.     */
 
-	for (  ; cons = utf8iscombining((unsigned char *)(symbol+i+consumes)); consumes += cons) {
+	for (  ; *(symbol+i+consumes) >= 0xcc && (cons = utf8iscombining(symbol+i+consumes)); consumes += cons) {
 	    (h->sigmatch_array+i)->signumber = IDENTITY;
 	}
 	(h->sigmatch_array+i)->consumes = consumes;
     }
 }
 
-void apply_add_flag(struct apply_handle *h, char *name) {
-    struct flag_list *flist, *flist_prev;
-    if (h->flag_list == NULL) {
-	flist = h->flag_list = xxmalloc(sizeof(struct flag_list));
-    } else {
-	for (flist = h->flag_list; flist != NULL; flist_prev = flist, flist = flist->next) {
-	    if (strcmp(flist->name, name) == 0) {
-		return;
-	    }
-	}
-	flist = xxmalloc(sizeof(struct flag_list));
-	flist_prev->next = flist;
-    }
-    flist->name = name;
-    flist->value = NULL;
-    flist->neg = 0;
-    flist->next = NULL;
-    return;
-}
-
 void apply_clear_flags(struct apply_handle *h) {
-    struct flag_list *flist;
-    for (flist = h->flag_list; flist != NULL; flist = flist->next) {
-	flist->value = NULL;
-	flist->neg = 0;
+    if (h->flag_regs == NULL) {
+	return;
     }
+    memset(h->flag_regs, 0, sizeof(int) * (h->shared->flag_name_count+1));
     return;
 }
 
 /* Check for flag consistency by looking at the current states of */
-/* flags in flist */
+/* the flag registers.  A register holds the value number shifted */
+/* left by one, with the low bit set if the value is negated.     */
 
-int apply_check_flag(struct apply_handle *h, int type, char *name, char *value) {
-    struct flag_list *flist, *flist2;
-    for (flist = h->flag_list; flist != NULL; flist = flist->next) {
-	if (strcmp(flist->name, name) == 0) {
-	    break;
-	}
-    }
-    h->oldflagvalue = flist->value;
-    h->oldflagneg = flist->neg;
+#define FLAGREG_VALUE(r) ((r) >> 1)
+#define FLAGREG_NEG(r) ((r) & 1)
+
+int apply_check_flag(struct apply_handle *h, int type, int name, int value) {
+    int reg, reg2;
+    reg = *(h->flag_regs+name);
+    h->oldflag = reg;
     
     if (type == FLAG_UNIFY) {
-	if (flist->value == NULL) {
-	    flist->value = xxstrdup(value);
+	if (FLAGREG_VALUE(reg) == 0) {
+	    *(h->flag_regs+name) = value << 1;
 	    return SUCCEED;
 	}
-	else if (strcmp(value, flist->value) == 0 && flist->neg == 0) {
+	else if (value == FLAGREG_VALUE(reg) && FLAGREG_NEG(reg) == 0) {
 	    return SUCCEED;	    
-	} else if (strcmp(value, flist->value) != 0 && flist->neg == 1) {
-	    flist->value = xxstrdup(value);
-	    flist->neg = 0;
+	} else if (value != FLAGREG_VALUE(reg) && FLAGREG_NEG(reg) == 1) {
+	    *(h->flag_regs+name) = value << 1;
 	    return SUCCEED;
 	}  
 	return FAIL;
     }
 
     if (type == FLAG_CLEAR) {
-	flist->value = NULL;
-	flist->neg = 0;
+	*(h->flag_regs+name) = 0;
 	return SUCCEED;
     }
 
     if (type == FLAG_DISALLOW) {
-	if (flist->value == NULL) {
+	if (FLAGREG_VALUE(reg) == 0) {
 	    return SUCCEED;
 	}
-	if (value == NULL && flist->value != NULL) {
+	if (value == 0) {
 	    return FAIL;
 	}
-	if (strcmp(value, flist->value) != 0) {
-            if (flist->neg == 1)
+	if (value != FLAGREG_VALUE(reg)) {
+            if (FLAGREG_NEG(reg) == 1)
                 return FAIL;
             return SUCCEED;
 	}
-	if (strcmp(value, flist->value) == 0 && flist->neg == 1) {
+	if (FLAGREG_NEG(reg) == 1) {
             return SUCCEED;
         }
         return FAIL;
     }
 
     if (type == FLAG_NEGATIVE) {
-	flist->value = value;
-	flist->neg = 1;
+	*(h->flag_regs+name) = (value << 1) | 1;
 	return SUCCEED;
     }
 
     if (type == FLAG_POSITIVE) {
-	flist->value = value;
-	flist->neg = 0;
+	*(h->flag_regs+name) = value << 1;
 	return SUCCEED;
     }
 
     if (type == FLAG_REQUIRE) {
 
-	if (value == NULL) {
-	    if (flist->value == NULL) {
+	if (value == 0) {
+	    if (FLAGREG_VALUE(reg) == 0) {
 		return FAIL;
 	    } else {
 		return SUCCEED;
 	    }
 	} else {
-	    if (flist->value == NULL) {
+	    if (FLAGREG_VALUE(reg) == 0) {
 		return FAIL;
 	    }
-	    if (strcmp(value, flist->value) != 0) {
+	    if (value != FLAGREG_VALUE(reg)) {
 		return FAIL;
 	    } else {
-                if (flist->neg == 1) {
+                if (FLAGREG_NEG(reg) == 1) {
                     return FAIL;
                 }
 		return SUCCEED;
@@ -1441,28 +4565,383 @@ int apply_check_flag(struct apply_handle *h, int type, char *name, char *value)
     }
 
     if (type == FLAG_EQUAL) {
-	for (flist2 = h->flag_list; flist2 != NULL; flist2 = flist2->next) {
-	    if (strcmp(flist2->name, value) == 0) {
-		break;
-	    }
-	}
-
-	if (flist2 == NULL && flist->value != NULL)
+	if (value == -1 && FLAGREG_VALUE(reg) != 0)
 	    return FAIL;
-	if (flist2 == NULL && flist->value == NULL) {
+	if (value == -1 && FLAGREG_VALUE(reg) == 0) {
 	    return SUCCEED;
 	}
-	if (flist2->value == NULL || flist->value == NULL) {
-	    if (flist2->value == NULL && flist->value == NULL && flist->neg == flist2->neg) {
+	reg2 = *(h->flag_regs+value);
+	if (FLAGREG_VALUE(reg2) == 0 || FLAGREG_VALUE(reg) == 0) {
+	    if (FLAGREG_VALUE(reg2) == 0 && FLAGREG_VALUE(reg) == 0 && FLAGREG_NEG(reg) == FLAGREG_NEG(reg2)) {
 		return SUCCEED;
 	    } else {
 		return FAIL;
 	    }
-	}  else if (strcmp(flist2->value, flist->value) == 0 && flist->neg == flist2->neg) {
+	}  else if (FLAGREG_VALUE(reg2) == FLAGREG_VALUE(reg) && FLAGREG_NEG(reg) == FLAGREG_NEG(reg2)) {
 	    return SUCCEED;
 	}
 	return FAIL;	
     }
-    fprintf(stderr,"***Don't know what do with flag [%i][%s][%s]\n", type, name, value);
+    fprintf(stderr,"***Don't know what do with flag [%i][%i][%i]\n", type, name, value);
     return FAIL;
 }
+
+/* Prefix cursors */
+
+static void apply_cursor_begin_set(struct apply_cursor *c) {
+    c->stamp++;
+    c->set_begin = c->size;
+}
+
+static unsigned int apply_cursor_hash(struct apply_cursor *c, int state, int *regs) {
+    unsigned int hash;
+    int i;
+    hash = (unsigned int) state * 2654435761U;
+    for (i = 0; i < c->nregs; i++) {
+	hash = (hash ^ (unsigned int) *(regs+i)) * 16777619U;
+    }
+    return(hash ^ (hash >> 15));
+}
+
+/* Adds a configuration to the set being built unless already there */
+
+static void apply_cursor_add(struct apply_cursor *c, int state, int *regs) {
+    struct apply_cursor_slot *slot;
+    unsigned int hash, i;
+    int j, conf;
+
+    hash = apply_cursor_hash(c, state, regs);
+    for (i = hash & c->tablemask; ; i = (i+1) & c->tablemask) {
+	slot = c->table+i;
+	if (slot->stamp != c->stamp) {
+	    break;
+	}
+	conf = slot->config;
+	if (*(c->states+conf) == state && (c->nregs == 0 || memcmp(c->regs+conf*c->nregs, regs, sizeof(int)*c->nregs) == 0)) {
+	    return;
+	}
+    }
+    if (c->size == c->cap) {
+	c->cap *= 2;
+	c->states = xxrealloc(c->states, sizeof(int)*c->cap);
+	if (c->nregs) {
+	    c->regs = xxrealloc(c->regs, sizeof(int)*c->cap*c->nregs);
+	}
+    }
+    *(c->states+c->size) = state;
+    if (c->nregs) {
+	memcpy(c->regs+c->size*c->nregs, regs, sizeof(int)*c->nregs);
+    }
+    slot->config = c->size;
+    slot->stamp = c->stamp;
+    c->size++;
+    /* Keep the table at most half full with the current set */
+    if ((unsigned int) (c->size - c->set_begin) * 2 > c->tablemask) {
+	xxfree(c->table);
+	c->tablemask = c->tablemask*2+1;
+	c->table = xxcalloc(c->tablemask+1, sizeof(struct apply_cursor_slot));
+	for (j = c->set_begin; j < c->size; j++) {
+	    for (i = apply_cursor_hash(c, *(c->states+j), c->regs+j*c->nregs) & c->tablemask; (c->table+i)->stamp == c->stamp; i = (i+1) & c->tablemask) { }
+	    (c->table+i)->config = j;
+	    (c->table+i)->stamp = c->stamp;
+	}
+    }
+}
+
+/* Follows input epsilons and flags from the set being built */
+
+static void apply_cursor_closure(struct apply_cursor *c) {
+    struct apply_handle *h;
+    int i, a, sym;
+    h = c->h;
+    for (i = c->set_begin; i < c->size; i++) {
+	for (a = *(h->arc_offsets+*(c->states+i)); a < *(h->arc_offsets+*(c->states+i)+1); a++) {
+	    sym = *(c->arc_insym+a);
+	    if (sym != EPSILON && !(h->has_flags && (h->flag_lookup+sym)->type)) {
+		continue;
+	    }
+	    if (c->nregs) {
+		memcpy(h->flag_regs, c->regs+i*c->nregs, sizeof(int)*c->nregs);
+		if (sym != EPSILON && apply_check_flag(h, (h->flag_lookup+sym)->type, (h->flag_lookup+sym)->name_id, (h->flag_lookup+sym)->value_id) == FAIL) {
+		    continue;
+		}
+		memcpy(c->tmpregs, h->flag_regs, sizeof(int)*c->nregs);
+	    }
+	    apply_cursor_add(c, *(h->arc_target+a), c->tmpregs);
+	}
+    }
+}
+
+static void apply_cursor_push_layer(struct apply_cursor *c) {
+    if (c->numlayers == c->layers_cap) {
+	c->layers_cap *= 2;
+	c->layers = xxrealloc(c->layers, sizeof(int)*c->layers_cap);
+    }
+    *(c->layers+c->numlayers) = c->set_begin;
+    c->numlayers++;
+}
+
+struct apply_cursor *apply_cursor_init(struct apply_handle *h, int side) {
+    struct apply_cursor *c;
+    struct apply_symbol_entry *symbols;
+    struct sigma *sig;
+    int i, n;
+
+    c = xxcalloc(1, sizeof(struct apply_cursor));
+    c->h = h;
+    c->arc_insym = side == M_LOWER ? h->arc_out : h->arc_in;
+    c->nregs = (h->has_flags && h->obey_flags) ? h->shared->flag_name_count+1 : 0;
+    c->cap = 64;
+    c->states = xxmalloc(sizeof(int)*c->cap);
+    c->regs = c->nregs ? xxmalloc(sizeof(int)*c->cap*c->nregs) : NULL;
+    c->tmpregs = xxcalloc(c->nregs+1, sizeof(int));
+    c->layers_cap = 16;
+    c->layers = xxmalloc(sizeof(int)*c->layers_cap);
+    c->pushes_cap = 16;
+    c->pushes = xxmalloc(sizeof(int)*c->pushes_cap);
+    c->push_prefix = xxmalloc(sizeof(int)*c->pushes_cap);
+    c->prefix_cap = 64;
+    c->prefix = xxmalloc(c->prefix_cap);
+    c->tablemask = 63;
+    c->table = xxcalloc(c->tablemask+1, sizeof(struct apply_cursor_slot));
+
+    for (sig = h->gsigma, n = 0; sig != NULL && sig->number != -1; sig = sig->next) {
+	n++;
+    }
+    symbols = xxmalloc(sizeof(struct apply_symbol_entry)*(n+1));
+    for (sig = h->gsigma, n = 0; sig != NULL && sig->number != -1; sig = sig->next, n++) {
+	(symbols+n)->symbol = sig->symbol;
+	(symbols+n)->number = sig->number;
+    }
+    qsort(symbols, n, sizeof(struct apply_symbol_entry), apply_symbol_cmp);
+    c->sym_rank = xxcalloc(h->sigma_size+1, sizeof(int));
+    for (i = 0; i < n; i++) {
+	*(c->sym_rank+(symbols+i)->number) = i;
+    }
+    xxfree(symbols);
+    apply_cursor_reset(c);
+    return(c);
+}
+
+void apply_cursor_clear(struct apply_cursor *c) {
+    xxfree(c->states);
+    xxfree(c->regs);
+    xxfree(c->tmpregs);
+    xxfree(c->layers);
+    xxfree(c->pushes);
+    xxfree(c->push_prefix);
+    xxfree(c->prefix);
+    xxfree(c->table);
+    xxfree(c->sym_rank);
+    xxfree(c);
+}
+
+/* Back to the empty prefix */
+int apply_cursor_reset(struct apply_cursor *c) {
+    c->size = 0;
+    c->numlayers = 0;
+    c->numpushes = 0;
+    c->prefix_len = 0;
+    *(c->prefix) = '\0';
+    apply_cursor_begin_set(c);
+    if (c->h->last_net != NULL && c->h->last_net->statecount > 0) {
+	memset(c->tmpregs, 0, sizeof(int)*c->nregs);
+	apply_cursor_add(c, c->h->shared->start_state, c->tmpregs);
+	apply_cursor_closure(c);
+    }
+    apply_cursor_push_layer(c);
+    return(c->size);
+}
+
+int apply_cursor_push(struct apply_cursor *c, char *symbols) {
+    struct apply_handle *h;
+    int i, a, ipos, len, sym, signumber, begin, end, mode;
+
+    h = c->h;
+    if (c->numpushes == c->pushes_cap) {
+	c->pushes_cap *= 2;
+	c->pushes = xxrealloc(c->pushes, sizeof(int)*c->pushes_cap);
+	c->push_prefix = xxrealloc(c->push_prefix, sizeof(int)*c->pushes_cap);
+    }
+    *(c->pushes+c->numpushes) = c->numlayers;
+    *(c->push_prefix+c->numpushes) = c->prefix_len;
+    c->numpushes++;
+    len = strlen(symbols);
+    while (c->prefix_len + len + 1 > c->prefix_cap) {
+	c->prefix_cap *= 2;
+	c->prefix = xxrealloc(c->prefix, c->prefix_cap);
+    }
+    strcpy(c->prefix+c->prefix_len, symbols);
+    c->prefix_len += len;
+
+    mode = h->mode;
+    h->mode = DOWN;
+    h->instring = symbols;
+    apply_create_sigmatch(h);
+    h->mode = mode;
+    for (ipos = 0; ipos < h->current_instring_length; ipos += (h->sigmatch_array+ipos)->consumes) {
+	signumber = (h->sigmatch_array+ipos)->signumber;
+	begin = *(c->layers+c->numlayers-1);
+	end = c->size;
+	apply_cursor_begin_set(c);
+	for (i = begin; i < end; i++) {
+	    for (a = *(h->arc_offsets+*(c->states+i)); a < *(h->arc_offsets+*(c->states+i)+1); a++) {
+		sym = *(c->arc_insym+a);
+		if (sym == signumber || ((sym == IDENTITY || sym == UNKNOWN) && signumber == IDENTITY)) {
+		    if (c->nregs) {
+			memcpy(c->tmpregs, c->regs+i*c->nregs, sizeof(int)*c->nregs);
+		    }
+		    apply_cursor_add(c, *(h->arc_target+a), c->tmpregs);
+		}
+	    }
+	}
+	apply_cursor_closure(c);
+	apply_cursor_push_layer(c);
+    }
+    return(c->size - *(c->layers+c->numlayers-1));
+}
+
+int apply_cursor_back(struct apply_cursor *c) {
+    if (c->numpushes > 0) {
+	c->numpushes--;
+	c->numlayers = *(c->pushes+c->numpushes);
+	c->size = *(c->layers+c->numlayers);
+	c->prefix_len = *(c->push_prefix+c->numpushes);
+	*(c->prefix+c->prefix_len) = '\0';
+    }
+    return(c->size - *(c->layers+c->numlayers-1));
+}
+
+struct apply_cursor_node {
+    int begin;
+    int end;
+    int parent;
+    int sym;
+};
+
+struct apply_cursor_move {
+    int rank;
+    int config;
+    int target;
+    int sym;
+};
+
+static int apply_cursor_move_cmp(const void *a, const void *b) {
+    const struct apply_cursor_move *ma, *mb;
+    ma = a; mb = b;
+    if (ma->rank != mb->rank)
+	return(ma->rank < mb->rank ? -1 : 1);
+    if (ma->config != mb->config)
+	return(ma->config < mb->config ? -1 : 1);
+    return(ma->target - mb->target);
+}
+
+/* Breadth-first over sets of configurations: every node stands for */
+/* one string of input symbols after the prefix, and its children   */
+/* are made by grouping the moves out of its set by symbol.          */
+
+int apply_cursor_complete(struct apply_cursor *c, int max_results, int max_nodes, int (*visit)(char *word, int length, void *userdata), void *userdata) {
+    struct apply_handle *h;
+    struct apply_cursor_node *nodes, *node;
+    struct apply_cursor_move *moves;
+    char *word;
+    int i, j, a, n, sym, numnodes, nodes_cap, nummoves, moves_cap, head, found, final, len, word_cap, saved_size, expand;
+
+    h = c->h;
+    saved_size = c->size;
+    if (max_nodes <= 0) {
+	max_nodes = APPLY_CURSOR_MAX_NODES;
+    }
+    nodes_cap = 64;
+    nodes = xxmalloc(sizeof(struct apply_cursor_node)*nodes_cap);
+    moves_cap = 64;
+    moves = xxmalloc(sizeof(struct apply_cursor_move)*moves_cap);
+    word_cap = c->prefix_len + 64;
+    word = xxmalloc(word_cap);
+    nodes->begin = *(c->layers+c->numlayers-1);
+    nodes->end = c->size;
+    nodes->parent = -1;
+    nodes->sym = -1;
+    numnodes = nodes->end > nodes->begin ? 1 : 0;
+    found = 0;
+    expand = 1;
+    for (head = 0; head < numnodes && (max_results == 0 || found < max_results); head++) {
+	node = nodes+head;
+	for (i = node->begin, final = 0; i < node->end; i++) {
+	    if (BITTEST(h->finals, *(c->states+i))) {
+		final = 1;
+		break;
+	    }
+	}
+	if (final) {
+	    for (j = head, len = c->prefix_len; (nodes+j)->parent != -1; j = (nodes+j)->parent) {
+		len += (h->sigs+(nodes+j)->sym)->length;
+	    }
+	    if (len + 1 > word_cap) {
+		word_cap = len + 1;
+		word = xxrealloc(word, word_cap);
+	    }
+	    memcpy(word, c->prefix, c->prefix_len);
+	    *(word+len) = '\0';
+	    for (j = head, n = len; (nodes+j)->parent != -1; j = (nodes+j)->parent) {
+		n -= (h->sigs+(nodes+j)->sym)->length;
+		memcpy(word+n, (h->sigs+(nodes+j)->sym)->symbol, (h->sigs+(nodes+j)->sym)->length);
+	    }
+	    found++;
+	    if (visit(word, len, userdata)) {
+		break;
+	    }
+	}
+	/* Once out of nodes, the ones queued are still visited */
+	if (!expand) {
+	    continue;
+	}
+	/* Moves on real symbols; unknown symbols have nothing to offer */
+	for (i = node->begin, nummoves = 0; i < node->end; i++) {
+	    for (a = *(h->arc_offsets+*(c->states+i)); a < *(h->arc_offsets+*(c->states+i)+1); a++) {
+		sym = *(c->arc_insym+a);
+		if (sym == EPSILON || sym == IDENTITY || sym == UNKNOWN || (h->has_flags && (h->flag_lookup+sym)->type)) {
+		    continue;
+		}
+		if (nummoves == moves_cap) {
+		    moves_cap *= 2;
+		    moves = xxrealloc(moves, sizeof(struct apply_cursor_move)*moves_cap);
+		}
+		(moves+nummoves)->rank = *(c->sym_rank+sym);
+		(moves+nummoves)->config = i;
+		(moves+nummoves)->target = *(h->arc_target+a);
+		(moves+nummoves)->sym = sym;
+		nummoves++;
+	    }
+	}
+	qsort(moves, nummoves, sizeof(struct apply_cursor_move), apply_cursor_move_cmp);
+	for (i = 0; i < nummoves; i = j) {
+	    if (numnodes >= max_nodes) {
+		expand = 0;
+		break;
+	    }
+	    apply_cursor_begin_set(c);
+	    for (j = i; j < nummoves && (moves+j)->rank == (moves+i)->rank; j++) {
+		if (c->nregs) {
+		    memcpy(c->tmpregs, c->regs+(moves+j)->config*c->nregs, sizeof(int)*c->nregs);
+		}
+		apply_cursor_add(c, (moves+j)->target, c->tmpregs);
+	    }
+	    apply_cursor_closure(c);
+	    if (numnodes == nodes_cap) {
+		nodes_cap *= 2;
+		nodes = xxrealloc(nodes, sizeof(struct apply_cursor_node)*nodes_cap);
+	    }
+	    (nodes+numnodes)->begin = c->set_begin;
+	    (nodes+numnodes)->end = c->size;
+	    (nodes+numnodes)->parent = head;
+	    (nodes+numnodes)->sym = (moves+i)->sym;
+	    numnodes++;
+	}
+    }
+    c->size = saved_size;
+    xxfree(nodes);
+    xxfree(moves);
+    xxfree(word);
+    return(found);
+}
@@ -0,0 +1,1038 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2014 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fomalib.h"
+
+/* Applies a cascade of transducers.  Instead of printing the output of */
+/* one stage and tokenizing it again for the next, each stage's results */
+/* are collected as sequences of global symbol numbers, with duplicates */
+/* removed, and fed to the next stage as they are.  Every sigma number  */
+/* of a stage maps to the global symbol spelled the same way, and every */
+/* global symbol maps to the stage's sigma number of that spelling, or  */
+/* to IDENTITY if the stage's alphabet doesn't have it.                 */
+
+#define SEQSET_INITIAL_SIZE 64
+
+static void apply_product_free(struct apply_product *pr);
+
+static struct apply_seqset *apply_seqset_init() {
+    struct apply_seqset *set;
+    set = xxcalloc(1, sizeof(struct apply_seqset));
+    set->syms_size = SEQSET_INITIAL_SIZE;
+    set->syms = xxmalloc(sizeof(int) * set->syms_size);
+    set->start_size = SEQSET_INITIAL_SIZE;
+    set->start = xxmalloc(sizeof(int) * set->start_size);
+    set->tablemask = SEQSET_INITIAL_SIZE - 1;
+    set->table = xxcalloc(set->tablemask + 1, sizeof(int));
+    *(set->start) = 0;
+    return(set);
+}
+
+static void apply_seqset_free(struct apply_seqset *set) {
+    xxfree(set->syms);
+    xxfree(set->start);
+    xxfree(set->table);
+    xxfree(set);
+}
+
+static void apply_seqset_clear(struct apply_seqset *set) {
+    if (set->count > 0) {
+	memset(set->table, 0, sizeof(int) * (set->tablemask + 1));
+    }
+    set->count = 0;
+    set->syms_used = 0;
+}
+
+static unsigned int apply_seqset_hashf(int *seq, int length) {
+    unsigned int hash;
+    int i;
+    for (hash = length, i = 0; i < length; i++) {
+	hash = hash * 101 + *(seq+i);
+    }
+    return(hash ^ (hash >> 15));
+}
+
+static int apply_seqset_equal(struct apply_seqset *set, int i, int *seq, int length) {
+    if (*(set->start+i+1) - *(set->start+i) != length)
+	return 0;
+    return(memcmp(set->syms + *(set->start+i), seq, sizeof(int) * length) == 0);
+}
+
+static void apply_seqset_rehash(struct apply_seqset *set) {
+    unsigned int slot;
+    int i;
+    xxfree(set->table);
+    set->tablemask = set->tablemask * 2 + 1;
+    set->table = xxcalloc(set->tablemask + 1, sizeof(int));
+    for (i = 0; i < set->count; i++) {
+	slot = apply_seqset_hashf(set->syms + *(set->start+i), *(set->start+i+1) - *(set->start+i)) & set->tablemask;
+	while (*(set->table+slot) != 0)
+	    slot = (slot + 1) & set->tablemask;
+	*(set->table+slot) = i + 1;
+    }
+}
+
+/* Adds a sequence unless it is already in the set */
+static void apply_seqset_add(struct apply_seqset *set, int *seq, int length) {
+    unsigned int slot;
+    if ((set->count + 1) * 2 > (int) set->tablemask + 1) {
+	apply_seqset_rehash(set);
+    }
+    for (slot = apply_seqset_hashf(seq, length) & set->tablemask; *(set->table+slot) != 0; slot = (slot + 1) & set->tablemask) {
+	if (apply_seqset_equal(set, *(set->table+slot) - 1, seq, length))
+	    return;
+    }
+    if (set->count + 2 > set->start_size) {
+	set->start_size *= 2;
+	set->start = xxrealloc(set->start, sizeof(int) * set->start_size);
+    }
+    while (set->syms_used + length > set->syms_size) {
+	set->syms_size *= 2;
+	set->syms = xxrealloc(set->syms, sizeof(int) * set->syms_size);
+    }
+    if (length > 0)
+	memcpy(set->syms + set->syms_used, seq, sizeof(int) * length);
+    set->syms_used += length;
+    *(set->table+slot) = set->count + 1;
+    set->count++;
+    *(set->start+set->count) = set->syms_used;
+}
+
+/* Returns the global number of a symbol, adding it if it's new */
+static int apply_cascade_symbol(struct apply_cascade *c, char *symbol) {
+    int i, g;
+    if (sh_find_string(c->symbolhash, symbol) != NULL) {
+	return(sh_get_value(c->symbolhash));
+    }
+    g = c->numsymbols++;
+    if (g == c->symbols_size) {
+	c->symbols_size *= 2;
+	c->symbols = xxrealloc(c->symbols, sizeof(char *) * c->symbols_size);
+	for (i = 0; i < c->numhandles; i++) {
+	    *(c->in_maps+i) = xxrealloc(*(c->in_maps+i), sizeof(int) * c->symbols_size);
+	}
+    }
+    *(c->symbols+g) = sh_add_string(c->symbolhash, symbol, g);
+    for (i = 0; i < c->numhandles; i++) {
+	*(*(c->in_maps+i)+g) = IDENTITY;
+    }
+    return(g);
+}
+
+struct apply_cascade *apply_cascade_init(struct apply_handle **handles, int numhandles) {
+    struct apply_cascade *c;
+    struct sigma *sig;
+    int i, g, maxsigma;
+
+    c = xxcalloc(1, sizeof(struct apply_cascade));
+    c->numhandles = numhandles;
+    c->handles = xxmalloc(sizeof(struct apply_handle *) * numhandles);
+    memcpy(c->handles, handles, sizeof(struct apply_handle *) * numhandles);
+    c->symbolhash = sh_init();
+    c->symbols_size = 256;
+    c->symbols = xxmalloc(sizeof(char *) * c->symbols_size);
+    c->in_maps = xxmalloc(sizeof(int *) * numhandles);
+    c->out_maps = xxmalloc(sizeof(int *) * numhandles);
+    for (i = 0; i < numhandles; i++) {
+	*(c->in_maps+i) = xxmalloc(sizeof(int) * c->symbols_size);
+    }
+    for (i = 0; i < numhandles; i++) {
+	maxsigma = sigma_max((*(handles+i))->last_net->sigma);
+	if (maxsigma < IDENTITY)
+	    maxsigma = IDENTITY;
+	*(c->out_maps+i) = xxcalloc(maxsigma + 1, sizeof(int));
+	/* An unknown output symbol is printed as ? */
+	c->unknown_symbol = apply_cascade_symbol(c, "?");
+	*(*(c->out_maps+i)+UNKNOWN) = c->unknown_symbol;
+	for (sig = (*(handles+i))->last_net->sigma; sig != NULL && sig->number != -1; sig = sig->next) {
+	    if (sig->number <= IDENTITY)
+		continue;
+	    g = apply_cascade_symbol(c, sig->symbol);
+	    *(*(c->out_maps+i)+sig->number) = g;
+	    *(*(c->in_maps+i)+g) = sig->number;
+	}
+    }
+    c->current = apply_seqset_init();
+    c->next = apply_seqset_init();
+    c->outstring_size = 256;
+    c->outstring = xxmalloc(c->outstring_size);
+    return(c);
+}
+
+void apply_cascade_clear(struct apply_cascade *c) {
+    int i;
+    for (i = 0; i < c->numhandles; i++) {
+	xxfree(*(c->in_maps+i));
+	xxfree(*(c->out_maps+i));
+    }
+    xxfree(c->in_maps);
+    xxfree(c->out_maps);
+    xxfree(c->handles);
+    sh_done(c->symbolhash);
+    xxfree(c->symbols);
+    apply_seqset_free(c->current);
+    apply_seqset_free(c->next);
+    if (c->tokens != NULL) {
+	xxfree(c->tokens);
+	xxfree(c->token_lengths);
+    }
+    if (c->product != NULL)
+	apply_product_free(c->product);
+    xxfree(c->outstring);
+    xxfree(c);
+}
+
+static int apply_cascade_visit(int *symbols, int length, void *userdata) {
+    apply_seqset_add(((struct apply_cascade *) userdata)->next, symbols, length);
+    return 0;
+}
+
+/* Spells out the next result of the last stage */
+static char *apply_cascade_next(struct apply_cascade *c, struct apply_handle *last) {
+    char *symbol;
+    int i, len, pos, spacelen;
+
+    if (c->result >= c->current->count)
+	return(NULL);
+    if (c->product != NULL && c->product->limit_results && c->result >= c->product->limit_results)
+	return(NULL);
+    spacelen = last->print_space ? strlen(last->space_symbol) : 0;
+    for (pos = 0, i = *(c->current->start+c->result); i < *(c->current->start+c->result+1); i++) {
+	symbol = *(c->symbols+*(c->current->syms+i));
+	len = strlen(symbol);
+	while (pos + len + spacelen + 1 > c->outstring_size) {
+	    c->outstring_size *= 2;
+	    c->outstring = xxrealloc(c->outstring, c->outstring_size);
+	}
+	memcpy(c->outstring+pos, symbol, len);
+	pos += len;
+	if (spacelen) {
+	    memcpy(c->outstring+pos, last->space_symbol, spacelen);
+	    pos += spacelen;
+	}
+    }
+    *(c->outstring+pos) = '\0';
+    c->result++;
+    return(c->outstring);
+}
+
+/* Composed lookup.  Instead of running the nets one after the other, */
+/* the cascade can walk the product of the nets the way fsm_compose() */
+/* builds it, but only the part reachable with the current word.  A   */
+/* node is the input position, the state of each net and the epsilon  */
+/* filter mode between each net and the nets before it, with the same */
+/* three modes as g_compose_tristate: 0 when both sides may move on   */
+/* epsilon, 1 after the lower side moved alone and 2 after the upper  */
+/* side moved alone.  Nodes are kept per word and so are the outputs  */
+/* leading from each node to a final node, as shared suffix lists.    */
+/*                                                                    */
+/* Values passed between nets are global symbols, PRODUCT_EPSILON or  */
+/* a wildcard standing for any symbol outside the alphabets of the    */
+/* nets in its mask, which is what ? and @ carry in a composition.    */
+/* Flag diacritics are ordinary symbols, as in fsm_compose(), so nets */
+/* that obey flags are not walked this way.                           */
+
+#define BITMASK(b) (1 << ((b) & 7))
+#define BITSLOT(b) ((b) >> 3)
+#define BITTEST(a,b) ((a)[BITSLOT(b)] & BITMASK(b))
+
+#define PRODUCT_MAX_NETS 30
+#define PRODUCT_EPSILON -1
+#define PRODUCT_WILD(mask) (-2-(mask))
+#define PRODUCT_IS_WILD(v) ((v) < PRODUCT_EPSILON)
+#define PRODUCT_MASK(v) (-2-(v))
+#define PRODUCT_INITIAL_SIZE 64
+
+static void apply_product_free(struct apply_product *pr) {
+    xxfree(pr->nodes);
+    xxfree(pr->nodehash);
+    xxfree(pr->status);
+    xxfree(pr->order);
+    xxfree(pr->low);
+    xxfree(pr->scc);
+    xxfree(pr->edge_start);
+    xxfree(pr->edge_count);
+    xxfree(pr->edges);
+    xxfree(pr->result_start);
+    xxfree(pr->result_count);
+    xxfree(pr->results);
+    xxfree(pr->cons);
+    xxfree(pr->conshash);
+    xxfree(pr->seen);
+    xxfree(pr->moves[0]);
+    xxfree(pr->moves[1]);
+    xxfree(pr->stack);
+    xxfree(pr->path);
+    xxfree(pr->spell);
+    xxfree(pr->netsymbols);
+    xxfree(pr);
+}
+
+static struct apply_product *apply_product_init(struct apply_cascade *c) {
+    struct apply_product *pr;
+    int i, g;
+
+    pr = xxcalloc(1, sizeof(struct apply_product));
+    pr->width = 1 + 2 * c->numhandles;
+    pr->nodes_size = PRODUCT_INITIAL_SIZE;
+    pr->nodes = xxmalloc(sizeof(int) * pr->width * pr->nodes_size);
+    pr->status = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->order = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->low = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->scc = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->edge_start = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->edge_count = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->result_start = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->result_count = xxmalloc(sizeof(int) * pr->nodes_size);
+    pr->nodemask = PRODUCT_INITIAL_SIZE * 2 - 1;
+    pr->nodehash = xxcalloc(pr->nodemask + 1, sizeof(int));
+    pr->edges_size = PRODUCT_INITIAL_SIZE;
+    pr->edges = xxmalloc(sizeof(int) * 2 * pr->edges_size);
+    pr->results_size = PRODUCT_INITIAL_SIZE;
+    pr->results = xxmalloc(sizeof(int) * pr->results_size);
+    pr->cons_size = PRODUCT_INITIAL_SIZE;
+    pr->cons = xxmalloc(sizeof(int) * 2 * pr->cons_size);
+    pr->seen = xxcalloc(pr->cons_size, sizeof(int));
+    pr->consmask = PRODUCT_INITIAL_SIZE * 2 - 1;
+    pr->conshash = xxcalloc(pr->consmask + 1, sizeof(int));
+    pr->numcons = 1;
+    for (i = 0; i < 2; i++) {
+	pr->moves_size[i] = PRODUCT_INITIAL_SIZE;
+	pr->moves[i] = xxmalloc(sizeof(int) * (pr->width + 1) * pr->moves_size[i]);
+    }
+    pr->stack_size = PRODUCT_INITIAL_SIZE;
+    pr->stack = xxmalloc(sizeof(int) * 2 * pr->stack_size);
+    pr->path_size = PRODUCT_INITIAL_SIZE;
+    pr->path = xxmalloc(sizeof(int) * pr->path_size);
+    pr->spell_size = PRODUCT_INITIAL_SIZE;
+    pr->spell = xxmalloc(sizeof(int) * pr->spell_size);
+
+    /* The symbols of all the nets */
+    pr->netsymbols = xxmalloc(sizeof(int) * c->numsymbols);
+    for (g = 0; g < c->numsymbols; g++) {
+	for (i = 0; i < c->numhandles; i++) {
+	    if (*(*(c->in_maps+i)+g) != IDENTITY)
+		break;
+	}
+	if (i < c->numhandles) {
+	    *(pr->netsymbols+pr->numnetsymbols) = g;
+	    pr->numnetsymbols++;
+	}
+    }
+    return(pr);
+}
+
+/* Does a cycle of input epsilons in h write output?  A lookup goes  */
+/* round such a cycle up to twice, the walk once, and the results    */
+/* differ.  Finds the strongly connected components of the input     */
+/* epsilon arcs (Tarjan) and looks for an output within one of them. */
+static int apply_product_output_cycle(struct apply_handle *h, short int *arcin, short int *arcout) {
+    int *order, *low, *scc, *stack, s, t, a, sp, n, top, numordered, statecount, found;
+    statecount = h->last_net->statecount;
+    order = xxmalloc(sizeof(int) * statecount);
+    low = xxmalloc(sizeof(int) * statecount);
+    scc = xxmalloc(sizeof(int) * statecount);
+    stack = xxmalloc(sizeof(int) * 2 * statecount);
+    for (s = 0; s < statecount; s++) {
+	*(order+s) = -1;
+    }
+    numordered = 0;
+    top = 0;
+    for (s = 0; s < statecount; s++) {
+	if (*(order+s) != -1)
+	    continue;
+	*(order+s) = *(low+s) = numordered++;
+	*(scc+top++) = s;
+	*(stack) = s;
+	*(stack+1) = *(h->arc_offsets+s);
+	for (sp = 0; sp >= 0; ) {
+	    n = *(stack+2*sp);
+	    a = *(stack+2*sp+1);
+	    if (a < *(h->arc_offsets+n+1)) {
+		*(stack+2*sp+1) = a + 1;
+		if (*(arcin+a) != EPSILON)
+		    continue;
+		t = *(h->arc_target+a);
+		if (*(order+t) == -1) {
+		    *(order+t) = *(low+t) = numordered++;
+		    *(scc+top++) = t;
+		    sp++;
+		    *(stack+2*sp) = t;
+		    *(stack+2*sp+1) = *(h->arc_offsets+t);
+		} else if (*(order+t) >= 0 && *(order+t) < *(low+n)) {
+		    *(low+n) = *(order+t);
+		}
+		continue;
+	    }
+	    if (*(low+n) == *(order+n)) {
+		/* Components are numbered -2, -3, ... once closed */
+		do {
+		    t = *(scc+--top);
+		    *(order+t) = -2 - n;
+		} while (t != n);
+	    }
+	    sp--;
+	    if (sp >= 0 && *(low+n) < *(low+*(stack+2*sp)))
+		*(low+*(stack+2*sp)) = *(low+n);
+	}
+    }
+    found = 0;
+    for (s = 0; s < statecount && !found; s++) {
+	for (a = *(h->arc_offsets+s); a < *(h->arc_offsets+s+1); a++) {
+	    if (*(arcin+a) == EPSILON && *(arcout+a) != EPSILON && *(order+s) == *(order+*(h->arc_target+a))) {
+		found = 1;
+		break;
+	    }
+	}
+    }
+    xxfree(order);
+    xxfree(low);
+    xxfree(scc);
+    xxfree(stack);
+    return(found);
+}
+
+int apply_cascade_set_composed(struct apply_cascade *c, int value) {
+    struct apply_handle *h;
+    int i;
+    if (c->product != NULL) {
+	apply_product_free(c->product);
+	c->product = NULL;
+    }
+    if (value) {
+	if (c->numhandles > PRODUCT_MAX_NETS)
+	    return 0;
+	for (i = 0; i < c->numhandles; i++) {
+	    h = *(c->handles+i);
+	    if (h->has_flags && h->obey_flags)
+		return 0;
+	    if (apply_product_output_cycle(h, h->arc_in, h->arc_out) || apply_product_output_cycle(h, h->arc_out, h->arc_in))
+		return 0;
+	}
+	c->product = apply_product_init(c);
+    }
+    return 1;
+}
+
+static void apply_product_reset(struct apply_product *pr) {
+    memset(pr->nodehash, 0, sizeof(int) * (pr->nodemask + 1));
+    memset(pr->conshash, 0, sizeof(int) * (pr->consmask + 1));
+    pr->numnodes = 0;
+    pr->edges_used = 0;
+    pr->results_used = 0;
+    pr->numcons = 1;
+    pr->numordered = 0;
+    pr->scc_used = 0;
+}
+
+static unsigned int apply_product_hashf(int *seq, int length) {
+    return(apply_seqset_hashf(seq, length));
+}
+
+/* Returns the number of a node, adding it if it's new */
+static int apply_product_node(struct apply_product *pr, int *node) {
+    unsigned int slot;
+    int i, n;
+    for (slot = apply_product_hashf(node, pr->width) & pr->nodemask; *(pr->nodehash+slot) != 0; slot = (slot + 1) & pr->nodemask) {
+	n = *(pr->nodehash+slot) - 1;
+	if (memcmp(pr->nodes + n * pr->width, node, sizeof(int) * pr->width) == 0)
+	    return(n);
+    }
+    if (pr->numnodes == pr->nodes_size) {
+	pr->nodes_size *= 2;
+	pr->nodes = xxrealloc(pr->nodes, sizeof(int) * pr->width * pr->nodes_size);
+	pr->status = xxrealloc(pr->status, sizeof(int) * pr->nodes_size);
+	pr->order = xxrealloc(pr->order, sizeof(int) * pr->nodes_size);
+	pr->low = xxrealloc(pr->low, sizeof(int) * pr->nodes_size);
+	pr->scc = xxrealloc(pr->scc, sizeof(int) * pr->nodes_size);
+	pr->edge_start = xxrealloc(pr->edge_start, sizeof(int) * pr->nodes_size);
+	pr->edge_count = xxrealloc(pr->edge_count, sizeof(int) * pr->nodes_size);
+	pr->result_start = xxrealloc(pr->result_start, sizeof(int) * pr->nodes_size);
+	pr->result_count = xxrealloc(pr->result_count, sizeof(int) * pr->nodes_size);
+    }
+    n = pr->numnodes++;
+    memcpy(pr->nodes + n * pr->width, node, sizeof(int) * pr->width);
+    *(pr->status+n) = 0;
+    *(pr->edge_start+n) = -1;
+    *(pr->edge_count+n) = 0;
+    *(pr->result_count+n) = 0;
+    if (pr->numnodes * 2 > (int) pr->nodemask + 1) {
+	xxfree(pr->nodehash);
+	pr->nodemask = pr->nodemask * 2 + 1;
+	pr->nodehash = xxcalloc(pr->nodemask + 1, sizeof(int));
+	for (i = 0; i < pr->numnodes; i++) {
+	    for (slot = apply_product_hashf(pr->nodes + i * pr->width, pr->width) & pr->nodemask; *(pr->nodehash+slot) != 0; slot = (slot + 1) & pr->nodemask) { }
+	    *(pr->nodehash+slot) = i + 1;
+	}
+    } else {
+	*(pr->nodehash+slot) = n + 1;
+    }
+    return(n);
+}
+
+/* Returns the suffix value followed by suffix tail */
+static int apply_product_cons(struct apply_product *pr, int value, int tail) {
+    unsigned int slot;
+    int i, n, pair[2];
+    pair[0] = value;
+    pair[1] = tail;
+    for (slot = apply_product_hashf(pair, 2) & pr->consmask; *(pr->conshash+slot) != 0; slot = (slot + 1) & pr->consmask) {
+	n = *(pr->conshash+slot);
+	if (*(pr->cons+2*n) == value && *(pr->cons+2*n+1) == tail)
+	    return(n);
+    }
+    if (pr->numcons == pr->cons_size) {
+	pr->cons_size *= 2;
+	pr->cons = xxrealloc(pr->cons, sizeof(int) * 2 * pr->cons_size);
+	pr->seen = xxrealloc(pr->seen, sizeof(int) * pr->cons_size);
+	memset(pr->seen + pr->numcons, 0, sizeof(int) * (pr->cons_size - pr->numcons));
+    }
+    n = pr->numcons++;
+    *(pr->cons+2*n) = value;
+    *(pr->cons+2*n+1) = tail;
+    if (pr->numcons * 2 > (int) pr->consmask + 1) {
+	xxfree(pr->conshash);
+	pr->consmask = pr->consmask * 2 + 1;
+	pr->conshash = xxcalloc(pr->consmask + 1, sizeof(int));
+	for (i = 1; i < pr->numcons; i++) {
+	    for (slot = apply_product_hashf(pr->cons+2*i, 2) & pr->consmask; *(pr->conshash+slot) != 0; slot = (slot + 1) & pr->consmask) { }
+	    *(pr->conshash+slot) = i;
+	}
+    } else {
+	*(pr->conshash+slot) = n;
+    }
+    return(n);
+}
+
+/* Is global symbol g outside the alphabets of all the nets in mask */
+static int apply_product_outside(struct apply_cascade *c, int mask, int g) {
+    int i;
+    for (i = 0; mask != 0; i++, mask >>= 1) {
+	if ((mask & 1) && *(*(c->in_maps+i)+g) != IDENTITY)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Matches value against input symbol in of net stage, setting what  */
+/* an identity output copies; returns 0 on no match                   */
+static int apply_product_match(struct apply_cascade *c, int stage, int in, int value, int *copy) {
+    int g;
+    if (!PRODUCT_IS_WILD(value)) {
+	*copy = value;
+	if (in == IDENTITY || in == UNKNOWN)
+	    return(*(*(c->in_maps+stage)+value) == IDENTITY);
+	return(*(*(c->in_maps+stage)+value) == in);
+    }
+    if (in == IDENTITY || in == UNKNOWN) {
+	*copy = PRODUCT_WILD(PRODUCT_MASK(value) | (1 << stage));
+	return 1;
+    }
+    g = *(*(c->out_maps+stage)+in);
+    *copy = g;
+    return(apply_product_outside(c, PRODUCT_MASK(value), g));
+}
+
+static int apply_product_output(struct apply_cascade *c, int stage, int out, int copy) {
+    if (out == EPSILON)
+	return(PRODUCT_EPSILON);
+    if (out == IDENTITY)
+	return(copy);
+    if (out == UNKNOWN)
+	return(PRODUCT_WILD(1 << stage));
+    return(*(*(c->out_maps+stage)+out));
+}
+
+/* A move is the input consumed, the value passed on and the node it  */
+/* leads to, with the nets not reached yet still in their old state  */
+static void apply_product_move(struct apply_product *pr, int buf, int consumes, int value, int *node, int net, int state, int mode) {
+    int *move, k;
+    k = (pr->width - 1) / 2;
+    if (pr->moves_used[buf] == pr->moves_size[buf]) {
+	pr->moves_size[buf] *= 2;
+	pr->moves[buf] = xxrealloc(pr->moves[buf], sizeof(int) * (pr->width + 1) * pr->moves_size[buf]);
+    }
+    move = pr->moves[buf] + pr->moves_used[buf] * (pr->width + 1);
+    pr->moves_used[buf]++;
+    memcpy(move + 1, node, sizeof(int) * pr->width);
+    *move = value;
+    *(move+1) += consumes;
+    *(move+2+net) = state;
+    *(move+2+k+net) = mode;
+}
+
+static void apply_product_result(struct apply_product *pr, int suffix) {
+    if (pr->results_used == pr->results_size) {
+	pr->results_size *= 2;
+	pr->results = xxrealloc(pr->results, sizeof(int) * pr->results_size);
+    }
+    *(pr->results+pr->results_used) = suffix;
+    pr->results_used++;
+}
+
+/* Finds the edges out of node n */
+static void apply_product_expand(struct apply_cascade *c, int n, int *tokens, int inlen, int down) {
+    struct apply_product *pr;
+    struct apply_handle *h;
+    short int *arcin, *arcout;
+    int *node, *move, net, stage, state, mode, k, i, j, a, cur, copy, value, t, narcs;
+
+    pr = c->product;
+    k = c->numhandles;
+    node = xxmalloc(sizeof(int) * pr->width);
+    memcpy(node, pr->nodes + n * pr->width, sizeof(int) * pr->width);
+    i = *node;
+    for (net = 0, cur = 0; net < k; net++, cur = 1 - cur) {
+	stage = down ? net : k - 1 - net;
+	h = *(c->handles+stage);
+	arcin = down ? h->arc_in : h->arc_out;
+	arcout = down ? h->arc_out : h->arc_in;
+	state = *(node+1+net);
+	mode = *(node+1+k+net);
+	narcs = *(h->arc_offsets+state+1) - *(h->arc_offsets+state);
+	pr->moves_used[cur] = 0;
+	if (net == 0) {
+	    pr->steps += narcs;
+	    for (a = *(h->arc_offsets+state); a < *(h->arc_offsets+state+1); a++) {
+		if (*(arcin+a) == EPSILON) {
+		    apply_product_move(pr, cur, 0, apply_product_output(c, stage, *(arcout+a), PRODUCT_EPSILON), node, net, *(h->arc_target+a), 0);
+		} else if (i < inlen && apply_product_match(c, stage, *(arcin+a), *(tokens+i), &copy)) {
+		    apply_product_move(pr, cur, 1, apply_product_output(c, stage, *(arcout+a), copy), node, net, *(h->arc_target+a), 0);
+		}
+	    }
+	    continue;
+	}
+	for (j = 0; j < pr->moves_used[1-cur]; j++) {
+	    move = pr->moves[1-cur] + j * (pr->width + 1);
+	    value = *move;
+	    pr->steps += narcs;
+	    if (value != PRODUCT_EPSILON) {
+		for (a = *(h->arc_offsets+state); a < *(h->arc_offsets+state+1); a++) {
+		    if (*(arcin+a) != EPSILON && apply_product_match(c, stage, *(arcin+a), value, &copy)) {
+			apply_product_move(pr, cur, 0, apply_product_output(c, stage, *(arcout+a), copy), move+1, net, *(h->arc_target+a), 0);
+		    }
+		}
+		continue;
+	    }
+	    /* The lower side moves alone */
+	    if (mode != 2) {
+		apply_product_move(pr, cur, 0, PRODUCT_EPSILON, move+1, net, state, 1);
+	    }
+	    /* Both sides move on epsilon */
+	    if (mode == 0) {
+		for (a = *(h->arc_offsets+state); a < *(h->arc_offsets+state+1); a++) {
+		    if (*(arcin+a) == EPSILON) {
+			apply_product_move(pr, cur, 0, apply_product_output(c, stage, *(arcout+a), PRODUCT_EPSILON), move+1, net, *(h->arc_target+a), 0);
+		    }
+		}
+	    }
+	}
+	/* The upper side moves alone */
+	if (mode != 1) {
+	    pr->steps += narcs;
+	    for (a = *(h->arc_offsets+state); a < *(h->arc_offsets+state+1); a++) {
+		if (*(arcin+a) == EPSILON) {
+		    apply_product_move(pr, cur, 0, apply_product_output(c, stage, *(arcout+a), PRODUCT_EPSILON), node, net, *(h->arc_target+a), 2);
+		}
+	    }
+	}
+    }
+    cur = 1 - cur;
+    *(pr->edge_start+n) = pr->edges_used;
+    for (j = 0; j < pr->moves_used[cur]; j++) {
+	move = pr->moves[cur] + j * (pr->width + 1);
+	t = apply_product_node(pr, move + 1);
+	if (pr->edges_used == pr->edges_size) {
+	    pr->edges_size *= 2;
+	    pr->edges = xxrealloc(pr->edges, sizeof(int) * 2 * pr->edges_size);
+	}
+	*(pr->edges+2*pr->edges_used) = t;
+	*(pr->edges+2*pr->edges_used+1) = *move;
+	pr->edges_used++;
+    }
+    *(pr->edge_count+n) = pr->edges_used - *(pr->edge_start+n);
+    xxfree(node);
+}
+
+static int apply_product_final(struct apply_cascade *c, int n, int inlen, int down) {
+    int *node, net, k;
+    k = c->numhandles;
+    node = c->product->nodes + n * c->product->width;
+    if (*node != inlen)
+	return 0;
+    for (net = 0; net < k; net++) {
+	if (!BITTEST((*(c->handles+(down ? net : k-1-net)))->finals, *(node+1+net)))
+	    return 0;
+    }
+    return 1;
+}
+
+/* The walk obeys the tightest of the nets' limits */
+static void apply_product_limits(struct apply_cascade *c) {
+    struct apply_product *pr;
+    struct apply_limits *l;
+    int i;
+    pr = c->product;
+    pr->limit_steps = 0;
+    pr->limit_results = pr->limit_length = pr->limit_msec = 0;
+    for (i = 0; i < c->numhandles; i++) {
+	if ((l = (*(c->handles+i))->limits) == NULL)
+	    continue;
+	if (l->max_steps && (pr->limit_steps == 0 || l->max_steps < pr->limit_steps))
+	    pr->limit_steps = l->max_steps;
+	if (l->max_results && (pr->limit_results == 0 || l->max_results < pr->limit_results))
+	    pr->limit_results = l->max_results;
+	if (l->max_length && (pr->limit_length == 0 || l->max_length < pr->limit_length))
+	    pr->limit_length = l->max_length;
+	if (l->max_msec && (pr->limit_msec == 0 || l->max_msec < pr->limit_msec))
+	    pr->limit_msec = l->max_msec;
+    }
+    pr->steps = 0;
+    pr->stopped = 0;
+    pr->next_clock = APPLY_CLOCK_INTERVAL;
+    if (pr->limit_msec)
+	pr->deadline = apply_limit_clock() + pr->limit_msec / 1000.0;
+}
+
+/* Returns 1 if the walk has run into the step or time limit */
+static int apply_product_stop(struct apply_cascade *c) {
+    struct apply_product *pr;
+    pr = c->product;
+    if (pr->stopped)
+	return 1;
+    if (pr->limit_steps && pr->steps > pr->limit_steps) {
+	c->status = APPLY_LIMIT_STEPS;
+	pr->stopped = 1;
+    } else if (pr->limit_msec && pr->steps >= pr->next_clock) {
+	pr->next_clock = pr->steps + APPLY_CLOCK_INTERVAL;
+	if (apply_limit_clock() > pr->deadline) {
+	    c->status = APPLY_LIMIT_TIME;
+	    pr->stopped = 1;
+	}
+    }
+    return(pr->stopped);
+}
+
+/* Adds the values on the first depth entries of the path followed by */
+/* suffix to the results being collected, unless they're there already */
+static void apply_product_prefixed(struct apply_product *pr, int depth, int suffix) {
+    for ( ; depth > 0; depth--) {
+	suffix = apply_product_cons(pr, *(pr->path+depth-1), suffix);
+    }
+    if (*(pr->seen+suffix) != pr->stamp) {
+	*(pr->seen+suffix) = pr->stamp;
+	apply_product_result(pr, suffix);
+    }
+}
+
+/* Adds the suffixes of node m that end there or leave its component, */
+/* each after the path so far                                         */
+static void apply_product_exits(struct apply_cascade *c, int m, int depth, int inlen, int down) {
+    struct apply_product *pr;
+    int e, r, t, value, d;
+    pr = c->product;
+    if (apply_product_final(c, m, inlen, down))
+	apply_product_prefixed(pr, depth, 0);
+    if (depth == pr->path_size) {
+	pr->path_size *= 2;
+	pr->path = xxrealloc(pr->path, sizeof(int) * pr->path_size);
+    }
+    for (e = *(pr->edge_start+m); e < *(pr->edge_start+m) + *(pr->edge_count+m); e++) {
+	t = *(pr->edges+2*e);
+	value = *(pr->edges+2*e+1);
+	if (*(pr->status+t) != 2)
+	    continue;
+	d = depth;
+	if (value != PRODUCT_EPSILON)
+	    *(pr->path+d++) = value;
+	for (r = *(pr->result_start+t); r < *(pr->result_start+t) + *(pr->result_count+t); r++) {
+	    apply_product_prefixed(pr, d, *(pr->results+r));
+	}
+    }
+}
+
+/* Follows the paths from m that stay in the component being closed,  */
+/* visiting no node twice, so a cycle is followed once                */
+static void apply_product_follow(struct apply_cascade *c, int m, int depth, int inlen, int down) {
+    struct apply_product *pr;
+    int e, t, value, d;
+    pr = c->product;
+    *(pr->status+m) = 4;
+    apply_product_exits(c, m, depth, inlen, down);
+    for (e = *(pr->edge_start+m); e < *(pr->edge_start+m) + *(pr->edge_count+m); e++) {
+	t = *(pr->edges+2*e);
+	value = *(pr->edges+2*e+1);
+	if (*(pr->status+t) != 3)
+	    continue;
+	pr->steps++;
+	if (apply_product_stop(c))
+	    break;
+	d = depth;
+	if (value != PRODUCT_EPSILON)
+	    *(pr->path+d++) = value;
+	apply_product_follow(c, t, d, inlen, down);
+    }
+    *(pr->status+m) = 3;
+}
+
+/* Collects the output suffixes of the strongly connected component   */
+/* rooted at n once all the components it leads to are done.  All its */
+/* nodes are at the same input position.  If the moves within it add  */
+/* no output, every node gets the same suffixes; otherwise the paths  */
+/* through it are followed from each node.                            */
+static void apply_product_close(struct apply_cascade *c, int n, int inlen, int down) {
+    struct apply_product *pr;
+    int i, first, m, e, start, cycle_output;
+    pr = c->product;
+    for (first = pr->scc_used - 1; *(pr->scc+first) != n; first--) { }
+    for (i = first; i < pr->scc_used; i++) {
+	*(pr->status+*(pr->scc+i)) = 3;
+    }
+    cycle_output = 0;
+    for (i = first; i < pr->scc_used && !cycle_output; i++) {
+	m = *(pr->scc+i);
+	for (e = *(pr->edge_start+m); e < *(pr->edge_start+m) + *(pr->edge_count+m); e++) {
+	    if (*(pr->status+*(pr->edges+2*e)) == 3 && *(pr->edges+2*e+1) != PRODUCT_EPSILON) {
+		cycle_output = 1;
+		break;
+	    }
+	}
+    }
+    if (!cycle_output) {
+	pr->stamp++;
+	start = pr->results_used;
+	for (i = first; i < pr->scc_used; i++) {
+	    apply_product_exits(c, *(pr->scc+i), 0, inlen, down);
+	}
+	for (i = first; i < pr->scc_used; i++) {
+	    *(pr->result_start+*(pr->scc+i)) = start;
+	    *(pr->result_count+*(pr->scc+i)) = pr->results_used - start;
+	}
+    } else {
+	for (i = first; i < pr->scc_used; i++) {
+	    m = *(pr->scc+i);
+	    pr->stamp++;
+	    *(pr->result_start+m) = pr->results_used;
+	    apply_product_follow(c, m, 0, inlen, down);
+	    *(pr->result_count+m) = pr->results_used - *(pr->result_start+m);
+	}
+    }
+    for (i = first; i < pr->scc_used; i++) {
+	*(pr->status+*(pr->scc+i)) = 2;
+    }
+    pr->scc_used = first;
+}
+
+/* Marks node n visited and finds its edges */
+static void apply_product_open(struct apply_cascade *c, int n, int *tokens, int inlen, int down) {
+    struct apply_product *pr;
+    pr = c->product;
+    *(pr->status+n) = 1;
+    *(pr->order+n) = *(pr->low+n) = pr->numordered++;
+    *(pr->scc+pr->scc_used++) = n;
+    apply_product_expand(c, n, tokens, inlen, down);
+}
+
+/* Walks the product depth-first from the start node, closing its     */
+/* strongly connected components as they're found (Tarjan).  Returns  */
+/* 0 if it stopped at a limit before the start node's outputs are in. */
+static int apply_product_walk(struct apply_cascade *c, int *tokens, int inlen, int down) {
+    struct apply_product *pr;
+    int *node, net, k, n, t, sp, e;
+    pr = c->product;
+    k = c->numhandles;
+    apply_product_reset(pr);
+    apply_product_limits(c);
+    node = xxcalloc(pr->width, sizeof(int));
+    for (net = 0; net < k; net++) {
+	*(node+1+net) = (*(c->handles+(down ? net : k-1-net)))->shared->start_state;
+    }
+    n = apply_product_node(pr, node);
+    xxfree(node);
+    apply_product_open(c, n, tokens, inlen, down);
+    *(pr->stack) = n;
+    *(pr->stack+1) = 0;
+    for (sp = 0; sp >= 0; ) {
+	if (apply_product_stop(c))
+	    return 0;
+	n = *(pr->stack+2*sp);
+	e = *(pr->stack+2*sp+1);
+	if (e < *(pr->edge_count+n)) {
+	    *(pr->stack+2*sp+1) = e + 1;
+	    t = *(pr->edges+2*(*(pr->edge_start+n)+e));
+	    if (*(pr->status+t) == 1 && *(pr->order+t) < *(pr->low+n))
+		*(pr->low+n) = *(pr->order+t);
+	    if (*(pr->status+t) != 0)
+		continue;
+	    apply_product_open(c, t, tokens, inlen, down);
+	    sp++;
+	    if (sp == pr->stack_size) {
+		pr->stack_size *= 2;
+		pr->stack = xxrealloc(pr->stack, sizeof(int) * 2 * pr->stack_size);
+	    }
+	    *(pr->stack+2*sp) = t;
+	    *(pr->stack+2*sp+1) = 0;
+	} else {
+	    if (*(pr->low+n) == *(pr->order+n))
+		apply_product_close(c, n, inlen, down);
+	    sp--;
+	    if (sp >= 0 && *(pr->low+n) < *(pr->low+*(pr->stack+2*sp)))
+		*(pr->low+*(pr->stack+2*sp)) = *(pr->low+n);
+	}
+    }
+    return(!apply_product_stop(c));
+}
+
+/* Bytes printed for the first length symbols spelled */
+static int apply_product_spelled_length(struct apply_cascade *c, int length) {
+    struct apply_handle *last;
+    int i, bytes, spacelen;
+    last = *(c->handles+(c->product->down ? c->numhandles-1 : 0));
+    spacelen = last->print_space ? strlen(last->space_symbol) : 0;
+    for (i = 0, bytes = 0; i < length; i++) {
+	bytes += strlen(*(c->symbols+*(c->product->spell+i))) + spacelen;
+    }
+    return(bytes);
+}
+
+/* Adds the sequences a suffix spells to the current set, with every  */
+/* wildcard read as ? and as each net symbol it doesn't exclude       */
+static void apply_product_spell(struct apply_cascade *c, int suffix, int length) {
+    struct apply_product *pr;
+    int i, g, value;
+    pr = c->product;
+    for ( ; suffix != 0; suffix = *(pr->cons+2*suffix+1)) {
+	if (length == pr->spell_size) {
+	    pr->spell_size *= 2;
+	    pr->spell = xxrealloc(pr->spell, sizeof(int) * pr->spell_size);
+	}
+	value = *(pr->cons+2*suffix);
+	if (!PRODUCT_IS_WILD(value)) {
+	    *(pr->spell+length) = value;
+	    length++;
+	    continue;
+	}
+	*(pr->spell+length) = c->unknown_symbol;
+	apply_product_spell(c, *(pr->cons+2*suffix+1), length + 1);
+	for (i = 0; i < pr->numnetsymbols && !pr->stopped; i++) {
+	    g = *(pr->netsymbols+i);
+	    if (apply_product_outside(c, PRODUCT_MASK(value), g)) {
+		*(pr->spell+length) = g;
+		apply_product_spell(c, *(pr->cons+2*suffix+1), length + 1);
+	    }
+	}
+	return;
+    }
+    if (pr->limit_length && apply_product_spelled_length(c, length) > pr->limit_length) {
+	if (c->status == APPLY_OK)
+	    c->status = APPLY_LIMIT_LENGTH;
+	return;
+    }
+    apply_seqset_add(c->current, pr->spell, length);
+    /* One more than the limit shows that results were left out */
+    if (pr->limit_results && c->current->count > pr->limit_results) {
+	c->status = APPLY_LIMIT_RESULTS;
+	pr->stopped = 1;
+    }
+}
+
+static char *apply_cascade_updown(struct apply_cascade *c, char *word, int down) {
+    struct apply_seqset *tmp;
+    struct apply_handle *h;
+    char *symbol;
+    int i, j, n, inlen, stage, pos, length;
+
+    if (word == NULL) {
+	return(apply_cascade_next(c, *(c->handles+(down ? c->numhandles-1 : 0))));
+    }
+
+    /* Split the word with the first stage's alphabet */
+    h = *(c->handles+(down ? 0 : c->numhandles-1));
+    inlen = strlen(word);
+    if (inlen >= c->tokens_size) {
+	if (c->tokens != NULL) {
+	    xxfree(c->tokens);
+	    xxfree(c->token_lengths);
+	}
+	c->tokens_size = next_power_of_two(inlen);
+	c->tokens = xxmalloc(sizeof(int) * c->tokens_size);
+	c->token_lengths = xxmalloc(sizeof(int) * c->tokens_size);
+    }
+    n = apply_tokenize(h, word, c->tokens, c->token_lengths);
+    for (i = 0, pos = 0; i < n; pos += *(c->token_lengths+i), i++) {
+	if (*(c->tokens+i) == IDENTITY) {
+	    symbol = xxstrndup(word+pos, *(c->token_lengths+i));
+	    *(c->tokens+i) = apply_cascade_symbol(c, symbol);
+	    xxfree(symbol);
+	} else {
+	    *(c->tokens+i) = *(*(c->out_maps+(down ? 0 : c->numhandles-1))+*(c->tokens+i));
+	}
+    }
+    apply_seqset_clear(c->current);
+    c->result = 0;
+    c->status = APPLY_OK;
+    if (c->product != NULL) {
+	for (i = 0; i < c->numhandles; i++) {
+	    if ((*(c->handles+i))->last_net->finalcount == 0)
+		return(NULL);
+	}
+	c->product->down = down;
+	if (!apply_product_walk(c, c->tokens, n, down))
+	    return(NULL);
+	for (i = 0; i < *(c->product->result_count) && !c->product->stopped; i++) {
+	    apply_product_spell(c, *(c->product->results+*(c->product->result_start)+i), 0);
+	}
+	return(apply_cascade_next(c, *(c->handles+(down ? c->numhandles-1 : 0))));
+    }
+    apply_seqset_add(c->current, c->tokens, n);
+
+    for (j = 0; j < c->numhandles && c->current->count > 0; j++) {
+	stage = down ? j : c->numhandles-1-j;
+	h = *(c->handles+stage);
+	apply_seqset_clear(c->next);
+	for (i = 0; i < c->current->count; i++) {
+	    pos = *(c->current->start+i);
+	    length = *(c->current->start+i+1) - pos;
+	    if (down) {
+		apply_down_symbols_foreach(h, c->current->syms+pos, length, *(c->in_maps+stage), *(c->out_maps+stage), apply_cascade_visit, c);
+	    } else {
+		apply_up_symbols_foreach(h, c->current->syms+pos, length, *(c->in_maps+stage), *(c->out_maps+stage), apply_cascade_visit, c);
+	    }
+	    if (c->status == APPLY_OK) {
+		c->status = apply_get_status(h);
+	    }
+	}
+	tmp = c->current;
+	c->current = c->next;
+	c->next = tmp;
+    }
+    return(apply_cascade_next(c, *(c->handles+(down ? c->numhandles-1 : 0))));
+}
+
+char *apply_cascade_down(struct apply_cascade *c, char *word) {
+    return(apply_cascade_updown(c, word, 1));
+}
+
+char *apply_cascade_up(struct apply_cascade *c, char *word) {
+    return(apply_cascade_updown(c, word, 0));
+}
+
+int apply_cascade_get_status(struct apply_cascade *c) {
+    return(c->status);
+}
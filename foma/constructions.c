@@ -501,6 +501,14 @@ struct fsm *fsm_intersect(struct fsm *net1, struct fsm *net2) {
 }
 
 struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
+    extern int g_flag_is_epsilon;
+    return(fsm_compose_flags(net1, net2, g_flag_is_epsilon));
+}
+
+/* As fsm_compose(), but whether flag diacritics are treated as epsilons */
+/* is passed in rather than read from g_flag_is_epsilon                 */
+
+struct fsm *fsm_compose_flags(struct fsm *net1, struct fsm *net2, int flag_is_epsilon) {
 
     
     /* The composition algorithm is the basic naive composition where we lazily      */
@@ -543,7 +551,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
         struct outarray *tail;
     } *index;
 
-    extern int g_compose_tristate, g_flag_is_epsilon;
+    extern int g_compose_tristate;
     int a,b,i,mainloop,current_state, current_start, current_final, target_number, ain, bin, aout, bout, asearch, max2sigma;
     struct fsm_state *machine_a, *machine_b;
     struct state_arr *point_a, *point_b;
@@ -567,7 +575,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
     /* supposed to have the behavior of EPSILON                     */
     /* And we need to do this before merging the sigmas, of course  */
 
-    if (g_flag_is_epsilon) {
+    if (flag_is_epsilon) {
         struct sigma *sig1, *sig2;
         int flags1, flags2;
         flags1 = flags2 = 0;
@@ -602,7 +610,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
 
     fsm_merge_sigma(net1, net2);
 
-    if (g_flag_is_epsilon) {
+    if (flag_is_epsilon) {
         /* Create lookup table for quickly checking if a symbol is a flag */
         struct sigma *sig1;
         is_flag = xxmalloc(sizeof(_Bool)*(sigma_max(net1->sigma)+1));
@@ -739,11 +747,11 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
         /* Treat epsilon outputs on machine a (may include flags) */
         for (machine_a = (point_a+a)->transitions ; machine_a->state_no == a ; machine_a++) {            
             aout = machine_a->out;
-            if (aout != EPSILON && g_flag_is_epsilon == 0)
+            if (aout != EPSILON && flag_is_epsilon == 0)
                 continue;
             ain = machine_a->in;
 
-            if (g_flag_is_epsilon && aout != -1 && mode == 0 && *(is_flag+aout)) {
+            if (flag_is_epsilon && aout != -1 && mode == 0 && *(is_flag+aout)) {
                 if ((target_number = triplet_hash_find(th, machine_a->target, b, 0)) == -1) {
                     STACK_3_PUSH(0, b, machine_a->target);
 		    target_number = triplet_hash_insert(th, machine_a->target, b, 0);
@@ -781,12 +789,12 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
         /* Treat epsilon inputs on machine b (may include flags) */
         for (machine_b = (point_b+b)->transitions; machine_b->state_no == b ; machine_b++) {
             bin = machine_b->in;
-            if (bin != EPSILON && g_flag_is_epsilon == 0)
+            if (bin != EPSILON && flag_is_epsilon == 0)
                 continue;
 
             bout = machine_b->out;
             
-            if (g_flag_is_epsilon && bin != -1 && *(is_flag+bin)) {
+            if (flag_is_epsilon && bin != -1 && *(is_flag+bin)) {
                 if ((target_number = triplet_hash_find(th, a, machine_b->target, 1)) == -1) {
                     STACK_3_PUSH(1, machine_b->target,a);
                     target_number = triplet_hash_insert(th, a, machine_b->target, 1);
@@ -831,7 +839,7 @@ struct fsm *fsm_compose(struct fsm *net1, struct fsm *net2) {
     xxfree(index);
     xxfree(outarray);
 
-    if (g_flag_is_epsilon)
+    if (flag_is_epsilon)
         xxfree(is_flag);
     triplet_hash_free(th);
     net1 = fsm_topsort(fsm_coaccessible(net1));
@@ -21,6 +21,8 @@
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "foma.h"
 
 #define SUBSET_EPSILON_REMOVE 1
@@ -29,9 +31,17 @@
 
 #define NHASH_LOAD_LIMIT 2 /* load limit for nhash table size */
 
-static int fsm_linecount, num_states, num_symbols, epsilon_symbol, *single_sigma_array, *double_sigma_array, limit, num_start_states, op;
+#define SUBSET_PARALLEL_MIN_STATES 256 /* smaller nets are always done sequentially */
+#define SUBSET_STRIPES 64              /* independently locked parts of the shared hash */
+#define SUBSET_CHUNK_BITS 14
+#define SUBSET_CHUNK (1 << SUBSET_CHUNK_BITS)
+#define SUBSET_DIR_SIZE (1 << (31 - SUBSET_CHUNK_BITS))
+#define SUBSET_BLOCK 65536             /* ints per worker storage block */
+#define SUBSET_PROGRESS_INTERVAL 65536 /* states between progress reports */
 
-static _Bool *finals, deterministic, numss;
+static FOMA_TLS int fsm_linecount, num_states, num_symbols, epsilon_symbol, *single_sigma_array, *double_sigma_array, limit, num_start_states, op;
+
+static FOMA_TLS _Bool *finals, deterministic, numss;
 
 struct e_closure_memo {
     int state;
@@ -42,9 +52,13 @@ struct e_closure_memo {
 
 static unsigned int primes[26] = {61,127,251,509,1021,2039,4093,8191,16381,32749,65521,131071,262139,524287,1048573,2097143,4194301,8388593,16777213,33554393,67108859,134217689,268435399,536870909,1073741789,2147483647};
 
-static struct e_closure_memo *e_closure_memo;
+static FOMA_TLS struct e_closure_memo *e_closure_memo;
+
+static FOMA_TLS int T_last_unmarked, T_limit;
 
-int T_last_unmarked, T_limit;
+static FOMA_TLS int subset_aborted, progress_next, subset_max_states;
+static FOMA_TLS void (*subset_progress)(int subsets, size_t bytes, void *userdata);
+static FOMA_TLS void *subset_progress_data;
 
 struct nhash_list {
     int setnum;
@@ -62,19 +76,22 @@ struct T_memo {
 struct trans_list {
     int inout;
     int target;
-} *trans_list;
+};
 
 struct trans_array {
     struct trans_list *transitions;
     unsigned int size;
     unsigned int tail;
-} *trans_array;
+};
+
+static FOMA_TLS struct trans_list *trans_list;
+static FOMA_TLS struct trans_array *trans_array;
 
-static struct T_memo *T_ptr;
+static FOMA_TLS struct T_memo *T_ptr;
 
-static int nhash_tablesize, nhash_load, current_setnum, *e_table, *marktable, *temp_move, mainloop, maxsigma, *set_table, set_table_size, star_free_mark;
-static unsigned int set_table_offset;
-static struct nhash_list *table;
+static FOMA_TLS int nhash_tablesize, nhash_load, current_setnum, *e_table, *marktable, *temp_move, mainloop, maxsigma, *set_table, set_table_size, star_free_mark;
+static FOMA_TLS unsigned int set_table_offset;
+static FOMA_TLS struct nhash_list *table;
 
 extern int add_fsm_arc(struct fsm_state *fsm, int offset, int state_no, int in, int out, int target, int final_state, int start_state);
 
@@ -96,6 +113,11 @@ static void nhash_free(struct nhash_list *nptr, int size);
 static void e_closure_free();
 static void init_trans_array(struct fsm *net);
 static struct fsm *fsm_subset(struct fsm *net, int operation);
+static int subset_check(int subsets, size_t bytes);
+static size_t subset_memory();
+static void subset_abort(struct fsm *net);
+static int subset_numthreads(int operation);
+static int subset_parallel(int T, int numthreads);
 
 struct fsm *fsm_epsilon_remove(struct fsm *net) {
     return(fsm_subset(net, SUBSET_EPSILON_REMOVE));
@@ -161,7 +183,7 @@ int fsm_isstarfree(struct fsm *net) {
 
 static struct fsm *fsm_subset(struct fsm *net, int operation) {
 
-    int T, U;
+    int T, U, numthreads, aborted;
     
     if (net->is_deterministic == YES && operation != SUBSET_TEST_STAR_FREE) {
         return(net);
@@ -217,6 +239,12 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         xxfree(net->states);
     }
 
+    aborted = 0;
+    if ((numthreads = subset_numthreads(operation)) > 1) {
+        aborted = subset_parallel(T, numthreads);
+        goto wrapup;
+    }
+
     /* init */
 
     do {
@@ -224,6 +252,10 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         struct trans_list *transitions;
         struct trans_array *tptr;
 
+        if (subset_check(current_setnum + 1, subset_memory())) {
+            aborted = 1;
+            break;
+        }
         fsm_state_set_current_state(T, (T_ptr+T)->finalstart, T == 0 ? 1 : 0);
         
         /* Prepare set */
@@ -312,6 +344,7 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
         fsm_state_end_state();
     } while ((T = next_unmarked()) != -1);
     
+ wrapup:
     /* wrapup() */
     nhash_free(table, nhash_tablesize);
     xxfree(set_table);
@@ -327,9 +360,86 @@ static struct fsm *fsm_subset(struct fsm *net, int operation) {
     xxfree(single_sigma_array);
     xxfree(finals);
     fsm_state_close(net);
+    if (aborted)
+        subset_abort(net);
     return(net);
 }
 
+int fsm_subset_aborted() {
+    return(subset_aborted);
+}
+
+void fsm_subset_clear_aborted() {
+    subset_aborted = 0;
+}
+
+void fsm_set_subset_progress(void (*progress)(int subsets, size_t bytes, void *userdata), void *userdata) {
+    subset_progress = progress;
+    subset_progress_data = userdata;
+}
+
+void fsm_set_subset_max_states(int max_states) {
+    subset_max_states = max_states;
+}
+
+/* The tighter of g_subset_max_states and the thread's own bound */
+static int subset_state_bound() {
+    extern int g_subset_max_states;
+    if (subset_max_states > 0 && (g_subset_max_states <= 0 || subset_max_states < g_subset_max_states))
+        return(subset_max_states);
+    return(g_subset_max_states);
+}
+
+static int subset_over_limit(int max_states, int subsets, size_t bytes) {
+    extern int g_subset_max_mb;
+    if (max_states > 0 && subsets > max_states)
+        return 1;
+    if (g_subset_max_mb > 0 && bytes > (size_t) g_subset_max_mb * 1048576)
+        return 1;
+    return 0;
+}
+
+/* Reports progress and checks the limits, returning 1 when */
+/* the construction has to be given up                     */
+static int subset_check(int subsets, size_t bytes) {
+    if (subset_progress != NULL && subsets >= progress_next) {
+        subset_progress(subsets, bytes, subset_progress_data);
+        while (progress_next <= subsets)
+            progress_next += SUBSET_PROGRESS_INTERVAL;
+    }
+    return(subset_over_limit(subset_state_bound(), subsets, bytes));
+}
+
+/* The set table, the subset index and hash, the closure tables and */
+/* the new machine                                                  */
+static size_t subset_memory() {
+    return((set_table_size + 2 * num_states + 1) * sizeof(int) + T_limit * sizeof(struct T_memo) + (nhash_tablesize + current_setnum + 1) * sizeof(struct nhash_list) + fsm_state_memory());
+}
+
+/* Leave the empty language behind in place of the half-built machine */
+static void subset_abort(struct fsm *net) {
+    extern int g_subset_max_states, g_subset_max_mb;
+    int_stack_clear();
+    /* A caller that set its own bound reports running into it */
+    if (!subset_aborted && subset_max_states <= 0) {
+        if (g_subset_max_states > 0 && g_subset_max_mb > 0)
+            fprintf(stderr, "Determinization aborted: limit of %i states or %i MB exceeded.\n", g_subset_max_states, g_subset_max_mb);
+        else if (g_subset_max_states > 0)
+            fprintf(stderr, "Determinization aborted: limit of %i states exceeded.\n", g_subset_max_states);
+        else
+            fprintf(stderr, "Determinization aborted: limit of %i MB exceeded.\n", g_subset_max_mb);
+    }
+    subset_aborted = 1;
+    xxfree(net->states);
+    net->states = fsm_empty();
+    fsm_update_flags(net,YES,YES,YES,YES,YES,NO);
+    net->statecount = 1;
+    net->finalcount = 0;
+    net->arccount = 0;
+    net->linecount = 2;
+    net->pathcount = 0;
+}
+
 static void init(struct fsm *net) {
     /* A temporary table for handling epsilon closure */
     /* to avoid doubles */
@@ -360,6 +470,7 @@ static void init(struct fsm *net) {
     /* states in the non-deterministic fsm */
     
     T_last_unmarked = 0;
+    progress_next = SUBSET_PROGRESS_INTERVAL;
     T_limit = next_power_of_two(num_states);
 
     T_ptr = xxcalloc(T_limit,sizeof(struct T_memo));
@@ -879,3 +990,556 @@ static void nhash_free(struct nhash_list *nptr, int size) {
     }
     xxfree(nptr);
 }
+
+/* Parallel subset construction                                       */
+/* With g_subset_threads set to more than one, the unmarked subsets   */
+/* of a large net are shared out among worker threads.  Each worker   */
+/* keeps its own queue of the subsets it has discovered and steals    */
+/* from the head of the others' queues when it runs dry.  Subsets are */
+/* found through a hash table split into separately locked stripes;   */
+/* as in nhash_find_insert(), a set is compared against the e_table   */
+/* marks of the thread looking it up.  Subset numbers are handed out  */
+/* in whatever order the threads get to them, so the result is        */
+/* renumbered afterwards by replaying the stack order of the          */
+/* sequential loop over the finished transitions: the determinized    */
+/* net is identical to the one built by a single thread.              */
+
+struct subset_pstate {
+    int *set;               /* Member states */
+    int size;
+    unsigned int hash;
+    int hnext;              /* Next subset in the same hash bucket */
+    unsigned char finalstart;
+    int *arcs;              /* inout, target pairs */
+    int numarcs;
+};
+
+struct subset_stripe {
+    pthread_mutex_t lock;
+    int *buckets;
+    unsigned int size;
+    unsigned int load;
+};
+
+struct subset_queue {
+    pthread_mutex_t lock;
+    int *items;
+    int head;
+    int tail;
+    int size;
+};
+
+struct subset_job {
+    int epsilon_symbol;
+    _Bool *finals;
+    struct trans_array *trans_array;
+    struct e_closure_memo *e_closure_memo;
+    struct subset_pstate **dir;
+    pthread_mutex_t dir_lock;
+    struct subset_stripe stripes[SUBSET_STRIPES];
+    struct subset_queue *queues;
+    int numthreads;
+    volatile int numsets;
+    volatile int pending;   /* Subsets created but not yet finished */
+    volatile int queued;    /* Subsets waiting in some queue */
+    volatile int sleeping;
+    int max_states;
+    void (*progress)(int subsets, size_t bytes, void *userdata);  /* The calling thread's */
+    void *progress_data;
+    volatile int stop;      /* Set when a limit is exceeded */
+    volatile size_t bytes;
+    pthread_mutex_t progress_lock;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+struct subset_worker {
+    struct subset_job *job;
+    int id;
+    pthread_t thread;
+    int *e_table;
+    int *visited;
+    int *temp_move;
+    int *tail;
+    int *stack;
+    int stack_size;
+    int *arcs;
+    int arcs_size;
+    int stamp;
+    int *pool;              /* Storage for sets and finished arcs */
+    int pool_used;
+    int pool_size;
+    int **blocks;
+    int numblocks;
+    int blocks_size;
+};
+
+static int subset_numthreads(int operation) {
+    extern int g_subset_threads;
+    int numthreads;
+    if (operation != SUBSET_DETERMINIZE || num_states < SUBSET_PARALLEL_MIN_STATES)
+        return 1;
+    numthreads = g_subset_threads;
+    if (numthreads <= 0)
+        numthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return(numthreads <= 0 ? 1 : numthreads);
+}
+
+static inline struct subset_pstate *subset_pstate(struct subset_job *job, int setnum) {
+    return(*(job->dir+(setnum >> SUBSET_CHUNK_BITS)) + (setnum & (SUBSET_CHUNK-1)));
+}
+
+static int *subset_alloc(struct subset_worker *wk, int n) {
+    int *ptr;
+    if (wk->pool_used + n > wk->pool_size) {
+        if (wk->numblocks == wk->blocks_size) {
+            __sync_fetch_and_add(&wk->job->bytes, wk->blocks_size * sizeof(int *));
+            wk->blocks_size *= 2;
+            wk->blocks = xxrealloc(wk->blocks, wk->blocks_size * sizeof(int *));
+        }
+        wk->pool_size = n > SUBSET_BLOCK ? n : SUBSET_BLOCK;
+        wk->pool = xxmalloc(wk->pool_size * sizeof(int));
+        *(wk->blocks+wk->numblocks) = wk->pool;
+        wk->numblocks++;
+        wk->pool_used = 0;
+        __sync_fetch_and_add(&wk->job->bytes, wk->pool_size * sizeof(int));
+    }
+    ptr = wk->pool + wk->pool_used;
+    wk->pool_used += n;
+    return(ptr);
+}
+
+/* Order-independent, like hashf() */
+static unsigned int subset_hashf(int *set, int setsize) {
+    int i;
+    unsigned int hashval, x;
+    for (i = 0, hashval = 0; i < setsize; i++) {
+        x = (unsigned int) *(set+i) * 2654435761U;
+        hashval += x ^ (x >> 15);
+    }
+    return(hashval ^ (unsigned int) setsize * 16777619U);
+}
+
+static void subset_push(struct subset_job *job, int id, int setnum) {
+    struct subset_queue *q;
+    q = job->queues+id;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->size) {
+        __sync_fetch_and_add(&job->bytes, q->size * sizeof(int));
+        q->size *= 2;
+        q->items = xxrealloc(q->items, q->size * sizeof(int));
+    }
+    *(q->items+q->tail) = setnum;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+    __sync_fetch_and_add(&job->queued, 1);
+    if (__sync_fetch_and_add(&job->sleeping, 0)) {
+        pthread_mutex_lock(&job->idle_lock);
+        pthread_cond_broadcast(&job->idle_cond);
+        pthread_mutex_unlock(&job->idle_lock);
+    }
+}
+
+/* Take from the tail of our own queue, or from the head of another's */
+static int subset_pop(struct subset_job *job, int id) {
+    struct subset_queue *q;
+    int i, setnum;
+    for (i = 0; i < job->numthreads; i++) {
+        q = job->queues + (id + i) % job->numthreads;
+        pthread_mutex_lock(&q->lock);
+        if (q->head == q->tail) {
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
+        if (i == 0) {
+            q->tail--;
+            setnum = *(q->items+q->tail);
+        } else {
+            setnum = *(q->items+q->head);
+            q->head++;
+        }
+        if (q->head == q->tail)
+            q->head = q->tail = 0;
+        pthread_mutex_unlock(&q->lock);
+        __sync_fetch_and_sub(&job->queued, 1);
+        return(setnum);
+    }
+    return -1;
+}
+
+static void subset_stripe_rebuild(struct subset_job *job, struct subset_stripe *st) {
+    int i, setnum, next, *oldbuckets;
+    unsigned int oldsize, b;
+    struct subset_pstate *ps;
+
+    oldbuckets = st->buckets;
+    oldsize = st->size;
+    for (i=0; primes[i] <= oldsize; i++) { }
+    st->size = primes[i];
+    st->buckets = xxmalloc(st->size * sizeof(int));
+    __sync_fetch_and_add(&job->bytes, (st->size - oldsize) * sizeof(int));
+    for (b = 0; b < st->size; b++)
+        *(st->buckets+b) = -1;
+    for (b = 0; b < oldsize; b++) {
+        for (setnum = *(oldbuckets+b); setnum != -1; setnum = next) {
+            ps = subset_pstate(job, setnum);
+            next = ps->hnext;
+            ps->hnext = *(st->buckets + (ps->hash / SUBSET_STRIPES) % st->size);
+            *(st->buckets + (ps->hash / SUBSET_STRIPES) % st->size) = setnum;
+        }
+    }
+    xxfree(oldbuckets);
+}
+
+/* Look up a set whose members are marked in wk's e_table, */
+/* adding it to wk's queue if it is new                    */
+static int subset_find_insert(struct subset_worker *wk, int *set, int setsize) {
+    struct subset_job *job;
+    struct subset_stripe *st;
+    struct subset_pstate *ps;
+    unsigned int hashval, b;
+    int i, setnum, chunk, fs;
+    size_t bytes;
+
+    job = wk->job;
+    hashval = subset_hashf(set, setsize);
+    st = job->stripes + hashval % SUBSET_STRIPES;
+    pthread_mutex_lock(&st->lock);
+    b = (hashval / SUBSET_STRIPES) % st->size;
+    for (setnum = *(st->buckets+b); setnum != -1; setnum = ps->hnext) {
+        ps = subset_pstate(job, setnum);
+        if (ps->hash != hashval || ps->size != setsize)
+            continue;
+        for (i = 0; i < setsize; i++) {
+            if (*(wk->e_table+*(ps->set+i)) != wk->stamp)
+                break;
+        }
+        if (i == setsize) {
+            pthread_mutex_unlock(&st->lock);
+            return(setnum);
+        }
+    }
+    setnum = __sync_fetch_and_add(&job->numsets, 1);
+    chunk = setnum >> SUBSET_CHUNK_BITS;
+    pthread_mutex_lock(&job->dir_lock);
+    if (*(job->dir+chunk) == NULL) {
+        *(job->dir+chunk) = xxcalloc(SUBSET_CHUNK, sizeof(struct subset_pstate));
+        __sync_fetch_and_add(&job->bytes, SUBSET_CHUNK * sizeof(struct subset_pstate));
+    }
+    pthread_mutex_unlock(&job->dir_lock);
+    ps = subset_pstate(job, setnum);
+    ps->set = subset_alloc(wk, setsize);
+    memcpy(ps->set, set, setsize * sizeof(int));
+    ps->size = setsize;
+    ps->hash = hashval;
+    for (i = 0, fs = 0; i < setsize; i++) {
+        if (*(job->finals+*(set+i)))
+            fs = 1;
+    }
+    ps->finalstart = fs;
+    ps->hnext = *(st->buckets+b);
+    *(st->buckets+b) = setnum;
+    st->load++;
+    if (st->load / NHASH_LOAD_LIMIT > st->size)
+        subset_stripe_rebuild(job, st);
+    pthread_mutex_unlock(&st->lock);
+
+    bytes = __sync_fetch_and_add(&job->bytes, 0);
+    if (job->progress != NULL && (setnum + 1) % SUBSET_PROGRESS_INTERVAL == 0) {
+        pthread_mutex_lock(&job->progress_lock);
+        job->progress(setnum + 1, bytes, job->progress_data);
+        pthread_mutex_unlock(&job->progress_lock);
+    }
+    if (subset_over_limit(job->max_states, setnum + 1, bytes))
+        __sync_fetch_and_or(&job->stop, 1);
+
+    __sync_fetch_and_add(&job->pending, 1);
+    subset_push(job, wk->id, setnum);
+    return(setnum);
+}
+
+/* Extend the first states entries of temp_move (all stamped in */
+/* e_table) with their epsilon closure and look up the result   */
+static int subset_closure(struct subset_worker *wk, int states) {
+    struct subset_job *job;
+    struct e_closure_memo *ptr;
+    int i, s, sp, set_size, stamp;
+
+    if (states == 0)
+        return -1;
+    job = wk->job;
+    stamp = wk->stamp;
+    set_size = states;
+    if (job->epsilon_symbol != -1) {
+        for (i = 0; i < states; i++) {
+            if ((job->e_closure_memo + *(wk->temp_move+i))->target == NULL)
+                continue;
+            sp = 0;
+            *(wk->stack+sp++) = *(wk->temp_move+i);
+            while (sp > 0) {
+                s = *(wk->stack + --sp);
+                if (*(wk->visited+s) == stamp)
+                    continue;
+                *(wk->visited+s) = stamp;
+                if (*(wk->e_table+s) != stamp) {
+                    *(wk->e_table+s) = stamp;
+                    *(wk->temp_move+set_size) = s;
+                    set_size++;
+                }
+                for (ptr = job->e_closure_memo+s; ptr != NULL && ptr->target != NULL; ptr = ptr->next) {
+                    if (*(wk->visited+ptr->target->state) == stamp)
+                        continue;
+                    if (sp == wk->stack_size) {
+                        __sync_fetch_and_add(&job->bytes, wk->stack_size * sizeof(int));
+                        wk->stack_size *= 2;
+                        wk->stack = xxrealloc(wk->stack, wk->stack_size * sizeof(int));
+                    }
+                    *(wk->stack+sp++) = ptr->target->state;
+                }
+            }
+        }
+    }
+    return(subset_find_insert(wk, wk->temp_move, set_size));
+}
+
+static void subset_add_arc(struct subset_worker *wk, int *numarcs, int inout, int target) {
+    if (*numarcs * 2 + 2 > wk->arcs_size) {
+        __sync_fetch_and_add(&wk->job->bytes, wk->arcs_size * sizeof(int));
+        wk->arcs_size *= 2;
+        wk->arcs = xxrealloc(wk->arcs, wk->arcs_size * sizeof(int));
+    }
+    *(wk->arcs + *numarcs * 2) = inout;
+    *(wk->arcs + *numarcs * 2 + 1) = target;
+    (*numarcs)++;
+}
+
+/* The main loop of fsm_subset() for one subset, determinizing only */
+static void subset_expand(struct subset_worker *wk, int T) {
+    struct subset_job *job;
+    struct subset_pstate *ps;
+    struct trans_array *tptr;
+    struct trans_list *transitions;
+    int i, j, tail, setsize, *theset, minsym, next_minsym, trgt, U, numarcs;
+
+    job = wk->job;
+    ps = subset_pstate(job, T);
+    setsize = ps->size;
+    theset = ps->set;
+    numarcs = 0;
+    minsym = INT_MAX;
+    for (i = 0; i < setsize; i++) {
+        tptr = job->trans_array + *(theset+i);
+        *(wk->tail+i) = 0;
+        if (tptr->size > 0 && (tptr->transitions)->inout < minsym)
+            minsym = (tptr->transitions)->inout;
+    }
+
+    for (next_minsym = INT_MAX; minsym != INT_MAX ; minsym = next_minsym, next_minsym = INT_MAX) {
+        wk->stamp++;
+        for (i = 0, j = 0 ; i < setsize; i++) {
+            tptr = job->trans_array + *(theset+i);
+            tail = *(wk->tail+i);
+            transitions = (tptr->transitions)+tail;
+            while (tail < tptr->size && transitions->inout == minsym) {
+                trgt = transitions->target;
+                if (*(wk->e_table+trgt) != wk->stamp) {
+                    *(wk->e_table+trgt) = wk->stamp;
+                    *(wk->temp_move+j) = trgt;
+                    j++;
+                }
+                tail++;
+                transitions++;
+            }
+            *(wk->tail+i) = tail;
+            if (tail < tptr->size && transitions->inout < next_minsym)
+                next_minsym = transitions->inout;
+        }
+        if ((U = subset_closure(wk, j)) != -1)
+            subset_add_arc(wk, &numarcs, minsym, U);
+    }
+    if (numarcs > 0) {
+        ps->arcs = subset_alloc(wk, numarcs * 2);
+        memcpy(ps->arcs, wk->arcs, numarcs * 2 * sizeof(int));
+    }
+    ps->numarcs = numarcs;
+}
+
+static void *subset_work(void *arg) {
+    struct subset_worker *wk;
+    struct subset_job *job;
+    struct timespec ts;
+    int T;
+
+    wk = arg;
+    job = wk->job;
+    for (;;) {
+        if (__sync_fetch_and_add(&job->stop, 0))
+            break;
+        if ((T = subset_pop(job, wk->id)) != -1) {
+            subset_expand(wk, T);
+            if (__sync_sub_and_fetch(&job->pending, 1) == 0) {
+                pthread_mutex_lock(&job->idle_lock);
+                pthread_cond_broadcast(&job->idle_cond);
+                pthread_mutex_unlock(&job->idle_lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&job->idle_lock);
+        if (__sync_fetch_and_add(&job->pending, 0) == 0) {
+            pthread_mutex_unlock(&job->idle_lock);
+            break;
+        }
+        if (__sync_fetch_and_add(&job->queued, 0) == 0) {
+            /* A push may slip in between the check and the wait */
+            /* so the wait is bounded                             */
+            __sync_fetch_and_add(&job->sleeping, 1);
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&job->idle_cond, &job->idle_lock, &ts);
+            __sync_fetch_and_sub(&job->sleeping, 1);
+        }
+        pthread_mutex_unlock(&job->idle_lock);
+    }
+    return(NULL);
+}
+
+/* Emit the states in the order fsm_subset() would have numbered them */
+static void subset_replay(struct subset_job *job) {
+    struct subset_pstate *ps;
+    int i, T, newT, nextnum, U, symbol_in, symbol_out, *newnum;
+
+    newnum = xxmalloc(job->numsets * sizeof(int));
+    for (i = 0; i < job->numsets; i++)
+        *(newnum+i) = -1;
+    *newnum = 0;
+    nextnum = 1;
+    int_stack_clear();
+    T = 0;
+    for (;;) {
+        ps = subset_pstate(job, T);
+        newT = *(newnum+T);
+        fsm_state_set_current_state(newT, ps->finalstart, newT == 0 ? 1 : 0);
+        for (i = 0; i < ps->numarcs; i++) {
+            U = *(ps->arcs+i*2+1);
+            if (*(newnum+U) == -1) {
+                *(newnum+U) = nextnum++;
+                int_stack_push(U);
+            }
+            single_symbol_to_symbol_pair(*(ps->arcs+i*2), &symbol_in, &symbol_out);
+            fsm_state_add_arc(newT, symbol_in, symbol_out, *(newnum+U), ps->finalstart, newT == 0 ? 1 : 0);
+        }
+        fsm_state_end_state();
+        if (int_stack_isempty())
+            break;
+        T = int_stack_pop();
+    }
+    xxfree(newnum);
+}
+
+/* Returns 1 if a limit was exceeded, in which case nothing is built */
+static int subset_parallel(int T, int numthreads) {
+    struct subset_job job;
+    struct subset_worker *workers, *wk;
+    int i, j, setsize;
+
+    memset(&job, 0, sizeof(struct subset_job));
+    job.epsilon_symbol = epsilon_symbol;
+    job.finals = finals;
+    job.trans_array = trans_array;
+    job.e_closure_memo = e_closure_memo;
+    job.numthreads = numthreads;
+    job.max_states = subset_state_bound();
+    job.progress = subset_progress;
+    job.progress_data = subset_progress_data;
+    job.dir = xxcalloc(SUBSET_DIR_SIZE, sizeof(struct subset_pstate *));
+    pthread_mutex_init(&job.dir_lock, NULL);
+    pthread_mutex_init(&job.progress_lock, NULL);
+    pthread_mutex_init(&job.idle_lock, NULL);
+    pthread_cond_init(&job.idle_cond, NULL);
+    for (i = 0; i < SUBSET_STRIPES; i++) {
+        pthread_mutex_init(&(job.stripes+i)->lock, NULL);
+        (job.stripes+i)->size = primes[0];
+        (job.stripes+i)->buckets = xxmalloc(primes[0] * sizeof(int));
+        for (j = 0; j < primes[0]; j++)
+            *((job.stripes+i)->buckets+j) = -1;
+    }
+    job.queues = xxcalloc(numthreads, sizeof(struct subset_queue));
+    workers = xxcalloc(numthreads, sizeof(struct subset_worker));
+    for (i = 0; i < numthreads; i++) {
+        pthread_mutex_init(&(job.queues+i)->lock, NULL);
+        (job.queues+i)->size = 256;
+        (job.queues+i)->items = xxmalloc(256 * sizeof(int));
+        wk = workers+i;
+        wk->job = &job;
+        wk->id = i;
+        wk->e_table = xxcalloc(num_states, sizeof(int));
+        wk->visited = xxcalloc(num_states, sizeof(int));
+        wk->temp_move = xxmalloc((num_states + 1) * sizeof(int));
+        wk->tail = xxmalloc((num_states + 1) * sizeof(int));
+        wk->stack_size = 256;
+        wk->stack = xxmalloc(wk->stack_size * sizeof(int));
+        wk->arcs_size = 256;
+        wk->arcs = xxmalloc(wk->arcs_size * sizeof(int));
+        wk->blocks_size = 16;
+        wk->blocks = xxmalloc(wk->blocks_size * sizeof(int *));
+    }
+    /* The limit covers the workers' tables, queues and the hash */
+    /* stripes as well as the subsets; growth is counted as it   */
+    /* happens                                                   */
+    job.bytes = SUBSET_DIR_SIZE * sizeof(struct subset_pstate *) + SUBSET_STRIPES * primes[0] * sizeof(int) + numthreads * (sizeof(struct subset_queue) + sizeof(struct subset_worker) + 256 * sizeof(int));
+    for (i = 0; i < numthreads; i++) {
+        wk = workers+i;
+        job.bytes += (2 * num_states + 2 * (num_states + 1) + wk->stack_size + wk->arcs_size) * sizeof(int) + wk->blocks_size * sizeof(int *);
+    }
+
+    /* The initial set becomes subset 0 */
+    wk = workers;
+    wk->stamp++;
+    setsize = (T_ptr+T)->size;
+    for (i = 0; i < setsize; i++) {
+        *(wk->temp_move+i) = *(set_table+(T_ptr+T)->set_offset+i);
+        *(wk->e_table+*(wk->temp_move+i)) = wk->stamp;
+    }
+    subset_find_insert(wk, wk->temp_move, setsize);
+
+    for (i = 0; i < numthreads; i++)
+        pthread_create(&(workers+i)->thread, NULL, subset_work, workers+i);
+    for (i = 0; i < numthreads; i++)
+        pthread_join((workers+i)->thread, NULL);
+
+    if (!job.stop)
+        subset_replay(&job);
+
+    for (i = 0; i < SUBSET_DIR_SIZE && *(job.dir+i) != NULL; i++)
+        xxfree(*(job.dir+i));
+    xxfree(job.dir);
+    for (i = 0; i < SUBSET_STRIPES; i++) {
+        pthread_mutex_destroy(&(job.stripes+i)->lock);
+        xxfree((job.stripes+i)->buckets);
+    }
+    for (i = 0; i < numthreads; i++) {
+        wk = workers+i;
+        pthread_mutex_destroy(&(job.queues+i)->lock);
+        xxfree((job.queues+i)->items);
+        xxfree(wk->e_table);
+        xxfree(wk->visited);
+        xxfree(wk->temp_move);
+        xxfree(wk->tail);
+        xxfree(wk->stack);
+        xxfree(wk->arcs);
+        for (j = 0; j < wk->numblocks; j++)
+            xxfree(*(wk->blocks+j));
+        xxfree(wk->blocks);
+    }
+    xxfree(job.queues);
+    xxfree(workers);
+    pthread_mutex_destroy(&job.dir_lock);
+    pthread_mutex_destroy(&job.progress_lock);
+    pthread_mutex_destroy(&job.idle_lock);
+    pthread_cond_destroy(&job.idle_cond);
+    return(job.stop != 0);
+}
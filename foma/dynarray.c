@@ -34,19 +34,19 @@ struct foma_reserved_symbols {
     {NULL,0,NULL}
 };
 
-static size_t current_fsm_size;
-static unsigned int current_fsm_linecount, current_state_no, current_final, current_start, current_trans, num_finals, num_initials, arity, statecount;
-static _Bool is_deterministic, is_epsilon_free;
-static struct fsm_state *current_fsm_head;
+static FOMA_TLS size_t current_fsm_size;
+static FOMA_TLS unsigned int current_fsm_linecount, current_state_no, current_final, current_start, current_trans, num_finals, num_initials, arity, statecount;
+static FOMA_TLS _Bool is_deterministic, is_epsilon_free;
+static FOMA_TLS struct fsm_state *current_fsm_head;
 
-static unsigned int mainloop, ssize, arccount;
+static FOMA_TLS unsigned int mainloop, ssize, arccount;
 
 struct sigma_lookup {
     int target;
     unsigned int mainloop;
 };
 
-static struct sigma_lookup *slookup;
+static FOMA_TLS struct sigma_lookup *slookup;
 
 /* Functions for directly building a fsm_state structure */
 /* dynamically. */
@@ -145,6 +145,10 @@ void fsm_state_add_arc(int state_no, int in, int out, int target, int final_stat
     current_fsm_linecount++;
 }
 
+size_t fsm_state_memory() {
+    return(current_fsm_size * sizeof(struct fsm_state));
+}
+
 void fsm_state_close(struct fsm *net) {
     fsm_state_add_arc(-1,-1,-1,-1,-1,-1);
     current_fsm_head = xxrealloc(current_fsm_head, current_fsm_linecount * sizeof(struct fsm_state));
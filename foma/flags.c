@@ -26,6 +26,7 @@
 #define NONE    3
 
 static struct flags *flag_extract (struct fsm *net);
+static void flag_extract_free(struct flags *flags);
 static char *flag_type_to_char (int type);
 static int flag_build(int ftype, char *fname, char *fvalue, int fftype, char *ffname, char *ffvalue);
 static void flag_purge (struct fsm *net, char *name);
@@ -79,6 +80,7 @@ struct fsm *flag_eliminate(struct fsm *net, char *name) {
         }
         if (found == 0) {
             printf("Flag attribute '%s' does not occur in the network.\n",name);
+            flag_extract_free(flags);
             return(net);
         }
     }
@@ -87,6 +89,7 @@ struct fsm *flag_eliminate(struct fsm *net, char *name) {
 
     for (f = flags; f != NULL; f = f->next) {
 
+        self = NULL;
         if ((name == NULL || strcmp(f->name,name) == 0) &&
             (f->type | FLAG_UNIFY | FLAG_REQUIRE | FLAG_DISALLOW | FLAG_EQUAL)) {
             
@@ -116,27 +119,28 @@ struct fsm *flag_eliminate(struct fsm *net, char *name) {
             }
 
             filter = (filter == NULL) ? newfilter : fsm_intersect(filter, newfilter);
+        } else if (self != NULL) {
+            fsm_destroy(self);
+            fsm_destroy(succeed_flags);
+            fsm_destroy(fail_flags);
         }
         flag = 0;
     }
     if (filter != NULL) {
-        extern int g_flag_is_epsilon;
-        int old_g_flag_is_epsilon;
-        old_g_flag_is_epsilon = g_flag_is_epsilon;
-        g_flag_is_epsilon = 0;
-        newnet = fsm_compose(fsm_copy(filter),fsm_compose(net,fsm_copy(filter)));
-        g_flag_is_epsilon = old_g_flag_is_epsilon;
+        newnet = fsm_compose_flags(fsm_copy(filter),fsm_compose_flags(net,fsm_copy(filter),0),0);
+        fsm_destroy(filter);
     } else {
         newnet = net;
     }
     flag_purge(newnet, name);
     newnet = fsm_minimize(newnet);
     sigma_cleanup(newnet,0);
-    xxfree(flags);
+    flag_extract_free(flags);
     return(fsm_topsort(newnet));
 }
 
 struct fsm *flag_create_symbol(int type, char *name, char *value) {
+    struct fsm *net;
     char *string;
     if (value == NULL)
         value = "";
@@ -152,8 +156,9 @@ struct fsm *flag_create_symbol(int type, char *name, char *value) {
         strcat(string, value);
     }
     strcat(string, "@");
-
-    return(fsm_symbol(string));
+    net = fsm_symbol(string);
+    xxfree(string);
+    return(net);
 
 }
 
@@ -324,6 +329,16 @@ struct flags *flag_extract (struct fsm *net) {
     return(flags);
 }
 
+void flag_extract_free(struct flags *flags) {
+    struct flags *next;
+    for ( ; flags != NULL; flags = next) {
+        next = flags->next;
+        xxfree(flags->name);
+        xxfree(flags->value);
+        xxfree(flags);
+    }
+}
+
 int flag_check(char *s) {
     
     /* We simply simulate this regex (where ND is not dot) */
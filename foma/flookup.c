@@ -30,7 +30,7 @@
 #define UDP_MAX 65535
 #define FLOOKUP_PORT 6062
 
-static char *usagestring = "Usage: flookup [-h] [-a] [-i] [-s \"separator\"] [-w \"wordseparator\"] [-v] [-x] [-b] [-I <#|#k|#m|f>] [-S] [-P] [-A] <binary foma file>\n";
+static char *usagestring = "Usage: flookup [-h] [-a] [-i] [-s \"separator\"] [-w \"wordseparator\"] [-v] [-x] [-b] [-I <#|#k|#m|f|c>] [-c MB] [-d <MB|l>] [-l limits] [-m] [-o] [-S] [-P] [-A] <binary foma file>\n";
 
 static char *helpstring = 
 "Applies words from stdin to a foma transducer/automaton read from a file and prints results to stdout.\n"
@@ -40,13 +40,25 @@ static char *helpstring =
 "-h\t\tprint help\n"
 "-a\t\ttry alternatives (in order of nets loaded, default is to pass words through each)\n"
 "-b\t\tunbuffered output (flushes output after each input word, for use in bidirectional piping)\n"
+"-c MB\t\tcache the results of frequent inputs in up to MB megabytes per net (default is no cache)\n"
+"\t\t(not used when -m or -o passes words through several nets)\n"
+"-d MB\t\tprune searches with input-side subsets of states cached in up to MB megabytes per net\n"
+"\t\t(speeds up nets that are far from deterministic on the input side)\n"
+"-d l\t\tprune searches with the lattice of each word instead, keeping nothing between words\n"
 "-i\t\tinverse application (apply down instead of up)\n"
-"-I indextype\tindex arcs with indextype (one of -I f -I #k -I #m or -I #)\n"
+"-I indextype\tindex arcs with indextype (one of -I f -I #k -I #m -I # or -I c)\n"
 "\t\t(usually slower than the default except for states > 1,000 arcs)\n"
 "\t\t  -I # will index all states containing # arcs or more\n"
 "\t\t  -I NUMk will index states from densest to sparsest until reaching mem limit of # kB\n"
 "\t\t  -I NUMM will index states from densest to sparsest until reaching mem limit of # MB\n"
 "\t\t  -I f will index flag-containing states only\n"
+"\t\t  -I c will use a compact index (sorted symbols per state), may be combined with the above\n"
+"-l limits\tstop looking up a word after steps,results,length,ms (0 is no limit),\n"
+"\t\t  e.g. -l 100000,50,0,20, and print +! after its results\n"
+"-m\t\twhen passing words through several nets, pass them on as symbols and print each distinct output once\n"
+"\t\t(a multicharacter symbol unknown to a later net stays one symbol)\n"
+"-o\t\twhen passing words through several nets, walk their composition instead of each net in turn\n"
+"\t\t(gives the outputs of the composed net, implies -m; not used with nets that obey flags)\n"
 "-q\t\tdon't sort arcs before applying (usually slower, except for really small, sparse automata)\n"
 "-S\t\trun flookup as UDP server (default addr INADDR_ANY port 6062)\n"
 "-A\t\t  specify address of server\n"
@@ -71,14 +83,19 @@ static int                listen_sd, numbytes;
 static socklen_t          addrlen;
 
 static char buffer[2048];
-static int  echo = 1, apply_alternates = 0, numnets = 0, direction = DIR_UP, results, buffered_output = 1, index_arcs = 0, index_flag_states = 0, index_cutoff = 0, index_mem_limit = INT_MAX, mode_server = 0, port_number = FLOOKUP_PORT, udpsize;
+static int  echo = 1, apply_alternates = 0, numnets = 0, direction = DIR_UP, results, buffered_output = 1, index_arcs = 0, index_flag_states = 0, index_cutoff = 0, index_mem_limit = INT_MAX, cache_mb = 0, subset_mb = 0, compose_nets = 0, symbol_cascade = 0, limit_results = 0, limit_length = 0, limit_msec = 0, limited = 0, mode_server = 0, port_number = FLOOKUP_PORT, udpsize;
 static char *separator = "\t", *wordseparator = "\n", *server_address = NULL, *line, *serverstring = NULL;
 static FILE *INFILE;
 static struct lookup_chain *chain_head, *chain_tail, *chain_new, *chain_pos;
+static struct apply_cascade *cascade = NULL;
+static long limit_steps = 0;
 static fsm_read_binary_handle fsrh;
 
 static char *(*applyer)() = &apply_up;  /* Default apply direction = up */
+static char *(*cascade_applyer)() = &apply_cascade_up;
+static void (*indexer)() = &apply_index; /* Default index = one list per symbol */
 static void handle_line(char *s);
+static char *apply_checked(struct apply_handle *h, char *word);
 static void app_print(char *result);
 static char *get_next_line();
 static void server_init();
@@ -114,13 +131,14 @@ void app_print(char *result) {
 }
 
 int main(int argc, char *argv[]) {
-    int opt, sortarcs = 1;
+    int opt, sortarcs = 1, i;
     char *infilename;
     struct fsm *net;
+    struct apply_handle **handles;
 
     setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
 
-    while ((opt = getopt(argc, argv, "abhHiI:qs:SA:P:w:vx")) != -1) {
+    while ((opt = getopt(argc, argv, "abc:d:hHiI:l:moqs:SA:P:w:vx")) != -1) {
         switch(opt) {
         case 'a':
 	    apply_alternates = 1;
@@ -134,19 +152,42 @@ int main(int argc, char *argv[]) {
         case 'i':
 	    direction = DIR_DOWN;
 	    applyer = &apply_down;
+	    cascade_applyer = &apply_cascade_down;
+	    break;
+	case 'l':
+	    sscanf(optarg, "%ld,%d,%d,%d", &limit_steps, &limit_results, &limit_length, &limit_msec);
+	    break;
+        case 'm':
+	    symbol_cascade = 1;
+	    break;
+        case 'o':
+	    compose_nets = 1;
 	    break;
         case 'q':
 	    sortarcs = 0;
 	    break;
+	case 'c':
+	    cache_mb = atoi(optarg);
+	    break;
+	case 'd':
+	    if (strcmp(optarg, "l") == 0) {
+		subset_mb = -1;
+	    } else {
+		subset_mb = atoi(optarg);
+	    }
+	    break;
 	case 'I':
 	    if (strcmp(optarg, "f") == 0) {
 		index_flag_states = 1;
 		index_arcs = 1;
-	    } else if (strstr(optarg, "k") != NULL && strstr(optarg,"K") != NULL) {
+	    } else if (strcmp(optarg, "c") == 0) {
+		indexer = &apply_index_compact;
+		index_arcs = 1;
+	    } else if (strstr(optarg, "k") != NULL || strstr(optarg,"K") != NULL) {
 		/* k limit */
 		index_mem_limit = 1024*atoi(optarg);
 		index_arcs = 1;
-	    } else if (strstr(optarg, "m") != NULL && strstr(optarg,"M") != NULL) {
+	    } else if (strstr(optarg, "m") != NULL || strstr(optarg,"M") != NULL) {
 		/* m limit */
 		index_mem_limit = 1024*1024*atoi(optarg);
 		index_arcs = 1;
@@ -205,11 +246,20 @@ int main(int argc, char *argv[]) {
 	}
 	chain_new->net = net;
 	chain_new->ah = apply_init(net);
+	if (cache_mb > 0) {
+	    apply_set_cache(chain_new->ah, (size_t) cache_mb * 1024 * 1024);
+	}
+	if (subset_mb > 0) {
+	    apply_set_subset_cache(chain_new->ah, (size_t) subset_mb * 1024 * 1024);
+	} else if (subset_mb == -1) {
+	    apply_set_lattice(chain_new->ah, 1);
+	}
+	apply_set_limits(chain_new->ah, limit_steps, limit_results, limit_length, limit_msec);
 	if (direction == DIR_DOWN && index_arcs) {
-	    apply_index(chain_new->ah, APPLY_INDEX_INPUT, index_cutoff, index_mem_limit, index_flag_states);
+	    indexer(chain_new->ah, APPLY_INDEX_INPUT, index_cutoff, index_mem_limit, index_flag_states);
 	}
 	if (direction == DIR_UP && index_arcs) {
-	    apply_index(chain_new->ah, APPLY_INDEX_OUTPUT, index_cutoff, index_mem_limit, index_flag_states);
+	    indexer(chain_new->ah, APPLY_INDEX_OUTPUT, index_cutoff, index_mem_limit, index_flag_states);
 	}
 
 	chain_new->next = NULL;
@@ -232,6 +282,21 @@ int main(int argc, char *argv[]) {
 	exit(EXIT_FAILURE);
     }
 
+    /* Pass words through several nets as symbols rather than strings */
+    if (numnets > 1 && apply_alternates == 0 && (symbol_cascade || compose_nets)) {
+	handles = xxmalloc(sizeof(struct apply_handle *) * numnets);
+	/* The cascade wants the nets in file order; going up, the chain is reversed */
+	for (i = 0, chain_pos = direction == DIR_DOWN ? chain_head : chain_tail; chain_pos != NULL; i++) {
+	    handles[i] = chain_pos->ah;
+	    chain_pos = direction == DIR_DOWN ? chain_pos->next : chain_pos->prev;
+	}
+	cascade = apply_cascade_init(handles, numnets);
+	if (compose_nets && !apply_cascade_set_composed(cascade, 1)) {
+	    fprintf(stderr, "Can't walk the composition of these nets, applying them one by one\n");
+	}
+	xxfree(handles);
+    }
+
     if (mode_server) {
 	server_init();
 	serverstring = xxcalloc(UDP_MAX+1, sizeof(char));
@@ -250,7 +315,9 @@ int main(int argc, char *argv[]) {
 	    udpsize = 0;
 	    serverstring[0] = '\0';
 	    handle_line(line);
-	    if (results == 0) {
+	    if (limited) {
+		app_print("+!");
+	    } else if (results == 0) {
 		app_print(NULL);
 	    }
 	    if (serverstring[0] != '\0') {
@@ -267,7 +334,9 @@ int main(int argc, char *argv[]) {
 	while (get_next_line() != NULL) {
 	    results = 0;
 	    handle_line(line);
-	    if (results == 0) {
+	    if (limited) {
+		app_print("+!");
+	    } else if (results == 0) {
 		app_print(NULL);
 	    }
 	    fprintf(stdout, "%s", wordseparator);
@@ -277,6 +346,9 @@ int main(int argc, char *argv[]) {
 	}
     }
    /* Cleanup */
+    if (cascade != NULL) {
+	apply_cascade_clear(cascade);
+    }
     for (chain_pos = chain_head; chain_pos != NULL; chain_pos = chain_head) {
 	chain_head = chain_pos->next;
 	if (chain_pos->ah != NULL) {
@@ -304,14 +376,15 @@ char *get_next_line() {
 
 void handle_line(char *s) {
     char *result, *tempstr;
+    limited = 0;
     /* Apply alternative */
     if (apply_alternates == 1) {
 	for (chain_pos = chain_head, tempstr = s;   ; chain_pos = chain_pos->next) {
-	    result = applyer(chain_pos->ah, tempstr);
+	    result = apply_checked(chain_pos->ah, tempstr);
 	    if (result != NULL) {
 		results++;
 		app_print(result);
-		while ((result = applyer(chain_pos->ah, NULL)) != NULL) {
+		while ((result = apply_checked(chain_pos->ah, NULL)) != NULL) {
 		    results++;
 		    app_print(result);
 		}
@@ -321,11 +394,17 @@ void handle_line(char *s) {
 		break;
 	    }
 	}
+    } else if (cascade != NULL) {
+	for (result = cascade_applyer(cascade, s); result != NULL; result = cascade_applyer(cascade, NULL)) {
+	    results++;
+	    app_print(result);
+	}
+	limited = apply_cascade_get_status(cascade) != APPLY_OK;
     } else {
 	    
 	/* Get result from chain */
 	for (chain_pos = chain_head, tempstr = s;  ; chain_pos = chain_pos->next) {		
-	    result = applyer(chain_pos->ah, tempstr);		
+	    result = apply_checked(chain_pos->ah, tempstr);		
 	    if (result != NULL && chain_pos != chain_tail) {
 		tempstr = result;
 		continue;
@@ -334,12 +413,12 @@ void handle_line(char *s) {
 		do {
 		    results++;
 		    app_print(result);
-		} while ((result = applyer(chain_pos->ah, NULL)) != NULL);
+		} while ((result = apply_checked(chain_pos->ah, NULL)) != NULL);
 	    }
 	    if (result == NULL) {
 		/* Move up */
 		for (chain_pos = chain_pos->prev; chain_pos != NULL; chain_pos = chain_pos->prev) {
-		    result = applyer(chain_pos->ah, NULL);
+		    result = apply_checked(chain_pos->ah, NULL);
 		    if (result != NULL) {
 			tempstr = result;
 			break;
@@ -383,3 +462,13 @@ void server_init(void) {
     }
     printf("Started flookup server on %s port %i\n", inet_ntoa(serveraddr.sin_addr), port_number); fflush(stdout);
 }
+
+/* Applies a word with the chosen direction, noting if a limit cut it short */
+char *apply_checked(struct apply_handle *h, char *word) {
+    char *result;
+    result = applyer(h, word);
+    if (apply_get_status(h) != APPLY_OK) {
+	limited = 1;
+    }
+    return(result);
+}
@@ -79,6 +79,15 @@ extern "C" {
 #define APPLY_INDEX_INPUT 1
 #define APPLY_INDEX_OUTPUT 2
 
+#define APPLY_OK 0
+#define APPLY_LIMIT_STEPS 1
+#define APPLY_LIMIT_RESULTS 2
+#define APPLY_LIMIT_LENGTH 3
+#define APPLY_LIMIT_TIME 4
+
+#define APPLY_SCAN_LONGEST 0
+#define APPLY_SCAN_ALL 1
+
 /* Defined networks */
 struct defined_networks {
   char *name;
@@ -191,9 +200,30 @@ int remove_defined (struct defined_networks *def, char *string);
 /********************/
 
 FEXPORT char *fsm_get_library_version_string();
+/* The operations below and the regex and lexc compilers can run in  */
+/* several threads at once, as long as no net is shared between them */
+/* and no defined_networks or defined_functions they share changes   */
+/* meanwhile; parses only read them, and lexc keeps the definitions  */
+/* of its file to itself.  Settings such as g_minimal are            */
+/* process-wide.  A thread that has compiled anything                */
+/* should call fsm_thread_clear() before it exits to free its        */
+/* working memory.                                                   */
+FEXPORT void fsm_thread_clear();
 
 FEXPORT struct fsm *fsm_determinize(struct fsm *net);
 FEXPORT struct fsm *fsm_epsilon_remove(struct fsm *net);
+/* The subset construction behind the two above gives up once it has */
+/* built more than g_subset_max_states states or uses more than      */
+/* g_subset_max_mb megabytes (0 = no limit).  The net then becomes   */
+/* the empty language, and fsm_subset_aborted() stays nonzero in the */
+/* calling thread until fsm_subset_clear_aborted() is called.  The   */
+/* regex parser clears it itself and fails the parse.  The progress  */
+/* callback is set per thread; if set, it is called every 65536      */
+/* states of that thread's constructions with the states built and   */
+/* the bytes in use, possibly from one of their worker threads.      */
+FEXPORT int fsm_subset_aborted();
+FEXPORT void fsm_subset_clear_aborted();
+FEXPORT void fsm_set_subset_progress(void (*progress)(int subsets, size_t bytes, void *userdata), void *userdata);
 FEXPORT struct fsm *fsm_find_ambiguous(struct fsm *net, int **extras);
 FEXPORT struct fsm *fsm_minimize(struct fsm *net);
 FEXPORT struct fsm *fsm_coaccessible(struct fsm *net);
@@ -336,6 +366,12 @@ FEXPORT int foma_net_print(struct fsm *net, gzFile outfile);
 FEXPORT void apply_clear(struct apply_handle *h);
 /* To be called before applying words */
 FEXPORT struct apply_handle *apply_init(struct fsm *net);
+/* Read-only lookup tables for a net that several handles (e.g. one per thread) can share */
+FEXPORT struct apply_shared *apply_shared_init(struct fsm *net);
+/* Frees shared tables, to be called after all handles using them are cleared */
+FEXPORT void apply_shared_clear(struct apply_shared *sh);
+/* Creates a cheap handle with its own search state on top of shared tables */
+FEXPORT struct apply_handle *apply_init_shared(struct apply_shared *sh);
 FEXPORT struct apply_med_handle *apply_med_init(struct fsm *net);
 FEXPORT void apply_med_clear(struct apply_med_handle *h);
 
@@ -349,6 +385,108 @@ FEXPORT char *apply_med_get_outstring(struct apply_med_handle *medh);
 
 FEXPORT char *apply_down(struct apply_handle *h, char *word);
 FEXPORT char *apply_up(struct apply_handle *h, char *word);
+/* As apply_down()/apply_up(), for input already split into sigma      */
+/* numbers; anything not in the alphabet is taken as IDENTITY.  Call   */
+/* with the input first and with NULL for further results.  Each       */
+/* result is *outlength output symbols, as for apply_down_foreach_     */
+/* symbols(), in an array owned by the handle that the next call reuses */
+FEXPORT int *apply_down_ids(struct apply_handle *h, int *symbols, int length, int *outlength);
+FEXPORT int *apply_up_ids(struct apply_handle *h, int *symbols, int length, int *outlength);
+/* The sigma number of symbol, -1 if it is not in the alphabet; and the */
+/* symbol of a sigma number, NULL for EPSILON, UNKNOWN, IDENTITY and    */
+/* unused numbers.  Numbers run from 0 to apply_sigma_size()-1          */
+FEXPORT int apply_symbol_id(struct apply_handle *h, char *symbol);
+FEXPORT char *apply_symbol_name(struct apply_handle *h, int id);
+FEXPORT int apply_sigma_size(struct apply_handle *h);
+
+/* Calls visit() with each result and its length in bytes; the string is */
+/* only valid during the call.  A nonzero return from visit() stops the   */
+/* search.  Returns the number of results visited.                       */
+FEXPORT int apply_down_foreach(struct apply_handle *h, char *word, int (*visit)(char *result, int length, void *userdata), void *userdata);
+FEXPORT int apply_up_foreach(struct apply_handle *h, char *word, int (*visit)(char *result, int length, void *userdata), void *userdata);
+/* As above, but each result is given as the sigma numbers of its output   */
+/* symbols, epsilons and hidden flags left out; IDENTITY stands for an     */
+/* input symbol copied through unchanged                                   */
+FEXPORT int apply_down_foreach_symbols(struct apply_handle *h, char *word, int (*visit)(int *symbols, int length, void *userdata), void *userdata);
+FEXPORT int apply_up_foreach_symbols(struct apply_handle *h, char *word, int (*visit)(int *symbols, int length, void *userdata), void *userdata);
+/* The number of results apply_down()/apply_up() would give for word, */
+/* found without building them; nonzero if the word is recognized     */
+FEXPORT long apply_count_down(struct apply_handle *h, char *word);
+FEXPORT long apply_count_up(struct apply_handle *h, char *word);
+
+/* Scans a NUL-terminated text in place for matches of the input side, */
+/* trying each symbol position in turn.  APPLY_SCAN_LONGEST reports     */
+/* the outputs of the longest match and resumes after it, skipping one  */
+/* symbol where nothing matches; APPLY_SCAN_ALL reports every nonempty  */
+/* match at every position.  The visitor gets the byte offset and       */
+/* length of the match and one output, and returns nonzero to stop.     */
+/* Returns the number of matches visited.                               */
+FEXPORT int apply_down_scan(struct apply_handle *h, char *text, int mode, int (*visit)(int offset, int length, char *output, void *userdata), void *userdata);
+FEXPORT int apply_up_scan(struct apply_handle *h, char *text, int mode, int (*visit)(int offset, int length, char *output, void *userdata), void *userdata);
+
+/* Prefix cursors for completion: symbols typed one push at a time on */
+/* side M_UPPER (as in apply_down) or M_LOWER (as in apply_up).  Push  */
+/* and back return the number of configurations reached, 0 if no word */
+/* starts with the prefix.  The handle is borrowed for tokenizing and  */
+/* flag checks, and must not be used concurrently.                     */
+FEXPORT struct apply_cursor *apply_cursor_init(struct apply_handle *h, int side);
+FEXPORT void apply_cursor_clear(struct apply_cursor *c);
+FEXPORT int apply_cursor_reset(struct apply_cursor *c);
+FEXPORT int apply_cursor_push(struct apply_cursor *c, char *symbols);
+/* Undoes the last apply_cursor_push() */
+FEXPORT int apply_cursor_back(struct apply_cursor *c);
+/* Visits up to max_results words (0 = all) that complete the prefix,  */
+/* fewest symbols first and in strcmp() order of symbols within a      */
+/* length, expanding at most max_nodes search nodes (0 = a default of  */
+/* 100000, so that cyclic nets end too).  The visitor returns nonzero  */
+/* to stop.  Returns the number of words visited.                      */
+FEXPORT int apply_cursor_complete(struct apply_cursor *c, int max_results, int max_nodes, int (*visit)(char *word, int length, void *userdata), void *userdata);
+
+/* Cascades: the output of each stage is the input of the next.  Going */
+/* down, handles[0] is applied first; going up, the last handle is.    */
+/* Stages hand over symbols rather than strings, and duplicate results */
+/* are dropped at every stage.  The handles are not copied, and must   */
+/* outlive the cascade; settings such as flags and indexes are taken   */
+/* from them.                                                          */
+FEXPORT struct apply_cascade *apply_cascade_init(struct apply_handle **handles, int numhandles);
+FEXPORT void apply_cascade_clear(struct apply_cascade *c);
+/* Makes the cascade walk the composition of its nets lazily instead of */
+/* applying them one by one, giving the results of applying            */
+/* fsm_compose() of the nets without building it, within the tightest */
+/* of the nets' apply_set_limits().  Returns 0 if it can't: with more  */
+/* than 30 nets, nets that obey flag diacritics, or nets with a cycle  */
+/* of input epsilons that writes output, which a lookup goes round up  */
+/* to twice.                                                           */
+FEXPORT int apply_cascade_set_composed(struct apply_cascade *c, int value);
+/* Call with NULL to get further results of the last word */
+FEXPORT char *apply_cascade_down(struct apply_cascade *c, char *word);
+FEXPORT char *apply_cascade_up(struct apply_cascade *c, char *word);
+/* APPLY_OK, or the first limit a stage or the walk ran into on the last word */
+FEXPORT int apply_cascade_get_status(struct apply_cascade *c);
+
+/* Batch lookup: results of many words go into one caller-provided arena */
+struct apply_batch {
+    char *arena;          /* Result strings, NUL-terminated, back to back    */
+    size_t arena_size;    /* Set by caller                                   */
+    size_t arena_used;
+    size_t *results;      /* Arena offset of each result                     */
+    int results_size;     /* Set by caller: capacity of results              */
+    int numresults;
+    int *word_results;    /* Caller-allocated, nwords+1 entries: results of  */
+                          /* word i are results[word_results[i]] up to but   */
+                          /* not including results[word_results[i+1]]        */
+    size_t arena_needed;  /* When a word does not fit: the arena and results */
+    int results_needed;   /* space that word needs on its own, else 0        */
+};
+
+/* Return the number of words processed, which is less than nwords */
+/* if the arena or the results table ran out of space.  The caller */
+/* can then grow them to at least arena_needed / results_needed    */
+/* and go on from the first word not processed.  A batch also ends */
+/* after a word that ran into a limit: apply_get_status() is then  */
+/* the limit that cut short the results of the last word.          */
+FEXPORT int apply_down_batch(struct apply_handle *h, char **words, int nwords, struct apply_batch *b);
+FEXPORT int apply_up_batch(struct apply_handle *h, char **words, int nwords, struct apply_batch *b);
 FEXPORT char *apply_med(struct apply_med_handle *medh, char *word);
 FEXPORT char *apply_upper_words(struct apply_handle *h);
 FEXPORT char *apply_lower_words(struct apply_handle *h);
@@ -356,14 +494,62 @@ FEXPORT char *apply_words(struct apply_handle *h);
 FEXPORT char *apply_random_lower(struct apply_handle *h);
 FEXPORT char *apply_random_upper(struct apply_handle *h);
 FEXPORT char *apply_random_words(struct apply_handle *h);
+/* Draw one accepting path uniformly at random and return its words,   */
+/* upper side or lower side; NULL if there is none.  In cyclic nets    */
+/* paths are drawn from those of at most apply_set_sample_length() arcs */
+FEXPORT char *apply_uniform_words(struct apply_handle *h);
+FEXPORT char *apply_uniform_upper(struct apply_handle *h);
+FEXPORT char *apply_uniform_lower(struct apply_handle *h);
+FEXPORT void apply_set_sample_length(struct apply_handle *h, int length);
+/* Seeds the handle's own random number generator (random & uniform) */
+FEXPORT void apply_set_seed(struct apply_handle *h, unsigned long seed);
+/* Enumerates the words (side M_UPPER|M_LOWER), upper words (M_UPPER) */
+/* or lower words (M_LOWER) with numthreads threads, 0 = one per CPU.  */
+/* The visitor is called on the calling thread, in the order           */
+/* apply_words() & co. would give; returning nonzero stops.  A handle  */
+/* with apply_set_limits() searches on the calling thread only.        */
+/* Returns the number of words visited.                                */
+FEXPORT int apply_words_parallel(struct apply_handle *h, int side, int numthreads, int (*visit)(char *result, int length, void *userdata), void *userdata);
 /* Reset the iterator to start anew with enumerating functions */
 FEXPORT void apply_reset_enumerator(struct apply_handle *h);
 FEXPORT void apply_index(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only);
+FEXPORT void apply_index_compact(struct apply_handle *h, int inout, int densitycutoff, int mem_limit, int flags_only);
 FEXPORT void apply_set_show_flags(struct apply_handle *h, int value);
 FEXPORT void apply_set_obey_flags(struct apply_handle *h, int value);
 FEXPORT void apply_set_print_space(struct apply_handle *h, int value);
 FEXPORT void apply_set_print_pairs(struct apply_handle *h, int value);
 FEXPORT void apply_set_space_symbol(struct apply_handle *h, char *space);
+/* Caches complete apply_up()/apply_down() results in up to max_bytes, 0 = off */
+FEXPORT void apply_set_cache(struct apply_handle *h, size_t max_bytes);
+/* Prunes apply_up()/apply_down() searches to the states that can still */
+/* lead to acceptance, found with an input-side DFA that is built as    */
+/* words need it within max_bytes, 0 = off.  A word that needs more     */
+/* goes on with the lattice below and the DFA is flushed.  Nets with    */
+/* input epsilon cycles are never pruned, so results don't change.      */
+FEXPORT void apply_set_subset_cache(struct apply_handle *h, size_t max_bytes);
+/* Prunes searches the same way from the lattice of (state, position) */
+/* pairs of each word, with no memory kept between words, 1 = on       */
+FEXPORT void apply_set_lattice(struct apply_handle *h, int value);
+/* The outputs for a word as a minimized automaton, empty if there are */
+/* none.  The caller frees it with fsm_destroy()                       */
+FEXPORT struct fsm *apply_down_to_fsm(struct apply_handle *h, char *word);
+FEXPORT struct fsm *apply_up_to_fsm(struct apply_handle *h, char *word);
+/* Whether word is in the domain (down) or range (up) of the net, by a */
+/* walk over a minimal DFA for that side, built on first use.  Sides   */
+/* whose DFA would exceed max_states (default 1000000, 0 = no limit),  */
+/* and nets with flag diacritics, are checked with the usual search.   */
+/* The subset construction for the DFA stops at the same bound.        */
+FEXPORT int apply_down_accepts(struct apply_handle *h, char *word);
+FEXPORT int apply_up_accepts(struct apply_handle *h, char *word);
+FEXPORT void apply_set_accept_limit(struct apply_handle *h, int max_states);
+FEXPORT void apply_get_cache_stats(struct apply_handle *h, unsigned long *hits, unsigned long *misses);
+/* Bounds the work done for each word, 0 = no limit: arcs followed,   */
+/* results, output length in bytes and milliseconds.  Hitting a step,  */
+/* result or time limit ends the search; outputs that grow too long    */
+/* are dropped and the search goes on.                                 */
+FEXPORT void apply_set_limits(struct apply_handle *h, long max_steps, int max_results, int max_length, int max_msec);
+/* APPLY_OK, or the APPLY_LIMIT_* the last word ran into */
+FEXPORT int apply_get_status(struct apply_handle *h);
 
 /* Minimum edit distance & spelling correction */
 FEXPORT void fsm_create_letter_lookup(struct apply_med_handle *medh, struct fsm *net);
@@ -376,6 +562,8 @@ FEXPORT void cmatrix_print(struct fsm *net);
 FEXPORT void cmatrix_print_att(struct fsm *net, FILE *outfile);
 
 /* Lexc */
+/* NULL if determinizing the lexicon runs into g_subset_max_states or */
+/* g_subset_max_mb                                                    */
 FEXPORT struct fsm *fsm_lexc_parse_file(char *myfile);
 FEXPORT struct fsm *fsm_lexc_parse_string(char *mystring);
 
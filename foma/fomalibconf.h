@@ -15,6 +15,11 @@
 /*     You should have received a copy of the GNU General Public License     */
 /*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
 
+/* The construction algorithms keep their working state in file-level  */
+/* variables; FOMA_TLS gives every thread its own copy, so different    */
+/* threads can compile at the same time                                 */
+#define FOMA_TLS __thread
+
 struct state_array {
     struct fsm_state *transitions;
 };
@@ -111,33 +116,304 @@ struct apply_med_handle {
     _Bool hascm;
 };
 
+/* Tables that only depend on the network being applied.  These are   */
+/* built once and never written to during lookup, so one apply_shared */
+/* can back any number of apply_handles, possibly in different threads */
+
+struct apply_shared {
+
+    int *arc_offsets;       /* Arcs of state s are arc_offsets[s] ... arc_offsets[s+1]-1 */
+    short int *arc_in;
+    short int *arc_out;
+    int *arc_target;
+    uint8_t *finals;        /* Bitmap of final states */
+    int start_state;
+    int sigma_size;
+    int has_flags;
+    uint8_t *flagstates;
+    int (*lower_bound)(short int *syms, int lo, int hi, int target); /* Chosen for the CPU */
+
+    /* Input tokenizer: a byte trie of the multicharacter symbols.  */
+    /* The root is a dense table; below it, the children of node n  */
+    /* are nodes first[n] ... first[n+1]-1, sorted on bytes[child]. */
+    struct apply_tokenizer {
+	int root_next[256];     /* Node reached on the first byte, 0 if none */
+	int ascii_sym[128];     /* Symbol for a byte that starts no longer symbol, else -1 */
+	int *first;
+	unsigned char *bytes;
+	int *sym;               /* Symbol spelled out by node n, 0 if none */
+	int numnodes;
+    } *tokenizer;
+
+    struct sigs {
+	char *symbol;
+	int length;
+    } *sigs;
+
+    struct fsm *last_net;
+    struct fsm_state *gstates;
+    struct sigma *gsigma;
+    struct apply_state_index {
+	int fsmptr;
+	struct apply_state_index *next;
+    } **index_in, **index_out;
+
+    /* Compact index: the arcs of an indexed state grouped by symbol */
+    /* The symbols of state s are keys[state_keys[s]] ...            */
+    /* keys[state_keys[s+1]-1] in ascending order, and the arcs for  */
+    /* keys[k] are arcs[ranges[k]] ... arcs[ranges[k+1]-1]           */
+    struct apply_compact_index {
+	int *state_keys;
+	uint8_t *indexed;
+	short int *keys;
+	int *ranges;
+	int *arcs;
+    } *cindex_in, *cindex_out;
+
+    struct flag_lookup {
+	int type;
+	char *name;
+	char *value;
+	int name_id;
+	int value_id;
+    } *flag_lookup ;
+    int flag_name_count;
+};
+
+/* Bounded LRU cache of complete apply_up()/apply_down() results */
+/* Each entry is one allocation: the struct, the input string and */
+/* the results, all NUL-terminated, back to back in data[]        */
+
+struct apply_cache_entry {
+    struct apply_cache_entry *hnext;
+    struct apply_cache_entry *prev;
+    struct apply_cache_entry *next;
+    unsigned int hash;
+    int mode;
+    int numresults;
+    size_t size;
+    char data[];
+};
+
+struct apply_cache {
+    struct apply_cache_entry **table;
+    struct apply_cache_entry *lru_head;   /* Most recently used */
+    struct apply_cache_entry *lru_tail;   /* Next to be evicted */
+    unsigned int tablemask;
+    size_t max_bytes;
+    size_t used_bytes;
+    unsigned long hits;
+    unsigned long misses;
+    /* Results being replayed from a hit */
+    struct apply_cache_entry *replay;
+    char *replay_ptr;
+    int replay_left;
+    /* Results being collected on a miss */
+    int recording;
+    char *rec;
+    size_t rec_size;
+    size_t rec_used;
+    int rec_count;
+};
+
+/* Minimal DFA for one side of a net, arcs of state s sorted by symbol */
+/* in syms[offsets[s]] ... syms[offsets[s+1]-1]; map takes net sigma   */
+/* numbers to its own, -1 for symbols it doesn't have                  */
+
+struct apply_acceptor {
+    int *offsets;
+    int *syms;
+    int *targets;
+    uint8_t *finals;
+    int *map;
+    int mapsize;
+    int start;
+};
+
+/* Lazily determinized input side of a net: subsets of states, closed */
+/* under input epsilons and flags, stored in discovery order, and the  */
+/* transitions between them found so far                               */
+
+struct apply_dfa {
+    int *pool;
+    size_t pool_used;
+    size_t pool_size;
+    struct apply_dfa_subset {
+	int begin;
+	int size;
+	unsigned int hash;
+	int next;               /* Next subset in the same bucket */
+    } *subsets;
+    int numsubsets;
+    int subsets_size;
+    int *buckets;
+    unsigned int bucketmask;
+    struct apply_dfa_trans {
+	int from;
+	int sym;
+	int to;
+    } *trans;
+    unsigned int transmask;
+    int numtrans;
+    int initial;
+    int *seen;              /* seen[s] == stamp if s is in the subset being built */
+    unsigned int stamp;
+    int *work;
+};
+
+/* Visitors of apply_*_foreach() and the apply_*_ids() iterator, */
+/* all NULL when results go through the iterator                  */
+
+struct apply_visitor {
+    int (*visit)(char *result, int length, void *userdata);
+    int (*visit_symbols)(int *symbols, int length, void *userdata);
+    void *data;
+    int *in;                /* Input of apply_symbols_foreach(), else NULL */
+    int *out_map;
+    int count;
+    int count_only;         /* Count results, visiting none */
+    int *syms;
+    int syms_size;
+    int *ids_in;            /* Input of apply_down_ids()/apply_up_ids() */
+    int ids_in_size;
+    int ids_length;
+};
+
+/* Limits of apply_set_limits(), 0 = none, and the running counts */
+
+struct apply_limits {
+    long max_steps;
+    int max_results;
+    int max_length;
+    int max_msec;
+    long steps;
+    int numresults;
+    double deadline;
+};
+
+/* Uniform sampling: number of accepting paths from each state,  */
+/* one row per remaining length if the net is cyclic, else 1 row */
+
+struct apply_sampler {
+    double *counts;
+    int rows;
+    int length;             /* Length bound in arcs for cyclic nets */
+};
+
+/* Counting: apply_count_*() runs the search without output, or a  */
+/* dynamic program over input positions if the input side has no   */
+/* epsilon cycles.  rank[d] orders the states along input epsilons */
+/* for direction d (0 = down, 1 = up), dp[d] is 0 until known, 1   */
+/* if the program applies and -1 if not.                           */
+
+struct apply_counter {
+    int dp[2];
+    int *rank[2];
+    long *cur;
+    long *next;
+    int *heap;
+    int *list;
+};
+
+/* Pruning, see apply_set_subset_cache() and apply_set_lattice():  */
+/* an input-side DFA per direction built lazily, or the reachable  */
+/* states of the word's lattice, and for the current word the      */
+/* states that lie on some accepting path at each input position,  */
+/* as sorted live_states[live_first[ipos]] ... [live_first[ipos+1]] */
+
+struct apply_pruner {
+    struct apply_dfa *dfa[2];
+    size_t dfa_max_bytes;
+    int use_lattice;
+    int *lattice_states;
+    int lattice_states_size;
+    int *live_first;
+    int live_first_size;
+    int *live_states;
+    int live_states_size;
+    int *live_mark[2];
+    int live_stamp;
+    int *work;
+    int *layers;            /* Reachable states, live ranges and positions by token */
+    int layer_size;
+    int acyclic[2];         /* 1 if input epsilons make no cycle, -1 if they do */
+};
+
+/* Acceptors for apply_down_accepts()/apply_up_accepts(), built */
+/* on first use; built[d] is -1 if over max_states              */
+
+struct apply_acceptors {
+    struct apply_acceptor *dfa[2];
+    int built[2];
+    int max_states;
+};
+
+/* A prefix typed on one side of a net.  Each pushed symbol adds a  */
+/* layer holding the configurations (state, flag registers) that    */
+/* the prefix reaches, closed under input epsilons, so undoing a     */
+/* push just drops layers.                                           */
+
+struct apply_cursor {
+    struct apply_handle *h;
+    short int *arc_insym;   /* Input side: arc_in or arc_out */
+    int nregs;              /* Flag registers per configuration, 0 if not obeyed */
+    int *states;
+    int *regs;
+    int size;
+    int cap;
+    int *layers;            /* First configuration of each layer */
+    int numlayers;
+    int layers_cap;
+    int *pushes;            /* numlayers and prefix length before each push */
+    int *push_prefix;
+    int numpushes;
+    int pushes_cap;
+    char *prefix;
+    int prefix_len;
+    int prefix_cap;
+    int *sym_rank;          /* Position of each symbol in strcmp() order */
+    /* Configurations of the set being built, by hash; slots from */
+    /* earlier sets have an old stamp and count as empty           */
+    struct apply_cursor_slot {
+	int config;
+	unsigned int stamp;
+    } *table;
+    unsigned int tablemask;
+    unsigned int stamp;
+    int set_begin;
+    int *tmpregs;
+};
+
+/* Per-query search state.  The table pointers are borrowed from */
+/* shared and must be treated as read-only.                      */
+
 struct apply_handle {
 
     int ptr;
     int curr_ptr; 
     int ipos;
     int opos;
+    int state;
     int mode;
     int printcount;
-    int *numlines;
-    int *statemap; 
+    int *arc_offsets;
+    short int *arc_in;
+    short int *arc_out;
+    int *arc_target;
+    uint8_t *finals;
     int *marks;
 
-    struct sigma_trie {
-	int signum;
-	struct sigma_trie *next;
-    } *sigma_trie;
+    struct apply_shared *shared;
+    int owns_shared;
+    struct apply_cache *cache;
+
+    struct apply_tokenizer *tokenizer;
 
     struct sigmatch_array {
 	int signumber ;
 	int consumes ;
     } *sigmatch_array;
 
-    struct sigma_trie_arrays {
-	struct sigma_trie *arr;
-	struct sigma_trie_arrays *next;
-    } *sigma_trie_arrays;
-
     int binsearch;
     int indexed;
     int state_has_index;
@@ -152,53 +428,176 @@ struct apply_handle {
     int print_pairs;
     int apply_stack_ptr;
     int apply_stack_top; 
-    int oldflagneg;
+    int oldflag;
     int outstringtop;
     int iterate_old;
     int iterator;
     uint8_t *flagstates;
     char *outstring;
     char *instring;
-    struct sigs {
-	char *symbol;
-	int length;
-    } *sigs;
-    char *oldflagvalue;
+    struct sigs *sigs;
     
     struct fsm *last_net;
-    struct fsm_state *gstates;
     struct sigma *gsigma;
-    struct apply_state_index {
-	int fsmptr;
-	struct apply_state_index *next;
-    } **index_in, **index_out, *iptr;
-
-    struct flag_list {
-	char *name;
-	char *value;
-	short neg;
-	struct flag_list *next;	
-    } *flag_list;
-
-    struct flag_lookup {
-	int type;
-	char *name;
-	char *value;
-    } *flag_lookup ;
+    struct apply_state_index *iptr;
+    struct apply_compact_index *cidx;
+    int cidx_pos;
+    int cidx_end;
+    int cidx_eps_pos;
+    int cidx_eps_end;
+
+    int *flag_regs;         /* Current value of each flag, indexed by name_id */
+
+    int status;             /* APPLY_OK or the limit the last word hit */
+    int stopped;            /* The search was abandoned at a limit */
+    int prune;              /* The search is pruned to pruner's live states */
+    uint64_t rand_state;    /* Per-handle PRNG, see apply_set_seed() */
+
+    /* State of the features below is allocated on first use, so */
+    /* a handle that only looks words up stays small             */
+    struct apply_visitor *visitor;
+    struct apply_limits *limits;
+    struct apply_enum_cut *enum_cut;    /* Only while enumerating in parallel */
+    struct apply_sampler *sampler;
+    struct apply_counter *counter;
+    struct apply_scan *scan;            /* Only while scanning a text */
+    struct apply_pruner *pruner;
+    struct apply_acceptors *acceptors;
+
+    struct flag_lookup *flag_lookup;
 
     struct searchstack {
 	int offset;
+	int state;
 	struct apply_state_index *iptr;
+	int cidx_pos;
+	int cidx_end;
+	int cidx_eps_pos;
+	int cidx_eps_end;
 	int state_has_index;
 	int opos;
 	int ipos;
 	int visitmark;
-	char *flagname;
-	char *flagvalue;
-	int flagneg;
+	int flagreg;            /* Flag register to restore on pop, or -1 */
+	int flagold;
     } *searchstack ;
 };
 
+/* A set of symbol sequences in insertion order, hashed for duplicate */
+/* detection.  Sequence i is syms[start[i]] ... syms[start[i+1]-1]    */
+
+struct apply_seqset {
+    int *syms;
+    int syms_used;
+    int syms_size;
+    int *start;
+    int count;
+    int start_size;
+    int *table;             /* Open addressing, entries are i+1, 0 = free */
+    unsigned int tablemask;
+};
+
+/* Walk of the product of a cascade's nets for one input word.  A node */
+/* is width ints: the input position, then the state of each net and   */
+/* the epsilon filter mode between it and the nets before it, in the   */
+/* order the nets are applied.                                         */
+
+struct apply_product {
+    int width;
+    int *nodes;
+    int numnodes;
+    int nodes_size;
+    int *nodehash;          /* Open addressing, entries are node+1, 0 = free */
+    unsigned int nodemask;
+    int *status;            /* 0 = unseen, 1 = in an open component, 2 = done, 3-4 = being closed */
+    int *order;             /* Depth-first visiting order of node n */
+    int *low;               /* Lowest order n reaches within open components */
+    int numordered;
+    int *scc;               /* Nodes of the open components, in visiting order */
+    int scc_used;
+    int *edge_start;        /* Edges of node n are (target, value) pairs from edges[2*edge_start[n]] */
+    int *edge_count;
+    int *edges;
+    int edges_used;
+    int edges_size;
+    int *result_start;      /* Output suffixes from node n to a final node */
+    int *result_count;
+    int *results;
+    int results_used;
+    int results_size;
+    int *cons;              /* Suffix i > 0 is value cons[2i] followed by suffix cons[2i+1] */
+    int numcons;
+    int cons_size;
+    int *conshash;
+    unsigned int consmask;
+    int *seen;              /* Stamps for removing duplicate suffixes */
+    int stamp;
+    int *moves[2];          /* Scratch for expanding a node */
+    int moves_used[2];
+    int moves_size[2];
+    int *stack;             /* (node, next edge) pairs */
+    int stack_size;
+    int *path;              /* Values on a path followed within a component */
+    int path_size;
+    int *spell;
+    int spell_size;
+    long limit_steps;       /* The tightest of the nets' limits */
+    int limit_results;
+    int limit_length;
+    int limit_msec;
+    long steps;             /* Arcs looked at for the current word */
+    long next_clock;
+    double deadline;
+    int stopped;            /* The walk was abandoned at a limit */
+    int down;               /* Direction of the current word */
+    int *netsymbols;        /* Global symbols in some net's alphabet */
+    int numnetsymbols;
+};
+
+/* A cascade of apply handles.  Results pass between stages as       */
+/* sequences of global symbol numbers, one table shared by all stages */
+
+struct apply_cascade {
+    struct apply_handle **handles;
+    int numhandles;
+    int **in_maps;          /* Global symbol -> sigma number of stage i, IDENTITY if absent */
+    int **out_maps;         /* Sigma number of stage i -> global symbol */
+    struct sh_handle *symbolhash;
+    char **symbols;         /* Global symbol -> string */
+    int numsymbols;
+    int symbols_size;
+    struct apply_seqset *current;
+    struct apply_seqset *next;
+    int *tokens;
+    int *token_lengths;
+    int tokens_size;
+    int result;             /* Next result of current to return */
+    int status;             /* First limit a stage hit on the last word */
+    int unknown_symbol;     /* Global symbol printed for unknown output, ? */
+    struct apply_product *product;  /* Set if walking the composition */
+    char *outstring;
+    int outstring_size;
+};
+
+/* Bounds the states of the subset constructions this thread runs, */
+/* on top of g_subset_max_states, 0 = none.  Running into it leaves  */
+/* fsm_subset_aborted() set but prints nothing.                      */
+void fsm_set_subset_max_states(int max_states);
+
+/* Steps between looks at the clock when a time limit is set */
+#define APPLY_CLOCK_INTERVAL 1024
+
+/* Seconds on a monotonic clock, for time limits */
+double apply_limit_clock();
+
+/* Fills kernels with the arc search kernels usable on this CPU, */
+/* the scalar one first, and returns how many there are (at most 3) */
+int apply_search_kernels(int (**kernels)(short int *syms, int lo, int hi, int target));
+
+/* Symbol-level apply */
+int apply_down_symbols_foreach(struct apply_handle *h, int *symbols, int length, int *in_map, int *out_map, int (*visit)(int *symbols, int length, void *userdata), void *userdata);
+int apply_up_symbols_foreach(struct apply_handle *h, int *symbols, int length, int *in_map, int *out_map, int (*visit)(int *symbols, int length, void *userdata), void *userdata);
+int apply_tokenize(struct apply_handle *h, char *word, int *symbols, int *lengths);
 
 /* Automaton functions operating on fsm_state */
 int add_fsm_arc(struct fsm_state *fsm, int offset, int state_no, int in, int out, int target, int final_state, int start_state);
@@ -222,6 +621,9 @@ void fsm_state_close();
 /* Call this when done with entire FSM */
 void fsm_state_end_state();
 
+/* Bytes currently reserved for the machine under construction */
+size_t fsm_state_memory();
+
 struct state_array *map_firstlines(struct fsm *net);
 
 FEXPORT void fsm_count(struct fsm *net);
@@ -254,6 +656,11 @@ void *ptr_stack_pop();
 int ptr_stack_isfull();
 void ptr_stack_push(void *ptr);
 
+/* Composition with flag-is-epsilon given explicitly instead of g_flag_is_epsilon */
+struct fsm *fsm_compose_flags(struct fsm *net1, struct fsm *net2, int flag_is_epsilon);
+/* Suspends (1) or resumes (0) fsm_minimize() in the calling thread; returns the old value */
+int fsm_minimize_suspend(int value);
+
 /* Sigma functions */
 FEXPORT int sigma_add (char *symbol, struct sigma *sigma);
 FEXPORT int sigma_add_number(struct sigma *sigma, char *symbol, int number);
@@ -45,6 +45,10 @@ extern int g_list_random_limit;
 extern int g_compose_tristate;
 extern int g_med_limit ;
 extern int g_med_cutoff ;
+extern int g_threads;
+extern int g_subset_threads;
+extern int g_subset_max_states;
+extern int g_subset_max_mb;
 extern char *g_att_epsilon;
 
 extern struct defined_networks   *g_defines;
@@ -86,6 +90,10 @@ struct g_v {
     {&g_compose_tristate, "compose-tristate", FVAR_BOOL},
     {&g_med_limit,        "med-limit",        FVAR_INT},
     {&g_med_cutoff,       "med-cutoff",       FVAR_INT},
+    {&g_threads,          "threads",          FVAR_INT},
+    {&g_subset_threads,   "subset-threads",   FVAR_INT},
+    {&g_subset_max_states,"subset-max-states",FVAR_INT},
+    {&g_subset_max_mb,    "subset-max-mb",    FVAR_INT},
     {&g_att_epsilon,      "att-epsilon",      FVAR_STRING},
     {NULL, NULL, 0}
 };
@@ -209,6 +217,10 @@ struct global_help {
     {"variable hopcroft-min","ON = Hopcroft minimization, OFF = Brzozowski minimization","Default value: ON\n"},
     {"variable med-limit","the limit on number of matches in apply med","Default value: 3\n"},
     {"variable med-cutoff","the cost limit for terminating a search in apply med","Default value: 3\n"},
+    {"variable threads","threads used for writing words to a file, 0 = one per processor","Default value: 1\n"},
+    {"variable subset-threads","threads used for determinizing large networks, 0 = one per processor","Default value: 1\n"},
+    {"variable subset-max-states","give up determinizing beyond this many states, 0 = no limit","Default value: 0\n"},
+    {"variable subset-max-mb","give up determinizing beyond this many megabytes, 0 = no limit","Default value: 0\n"},
     {"variable att-epsilon","the EPSILON symbol when reading/writing AT&T files","Default value: @0@\n"},
     {"write prolog (> filename)","writes top network to prolog format file/stdout","Short form: wpl"},
     {"write att (> <filename>)","writes top network to AT&T format file/stdout","Short form: watt"},
@@ -773,15 +785,15 @@ void iface_quit() {
 }
 
 void iface_random_lower(int limit) {
-    iface_apply_random(&apply_random_lower, limit);
+    iface_apply_random(&apply_uniform_lower, limit);
 }
 
 void iface_random_upper(int limit) {
-    iface_apply_random(&apply_random_upper, limit);
+    iface_apply_random(&apply_uniform_upper, limit);
 }
 
 void iface_random_words(int limit) {
-    iface_apply_random(&apply_random_words, limit);
+    iface_apply_random(&apply_uniform_words, limit);
 }
 
 void iface_apply_random(char *(*applyer)(), int limit) {
@@ -1209,19 +1221,18 @@ void iface_view() {
         view_net(stack_find_top()->fsm);
 }
 
+static int iface_words_file_print(char *result, int length, void *outfile) {
+    fprintf((FILE *) outfile, "%s\n", result);
+    return 0;
+}
+
 void iface_words_file(char *filename, int type) {
     /* type 0 (words), 1 (upper-words), 2 (lower-words) */
     FILE *outfile;
-    char *result;
-    static char *(*applyer)() = &apply_words;
     struct apply_handle *ah;
+    int side;
 
-    if (type == 1) {
-	applyer = &apply_upper_words;
-    }
-    if (type == 2) {
-	applyer = &apply_lower_words;
-    }
+    side = type == 1 ? M_UPPER : type == 2 ? M_LOWER : M_UPPER|M_LOWER;
     if (iface_stack_check(1)) {
 	if (stack_find_top()->fsm->pathcount == PATHCOUNT_CYCLIC) {
 	    printf("FSM is cyclic: can't write all words to file.\n");
@@ -1234,12 +1245,7 @@ void iface_words_file(char *filename, int type) {
 	}
         ah = stack_get_ah();
 	iface_apply_set_params(ah);
-        for (;;) {
-            result = applyer(ah);
-            if (result == NULL)
-                break;
-            fprintf(outfile,"%s\n",result);
-        }
+	apply_words_parallel(ah, side, g_threads, iface_words_file_print, outfile);
         apply_reset_enumerator(ah);
 	fclose(outfile);
     }   
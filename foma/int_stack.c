@@ -21,12 +21,27 @@
 
 #define MAX_STACK 2097152
 #define MAX_PTR_STACK 2097152
-
-static int a[MAX_STACK];
-static int top = -1;
-
-static void *ptr_stack[MAX_PTR_STACK];
-static int ptr_stack_top = -1;
+#define INITIAL_STACK 1024
+
+/* Each thread has its own stacks, grown on demand up to the maximum */
+static FOMA_TLS int *a = NULL;
+static FOMA_TLS int a_size = 0;
+static FOMA_TLS int top = -1;
+
+static FOMA_TLS void **ptr_stack = NULL;
+static FOMA_TLS int ptr_stack_size = 0;
+static FOMA_TLS int ptr_stack_top = -1;
+
+void fsm_thread_clear() {
+    xxfree(a);
+    a = NULL;
+    a_size = 0;
+    top = -1;
+    xxfree(ptr_stack);
+    ptr_stack = NULL;
+    ptr_stack_size = 0;
+    ptr_stack_top = -1;
+}
 
 int ptr_stack_isempty() {
     return ptr_stack_top == -1;
@@ -49,6 +64,10 @@ void ptr_stack_push(void *ptr) {
         fprintf(stderr, "Pointer stack full!\n");
         exit(1);
     }
+    if (ptr_stack_top == ptr_stack_size - 1) {
+        ptr_stack_size = ptr_stack_size == 0 ? INITIAL_STACK : ptr_stack_size * 2;
+        ptr_stack = xxrealloc(ptr_stack, sizeof(void *) * ptr_stack_size);
+    }
     ptr_stack[++ptr_stack_top] = ptr;
 }
 
@@ -83,6 +102,10 @@ void int_stack_push(int c) {
     fprintf(stderr, "Stack full!\n");
     exit(1);
   }
+  if (top == a_size - 1) {
+    a_size = a_size == 0 ? INITIAL_STACK : a_size * 2;
+    a = xxrealloc(a, sizeof(int) * a_size);
+  }
   a[++top] = c;
 }
 
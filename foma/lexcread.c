@@ -71,16 +71,16 @@ struct lexc_hashtable {      /* Hash for looking up symbols in sigma quickly */
 
 static unsigned int primes[26] = {61,127,251,509,1021,2039,4093,8191,16381,32749,65521,131071,262139,524287,1048573,2097143,4194301,8388593,16777213,33554393,67108859,134217689,268435399,536870909,1073741789,2147483647};
 
-static struct statelist *statelist = NULL;
-static struct multichar_symbols *mc = NULL;
-static struct lexstates *lexstates = NULL;
-static struct sigma *lexsigma = NULL;
-static struct lexc_hashtable *hashtable;
-static struct fsm *current_regex_network;
+static FOMA_TLS struct statelist *statelist = NULL;
+static FOMA_TLS struct multichar_symbols *mc = NULL;
+static FOMA_TLS struct lexstates *lexstates = NULL;
+static FOMA_TLS struct sigma *lexsigma = NULL;
+static FOMA_TLS struct lexc_hashtable *hashtable;
+static FOMA_TLS struct fsm *current_regex_network;
 
-static int cwordin[1000], cwordout[1000], carity, lexc_statecount, maxlen, hasfinal, current_entry, net_has_unknown;
-static _Bool *mchash;
-static struct lexstates *clexicon, *ctarget;
+static FOMA_TLS int cwordin[1000], cwordout[1000], carity, lexc_statecount, maxlen, hasfinal, current_entry, net_has_unknown;
+static FOMA_TLS _Bool *mchash;
+static FOMA_TLS struct lexstates *clexicon, *ctarget;
 
 static char *mystrncpy(char *dest, char *src, int len);
 static void lexc_string_to_tokens(char *string, int *intarr);
@@ -934,10 +934,16 @@ struct fsm *lexc_to_fsm() {
     
     printf("Determinizing...\n");
     fflush(stdout);
+    fsm_subset_clear_aborted();
     net = fsm_determinize(net);
     printf("Minimizing...\n");
     fflush(stdout);
     net = fsm_topsort(fsm_minimize(net));
+    /* A determinization that hit its limit left an empty net behind */
+    if (fsm_subset_aborted()) {
+        fsm_destroy(net);
+        return(NULL);
+    }
     printf("Done!\n");
     return(net);
 }
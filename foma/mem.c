@@ -39,6 +39,10 @@ int g_list_limit = 100;
 int g_list_random_limit = 15;
 int g_med_limit  = 3;
 int g_med_cutoff = 15;
+int g_threads = 1;
+int g_subset_threads = 1;
+int g_subset_max_states = 0;
+int g_subset_max_mb = 0;
 char *g_att_epsilon = "@0@";
 
 char *xxstrndup(const char *s, size_t n) {
@@ -25,9 +25,9 @@ static struct fsm *fsm_minimize_brz(struct fsm *net);
 static struct fsm *fsm_minimize_hop(struct fsm *net);
 static struct fsm *rebuild_machine(struct fsm *net);
 
-static int *single_sigma_array, *double_sigma_array, *memo_table, *temp_move, *temp_group, maxsigma, epsilon_symbol, num_states, num_symbols, num_finals, mainloop, total_states;
+static FOMA_TLS int *single_sigma_array, *double_sigma_array, *memo_table, *temp_move, *temp_group, maxsigma, epsilon_symbol, num_states, num_symbols, num_finals, mainloop, total_states;
 
-static _Bool *finals;
+static FOMA_TLS _Bool *finals;
 
 struct statesym {
     int target;
@@ -69,19 +69,22 @@ struct agenda {
 struct trans_list {
     int inout;
     int source;
-} *trans_list;
+};
 
 struct trans_array {
     struct trans_list *transitions;
     unsigned int size;
     unsigned int tail;
-} *trans_array;
+};
 
+static FOMA_TLS struct trans_list *trans_list;
+static FOMA_TLS struct trans_array *trans_array;
 
 
-static struct p *P, *Phead, *Pnext, *current_w;
-static struct e *E;
-static struct agenda *Agenda_head, *Agenda_top, *Agenda_next, *Agenda;
+
+static FOMA_TLS struct p *P, *Phead, *Pnext, *current_w;
+static FOMA_TLS struct e *E;
+static FOMA_TLS struct agenda *Agenda_head, *Agenda_top, *Agenda_next, *Agenda;
 
 static inline int refine_states(int sym);
 static void init_PE();
@@ -91,6 +94,18 @@ static void sigma_to_pairs(struct fsm *net);
 static inline int symbol_pair_to_single_symbol(int in, int out);
 static void generate_inverse(struct fsm *net);
 
+/* Lets a construction switch minimization off for the calling thread */
+/* without touching g_minimal; returns the previous setting            */
+
+static FOMA_TLS int minimize_suspended = 0;
+
+int fsm_minimize_suspend(int value) {
+    int old;
+    old = minimize_suspended;
+    minimize_suspended = value;
+    return(old);
+}
+
 struct fsm *fsm_minimize(struct fsm *net) {
     extern int g_minimal;
     extern int g_minimize_hopcroft;
@@ -101,7 +116,7 @@ struct fsm *fsm_minimize(struct fsm *net) {
         net = fsm_determinize(net);
     if (net->is_pruned != YES)
         net = fsm_coaccessible(net);
-    if (net->is_minimized != YES && g_minimal == 1) {
+    if (net->is_minimized != YES && g_minimal == 1 && !minimize_suspended) {
         if (g_minimize_hopcroft != 0) {
             net = fsm_minimize_hop(net);
         }
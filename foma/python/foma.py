@@ -34,6 +34,11 @@ foma_fsm_parse_regex.restype = POINTER(FSTstruct)
 foma_apply_init = foma.apply_init
 foma_apply_init.restype = c_void_p
 foma_apply_clear = foma.apply_clear
+foma_apply_shared_init = foma.apply_shared_init
+foma_apply_shared_init.restype = c_void_p
+foma_apply_shared_clear = foma.apply_shared_clear
+foma_apply_init_shared = foma.apply_init_shared
+foma_apply_init_shared.restype = c_void_p
 foma_apply_words = foma.apply_words
 foma_apply_words.restype = c_char_p
 foma_apply_lower_words = foma.apply_lower_words
@@ -44,6 +49,16 @@ foma_apply_down = foma.apply_down
 foma_apply_down.restype = c_char_p
 foma_apply_up = foma.apply_up
 foma_apply_up.restype = c_char_p
+foma_apply_down_ids = foma.apply_down_ids
+foma_apply_down_ids.restype = POINTER(c_int)
+foma_apply_up_ids = foma.apply_up_ids
+foma_apply_up_ids.restype = POINTER(c_int)
+foma_apply_symbol_id = foma.apply_symbol_id
+foma_apply_symbol_id.restype = c_int
+foma_apply_symbol_name = foma.apply_symbol_name
+foma_apply_symbol_name.restype = c_char_p
+foma_apply_sigma_size = foma.apply_sigma_size
+foma_apply_sigma_size.restype = c_int
 foma_fsm_count = foma.fsm_count
 foma_fsm_topsort = foma.fsm_topsort
 foma_fsm_topsort.restype = POINTER(FSTstruct)
@@ -146,6 +161,7 @@ class FST(object):
             #raise ValueError("Expected str or unicode")
             
     def __init__(self, regex = False):
+        self.sharedtables = None
         if regex:
             self.regex = self.encode(regex)
             self.fsthandle = foma_fsm_parse_regex(c_char_p(self.regex), c_void_p(self.networkdefinitions.defhandle), c_void_p(self.functiondefinitions.deffhandle))
@@ -158,8 +174,7 @@ class FST(object):
     def __getitem__(self, key):
         if not self.fsthandle:
             raise KeyError('FST not defined')
-        if not self.getitemapplyer:
-            self.getitemapplyer = foma_apply_init(self.fsthandle)
+        self._getitemapplyer()
         result = []
         output = foma_apply_down(c_void_p(self.getitemapplyer), c_char_p(self.encode(key)))
         while True:
@@ -169,7 +184,23 @@ class FST(object):
                 result.append(output)
                 output = foma_apply_down(c_void_p(self.getitemapplyer), None)
             
+    def _getitemapplyer(self):
+        if not self.getitemapplyer:
+            self.getitemapplyer = foma_apply_init(self.fsthandle)
+        return self.getitemapplyer
+
+    def _sharedtables(self):
+        if not self.sharedtables:
+            self.sharedtables = foma_apply_shared_init(self.fsthandle)
+        return self.sharedtables
+
+    def _clearsharedtables(self):
+        if self.sharedtables:
+            foma_apply_shared_clear(c_void_p(self.sharedtables))
+            self.sharedtables = None
+
     def __del__(self):
+        self._clearsharedtables()
         if self.fsthandle:
             #print "DESTROY"
             foma_fsm_destroy(self.fsthandle)
@@ -190,6 +221,7 @@ class FST(object):
     def __len__(self):
         if self.fsthandle:
             if self.fsthandle.contents.pathcount == -3: # UNKNOWN
+                self._clearsharedtables()
                 self.fsthandle = foma_fsm_topsort(self.fsthandle)
             if self.fsthandle.contents.pathcount == -1: # CYCLIC
                 raise ValueError("FSM is cyclic")
@@ -291,6 +323,56 @@ class FST(object):
         else:
             raise ValueError('Undefined FST')
 
+    def _apply_ids(self, applyf, ids):
+        if not self.fsthandle:
+            raise ValueError('FST not defined')
+        # The network tables are built once per FST and shared; each call
+        # only gets a handle of its own for the search state
+        applyerhandle = foma_apply_init_shared(c_void_p(self._sharedtables()))
+        try:
+            inarray = (c_int * max(len(ids), 1))(*ids)
+            outlength = c_int()
+            output = applyf(c_void_p(applyerhandle), inarray, c_int(len(ids)), byref(outlength))
+            while output:
+                yield output[:outlength.value]
+                output = applyf(c_void_p(applyerhandle), None, c_int(0), byref(outlength))
+        finally:
+            foma_apply_clear(c_void_p(applyerhandle))
+
+    def apply_down_ids(self, ids):
+        """Like apply_down, for input given as symbol ids (see symbol_id).
+           Yields each output as a list of symbol ids."""
+        return self._apply_ids(foma_apply_down_ids, ids)
+
+    def apply_up_ids(self, ids):
+        """Like apply_up, for input given as symbol ids (see symbol_id).
+           Yields each output as a list of symbol ids."""
+        return self._apply_ids(foma_apply_up_ids, ids)
+
+    def symbol_id(self, symbol):
+        """Returns the id of an alphabet symbol, or -1 if there is none."""
+        if not self.fsthandle:
+            raise ValueError('FST not defined')
+        return foma_apply_symbol_id(c_void_p(self._getitemapplyer()), c_char_p(self.encode(symbol)))
+
+    def symbol_name(self, id):
+        """Returns the symbol with a given id, or None."""
+        if not self.fsthandle:
+            raise ValueError('FST not defined')
+        return foma_apply_symbol_name(c_void_p(self._getitemapplyer()), c_int(id))
+
+    def symbols(self):
+        """Returns the alphabet as a dict from symbols to ids."""
+        if not self.fsthandle:
+            raise ValueError('FST not defined')
+        applyerhandle = c_void_p(self._getitemapplyer())
+        table = {}
+        for i in xrange(foma_apply_sigma_size(applyerhandle)):
+            name = foma_apply_symbol_name(applyerhandle, c_int(i))
+            if name is not None:
+                table[name] = i
+        return table
+
     def _fomacallunary(self, func, minimize = True):
         if self.fsthandle:
             handle = func(foma_fsm_copy(self.fsthandle))
@@ -24,19 +24,19 @@
 extern int yyerror();
 extern int yylex();
 extern int my_yyparse(char *my_string, int lineno, struct defined_networks *defined_nets, struct defined_functions *defined_funcs);
-struct fsm *current_parse;
-int rewrite, rule_direction;
-int substituting = 0;
-static char *subval1, *subval2;
-struct fsmcontexts *contexts;
-struct fsmrules *rules;
-struct rewrite_set *rewrite_rules;
-static struct fsm *fargs[100][MAX_F_RECURSION];  /* Function arguments [number][frec] */
-static int frec = -1;                            /* Current depth of function recursion */
-static char *fname[MAX_F_RECURSION];             /* Function names */
-static int fargptr[MAX_F_RECURSION];             /* Current argument no. */
+FOMA_TLS struct fsm *current_parse;
+FOMA_TLS int rewrite, rule_direction;
+FOMA_TLS int substituting = 0;
+static FOMA_TLS char *subval1, *subval2;
+FOMA_TLS struct fsmcontexts *contexts;
+FOMA_TLS struct fsmrules *rules;
+FOMA_TLS struct rewrite_set *rewrite_rules;
+static FOMA_TLS struct fsm *fargs[100][MAX_F_RECURSION];  /* Function arguments [number][frec] */
+static FOMA_TLS int frec = -1;                            /* Current depth of function recursion */
+static FOMA_TLS char *fname[MAX_F_RECURSION];             /* Function names */
+static FOMA_TLS int fargptr[MAX_F_RECURSION];             /* Current argument no. */
 /* Variable to produce internal symbols */
-unsigned int g_internal_sym = 23482342;
+FOMA_TLS unsigned int g_internal_sym = 23482342;
 
 void add_function_argument(struct fsm *net) {
     fargs[fargptr[frec]][frec] = net;
@@ -53,33 +53,41 @@ void declare_function_name(char *s) {
 }
 
 struct fsm *function_apply(struct defined_networks *defined_nets, struct defined_functions *defined_funcs) {
-    int i, mygsym, myfargptr;
+    int i;
     char *regex;
     char repstr[13], oldstr[13];
+    struct defined_networks *args, *d;
     if ((regex = find_defined_function(defined_funcs, fname[frec],fargptr[frec])) == NULL) {
         fprintf(stderr, "***Error: function %s@%i) not defined!\n",fname[frec], fargptr[frec]);
         return NULL;
     }
     regex = xxstrdup(regex);
-    mygsym = g_internal_sym;
-    myfargptr = fargptr[frec];
     /* Create new regular expression from function def. */
     /* and parse that */
+    args = defined_nets;
     for (i = 0; i < fargptr[frec]; i++) {
         sprintf(repstr,"%012X",g_internal_sym);
         sprintf(oldstr, "@ARGUMENT%02i@", (i+1));
         streqrep(regex, oldstr, repstr);
         /* We temporarily define a network and save argument there */
-        /* The name is a running counter g_internal_sym */
-        add_defined(defined_nets, fargs[i][frec], repstr);
+        /* The name is a running counter g_internal_sym.  It goes  */
+        /* in front of the caller's definitions, which are shared  */
+        /* between threads and so are left untouched               */
+        d = xxmalloc(sizeof(struct defined_networks));
+        d->name = xxstrdup(repstr);
+        d->net = fargs[i][frec];
+        d->next = args;
+        args = d;
         g_internal_sym++;
     }
-    my_yyparse(regex,1,defined_nets, defined_funcs);
-    for (i = 0; i < myfargptr; i++) {
-        sprintf(repstr,"%012X",mygsym);
-        /* Remove the temporarily defined network */
-        remove_defined(defined_nets, repstr);
-        mygsym++;
+    my_yyparse(regex,1,args, defined_funcs);
+    /* Remove the temporarily defined networks */
+    while (args != defined_nets) {
+        d = args;
+        args = d->next;
+        fsm_destroy(d->net);
+        xxfree(d->name);
+        xxfree(d);
     }
     xxfree(fname[frec]);
     frec--;
@@ -231,7 +231,6 @@ struct fsm *fsm_rewrite(struct rewrite_set *all_rules) {
     struct fsm *UnionCP, *RuleCP, *UnionCPI, *Insert, *NoSpecial, *Context, *ContextD, *Result, *Coerce, *CoerceLR, *CoerceLM, *CoerceSM, *thisCoerce, *SigL, *SigR, *Id, *Outside, *EndOutside, *CoerceCenter = NULL;
     int dir, c, minimal_old, dottedrules, num_parallel_rules;
 
-    extern int g_minimal;
 
     dottedrules = 0;
 
@@ -354,8 +353,7 @@ struct fsm *fsm_rewrite(struct rewrite_set *all_rules) {
 
 
     /* Suspend minimization for Context */
-    minimal_old = g_minimal;
-    g_minimal = 0;
+    minimal_old = fsm_minimize_suspend(1);
 
     if (allcontexts == NULL) {
         Context = fsm_universal();
@@ -386,7 +384,7 @@ struct fsm *fsm_rewrite(struct rewrite_set *all_rules) {
         }
     }
 
-    g_minimal = minimal_old;
+    fsm_minimize_suspend(minimal_old);
 
     /* For all L C R combos */
     /* ~[?* - [?* @>@] Dir(L) A [Dir(R) ?* & Outside ?*] ?*] for -> */
@@ -21,10 +21,10 @@
 #include <sys/time.h>
 #include "foma.h"
 
-static struct defined_quantifiers *quantifiers;
+static FOMA_TLS struct defined_quantifiers *quantifiers;
 
 char *fsm_get_library_version_string() {
-    static char s[20];
+    static FOMA_TLS char s[20];
     sprintf(s,"%i.%i.%i%s",MAJOR_VERSION,MINOR_VERSION,BUILD_VERSION,STATUS_VERSION);
     return(s);
 }
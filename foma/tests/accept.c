@@ -0,0 +1,162 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+/* apply_down_accepts() and apply_up_accepts() say yes exactly when    */
+/* apply_down() and apply_up() give a result, whether the answer comes */
+/* from the DFA or, past the accept limit or with flags, from a search */
+
+#include "check.h"
+
+#define NUMWORDS 100
+
+/* A random net, now and then with ? and @ arcs, or flags that */
+/* forbid what another requires                                */
+static struct fsm *net_accept(int kind) {
+    struct fsm_construct_handle *h;
+    struct fsm_state *line;
+    struct fsm *net;
+    net = check_net_random(6, 12, 1);
+    h = fsm_construct_init("accept");
+    fsm_construct_copy_sigma(h, net->sigma);
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1)
+            fsm_construct_add_arc_nums(h, line->state_no, line->target, line->in, line->out);
+        if (line->final_state)
+            fsm_construct_set_final(h, line->state_no);
+    }
+    if (kind == 1) {
+        fsm_construct_add_arc(h, check_rand() % 6, check_rand() % 6, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@");
+        fsm_construct_add_arc(h, check_rand() % 6, check_rand() % 6, "@_UNKNOWN_SYMBOL_@", "b");
+    } else if (kind == 2) {
+        fsm_construct_add_arc(h, 0, 1 + check_rand() % 2, "@P.F.x@", "@P.F.x@");
+        fsm_construct_add_arc(h, 3, 4 + check_rand() % 2, "@D.F.x@", "@D.F.x@");
+        fsm_construct_add_arc(h, 2, 3, "@R.F.x@", "@R.F.x@");
+    }
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    fsm_destroy(net);
+    return(fsm_construct_done(h));
+}
+
+/* Compares the acceptor with lookups on another handle, first with */
+/* the given accept limit and then with a limit that forces searches */
+static void test_accept(struct fsm *net, int limit) {
+    struct apply_handle *h, *ah, *sh;
+    char **words;
+    int i, up, want;
+
+    h = apply_init(net);
+    ah = apply_init(net);
+    sh = apply_init(net);
+    apply_set_accept_limit(ah, limit);
+    apply_set_accept_limit(sh, 1);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            want = (up ? apply_up(h, words[i]) : apply_down(h, words[i])) != NULL;
+            CHECK((up ? apply_up_accepts(ah, words[i]) : apply_down_accepts(ah, words[i])) == want);
+            CHECK((up ? apply_up_accepts(sh, words[i]) : apply_down_accepts(sh, words[i])) == want);
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(ah);
+    apply_clear(sh);
+}
+
+/* (a|b)* a (a|b)^n, whose DFA has 2^(n+1) states */
+static struct fsm *net_nth_from_end(int n) {
+    struct fsm_construct_handle *h;
+    int i;
+    h = fsm_construct_init("nth");
+    fsm_construct_add_arc(h, 0, 0, "a", "a");
+    fsm_construct_add_arc(h, 0, 0, "b", "b");
+    fsm_construct_add_arc(h, 0, 1, "a", "a");
+    for (i = 1; i <= n; i++) {
+        fsm_construct_add_arc(h, i, i+1, "a", "a");
+        fsm_construct_add_arc(h, i, i+1, "b", "b");
+    }
+    fsm_construct_set_final(h, n+1);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* Past the limit the acceptor gives up on its DFA and searches, */
+/* leaving no abort behind for the caller; within it the DFA is  */
+/* used and agrees with the search                               */
+static void test_limit(void) {
+    struct apply_handle *h;
+    struct fsm *net;
+
+    net = net_nth_from_end(20);
+    h = apply_init(net);
+    apply_set_accept_limit(h, 100);
+    CHECK(apply_down_accepts(h, "aaaaaaaaaaaaaaaaaaaaa") == 1);
+    CHECK(apply_down_accepts(h, "baaaaaaaaaaaaaaaaaaaa") == 0);
+    CHECK(apply_up_accepts(h, "abbbbbbbbbbbbbbbbbbbb") == 1);
+    CHECK(apply_up_accepts(h, "bbbbbbbbbbbbbbbbbbbbb") == 0);
+    CHECK(!fsm_subset_aborted());
+    apply_clear(h);
+    fsm_destroy(net);
+
+    net = net_nth_from_end(4);
+    h = apply_init(net);
+    CHECK(apply_down_accepts(h, "babaab") == 1);
+    CHECK(apply_down_accepts(h, "bbbaab") == 0);
+    CHECK(apply_down_accepts(h, "abbbb") == 1);
+    CHECK(apply_down_accepts(h, "abbb") == 0);
+    CHECK(apply_down_accepts(h, "") == 0);
+    CHECK(apply_down_accepts(h, "abbbc") == 0);
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+/* A start state that reaches no final state accepts nothing */
+static void test_empty(void) {
+    struct fsm_construct_handle *ch;
+    struct apply_handle *h;
+    struct fsm *net;
+
+    ch = fsm_construct_init("empty");
+    fsm_construct_add_arc(ch, 0, 1, "a", "b");
+    fsm_construct_add_arc(ch, 2, 3, "a", "b");
+    fsm_construct_set_final(ch, 3);
+    fsm_construct_set_initial(ch, 0);
+    net = fsm_construct_done(ch);
+    h = apply_init(net);
+    CHECK(apply_down_accepts(h, "a") == 0);
+    CHECK(apply_down_accepts(h, "") == 0);
+    CHECK(apply_up_accepts(h, "b") == 0);
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(21);
+    test_limit();
+    test_empty();
+    net = check_net_words();
+    test_accept(net, 0);
+    fsm_destroy(net);
+    for (i = 0; i < 90; i++) {
+        net = net_accept(i % 3);
+        test_accept(net, i % 2 ? 0 : 4);
+        fsm_destroy(net);
+    }
+    return(check_done("accept"));
+}
@@ -0,0 +1,84 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Lookups over the packed arc arrays give the results of a plain */
+/* search over the nets' line arrays, whichever way arcs are found */
+
+#include <limits.h>
+#include "check.h"
+
+#define NUMWORDS 200
+
+static void check_lookups(struct apply_handle *h, struct fsm *net, char **words) {
+    char *s, *r;
+    int i, up;
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            s = check_apply(h, words[i], up);
+            r = check_reference(net, words[i], up);
+            CHECK(strcmp(s, r) == 0);
+            free(s);
+            free(r);
+        }
+    }
+}
+
+static void test_arcs(struct fsm *net) {
+    struct apply_handle *h;
+    char **words;
+    words = check_word_list(net, NUMWORDS);
+
+    /* Scanning each state's arcs */
+    h = apply_init(net);
+    check_lookups(h, net, words);
+    apply_clear(h);
+
+    /* The old index, over every state up to the last one */
+    h = apply_init(net);
+    apply_index(h, APPLY_INDEX_INPUT, 0, INT_MAX, 0);
+    apply_index(h, APPLY_INDEX_OUTPUT, 0, INT_MAX, 0);
+    check_lookups(h, net, words);
+    apply_clear(h);
+
+    /* Binary search over arcs sorted on either side */
+    fsm_sort_arcs(net, 1);
+    h = apply_init(net);
+    check_lookups(h, net, words);
+    apply_clear(h);
+    fsm_sort_arcs(net, 2);
+    h = apply_init(net);
+    check_lookups(h, net, words);
+    apply_clear(h);
+
+    check_free_list(words, NUMWORDS);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(3);
+    for (i = 0; i < 30; i++) {
+        /* From a state or two up to some with many arcs and some with none */
+        net = check_net_random(1 + i % 10, 2 + (i * 7) % 30, i % 2);
+        test_arcs(net);
+        fsm_destroy(net);
+    }
+    net = check_net_random(40, 60, 1);
+    test_arcs(net);
+    fsm_destroy(net);
+    return(check_done("arcs"));
+}
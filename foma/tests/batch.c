@@ -0,0 +1,159 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_down_batch()/apply_up_batch() give the results of a plain */
+/* search for every word, and ask for room a word doesn't fit in    */
+
+#include "check.h"
+
+#define NUMWORDS 300
+
+static char *batch_word(struct apply_batch *b, int i) {
+    char **results, *s;
+    int j, n;
+    n = b->word_results[i+1] - b->word_results[i];
+    results = malloc(sizeof(char *) * (n + 1));
+    for (j = 0; j < n; j++)
+        results[j] = b->arena + *(b->results + b->word_results[i] + j);
+    s = check_join(results, n);
+    free(results);
+    return(s);
+}
+
+static void test_batch_random(struct fsm *net) {
+    struct apply_handle *h;
+    struct apply_batch b;
+    char **words, *s, *r;
+    int i, up, first, done;
+
+    h = apply_init(net);
+    words = check_word_list(net, NUMWORDS);
+    b.arena_size = 4096;
+    b.arena = malloc(b.arena_size);
+    b.results_size = 256;
+    b.results = malloc(sizeof(size_t) * b.results_size);
+    b.word_results = malloc(sizeof(int) * (NUMWORDS + 1));
+    for (up = 0; up < 2; up++) {
+        for (first = 0; first < NUMWORDS; first += done) {
+            done = up ? apply_up_batch(h, words + first, NUMWORDS - first, &b) : apply_down_batch(h, words + first, NUMWORDS - first, &b);
+            CHECK(b.numresults == b.word_results[done] - b.word_results[0]);
+            for (i = 0; i < done; i++) {
+                s = batch_word(&b, i);
+                r = check_reference(net, words[first+i], up);
+                CHECK(strcmp(s, r) == 0);
+                free(s);
+                free(r);
+            }
+            if (first + done < NUMWORDS) {
+                if (b.arena_needed > b.arena_size) {
+                    b.arena_size = b.arena_needed;
+                    b.arena = realloc(b.arena, b.arena_size);
+                }
+                if (b.results_needed > b.results_size) {
+                    b.results_size = b.results_needed;
+                    b.results = realloc(b.results, sizeof(size_t) * b.results_size);
+                }
+            }
+        }
+    }
+    free(b.arena);
+    free(b.results);
+    free(b.word_results);
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+}
+
+static struct fsm *net_batch(void) {
+    struct fsm_construct_handle *h;
+    h = fsm_construct_init("batch");
+    fsm_construct_add_arc(h, 0, 1, "a", "x");
+    fsm_construct_add_arc(h, 0, 2, "a", "xx");
+    fsm_construct_add_arc(h, 0, 3, "a", "xxx");
+    fsm_construct_add_arc(h, 0, 4, "a", "xxxx");
+    fsm_construct_add_arc(h, 0, 5, "b", "y");
+    fsm_construct_set_final(h, 1);
+    fsm_construct_set_final(h, 2);
+    fsm_construct_set_final(h, 3);
+    fsm_construct_set_final(h, 4);
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* Starting from no room at all, growing as asked gets every word through */
+static void test_batch_overflow(void) {
+    struct apply_handle *h;
+    struct apply_batch b;
+    struct fsm *net;
+    char *words[] = { "a", "b", "c", "a", "b" };
+    char *expect[] = { "x,xx,xxx,xxxx", "y", "", "x,xx,xxx,xxxx", "y" };
+    char *s;
+    int i, first, done, rounds;
+
+    net = net_batch();
+    h = apply_init(net);
+    b.arena_size = 1;
+    b.arena = malloc(b.arena_size);
+    b.results_size = 1;
+    b.results = malloc(sizeof(size_t) * b.results_size);
+    b.word_results = malloc(sizeof(int) * 6);
+    for (first = 0, rounds = 0; first < 5 && rounds < 20; rounds++) {
+        done = apply_down_batch(h, words + first, 5 - first, &b);
+        for (i = 0; i < done; i++) {
+            s = batch_word(&b, i);
+            CHECK(strcmp(s, expect[first+i]) == 0);
+            free(s);
+        }
+        first += done;
+        if (first < 5) {
+            CHECK(b.arena_needed > 0 || b.results_needed > 0);
+            /* A word that doesn't fit first has to ask for more */
+            if (done == 0)
+                CHECK(b.arena_needed > b.arena_size || b.results_needed > b.results_size);
+            if (b.arena_needed > b.arena_size) {
+                b.arena_size = b.arena_needed;
+                b.arena = realloc(b.arena, b.arena_size);
+            }
+            if (b.results_needed > b.results_size) {
+                b.results_size = b.results_needed;
+                b.results = realloc(b.results, sizeof(size_t) * b.results_size);
+            }
+        }
+    }
+    CHECK(first == 5);
+    /* "a" on its own needs 4 results and 14 bytes */
+    CHECK(b.results_size == 4);
+    CHECK(b.arena_size == 14);
+    free(b.arena);
+    free(b.results);
+    free(b.word_results);
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(2);
+    for (i = 0; i < 20; i++) {
+        net = check_net_random(8, 24, 1);
+        test_batch_random(net);
+        fsm_destroy(net);
+    }
+    test_batch_overflow();
+    return(check_done("batch"));
+}
@@ -0,0 +1,166 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+/* g_subset_max_states and g_subset_max_mb stop the subset construction */
+/* with the empty language and fsm_subset_aborted() set, counting the   */
+/* working tables of every worker when it is threaded                   */
+
+#include <pthread.h>
+#include "check.h"
+
+extern int g_subset_threads, g_subset_max_states, g_subset_max_mb;
+
+/* (a|b)* a (a|b)^n, whose DFA has 2^(n+1) states */
+static struct fsm *net_nth_from_end(int n) {
+    struct fsm_construct_handle *h;
+    int i;
+    h = fsm_construct_init("nth");
+    fsm_construct_add_arc(h, 0, 0, "a", "a");
+    fsm_construct_add_arc(h, 0, 0, "b", "b");
+    fsm_construct_add_arc(h, 0, 1, "a", "a");
+    for (i = 1; i <= n; i++) {
+        fsm_construct_add_arc(h, i, i+1, "a", "a");
+        fsm_construct_add_arc(h, i, i+1, "b", "b");
+    }
+    fsm_construct_set_final(h, n+1);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* A chain of length states over a and b, with an a straight to its */
+/* end: the DFA is as large as the net, over small subsets          */
+static struct fsm *net_chain(int length) {
+    struct fsm_construct_handle *h;
+    int i;
+    h = fsm_construct_init("chain");
+    for (i = 0; i < length; i++) {
+        fsm_construct_add_arc(h, i, i+1, "a", "a");
+        fsm_construct_add_arc(h, i, i+1, "b", "b");
+    }
+    fsm_construct_add_arc(h, 0, length, "a", "a");
+    fsm_construct_set_final(h, length);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* The state count of net determinized with the given threads and */
+/* limits, or -1 if the construction gave up                       */
+static int bound_determinize(struct fsm *net, int threads, int max_states, int max_mb) {
+    struct fsm *out;
+    int statecount;
+    g_subset_threads = threads;
+    g_subset_max_states = max_states;
+    g_subset_max_mb = max_mb;
+    fsm_subset_clear_aborted();
+    out = fsm_determinize(fsm_copy(net));
+    if (fsm_subset_aborted()) {
+        CHECK(out->finalcount == 0 && out->arccount == 0);
+        statecount = -1;
+    } else {
+        statecount = out->statecount;
+    }
+    fsm_destroy(out);
+    g_subset_threads = 1;
+    g_subset_max_states = g_subset_max_mb = 0;
+    fsm_subset_clear_aborted();
+    return(statecount);
+}
+
+static void test_states(void) {
+    struct fsm *net;
+    net = net_nth_from_end(10);
+    CHECK(bound_determinize(net, 1, 100, 0) == -1);
+    CHECK(bound_determinize(net, 1, 2048, 0) == 2048);
+    CHECK(bound_determinize(net, 1, 0, 0) == 2048);
+    fsm_destroy(net);
+    /* Threading only takes nets of 256 states and up */
+    net = net_chain(1000);
+    CHECK(bound_determinize(net, 4, 100, 0) == -1);
+    CHECK(bound_determinize(net, 1, 100, 0) == -1);
+    CHECK(bound_determinize(net, 4, 0, 0) == bound_determinize(net, 1, 0, 0));
+    fsm_destroy(net);
+}
+
+/* The chain's subsets take little room next to the closure tables */
+/* of eight workers, 4 tables of 60000 ints each                    */
+static void test_memory(void) {
+    struct fsm *net;
+    int statecount;
+    net = net_chain(60000);
+    statecount = bound_determinize(net, 1, 0, 0);
+    CHECK(statecount > 60000);
+    CHECK(bound_determinize(net, 1, 0, 8) == statecount);
+    CHECK(bound_determinize(net, 8, 0, 8) == -1);
+    CHECK(bound_determinize(net, 8, 0, 16) == statecount);
+    fsm_destroy(net);
+}
+
+static size_t bound_bytes;
+
+static void bound_progress(int subsets, size_t bytes, void *userdata) {
+    if (bytes > bound_bytes)
+        bound_bytes = bytes;
+}
+
+/* The progress callback sees the same count */
+static void test_progress(void) {
+    struct fsm *net;
+    int length;
+    length = 70000;
+    net = net_chain(length);
+    fsm_set_subset_progress(bound_progress, NULL);
+    bound_bytes = 0;
+    CHECK(bound_determinize(net, 1, 0, 0) > length);
+    CHECK(bound_bytes >= 2 * length * sizeof(int));
+    bound_bytes = 0;
+    CHECK(bound_determinize(net, 8, 0, 0) > length);
+    CHECK(bound_bytes >= 8 * 4 * length * sizeof(int));
+    fsm_set_subset_progress(NULL, NULL);
+    fsm_destroy(net);
+}
+
+static void *bound_thread(void *arg) {
+    struct fsm *net;
+    net = fsm_determinize(fsm_copy(arg));
+    fsm_destroy(net);
+    fsm_thread_clear();
+    return((void *) (long) fsm_subset_aborted());
+}
+
+/* The aborted flag is left set only in the thread that ran into */
+/* the limit                                                     */
+static void test_thread(void) {
+    pthread_t thread;
+    struct fsm *net;
+    void *aborted;
+    net = net_nth_from_end(10);
+    fsm_subset_clear_aborted();
+    g_subset_max_states = 100;
+    CHECK(pthread_create(&thread, NULL, bound_thread, net) == 0);
+    pthread_join(thread, &aborted);
+    g_subset_max_states = 0;
+    CHECK(aborted != NULL);
+    CHECK(!fsm_subset_aborted());
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    test_states();
+    test_memory();
+    test_progress();
+    test_thread();
+    return(check_done("bound"));
+}
@@ -0,0 +1,109 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* A handle with a result cache gives the results a handle without */
+/* one gives, whether a lookup hits or misses                      */
+
+#include "check.h"
+
+#define NUMWORDS 100
+#define NUMLOOKUPS 2000
+
+/* Whether result is one of the joined results */
+static int cache_has(char *joined, char *result) {
+    char *p;
+    int len;
+    len = strlen(result);
+    for (p = joined; p != NULL; p = strchr(p, ',') != NULL ? strchr(p, ',') + 1 : NULL) {
+        if (strncmp(p, result, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return(1);
+    }
+    return(0);
+}
+
+static void test_cache(struct fsm *net, size_t max_bytes) {
+    struct apply_handle *h, *hc;
+    char **words, *s, *r;
+    char *expect[NUMWORDS][2];
+    unsigned long hits, misses;
+    int i, n, up;
+
+    words = check_word_list(net, NUMWORDS);
+    h = apply_init(net);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++)
+            expect[i][up] = check_apply(h, words[i], up);
+    }
+    apply_clear(h);
+
+    hc = apply_init(net);
+    apply_set_cache(hc, max_bytes);
+    for (n = 0; n < NUMLOOKUPS; n++) {
+        i = check_rand() % NUMWORDS;
+        up = check_rand() % 2;
+        /* Now and then give up after the first result, which must */
+        /* not leave a partial list in the cache                    */
+        if (check_rand() % 8 == 0) {
+            r = up ? apply_up(hc, words[i]) : apply_down(hc, words[i]);
+            if (r == NULL)
+                CHECK(expect[i][up][0] == '\0');
+            else
+                CHECK(cache_has(expect[i][up], r));
+            continue;
+        }
+        s = check_apply(hc, words[i], up);
+        CHECK(strcmp(s, expect[i][up]) == 0);
+        free(s);
+    }
+    apply_get_cache_stats(hc, &hits, &misses);
+    CHECK(hits > 0);
+    CHECK(hits + misses == NUMLOOKUPS);
+
+    /* Output settings flush the cache */
+    apply_set_print_pairs(hc, 1);
+    h = apply_init(net);
+    apply_set_print_pairs(h, 1);
+    for (i = 0; i < NUMWORDS; i++) {
+        s = check_apply(hc, words[i], 0);
+        r = check_apply(h, words[i], 0);
+        CHECK(strcmp(s, r) == 0);
+        free(s);
+        free(r);
+    }
+    apply_clear(h);
+    apply_clear(hc);
+
+    for (i = 0; i < NUMWORDS; i++) {
+        free(expect[i][0]);
+        free(expect[i][1]);
+    }
+    check_free_list(words, NUMWORDS);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(5);
+    for (i = 0; i < 20; i++) {
+        net = check_net_random(8, 24, 1);
+        /* Room for everything, and room for a few entries */
+        test_cache(net, 1 << 20);
+        test_cache(net, 1024);
+        fsm_destroy(net);
+    }
+    return(check_done("cache"));
+}
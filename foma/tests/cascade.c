@@ -0,0 +1,263 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* A cascade gives the outputs of applying its nets one after the   */
+/* other, symbol by symbol, each stage's duplicate symbol sequences */
+/* dropped; "a" "b" and "ab" are told apart                         */
+
+#include "check.h"
+
+#define NUMWORDS 60
+#define MAXSTAGES 3
+#define SEP "\001"
+
+/* Sequences of symbols are kept as their spellings, each followed */
+/* by SEP, so that sets of them can be sorted and compared          */
+
+struct stage_search {
+    struct fsm *net;
+    int *first;
+    char **in;
+    int numin;
+    int up;
+    char out[1024];
+    char **results;
+    int numresults;
+    int size;
+};
+
+static void stage_search(struct stage_search *ss, int state, int pos) {
+    struct fsm_state *line;
+    char *insym;
+    int in, out, len;
+    for (line = ss->net->states + ss->first[state]; line->state_no == state; line++) {
+        if (line->final_state && pos == ss->numin && line == ss->net->states + ss->first[state]) {
+            if (ss->numresults == ss->size) {
+                ss->size *= 2;
+                ss->results = realloc(ss->results, sizeof(char *) * ss->size);
+            }
+            ss->results[ss->numresults++] = strdup(ss->out);
+        }
+        if (line->target == -1)
+            continue;
+        in = ss->up ? line->out : line->in;
+        out = ss->up ? line->in : line->out;
+        insym = sigma_string(in, ss->net->sigma);
+        if (in != EPSILON && (pos == ss->numin || strcmp(ss->in[pos], insym) != 0))
+            continue;
+        len = strlen(ss->out);
+        if (out != EPSILON) {
+            strcat(ss->out, sigma_string(out, ss->net->sigma));
+            strcat(ss->out, SEP);
+        }
+        stage_search(ss, line->target, in == EPSILON ? pos : pos + 1);
+        ss->out[len] = '\0';
+    }
+}
+
+/* Adds the outputs of net for the sequence seq to the set */
+static void stage_apply(struct fsm *net, char *seq, int up, char ***set, int *setsize) {
+    struct stage_search ss;
+    struct fsm_state *line;
+    char *copy, *sym;
+    int i, j;
+    memset(&ss, 0, sizeof(ss));
+    ss.net = net;
+    ss.up = up;
+    ss.first = calloc(net->statecount, sizeof(int));
+    for (i = 0, line = net->states; line->state_no != -1; line++, i++) {
+        if (i == 0 || (line-1)->state_no != line->state_no)
+            ss.first[line->state_no] = i;
+    }
+    copy = strdup(seq);
+    ss.in = malloc(sizeof(char *) * (strlen(seq) + 1));
+    for (sym = strtok(copy, SEP); sym != NULL; sym = strtok(NULL, SEP))
+        ss.in[ss.numin++] = sym;
+    ss.size = 16;
+    ss.results = malloc(sizeof(char *) * ss.size);
+    stage_search(&ss, 0, 0);
+    for (i = 0; i < ss.numresults; i++) {
+        for (j = 0; j < *setsize; j++) {
+            if (strcmp((*set)[j], ss.results[i]) == 0)
+                break;
+        }
+        if (j < *setsize) {
+            free(ss.results[i]);
+        } else {
+            *set = realloc(*set, sizeof(char *) * (*setsize + 1));
+            (*set)[(*setsize)++] = ss.results[i];
+        }
+    }
+    free(ss.results);
+    free(ss.in);
+    free(copy);
+    free(ss.first);
+}
+
+static char *cascade_reference(struct fsm **nets, int numnets, char *word, int up) {
+    char **set, **next, buf[256], *s;
+    int i, j, n, numset, numnext, tokens[64];
+    /* The word is split up by the first stage's alphabet */
+    n = check_tokenize(nets[up ? numnets - 1 : 0], word, tokens);
+    buf[0] = '\0';
+    for (i = 0; i < n; i++) {
+        strcat(buf, tokens[i] == -1 ? "?" : sigma_string(tokens[i], nets[up ? numnets - 1 : 0]->sigma));
+        strcat(buf, SEP);
+    }
+    set = malloc(sizeof(char *));
+    set[0] = strdup(buf);
+    numset = 1;
+    for (i = 0; i < numnets; i++) {
+        next = NULL;
+        numnext = 0;
+        for (j = 0; j < numset; j++)
+            stage_apply(nets[up ? numnets - 1 - i : i], set[j], up, &next, &numnext);
+        check_free_list(set, numset);
+        set = next;
+        numset = numnext;
+    }
+    for (i = 0; i < numset; i++) {
+        for (s = set[i], j = 0; *s != '\0'; s++) {
+            if (*s != SEP[0])
+                set[i][j++] = *s;
+        }
+        set[i][j] = '\0';
+    }
+    s = check_join(set, numset);
+    check_free_list(set, numset);
+    return(s);
+}
+
+static char *cascade_apply(struct apply_cascade *c, char *word, int up) {
+    char **results, *r, *s;
+    int n;
+    results = NULL;
+    for (n = 0, r = up ? apply_cascade_up(c, word) : apply_cascade_down(c, word); r != NULL; r = up ? apply_cascade_up(c, NULL) : apply_cascade_down(c, NULL)) {
+        results = realloc(results, sizeof(char *) * (n + 1));
+        results[n++] = strdup(r);
+    }
+    s = check_join(results, n);
+    check_free_list(results, n);
+    return(s);
+}
+
+static void test_cascade(int numnets, int composed) {
+    struct apply_handle *h[MAXSTAGES];
+    struct apply_cascade *c;
+    struct fsm *nets[MAXSTAGES];
+    char **words, *s, *r;
+    int i, up;
+    for (i = 0; i < numnets; i++) {
+        nets[i] = check_net_random(4, 14, 1);
+        h[i] = apply_init(nets[i]);
+    }
+    c = apply_cascade_init(h, numnets);
+    if (composed)
+        CHECK(apply_cascade_set_composed(c, 1));
+    for (up = 0; up < 2; up++) {
+        /* Words of the net the cascade starts from */
+        words = check_word_list(nets[up ? numnets - 1 : 0], NUMWORDS);
+        for (i = 0; i < NUMWORDS; i++) {
+            s = cascade_apply(c, words[i], up);
+            r = cascade_reference(nets, numnets, words[i], up);
+            CHECK(strcmp(s, r) == 0);
+            free(s);
+            free(r);
+        }
+        check_free_list(words, NUMWORDS);
+    }
+    apply_cascade_clear(c);
+    for (i = 0; i < numnets; i++) {
+        apply_clear(h[i]);
+        fsm_destroy(nets[i]);
+    }
+}
+
+/* From 0, x or y, then an epsilon cycle between 1 and 2 that writes */
+/* p and q if output is set; 1 is final                             */
+static struct fsm *net_cycle(int reversed, int output) {
+    struct fsm_construct_handle *h;
+    h = fsm_construct_init("cycle");
+    if (reversed) {
+        fsm_construct_add_arc(h, 0, 2, EPS, "y");
+        fsm_construct_add_arc(h, 0, 1, EPS, "x");
+    } else {
+        fsm_construct_add_arc(h, 0, 1, EPS, "x");
+        fsm_construct_add_arc(h, 0, 2, EPS, "y");
+    }
+    fsm_construct_add_arc(h, 1, 2, EPS, output ? "p" : EPS);
+    fsm_construct_add_arc(h, 2, 1, EPS, output ? "q" : EPS);
+    fsm_construct_set_final(h, 1);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* Identity over x, y, p, q */
+static struct fsm *net_identity() {
+    struct fsm_construct_handle *h;
+    h = fsm_construct_init("identity");
+    fsm_construct_add_arc(h, 0, 0, "x", "x");
+    fsm_construct_add_arc(h, 0, 0, "y", "y");
+    fsm_construct_add_arc(h, 0, 0, "p", "p");
+    fsm_construct_add_arc(h, 0, 0, "q", "q");
+    fsm_construct_set_final(h, 0);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* A lookup goes round an epsilon cycle up to twice.  The composition */
+/* can't follow one that writes output that way, and refuses the nets */
+static void test_cycles() {
+    struct apply_handle *h[2];
+    struct apply_cascade *c;
+    struct fsm *nets[2];
+    char *s;
+    int reversed, output, composed;
+    for (reversed = 0; reversed < 2; reversed++) {
+        for (output = 0; output < 2; output++) {
+            for (composed = 0; composed < 2; composed++) {
+                nets[0] = net_cycle(reversed, output);
+                nets[1] = net_identity();
+                h[0] = apply_init(nets[0]);
+                h[1] = apply_init(nets[1]);
+                c = apply_cascade_init(h, 2);
+                if (composed)
+                    CHECK(apply_cascade_set_composed(c, 1) == !output);
+                s = cascade_apply(c, "", 0);
+                CHECK(strcmp(s, output ? "x,xpq,yq,yqpq" : "x,y") == 0);
+                CHECK(apply_cascade_get_status(c) == APPLY_OK);
+                free(s);
+                apply_cascade_clear(c);
+                apply_clear(h[0]);
+                apply_clear(h[1]);
+                fsm_destroy(nets[0]);
+                fsm_destroy(nets[1]);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int i;
+    check_srand(10);
+    for (i = 0; i < 60; i++) {
+        test_cascade(1 + i % MAXSTAGES, 0);
+        test_cascade(1 + i % MAXSTAGES, 1);
+    }
+    test_cycles();
+    return(check_done("cascade"));
+}
@@ -0,0 +1,297 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+#include "check.h"
+
+int check_failures = 0;
+
+static unsigned int check_state = 1;
+
+/* Symbols of the random nets, multicharacter and UTF-8 ones among them */
+static char *check_symbols[] = { "a", "b", "c", "ab", "\xc3\xa9", "+N", "d" };
+
+#define CHECK_NUMSYMBOLS 7
+
+void check_fail(const char *file, int line, const char *func, const char *cond) {
+    fprintf(stderr, "%s:%i: %s: failed: %s\n", file, line, func, cond);
+    check_failures++;
+}
+
+int check_done(char *name) {
+    if (check_failures) {
+        fprintf(stderr, "%s: %i check(s) failed\n", name, check_failures);
+        return(EXIT_FAILURE);
+    }
+    printf("%s: all tests passed\n", name);
+    return(EXIT_SUCCESS);
+}
+
+void check_srand(unsigned int seed) {
+    check_state = seed ? seed : 1;
+}
+
+unsigned int check_rand(void) {
+    /* xorshift32 */
+    check_state ^= check_state << 13;
+    check_state ^= check_state >> 17;
+    check_state ^= check_state << 5;
+    return(check_state);
+}
+
+static int check_compare(const void *a, const void *b) {
+    return(strcmp(*(char **)a, *(char **)b));
+}
+
+char *check_join(char **results, int numresults) {
+    char *s;
+    int i, len;
+    if (numresults > 0)
+        qsort(results, numresults, sizeof(char *), check_compare);
+    for (i = 0, len = 1; i < numresults; i++)
+        len += strlen(results[i]) + 1;
+    s = calloc(len, 1);
+    for (i = 0; i < numresults; i++) {
+        if (i > 0)
+            strcat(s, ",");
+        strcat(s, results[i]);
+    }
+    return(s);
+}
+
+char *check_apply(struct apply_handle *h, char *word, int up) {
+    char **results, *r, *s;
+    int i, n, size;
+    size = 16;
+    results = malloc(sizeof(char *) * size);
+    for (n = 0, r = up ? apply_up(h, word) : apply_down(h, word); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL)) {
+        if (n == size) {
+            size *= 2;
+            results = realloc(results, sizeof(char *) * size);
+        }
+        results[n++] = strdup(r);
+    }
+    s = check_join(results, n);
+    for (i = 0; i < n; i++)
+        free(results[i]);
+    free(results);
+    return(s);
+}
+
+int check_tokenize(struct fsm *net, char *word, int *tokens) {
+    struct sigma *sig;
+    int numtokens, len, best, bestlen;
+    for (numtokens = 0; *word != '\0'; numtokens++) {
+        best = -1;
+        bestlen = 0;
+        for (sig = net->sigma; sig != NULL && sig->number != -1; sig = sig->next) {
+            if (sig->number <= IDENTITY)
+                continue;
+            len = strlen(sig->symbol);
+            if (len > bestlen && strncmp(word, sig->symbol, len) == 0) {
+                best = sig->number;
+                bestlen = len;
+            }
+        }
+        /* A character outside the sigma: no arc reads it */
+        if (best == -1)
+            for (bestlen = 1; (word[bestlen] & 0xc0) == 0x80; bestlen++)
+                ;
+        tokens[numtokens] = best;
+        word += bestlen;
+    }
+    return(numtokens);
+}
+
+struct check_search {
+    struct fsm *net;
+    int *first;
+    int *tokens;
+    int numtokens;
+    int up;
+    char out[256];
+    char **results;
+    int numresults;
+    int size;
+};
+
+static void check_search(struct check_search *cs, int state, int pos) {
+    struct fsm_state *line;
+    int insym, outsym, len;
+    for (line = cs->net->states + cs->first[state]; line->state_no == state; line++) {
+        if (line->final_state && pos == cs->numtokens && line == cs->net->states + cs->first[state]) {
+            if (cs->numresults == cs->size) {
+                cs->size *= 2;
+                cs->results = realloc(cs->results, sizeof(char *) * cs->size);
+            }
+            cs->results[cs->numresults++] = strdup(cs->out);
+        }
+        if (line->target == -1)
+            continue;
+        insym = cs->up ? line->out : line->in;
+        outsym = cs->up ? line->in : line->out;
+        if (insym != EPSILON && (pos == cs->numtokens || cs->tokens[pos] != insym))
+            continue;
+        len = strlen(cs->out);
+        if (outsym != EPSILON)
+            strcat(cs->out, sigma_string(outsym, cs->net->sigma));
+        check_search(cs, line->target, insym == EPSILON ? pos : pos + 1);
+        cs->out[len] = '\0';
+    }
+}
+
+char *check_reference(struct fsm *net, char *word, int up) {
+    struct check_search cs;
+    struct fsm_state *line;
+    char *s;
+    int i;
+    cs.net = net;
+    cs.up = up;
+    cs.first = calloc(net->statecount, sizeof(int));
+    for (i = 0, line = net->states; line->state_no != -1; line++, i++) {
+        if (i == 0 || (line-1)->state_no != line->state_no)
+            cs.first[line->state_no] = i;
+    }
+    cs.tokens = malloc(sizeof(int) * (strlen(word) + 1));
+    cs.numtokens = check_tokenize(net, word, cs.tokens);
+    cs.out[0] = '\0';
+    cs.size = 16;
+    cs.numresults = 0;
+    cs.results = malloc(sizeof(char *) * cs.size);
+    check_search(&cs, 0, 0);
+    s = check_join(cs.results, cs.numresults);
+    check_free_list(cs.results, cs.numresults);
+    free(cs.tokens);
+    free(cs.first);
+    return(s);
+}
+
+struct fsm *check_net_words(void) {
+    struct fsm_construct_handle *h;
+    int s;
+    h = fsm_construct_init("words");
+    for (s = 0; s < 6; s++) {
+        fsm_construct_add_arc(h, s, s+1, "a", "x");
+        fsm_construct_add_arc(h, s, s+1, "b", "b");
+        fsm_construct_add_arc(h, s, s+1, "cc", "d");
+        fsm_construct_set_final(h, s+1);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+static char *check_random_symbol(int epsilons) {
+    if (epsilons && check_rand() % 5 == 0)
+        return(EPS);
+    return(check_symbols[check_rand() % CHECK_NUMSYMBOLS]);
+}
+
+struct fsm *check_net_random(int numstates, int numarcs, int epsilons) {
+    struct fsm_construct_handle *h;
+    char *in, *out;
+    int i, source, target, tmp;
+    h = fsm_construct_init("random");
+    for (i = 0; i < numarcs; i++) {
+        source = check_rand() % numstates;
+        target = check_rand() % numstates;
+        in = check_random_symbol(epsilons);
+        out = check_random_symbol(epsilons);
+        /* Epsilons only lead to higher states, so there are no epsilon */
+        /* cycles for the search to get lost in                         */
+        if ((strcmp(in, EPS) == 0 || strcmp(out, EPS) == 0) && source >= target) {
+            if (source == target)
+                continue;
+            tmp = source;
+            source = target;
+            target = tmp;
+        }
+        fsm_construct_add_arc(h, source, target, in, out);
+    }
+    /* fsm_construct_done() would throw the handle away without finals */
+    fsm_construct_set_final(h, numstates - 1);
+    for (i = 0; i < numstates - 1; i++) {
+        if (check_rand() % 3 == 0)
+            fsm_construct_set_final(h, i);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+char *check_random_word(char *buf, int maxsyms) {
+    int i, n;
+    buf[0] = '\0';
+    n = check_rand() % (maxsyms + 1);
+    for (i = 0; i < n; i++) {
+        if (check_rand() % 20 == 0)
+            strcat(buf, "z");
+        else
+            strcat(buf, check_symbols[check_rand() % CHECK_NUMSYMBOLS]);
+    }
+    return(buf);
+}
+
+/* A random path from the initial state: the upper (side 0) or lower */
+/* (side 1) symbols along it, stopping at a final state now and then. */
+/* ? and @ read a character no net has, and flags read nothing        */
+static char *check_net_word(struct fsm *net, int *first, int side, char *buf) {
+    struct fsm_state *line;
+    int state, n, count, sym;
+    buf[0] = '\0';
+    for (state = 0, n = 0; n < 8; n++) {
+        line = net->states + first[state];
+        for (count = 0; (line+count)->state_no == state; count++)
+            ;
+        if (line->final_state && (line->target == -1 || check_rand() % 3 == 0))
+            return(buf);
+        if (line->target == -1)
+            return(NULL);
+        line += check_rand() % count;
+        sym = side ? line->out : line->in;
+        if (sym == IDENTITY || sym == UNKNOWN)
+            strcat(buf, "z");
+        else if (sym > IDENTITY && !flag_check(sigma_string(sym, net->sigma)))
+            strcat(buf, sigma_string(sym, net->sigma));
+        state = line->target;
+    }
+    return(NULL);
+}
+
+char **check_word_list(struct fsm *net, int numwords) {
+    struct fsm_state *line;
+    char **words, buf[128], *r;
+    int i, *first;
+    first = calloc(net->statecount, sizeof(int));
+    for (i = 0, line = net->states; line->state_no != -1; line++, i++) {
+        if (i == 0 || (line-1)->state_no != line->state_no)
+            first[line->state_no] = i;
+    }
+    words = malloc(sizeof(char *) * numwords);
+    for (i = 0; i < numwords; i++) {
+        r = NULL;
+        if (i % 3 != 0 && net->finalcount > 0)
+            r = check_net_word(net, first, i % 3 - 1, buf);
+        words[i] = strdup(r != NULL ? r : check_random_word(buf, 6));
+    }
+    free(first);
+    return(words);
+}
+
+void check_free_list(char **words, int numwords) {
+    int i;
+    for (i = 0; i < numwords; i++)
+        free(words[i]);
+    free(words);
+}
@@ -0,0 +1,67 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Helpers shared by the regression tests.  Each test is its own   */
+/* program that builds its nets with fsm_construct_*(), so that the */
+/* tests don't depend on the regex parser.  Run with "make check".  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fomalib.h"
+
+#define EPS "@_EPSILON_SYMBOL_@"
+
+extern int check_failures;
+
+#define CHECK(cond) do { if (!(cond)) check_fail(__FILE__, __LINE__, __func__, #cond); } while (0)
+
+void check_fail(const char *file, int line, const char *func, const char *cond);
+/* Prints the outcome and returns the exit status for main() */
+int check_done(char *name);
+
+/* A small deterministic PRNG, so that failures can be reproduced */
+void check_srand(unsigned int seed);
+unsigned int check_rand(void);
+
+/* Sorts results and joins them with commas into a malloced string */
+char *check_join(char **results, int numresults);
+/* All results of apply_down() (up = 0) or apply_up() (up = 1) of word, joined */
+char *check_apply(struct apply_handle *h, char *word, int up);
+
+/* The same, looked up by a plain search over net->states that shares */
+/* no code with apply.c: the word is split into the longest symbols of */
+/* the sigma from left to right, and every path of the net that reads  */
+/* it gives a result.  For nets without ?, @ and input epsilon cycles. */
+char *check_reference(struct fsm *net, char *word, int up);
+/* Splits word as check_reference() does into tokens, which needs room */
+/* for strlen(word) entries; -1 stands for a character outside sigma   */
+int check_tokenize(struct fsm *net, char *word, int *tokens);
+
+/* Words of 1-6 symbols over a:x, b and cc:d, 1092 in all */
+struct fsm *check_net_words(void);
+/* A net with numstates states and numarcs arcs drawn from the symbols  */
+/* of check_random_word(), final states included, and epsilons on either */
+/* side if epsilons is set, though never in a cycle                      */
+struct fsm *check_net_random(int numstates, int numarcs, int epsilons);
+/* A string of up to maxsyms symbols of the random nets, now and then */
+/* one they don't have                                                */
+char *check_random_word(char *buf, int maxsyms);
+/* numwords malloced words to look up in net: random strings, and */
+/* upper and lower words of random paths of the net                */
+char **check_word_list(struct fsm *net, int numwords);
+void check_free_list(char **words, int numwords);
@@ -0,0 +1,111 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_count_down()/apply_count_up() give the number of results    */
+/* apply_down()/apply_up() would give, whether they count along the  */
+/* input or fall back on the search: with epsilon cycles on the input */
+/* side, or with flag diacritics that are obeyed                      */
+
+#include "check.h"
+
+#define NUMWORDS 100
+
+static long count_results(struct apply_handle *h, char *word, int up) {
+    char *r;
+    long n;
+    for (n = 0, r = up ? apply_up(h, word) : apply_down(h, word); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL))
+        n++;
+    return(n);
+}
+
+/* A random net with a few extra arcs: @:@, ?:?, and flags going  */
+/* forward if flags is set, and an epsilon cycle between states 2 */
+/* and 3 if cycle is set. State 5 is final so that the net never  */
+/* comes out empty                                                */
+static struct fsm *net_count(int cycle, int flags) {
+    static char *extra[] = { "@_IDENTITY_SYMBOL_@", "@_UNKNOWN_SYMBOL_@", "@U.F.x@", "@U.F.y@", "@R.F.x@" };
+    struct fsm_construct_handle *h;
+    struct fsm_state *line;
+    struct fsm *net;
+    char *sym;
+    int i, source, target;
+    net = check_net_random(6, 16, 1);
+    h = fsm_construct_init("count");
+    fsm_construct_copy_sigma(h, net->sigma);
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1)
+            fsm_construct_add_arc_nums(h, line->state_no, line->target, line->in, line->out);
+        if (line->final_state)
+            fsm_construct_set_final(h, line->state_no);
+    }
+    for (i = 0; i < 3; i++) {
+        sym = extra[check_rand() % (flags ? 5 : 2)];
+        source = check_rand() % 5;
+        target = check_rand() % 6;
+        if (sym[1] != '_' && target <= source)
+            target = source + 1;
+        fsm_construct_add_arc(h, source, target, sym, sym);
+    }
+    if (cycle) {
+        fsm_construct_add_arc(h, 2, 3, EPS, EPS);
+        fsm_construct_add_arc(h, 3, 2, EPS, EPS);
+    }
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    fsm_destroy(net);
+    return(fsm_construct_done(h));
+}
+
+/* Results multiply with the length of the word through ?:? and   */
+/* epsilon cycles, so words are kept short enough to list them all */
+static void test_count(struct fsm *net, int maxlength) {
+    struct apply_handle *h, *ch;
+    char **words;
+    int i, up, obey;
+    h = apply_init(net);
+    ch = apply_init(net);
+    words = check_word_list(net, NUMWORDS);
+    for (obey = 0; obey < 2; obey++) {
+        apply_set_obey_flags(h, obey);
+        apply_set_obey_flags(ch, obey);
+        for (up = 0; up < 2; up++) {
+            for (i = 0; i < NUMWORDS; i++) {
+                if ((int) strlen(words[i]) > maxlength)
+                    continue;
+                CHECK((up ? apply_count_up(ch, words[i]) : apply_count_down(ch, words[i])) == count_results(h, words[i], up));
+            }
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(ch);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(15);
+    net = check_net_words();
+    test_count(net, 100);
+    fsm_destroy(net);
+    for (i = 0; i < 120; i++) {
+        net = net_count(i % 2, i % 3 == 0);
+        test_count(net, i % 2 ? 8 : 12);
+        fsm_destroy(net);
+    }
+    return(check_done("count"));
+}
@@ -0,0 +1,239 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Completions of a prefix are the words of the net that start with */
+/* it, fewest symbols first and in strcmp() order of symbols within */
+/* a length, and completing a cyclic net without bounds comes to an */
+/* end                                                              */
+
+#include "check.h"
+
+#define MAXWORDS 4096
+#define MAXTOKENS 64
+
+/* No symbol is a prefix of another, so words split one way only */
+static char *symbols[] = { EPS, "a", "b", "cc", "+N", "\xc3\xa9" };
+
+struct cursor_output {
+    char *words[MAXWORDS];
+    int count;
+    int stop_after;     /* Ask to stop after this many words, 0 = never */
+};
+
+static int cursor_visit(char *word, int length, void *userdata) {
+    struct cursor_output *o = userdata;
+    CHECK((int) strlen(word) == length);
+    if (o->count < MAXWORDS)
+        o->words[o->count] = strdup(word);
+    o->count++;
+    return(o->stop_after && o->count == o->stop_after);
+}
+
+static void cursor_free(struct cursor_output *o) {
+    int i;
+    for (i = 0; i < o->count && i < MAXWORDS; i++)
+        free(o->words[i]);
+    o->count = 0;
+}
+
+/* Splits word into its symbols, returning how many */
+static int cursor_tokenize(char *word, char **tokens) {
+    int i, n;
+    for (n = 0; *word != '\0' && n < MAXTOKENS; n++) {
+        for (i = 1; i < 6 && strncmp(word, symbols[i], strlen(symbols[i])) != 0; i++)
+            ;
+        if (i == 6)
+            return(-1);
+        tokens[n] = symbols[i];
+        word += strlen(symbols[i]);
+    }
+    return(n);
+}
+
+static int cursor_cmp(const void *a, const void *b) {
+    char *ta[MAXTOKENS], *tb[MAXTOKENS];
+    int i, na, nb, c;
+    na = cursor_tokenize(*(char **) a, ta);
+    nb = cursor_tokenize(*(char **) b, tb);
+    if (na != nb)
+        return(na < nb ? -1 : 1);
+    for (i = 0; i < na; i++) {
+        if ((c = strcmp(ta[i], tb[i])) != 0)
+            return(c);
+    }
+    return(0);
+}
+
+/* A random net whose arcs all lead to higher states, so that it has */
+/* finitely many words                                               */
+static struct fsm *net_acyclic(int numstates, int numarcs) {
+    struct fsm_construct_handle *h;
+    int i, source, target;
+    h = fsm_construct_init("acyclic");
+    for (i = 0; i < numarcs; i++) {
+        source = check_rand() % (numstates - 1);
+        target = source + 1 + check_rand() % (numstates - 1 - source);
+        fsm_construct_add_arc(h, source, target, symbols[check_rand() % 6], symbols[check_rand() % 6]);
+    }
+    fsm_construct_set_final(h, numstates - 1);
+    for (i = 0; i < numstates - 1; i++) {
+        if (check_rand() % 3 == 0)
+            fsm_construct_set_final(h, i);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* The distinct words on one side that start with prefix, in the */
+/* order completion gives them                                   */
+static void cursor_reference(struct apply_handle *h, int side, char *prefix, struct cursor_output *o) {
+    char *r;
+    int i, j;
+    o->count = 0;
+    apply_reset_enumerator(h);
+    while ((r = side == M_UPPER ? apply_upper_words(h) : apply_lower_words(h)) != NULL) {
+        if (strncmp(r, prefix, strlen(prefix)) == 0 && o->count < MAXWORDS)
+            o->words[o->count++] = strdup(r);
+    }
+    apply_reset_enumerator(h);
+    qsort(o->words, o->count, sizeof(char *), cursor_cmp);
+    for (i = j = 0; i < o->count; i++) {
+        if (j > 0 && strcmp(o->words[j-1], o->words[i]) == 0)
+            free(o->words[i]);
+        else
+            o->words[j++] = o->words[i];
+    }
+    o->count = j;
+}
+
+static int cursor_same(struct cursor_output *a, struct cursor_output *b, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (strcmp(a->words[i], b->words[i]) != 0)
+            return(0);
+    }
+    return(1);
+}
+
+static void test_complete(struct fsm *net, int side) {
+    struct apply_handle *h;
+    struct apply_cursor *c;
+    struct cursor_output all, ref, out;
+    char *tokens[MAXTOKENS], prefix[256];
+    int i, k, n, numtokens;
+
+    h = apply_init(net);
+    c = apply_cursor_init(h, side);
+    memset(&out, 0, sizeof(out));
+    cursor_reference(h, side, "", &all);
+    n = apply_cursor_complete(c, 0, 0, cursor_visit, &out);
+    CHECK(n == all.count && out.count == n && cursor_same(&out, &all, n));
+    cursor_free(&out);
+
+    for (i = 0; i < 8 && all.count > 0; i++) {
+        /* The first symbols of some word, pushed one or two at a time */
+        numtokens = cursor_tokenize(all.words[check_rand() % all.count], tokens);
+        k = check_rand() % (numtokens + 1);
+        apply_cursor_reset(c);
+        for (n = 0, prefix[0] = '\0'; n < k; ) {
+            if (n + 1 < k && check_rand() % 2) {
+                sprintf(prefix + strlen(prefix), "%s%s", tokens[n], tokens[n+1]);
+                CHECK(apply_cursor_push(c, prefix + strlen(prefix) - strlen(tokens[n]) - strlen(tokens[n+1])) > 0);
+                n += 2;
+            } else {
+                strcat(prefix, tokens[n]);
+                CHECK(apply_cursor_push(c, tokens[n]) > 0);
+                n++;
+            }
+        }
+        cursor_reference(h, side, prefix, &ref);
+        CHECK(ref.count > 0);
+        n = apply_cursor_complete(c, 0, 0, cursor_visit, &out);
+        CHECK(n == ref.count && out.count == n && cursor_same(&out, &ref, n));
+        cursor_free(&out);
+        /* A bound on results gives the first ones, as does the visitor */
+        k = 1 + check_rand() % ref.count;
+        n = apply_cursor_complete(c, k, 0, cursor_visit, &out);
+        CHECK(n == k && cursor_same(&out, &ref, k));
+        cursor_free(&out);
+        out.stop_after = k;
+        n = apply_cursor_complete(c, 0, 0, cursor_visit, &out);
+        CHECK(n == k && cursor_same(&out, &ref, k));
+        out.stop_after = 0;
+        cursor_free(&out);
+        /* Going back over a push that leads nowhere changes nothing */
+        if (apply_cursor_push(c, "\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9\xc3\xa9") == 0) {
+            CHECK(apply_cursor_complete(c, 0, 0, cursor_visit, &out) == 0);
+            apply_cursor_back(c);
+            n = apply_cursor_complete(c, 0, 0, cursor_visit, &out);
+            CHECK(n == ref.count && cursor_same(&out, &ref, n));
+            cursor_free(&out);
+        }
+        cursor_free(&ref);
+    }
+    cursor_free(&all);
+    apply_cursor_clear(c);
+    apply_clear(h);
+}
+
+/* a* with a dead end b b*: without bounds, completing stops at the */
+/* default node bound, and a bound on results is reached or the     */
+/* search runs out of nodes                                         */
+static void test_cyclic(void) {
+    struct fsm_construct_handle *ch;
+    struct apply_handle *h;
+    struct apply_cursor *c;
+    struct cursor_output out;
+    struct fsm *net;
+    int n;
+
+    ch = fsm_construct_init("cyclic");
+    fsm_construct_add_arc(ch, 0, 0, "a", "a");
+    fsm_construct_add_arc(ch, 0, 1, "b", "b");
+    fsm_construct_add_arc(ch, 1, 1, "b", "b");
+    fsm_construct_set_final(ch, 0);
+    fsm_construct_set_initial(ch, 0);
+    net = fsm_construct_done(ch);
+    h = apply_init(net);
+    c = apply_cursor_init(h, M_UPPER);
+    memset(&out, 0, sizeof(out));
+    n = apply_cursor_complete(c, 0, 0, cursor_visit, &out);
+    CHECK(n > 0 && n == out.count && strcmp(out.words[0], "") == 0 && strcmp(out.words[1], "a") == 0);
+    cursor_free(&out);
+    n = apply_cursor_complete(c, 5, 0, cursor_visit, &out);
+    CHECK(n == 5 && strcmp(out.words[4], "aaaa") == 0);
+    cursor_free(&out);
+    CHECK(apply_cursor_push(c, "b") > 0);
+    CHECK(apply_cursor_complete(c, 5, 0, cursor_visit, &out) == 0);
+    CHECK(apply_cursor_complete(c, 5, 50, cursor_visit, &out) == 0);
+    apply_cursor_clear(c);
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(16);
+    test_cyclic();
+    for (i = 0; i < 60; i++) {
+        net = net_acyclic(7, 10 + i % 12);
+        test_complete(net, i % 2 ? M_LOWER : M_UPPER);
+        fsm_destroy(net);
+    }
+    return(check_done("cursor"));
+}
@@ -0,0 +1,142 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_words_parallel() visits the words apply_words(),           */
+/* apply_upper_words() and apply_lower_words() give, in their order, */
+/* whatever the number of threads, and stops when the visitor asks  */
+
+#include "check.h"
+
+struct enum_output {
+    char *buf;
+    size_t used;
+    size_t size;
+    int count;
+    int stop_after;     /* Ask to stop after this many words, 0 = never */
+};
+
+static int enum_visit(char *result, int length, void *userdata) {
+    struct enum_output *o = userdata;
+    if (o->used + length + 1 > o->size) {
+        o->size = (o->used + length + 1) * 2;
+        o->buf = realloc(o->buf, o->size);
+    }
+    memcpy(o->buf + o->used, result, length);
+    o->used += length;
+    o->buf[o->used++] = '\n';
+    o->count++;
+    return(o->stop_after && o->count == o->stop_after);
+}
+
+/* A random net whose arcs all lead to higher states, so that it has */
+/* finitely many words                                               */
+static struct fsm *net_acyclic(int numstates, int numarcs) {
+    static char *symbols[] = { EPS, "a", "b", "cc", "+N", "\xc3\xa9" };
+    struct fsm_construct_handle *h;
+    int i, source, target;
+    h = fsm_construct_init("acyclic");
+    for (i = 0; i < numarcs; i++) {
+        source = check_rand() % (numstates - 1);
+        target = source + 1 + check_rand() % (numstates - 1 - source);
+        fsm_construct_add_arc(h, source, target, symbols[check_rand() % 6], symbols[check_rand() % 6]);
+    }
+    fsm_construct_set_final(h, numstates - 1);
+    for (i = 0; i < numstates - 1; i++) {
+        if (check_rand() % 3 == 0)
+            fsm_construct_set_final(h, i);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* What the iterator gives, as the visitor would have it */
+static void enum_iterate(struct apply_handle *h, int side, struct enum_output *o) {
+    char *r;
+    apply_reset_enumerator(h);
+    for (;;) {
+        if (side == (M_UPPER|M_LOWER))
+            r = apply_words(h);
+        else if (side == M_UPPER)
+            r = apply_upper_words(h);
+        else
+            r = apply_lower_words(h);
+        if (r == NULL)
+            break;
+        enum_visit(r, strlen(r), o);
+    }
+    apply_reset_enumerator(h);
+}
+
+static void test_enumerate(struct fsm *net) {
+    struct apply_handle *h;
+    struct enum_output serial, parallel;
+    int n, side, threads, stop;
+    static int sides[] = { M_UPPER|M_LOWER, M_UPPER, M_LOWER };
+
+    h = apply_init(net);
+    for (side = 0; side < 3; side++) {
+        memset(&serial, 0, sizeof(serial));
+        enum_iterate(h, sides[side], &serial);
+        for (threads = 1; threads <= 8; threads *= 2) {
+            memset(&parallel, 0, sizeof(parallel));
+            n = apply_words_parallel(h, sides[side], threads, enum_visit, &parallel);
+            CHECK(n == serial.count && parallel.count == n);
+            CHECK(parallel.used == serial.used && (n == 0 || memcmp(parallel.buf, serial.buf, serial.used) == 0));
+            free(parallel.buf);
+            /* Stopping early gives the first words */
+            if (serial.count < 2)
+                continue;
+            stop = 1 + check_rand() % (serial.count - 1);
+            memset(&parallel, 0, sizeof(parallel));
+            parallel.stop_after = stop;
+            n = apply_words_parallel(h, sides[side], threads, enum_visit, &parallel);
+            CHECK(n == stop && parallel.count == stop);
+            CHECK(parallel.used < serial.used && memcmp(parallel.buf, serial.buf, parallel.used) == 0);
+            free(parallel.buf);
+        }
+        free(serial.buf);
+    }
+    /* With limits the search stays on this thread, in the same order */
+    memset(&serial, 0, sizeof(serial));
+    enum_iterate(h, M_UPPER|M_LOWER, &serial);
+    if (serial.count > 3) {
+        apply_set_limits(h, 0, 3, 0, 0);
+        memset(&parallel, 0, sizeof(parallel));
+        n = apply_words_parallel(h, M_UPPER|M_LOWER, 4, enum_visit, &parallel);
+        CHECK(n == 3);
+        CHECK(apply_get_status(h) == APPLY_LIMIT_RESULTS);
+        CHECK(parallel.used < serial.used && memcmp(parallel.buf, serial.buf, parallel.used) == 0);
+        free(parallel.buf);
+    }
+    free(serial.buf);
+    apply_clear(h);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(13);
+    net = check_net_words();
+    test_enumerate(net);
+    fsm_destroy(net);
+    for (i = 0; i < 40; i++) {
+        net = net_acyclic(8, 16 + i % 16);
+        test_enumerate(net);
+        fsm_destroy(net);
+    }
+    return(check_done("enumerate"));
+}
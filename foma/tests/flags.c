@@ -0,0 +1,300 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Flag diacritics kept in integer registers give the results of a */
+/* search that keeps them as strings, the way apply used to        */
+
+#include <limits.h>
+#include "check.h"
+
+#define NUMWORDS 100
+#define NUMFLAGNAMES 3
+
+static char *flag_names[NUMFLAGNAMES] = { "X", "Y", "W" };
+
+static char *flag_symbols[] = { "@U.X.a@", "@U.X.b@", "@P.X.a@", "@N.X.a@", "@R.X.a@", "@R.X@", "@D.X.b@", "@D.X@", "@C.X@", "@E.X.Y@", "@P.Y.a@", "@U.Y.b@", "@N.Y.b@", "@E.Y.W@", "@R.Y@", "@C.Y@" };
+
+#define NUMFLAGSYMBOLS 16
+
+static char *plain_symbols[] = { "a", "b", "c", "ab" };
+
+/* The flag registers of the string search: value NULL if unset */
+struct flag_reg {
+    char *value;
+    int neg;
+};
+
+struct flag_search {
+    struct fsm *net;
+    int *first;
+    int *tokens;
+    int numtokens;
+    int up;
+    int obey;
+    int show;
+    struct flag_reg regs[NUMFLAGNAMES];
+    char out[512];
+    char **results;
+    int numresults;
+    int size;
+};
+
+static int flag_name(char *name) {
+    int i;
+    for (i = 0; i < NUMFLAGNAMES; i++) {
+        if (strcmp(flag_names[i], name) == 0)
+            return(i);
+    }
+    return(-1);
+}
+
+/* Splits @T.NAME.VALUE@ or @T.NAME@ */
+static void flag_parse(char *symbol, char *type, char *name, char *value) {
+    char *dot;
+    *type = symbol[1];
+    strcpy(name, symbol + 3);
+    name[strlen(name)-1] = '\0';
+    value[0] = '\0';
+    if ((dot = strchr(name, '.')) != NULL) {
+        strcpy(value, dot + 1);
+        *dot = '\0';
+    }
+}
+
+/* A value that outlives the search, NULL for none */
+static char *flag_value(char *value) {
+    static char *values[] = { "a", "b", "X", "Y", "W" };
+    int i;
+    for (i = 0; i < 5; i++) {
+        if (strcmp(values[i], value) == 0)
+            return(values[i]);
+    }
+    return(NULL);
+}
+
+/* The string flag check apply.c had before the registers */
+static int flag_test(struct flag_search *fs, char type, char *name, char *value) {
+    struct flag_reg *f, *f2;
+    int n;
+    f = &fs->regs[flag_name(name)];
+    switch (type) {
+    case 'U':
+        if (f->value == NULL) {
+            f->value = value;
+            return(1);
+        } else if (strcmp(value, f->value) == 0 && f->neg == 0) {
+            return(1);
+        } else if (strcmp(value, f->value) != 0 && f->neg == 1) {
+            f->value = value;
+            f->neg = 0;
+            return(1);
+        }
+        return(0);
+    case 'C':
+        f->value = NULL;
+        f->neg = 0;
+        return(1);
+    case 'D':
+        if (f->value == NULL)
+            return(1);
+        if (value == NULL)
+            return(0);
+        if (strcmp(value, f->value) != 0)
+            return(f->neg == 1 ? 0 : 1);
+        return(f->neg == 1 ? 1 : 0);
+    case 'N':
+        f->value = value;
+        f->neg = 1;
+        return(1);
+    case 'P':
+        f->value = value;
+        f->neg = 0;
+        return(1);
+    case 'R':
+        if (value == NULL)
+            return(f->value != NULL);
+        if (f->value == NULL || strcmp(value, f->value) != 0)
+            return(0);
+        return(f->neg == 1 ? 0 : 1);
+    case 'E':
+        n = flag_name(value);
+        f2 = n == -1 ? NULL : &fs->regs[n];
+        if (f2 == NULL)
+            return(f->value == NULL);
+        if (f2->value == NULL || f->value == NULL)
+            return(f2->value == NULL && f->value == NULL && f->neg == f2->neg);
+        return(strcmp(f2->value, f->value) == 0 && f->neg == f2->neg);
+    }
+    return(0);
+}
+
+static void flag_search(struct flag_search *fs, int state, int pos) {
+    struct fsm_state *line;
+    struct flag_reg saved[NUMFLAGNAMES];
+    char *insym, *outsym, type, name[32], value[32];
+    int in, out, len, isflag;
+    for (line = fs->net->states + fs->first[state]; line->state_no == state; line++) {
+        if (line->final_state && pos == fs->numtokens && line == fs->net->states + fs->first[state]) {
+            if (fs->numresults == fs->size) {
+                fs->size *= 2;
+                fs->results = realloc(fs->results, sizeof(char *) * fs->size);
+            }
+            fs->results[fs->numresults++] = strdup(fs->out);
+        }
+        if (line->target == -1)
+            continue;
+        in = fs->up ? line->out : line->in;
+        out = fs->up ? line->in : line->out;
+        insym = sigma_string(in, fs->net->sigma);
+        outsym = sigma_string(out, fs->net->sigma);
+        isflag = insym[0] == '@' && strlen(insym) > 1;
+        memcpy(saved, fs->regs, sizeof(saved));
+        if (isflag) {
+            if (fs->obey) {
+                flag_parse(insym, &type, name, value);
+                if (!flag_test(fs, type, name, flag_value(value)))
+                    continue;
+            }
+        } else if (in != EPSILON && (pos == fs->numtokens || fs->tokens[pos] != in)) {
+            continue;
+        }
+        len = strlen(fs->out);
+        if (out != EPSILON && (!isflag || fs->show))
+            strcat(fs->out, outsym);
+        flag_search(fs, line->target, isflag || in == EPSILON ? pos : pos + 1);
+        fs->out[len] = '\0';
+        memcpy(fs->regs, saved, sizeof(saved));
+    }
+}
+
+static char *flag_reference(struct fsm *net, char *word, int up, int obey, int show) {
+    struct flag_search fs;
+    struct fsm_state *line;
+    char *s;
+    int i;
+    memset(&fs, 0, sizeof(fs));
+    fs.net = net;
+    fs.up = up;
+    fs.obey = obey;
+    fs.show = show;
+    fs.first = calloc(net->statecount, sizeof(int));
+    for (i = 0, line = net->states; line->state_no != -1; line++, i++) {
+        if (i == 0 || (line-1)->state_no != line->state_no)
+            fs.first[line->state_no] = i;
+    }
+    fs.tokens = malloc(sizeof(int) * (strlen(word) + 1));
+    fs.numtokens = check_tokenize(net, word, fs.tokens);
+    fs.size = 16;
+    fs.results = malloc(sizeof(char *) * fs.size);
+    flag_search(&fs, 0, 0);
+    s = check_join(fs.results, fs.numresults);
+    check_free_list(fs.results, fs.numresults);
+    free(fs.tokens);
+    free(fs.first);
+    return(s);
+}
+
+/* Flag arcs only lead to higher states, so they make no input */
+/* epsilon cycles                                               */
+static struct fsm *net_flags(int numstates, int numarcs) {
+    struct fsm_construct_handle *h;
+    char *in, *out, *flag;
+    int i, source, target;
+    h = fsm_construct_init("flags");
+    for (i = 0; i < numarcs; i++) {
+        source = check_rand() % numstates;
+        target = check_rand() % numstates;
+        if (check_rand() % 2 == 0) {
+            if (source == target)
+                continue;
+            if (source > target) {
+                target = source + target;
+                source = target - source;
+                target = target - source;
+            }
+            flag = flag_symbols[check_rand() % NUMFLAGSYMBOLS];
+            fsm_construct_add_arc(h, source, target, flag, flag);
+        } else {
+            in = plain_symbols[check_rand() % 4];
+            out = plain_symbols[check_rand() % 4];
+            fsm_construct_add_arc(h, source, target, in, out);
+        }
+    }
+    fsm_construct_set_final(h, numstates - 1);
+    for (i = 0; i < numstates - 1; i++) {
+        if (check_rand() % 3 == 0)
+            fsm_construct_set_final(h, i);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+static char *flag_word(char *buf) {
+    int i, n;
+    buf[0] = '\0';
+    n = check_rand() % 6;
+    for (i = 0; i < n; i++)
+        strcat(buf, plain_symbols[check_rand() % 4]);
+    return(buf);
+}
+
+/* way 0: scanning arcs, 1: binary search, 2: apply_index(), 3: compact index */
+static void test_flags(struct fsm *net, int way) {
+    struct apply_handle *h;
+    char word[64], *s, *r;
+    int i, up, obey, show;
+    if (way == 1)
+        fsm_sort_arcs(net, 1);
+    h = apply_init(net);
+    if (way == 2) {
+        apply_index(h, APPLY_INDEX_INPUT, 0, INT_MAX, 1);
+        apply_index(h, APPLY_INDEX_OUTPUT, 0, INT_MAX, 0);
+    }
+    if (way == 3) {
+        apply_index_compact(h, APPLY_INDEX_INPUT, 0, INT_MAX, 0);
+        apply_index_compact(h, APPLY_INDEX_OUTPUT, 0, INT_MAX, 1);
+    }
+    for (obey = 0; obey < 2; obey++) {
+        for (show = 0; show < 2; show++) {
+            apply_set_obey_flags(h, obey);
+            apply_set_show_flags(h, show);
+            for (i = 0; i < NUMWORDS; i++) {
+                flag_word(word);
+                for (up = 0; up < 2; up++) {
+                    s = check_apply(h, word, up);
+                    r = flag_reference(net, word, up, obey, show);
+                    CHECK(strcmp(s, r) == 0);
+                    free(s);
+                    free(r);
+                }
+            }
+        }
+    }
+    apply_clear(h);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(7);
+    for (i = 0; i < 200; i++) {
+        net = net_flags(4 + i % 8, 8 + i % 8 * 3);
+        test_flags(net, i % 4);
+        fsm_destroy(net);
+    }
+    return(check_done("flags"));
+}
@@ -0,0 +1,122 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_*_foreach() and apply_*_foreach_symbols() visit the results */
+/* the iterator gives, and stop where the visitor says               */
+
+#include "check.h"
+
+#define NUMWORDS 200
+
+struct visited {
+    struct fsm *net;
+    char **results;
+    int numresults;
+    int size;
+    int stop_after;
+};
+
+static void visited_add(struct visited *v, char *s) {
+    if (v->numresults == v->size) {
+        v->size = v->size ? v->size * 2 : 16;
+        v->results = realloc(v->results, sizeof(char *) * v->size);
+    }
+    v->results[v->numresults++] = s;
+}
+
+static int visit_string(char *result, int length, void *userdata) {
+    struct visited *v = userdata;
+    CHECK((int) strlen(result) == length);
+    visited_add(v, strndup(result, length));
+    return(v->stop_after && v->numresults == v->stop_after);
+}
+
+static int visit_symbols(int *symbols, int length, void *userdata) {
+    struct visited *v = userdata;
+    char buf[512];
+    int i;
+    buf[0] = '\0';
+    for (i = 0; i < length; i++) {
+        CHECK(symbols[i] > IDENTITY);
+        strcat(buf, sigma_string(symbols[i], v->net->sigma));
+    }
+    visited_add(v, strdup(buf));
+    return(v->stop_after && v->numresults == v->stop_after);
+}
+
+static char *visited_join(struct visited *v) {
+    char *s;
+    s = check_join(v->results, v->numresults);
+    check_free_list(v->results, v->numresults);
+    memset(v, 0, sizeof(struct visited));
+    return(s);
+}
+
+static void test_foreach(struct fsm *net, int cached) {
+    struct apply_handle *h;
+    struct visited v;
+    char **words, *s, *r;
+    int i, n, up, symbols, all;
+    words = check_word_list(net, NUMWORDS);
+    h = apply_init(net);
+    if (cached)
+        apply_set_cache(h, 1 << 16);
+    memset(&v, 0, sizeof(struct visited));
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            r = check_reference(net, words[i], up);
+            for (symbols = 0; symbols < 2; symbols++) {
+                v.net = net;
+                if (symbols)
+                    n = up ? apply_up_foreach_symbols(h, words[i], visit_symbols, &v) : apply_down_foreach_symbols(h, words[i], visit_symbols, &v);
+                else
+                    n = up ? apply_up_foreach(h, words[i], visit_string, &v) : apply_down_foreach(h, words[i], visit_string, &v);
+                CHECK(n == v.numresults);
+                all = n;
+                s = visited_join(&v);
+                CHECK(strcmp(s, r) == 0);
+                free(s);
+
+                /* Stopping after the first result, the handle is */
+                /* left ready for the iterator                    */
+                v.net = net;
+                v.stop_after = 1;
+                n = up ? apply_up_foreach(h, words[i], visit_string, &v) : apply_down_foreach(h, words[i], visit_string, &v);
+                CHECK(n == (all > 0 ? 1 : 0));
+                free(visited_join(&v));
+                s = check_apply(h, words[i], up);
+                CHECK(strcmp(s, r) == 0);
+                free(s);
+            }
+            free(r);
+        }
+    }
+    apply_clear(h);
+    check_free_list(words, NUMWORDS);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(9);
+    for (i = 0; i < 20; i++) {
+        net = check_net_random(8, 24, 1);
+        test_foreach(net, i % 2);
+        fsm_destroy(net);
+    }
+    return(check_done("foreach"));
+}
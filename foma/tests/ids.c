@@ -0,0 +1,138 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+/* apply_down_ids() and apply_up_ids() give the results of apply_down() */
+/* and apply_up(), as symbol numbers, also on handles that share their  */
+/* tables and take turns                                                */
+
+#include "check.h"
+
+#define NUMWORDS 100
+
+/* Spells each result of an ids lookup with apply_symbol_name() */
+static char *ids_results(struct apply_handle *h, int *ids, int length, int up) {
+    char **list, *s, *name;
+    int *out, outlength, i, n, size, len;
+    size = 16;
+    list = malloc(sizeof(char *) * size);
+    for (n = 0, out = up ? apply_up_ids(h, ids, length, &outlength) : apply_down_ids(h, ids, length, &outlength); out != NULL; out = up ? apply_up_ids(h, NULL, 0, &outlength) : apply_down_ids(h, NULL, 0, &outlength)) {
+        for (i = len = 0; i < outlength; i++)
+            if ((name = apply_symbol_name(h, out[i])) != NULL)
+                len += strlen(name);
+        s = malloc(len + 1);
+        s[0] = '\0';
+        for (i = 0; i < outlength; i++)
+            if ((name = apply_symbol_name(h, out[i])) != NULL)
+                strcat(s, name);
+        if (n == size) {
+            size *= 2;
+            list = realloc(list, sizeof(char *) * size);
+        }
+        list[n++] = s;
+    }
+    s = check_join(list, n);
+    for (i = 0; i < n; i++)
+        free(list[i]);
+    free(list);
+    return(s);
+}
+
+static void test_ids(struct fsm *net) {
+    struct apply_shared *sh;
+    struct apply_handle *h, *ih[2];
+    struct sigma *sig;
+    char **words, *ref[2], *got;
+    int *ids, i, j, length, up;
+
+    h = apply_init(net);
+    sh = apply_shared_init(net);
+    ih[0] = apply_init_shared(sh);
+    ih[1] = apply_init_shared(sh);
+    for (sig = net->sigma; sig != NULL && sig->number != -1; sig = sig->next) {
+        if (sig->number > IDENTITY) {
+            CHECK(apply_symbol_id(ih[0], sig->symbol) == sig->number);
+            CHECK(strcmp(apply_symbol_name(ih[1], sig->number), sig->symbol) == 0);
+        }
+    }
+    CHECK(apply_symbol_id(ih[0], "nosuchsymbol") == -1);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        ids = malloc(sizeof(int) * (strlen(words[i]) + 1));
+        length = check_tokenize(net, words[i], ids);
+        for (up = 0; up < 2; up++)
+            ref[up] = check_apply(h, words[i], up);
+        /* The two handles look up both sides in turn */
+        for (j = 0; j < 4; j++) {
+            up = j % 2;
+            got = ids_results(ih[(i + j / 2) % 2], ids, length, up);
+            CHECK(strcmp(got, ref[up]) == 0);
+            free(got);
+        }
+        free(ref[0]);
+        free(ref[1]);
+        free(ids);
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(ih[0]);
+    apply_clear(ih[1]);
+    apply_shared_clear(sh);
+    apply_clear(h);
+}
+
+/* A result left half read doesn't leak into the next lookup, and the */
+/* other handle on the same tables keeps its own place               */
+static void test_interleave(void) {
+    struct apply_shared *sh;
+    struct apply_handle *h1, *h2;
+    struct fsm *net;
+    int a[1], b[1], *out, outlength;
+
+    net = check_net_words();
+    sh = apply_shared_init(net);
+    h1 = apply_init_shared(sh);
+    h2 = apply_init_shared(sh);
+    a[0] = apply_symbol_id(h1, "a");
+    b[0] = apply_symbol_id(h1, "b");
+    out = apply_down_ids(h1, a, 1, &outlength);
+    CHECK(out != NULL && outlength == 1 && strcmp(apply_symbol_name(h1, out[0]), "x") == 0);
+    out = apply_down_ids(h2, b, 1, &outlength);
+    CHECK(out != NULL && outlength == 1 && out[0] == b[0]);
+    CHECK(apply_down_ids(h1, NULL, 0, &outlength) == NULL);
+    CHECK(apply_down_ids(h2, NULL, 0, &outlength) == NULL);
+    out = apply_up_ids(h1, b, 1, &outlength);
+    CHECK(out != NULL && outlength == 1 && out[0] == b[0]);
+    CHECK(apply_up_ids(h2, a, 1, &outlength) == NULL);
+    apply_clear(h1);
+    apply_clear(h2);
+    apply_shared_clear(sh);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(22);
+    test_interleave();
+    net = check_net_words();
+    test_ids(net);
+    fsm_destroy(net);
+    for (i = 0; i < 60; i++) {
+        net = check_net_random(6, 14, i % 2);
+        test_ids(net);
+        fsm_destroy(net);
+    }
+    return(check_done("ids"));
+}
@@ -0,0 +1,76 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_index_compact() gives the results of apply_index() and of */
+/* the reference search, whatever states its memory limit leaves   */
+/* out and whichever sides are indexed                             */
+
+#include <limits.h>
+#include "check.h"
+
+#define NUMWORDS 200
+
+/* sides: APPLY_INDEX_INPUT, APPLY_INDEX_OUTPUT or both */
+static void test_index(struct fsm *net, int cutoff, int mem_limit, int sides) {
+    struct apply_handle *hl, *hc;
+    char **words, *sl, *sc, *r;
+    int i, up;
+    words = check_word_list(net, NUMWORDS);
+    hl = apply_init(net);
+    hc = apply_init(net);
+    if (sides & APPLY_INDEX_INPUT) {
+        apply_index(hl, APPLY_INDEX_INPUT, cutoff, mem_limit, 0);
+        apply_index_compact(hc, APPLY_INDEX_INPUT, cutoff, mem_limit, 0);
+    }
+    if (sides & APPLY_INDEX_OUTPUT) {
+        apply_index(hl, APPLY_INDEX_OUTPUT, cutoff, mem_limit, 0);
+        apply_index_compact(hc, APPLY_INDEX_OUTPUT, cutoff, mem_limit, 0);
+    }
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            sl = check_apply(hl, words[i], up);
+            sc = check_apply(hc, words[i], up);
+            r = check_reference(net, words[i], up);
+            CHECK(strcmp(sc, sl) == 0);
+            CHECK(strcmp(sc, r) == 0);
+            free(sl);
+            free(sc);
+            free(r);
+        }
+    }
+    apply_clear(hl);
+    apply_clear(hc);
+    check_free_list(words, NUMWORDS);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(4);
+    for (i = 0; i < 30; i++) {
+        net = check_net_random(2 + i % 12, 4 + i % 12 * 3, i % 2);
+        test_index(net, 0, INT_MAX, APPLY_INDEX_INPUT|APPLY_INDEX_OUTPUT);
+        test_index(net, 3, INT_MAX, APPLY_INDEX_INPUT|APPLY_INDEX_OUTPUT);
+        /* Room for a few states only */
+        test_index(net, 0, 256, APPLY_INDEX_INPUT|APPLY_INDEX_OUTPUT);
+        /* Lookups the other way must not use the index */
+        test_index(net, 0, INT_MAX, APPLY_INDEX_INPUT);
+        test_index(net, 0, INT_MAX, APPLY_INDEX_OUTPUT);
+        fsm_destroy(net);
+    }
+    return(check_done("index"));
+}
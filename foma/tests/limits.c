@@ -0,0 +1,234 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_set_limits() cuts a lookup short without changing what it  */
+/* gives up to there: the results are the first ones of the search  */
+/* without limits, or those whose output is short enough, and the   */
+/* status says whether something was left out                       */
+
+#include "check.h"
+
+#define NUMWORDS 100
+#define MAXRESULTS 4096
+
+/* The results of word in the order the search gives them */
+static int results_list(struct apply_handle *h, char *word, int up, char **results) {
+    char *r;
+    int n;
+    for (n = 0, r = up ? apply_up(h, word) : apply_down(h, word); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL)) {
+        if (n < MAXRESULTS)
+            results[n++] = strdup(r);
+    }
+    return(n);
+}
+
+static int is_prefix(char **part, int numpart, char **all, int numall) {
+    int i;
+    if (numpart > numall)
+        return 0;
+    for (i = 0; i < numpart; i++) {
+        if (strcmp(part[i], all[i]) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void free_results(char **results, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        free(results[i]);
+}
+
+static void test_limits_random(struct fsm *net) {
+    struct apply_handle *h, *lh;
+    char **words, *all[MAXRESULTS], *part[MAXRESULTS];
+    int i, j, k, up, numall, numpart, dropped, status;
+
+    h = apply_init(net);
+    lh = apply_init(net);
+    words = check_word_list(net, NUMWORDS);
+    for (up = 0; up < 2; up++) {
+        for (i = 0; i < NUMWORDS; i++) {
+            numall = results_list(h, words[i], up, all);
+            CHECK(apply_get_status(h) == APPLY_OK);
+            /* At most k results, the first k */
+            for (k = 1; k <= 3; k++) {
+                apply_set_limits(lh, 0, k, 0, 0);
+                numpart = results_list(lh, words[i], up, part);
+                status = apply_get_status(lh);
+                CHECK(numpart == (numall < k ? numall : k));
+                CHECK(is_prefix(part, numpart, all, numall));
+                CHECK(status == (numall > k ? APPLY_LIMIT_RESULTS : APPLY_OK));
+                free_results(part, numpart);
+            }
+            /* A few steps give the first results, and all if it's OK */
+            for (k = 1; k <= 64; k *= 4) {
+                apply_set_limits(lh, k, 0, 0, 0);
+                numpart = results_list(lh, words[i], up, part);
+                status = apply_get_status(lh);
+                CHECK(is_prefix(part, numpart, all, numall));
+                CHECK(status == APPLY_OK || status == APPLY_LIMIT_STEPS);
+                if (status == APPLY_OK)
+                    CHECK(numpart == numall);
+                free_results(part, numpart);
+            }
+            /* Outputs longer than k are dropped, and reported */
+            for (k = 1; k <= 4; k++) {
+                apply_set_limits(lh, 0, 0, k, 0);
+                numpart = results_list(lh, words[i], up, part);
+                status = apply_get_status(lh);
+                for (j = 0, dropped = 0; j < numall; j++) {
+                    if ((int) strlen(all[j]) > k)
+                        dropped++;
+                    else if (j - dropped < numpart)
+                        CHECK(strcmp(part[j-dropped], all[j]) == 0);
+                }
+                CHECK(numpart == numall - dropped);
+                if (dropped)
+                    CHECK(status == APPLY_LIMIT_LENGTH);
+                else
+                    CHECK(status == APPLY_OK || status == APPLY_LIMIT_LENGTH);
+                free_results(part, numpart);
+            }
+            free_results(all, numall);
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(lh);
+}
+
+/* A batch ends after the first word a limit cut short */
+static void test_batch_limits(struct fsm *net) {
+    struct apply_handle *h, *lh;
+    struct apply_batch b;
+    char **words, *all[MAXRESULTS];
+    int i, up, first, done, numall, limited;
+
+    h = apply_init(net);
+    lh = apply_init(net);
+    apply_set_limits(lh, 0, 1, 0, 0);
+    words = check_word_list(net, NUMWORDS);
+    b.arena_size = 1 << 16;
+    b.arena = malloc(b.arena_size);
+    b.results_size = 1 << 12;
+    b.results = malloc(sizeof(size_t) * b.results_size);
+    b.word_results = malloc(sizeof(int) * (NUMWORDS + 1));
+    for (up = 0; up < 2; up++) {
+        for (first = 0; first < NUMWORDS; first += done) {
+            done = up ? apply_up_batch(lh, words + first, NUMWORDS - first, &b) : apply_down_batch(lh, words + first, NUMWORDS - first, &b);
+            CHECK(done > 0);
+            CHECK(b.arena_needed == 0 && b.results_needed == 0);
+            if (done <= 0)
+                break;
+            for (i = 0; i < done; i++) {
+                numall = results_list(h, words[first+i], up, all);
+                limited = numall > 1;
+                /* Only the last word may have been cut short */
+                CHECK(!limited || i == done - 1);
+                CHECK(b.word_results[i+1] - b.word_results[i] == (numall > 0));
+                if (numall > 0)
+                    CHECK(strcmp(b.arena + b.results[b.word_results[i]], all[0]) == 0);
+                if (i == done - 1)
+                    CHECK(apply_get_status(lh) == (limited ? APPLY_LIMIT_RESULTS : APPLY_OK));
+                free_results(all, numall);
+            }
+            if (first + done < NUMWORDS)
+                CHECK(apply_get_status(lh) == APPLY_LIMIT_RESULTS);
+        }
+    }
+    free(b.arena);
+    free(b.results);
+    free(b.word_results);
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(lh);
+}
+
+static char *cascade_list(struct apply_cascade *c, char *word, int *n) {
+    char *results[MAXRESULTS], *r;
+    for (*n = 0, r = apply_cascade_down(c, word); r != NULL; r = apply_cascade_down(c, NULL)) {
+        if (*n < MAXRESULTS)
+            results[(*n)++] = strdup(r);
+    }
+    r = check_join(results, *n);
+    free_results(results, *n);
+    return(r);
+}
+
+/* The composed walk keeps to the tightest of the nets' limits */
+static void test_cascade_limits(void) {
+    struct apply_handle *h[2], *lh[2];
+    struct apply_cascade *c, *lc;
+    struct fsm *nets[2];
+    char **words, *s, *r, *p, *q;
+    int i, k, n, numall;
+
+    for (i = 0; i < 2; i++) {
+        nets[i] = check_net_random(4, 14, 1);
+        h[i] = apply_init(nets[i]);
+        lh[i] = apply_init(nets[i]);
+    }
+    c = apply_cascade_init(h, 2);
+    lc = apply_cascade_init(lh, 2);
+    CHECK(apply_cascade_set_composed(c, 1));
+    CHECK(apply_cascade_set_composed(lc, 1));
+    words = check_word_list(nets[0], NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        s = cascade_list(c, words[i], &numall);
+        CHECK(apply_cascade_get_status(c) == APPLY_OK);
+        for (k = 1; k <= 3; k++) {
+            apply_set_limits(lh[k % 2], 0, k, 0, 0);
+            apply_set_limits(lh[1 - k % 2], 0, k + 1, 0, 0);
+            r = cascade_list(lc, words[i], &n);
+            CHECK(n == (numall < k ? numall : k));
+            CHECK(apply_cascade_get_status(lc) == (numall > k ? APPLY_LIMIT_RESULTS : APPLY_OK));
+            /* Every result is one of those without limits */
+            for (p = strtok(r, ","); p != NULL; p = strtok(NULL, ",")) {
+                for (q = strstr(s, p); q != NULL; q = strstr(q + 1, p)) {
+                    if ((q == s || q[-1] == ',') && (q[strlen(p)] == ',' || q[strlen(p)] == '\0'))
+                        break;
+                }
+                CHECK(q != NULL);
+            }
+            free(r);
+        }
+        free(s);
+    }
+    check_free_list(words, NUMWORDS);
+    apply_cascade_clear(c);
+    apply_cascade_clear(lc);
+    for (i = 0; i < 2; i++) {
+        apply_clear(h[i]);
+        apply_clear(lh[i]);
+        fsm_destroy(nets[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(12);
+    for (i = 0; i < 20; i++) {
+        net = check_net_random(8, 24, 1);
+        test_limits_random(net);
+        test_batch_limits(net);
+        fsm_destroy(net);
+        test_cascade_limits();
+    }
+    return(check_done("limits"));
+}
@@ -0,0 +1,274 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Pruning with the subset cache, at any budget, or with the lattice */
+/* gives the results of a plain search, in the same order            */
+
+#include "check.h"
+
+#define NUMWORDS 60
+
+/* All results of word in the order they come, joined with commas */
+static char *prune_apply(struct apply_handle *h, char *word, int up) {
+    char *s, *r;
+    size_t used, size;
+    size = 64;
+    used = 0;
+    s = malloc(size);
+    s[0] = '\0';
+    for (r = up ? apply_up(h, word) : apply_down(h, word); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL)) {
+        if (used + strlen(r) + 2 > size) {
+            size = (used + strlen(r) + 2) * 2;
+            s = realloc(s, size);
+        }
+        used += sprintf(s + used, "%s,", r);
+    }
+    return(s);
+}
+
+/* A random net with a few extra arcs: @:@, ?:?, and flags going  */
+/* forward if flags is set, and an epsilon cycle between states 2 */
+/* and 3 if cycle is set. State 5 is final so that the net never  */
+/* comes out empty                                                */
+static struct fsm *net_prune(int cycle, int flags) {
+    static char *extra[] = { "@_IDENTITY_SYMBOL_@", "@_UNKNOWN_SYMBOL_@", "@U.F.x@", "@U.F.y@", "@R.F.x@" };
+    struct fsm_construct_handle *h;
+    struct fsm_state *line;
+    struct fsm *net;
+    char *sym;
+    int i, source, target;
+    net = check_net_random(8, 20, 1);
+    h = fsm_construct_init("prune");
+    fsm_construct_copy_sigma(h, net->sigma);
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1)
+            fsm_construct_add_arc_nums(h, line->state_no, line->target, line->in, line->out);
+        if (line->final_state)
+            fsm_construct_set_final(h, line->state_no);
+    }
+    for (i = 0; i < 3; i++) {
+        sym = extra[check_rand() % (flags ? 5 : 2)];
+        source = check_rand() % 5;
+        target = check_rand() % 6;
+        if (sym[1] != '_' && target <= source)
+            target = source + 1;
+        fsm_construct_add_arc(h, source, target, sym, sym);
+    }
+    if (cycle) {
+        fsm_construct_add_arc(h, 2, 3, EPS, "a");
+        fsm_construct_add_arc(h, 3, 2, EPS, EPS);
+    }
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    fsm_destroy(net);
+    return(fsm_construct_done(h));
+}
+
+static void test_prune(struct fsm *net, int obey) {
+    /* From no room for the DFA at all to plenty, through budgets */
+    /* that run out in the middle of a word                       */
+    static size_t budgets[] = { 1, 8000, 12000, 20000, 1 << 20 };
+    struct apply_handle *h, *ph[6];
+    char **words, *ref, *got;
+    int i, k, up;
+
+    h = apply_init(net);
+    apply_set_obey_flags(h, obey);
+    for (k = 0; k < 6; k++) {
+        ph[k] = apply_init(net);
+        apply_set_obey_flags(ph[k], obey);
+        if (k < 5)
+            apply_set_subset_cache(ph[k], budgets[k]);
+        else
+            apply_set_lattice(ph[k], 1);
+    }
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            ref = prune_apply(h, words[i], up);
+            for (k = 0; k < 6; k++) {
+                got = prune_apply(ph[k], words[i], up);
+                CHECK(strcmp(got, ref) == 0);
+                free(got);
+            }
+            free(ref);
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    for (k = 0; k < 6; k++)
+        apply_clear(ph[k]);
+    apply_clear(h);
+}
+
+/* (a|b)* a (a|b)^8: a DFA of 512 subsets, which a small budget runs */
+/* out of in the middle of a word                                    */
+static void test_budget(void) {
+    struct fsm_construct_handle *ch;
+    struct apply_handle *h, *ph;
+    struct fsm *net;
+    char word[41], *ref, *got;
+    int i, n;
+
+    ch = fsm_construct_init("budget");
+    fsm_construct_add_arc(ch, 0, 0, "a", "a");
+    fsm_construct_add_arc(ch, 0, 0, "b", "b");
+    fsm_construct_add_arc(ch, 0, 1, "a", "x");
+    for (i = 1; i <= 8; i++) {
+        fsm_construct_add_arc(ch, i, i + 1, "a", "a");
+        fsm_construct_add_arc(ch, i, i + 1, "b", "b");
+    }
+    fsm_construct_set_final(ch, 9);
+    fsm_construct_set_initial(ch, 0);
+    net = fsm_construct_done(ch);
+    h = apply_init(net);
+    ph = apply_init(net);
+    apply_set_subset_cache(ph, 9000);
+    for (n = 0; n < 200; n++) {
+        for (i = 0; i < 40; i++)
+            word[i] = check_rand() % 2 ? 'a' : 'b';
+        word[40] = '\0';
+        ref = prune_apply(h, word, 0);
+        got = prune_apply(ph, word, 0);
+        CHECK(strcmp(got, ref) == 0 && strlen(ref) == (word[31] == 'a' ? 41 : 0));
+        free(got);
+        free(ref);
+    }
+    apply_clear(h);
+    apply_clear(ph);
+    fsm_destroy(net);
+}
+
+struct prune_output {
+    char *buf;
+    size_t used;
+    size_t size;
+};
+
+static int prune_visit(char *result, int length, void *userdata) {
+    struct prune_output *o = userdata;
+    if (o->used + length + 2 > o->size) {
+        o->size = (o->used + length + 2) * 2;
+        o->buf = realloc(o->buf, o->size);
+    }
+    memcpy(o->buf + o->used, result, length);
+    o->used += length;
+    o->buf[o->used++] = ',';
+    o->buf[o->used] = '\0';
+    return(0);
+}
+
+/* The same through the visitor, or a batch of one word */
+static char *prune_foreach(struct apply_handle *h, char *word, int up) {
+    struct prune_output o;
+    o.used = 0;
+    o.size = 64;
+    o.buf = malloc(o.size);
+    o.buf[0] = '\0';
+    (up ? apply_up_foreach : apply_down_foreach)(h, word, prune_visit, &o);
+    return(o.buf);
+}
+
+static char *prune_batch(struct apply_handle *h, char *word, int up) {
+    struct apply_batch b;
+    struct prune_output o;
+    int i, wr[2];
+    o.used = 0;
+    o.size = 64;
+    o.buf = malloc(o.size);
+    o.buf[0] = '\0';
+    b.arena_size = 4096;
+    b.arena = malloc(b.arena_size);
+    b.results_size = 256;
+    b.results = malloc(sizeof(size_t) * b.results_size);
+    b.word_results = wr;
+    while ((up ? apply_up_batch : apply_down_batch)(h, &word, 1, &b) == 0) {
+        if (b.arena_needed > b.arena_size) {
+            b.arena_size = b.arena_needed;
+            b.arena = realloc(b.arena, b.arena_size);
+        }
+        if (b.results_needed > b.results_size) {
+            b.results_size = b.results_needed;
+            b.results = realloc(b.results, sizeof(size_t) * b.results_size);
+        }
+    }
+    for (i = wr[0]; i < wr[1]; i++)
+        prune_visit(b.arena + b.results[i], strlen(b.arena + b.results[i]), &o);
+    free(b.arena);
+    free(b.results);
+    return(o.buf);
+}
+
+/* The lattice prunes the visitor and batch lookups as well, and */
+/* turning it off and on, or using it with the subset cache,     */
+/* changes nothing                                               */
+static void test_lattice(struct fsm *net, int obey) {
+    struct apply_handle *h, *lh, *bh;
+    char **words, *ref, *got;
+    int i, up;
+
+    h = apply_init(net);
+    lh = apply_init(net);
+    bh = apply_init(net);
+    apply_set_obey_flags(h, obey);
+    apply_set_obey_flags(lh, obey);
+    apply_set_obey_flags(bh, obey);
+    apply_set_lattice(lh, 1);
+    apply_set_lattice(bh, 1);
+    apply_set_subset_cache(bh, 8000);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            ref = prune_foreach(h, words[i], up);
+            got = prune_foreach(lh, words[i], up);
+            CHECK(strcmp(got, ref) == 0);
+            free(got);
+            got = prune_batch(lh, words[i], up);
+            CHECK(strcmp(got, ref) == 0);
+            free(got);
+            got = prune_apply(bh, words[i], up);
+            CHECK(strcmp(got, ref) == 0);
+            free(got);
+            apply_set_lattice(lh, i % 2);
+            got = prune_apply(lh, words[i], up);
+            CHECK(strcmp(got, ref) == 0);
+            free(got);
+            free(ref);
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(lh);
+    apply_clear(bh);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(18);
+    test_budget();
+    net = check_net_words();
+    test_prune(net, 1);
+    test_lattice(net, 1);
+    fsm_destroy(net);
+    for (i = 0; i < 80; i++) {
+        net = net_prune(i % 2, i % 3 == 0);
+        test_prune(net, i % 4 != 3);
+        test_lattice(net, i % 4 != 3);
+        fsm_destroy(net);
+    }
+    return(check_done("prune"));
+}
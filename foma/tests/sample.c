@@ -0,0 +1,157 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_uniform_*() draw every accepting path equally often, and   */
+/* both they and apply_random_*() give only words of the net, the   */
+/* same ones for the same apply_set_seed()                          */
+
+#include "check.h"
+
+#define MAXPATHS 12
+#define DRAWS 600
+
+/* A random net over symbols no two of which spell a third, so that */
+/* words read back along their own paths.  Epsilon arcs only lead to */
+/* higher states, and so do all arcs unless cyclic is set            */
+static struct fsm *net_sample(int numstates, int numarcs, int cyclic) {
+    static char *symbols[] = { EPS, "a", "b", "cc", "+N", "\xc3\xa9" };
+    struct fsm_construct_handle *h;
+    char *in, *out;
+    int i, source, target;
+    h = fsm_construct_init("sample");
+    for (i = 0; i < numarcs; i++) {
+        in = symbols[check_rand() % 6];
+        out = symbols[check_rand() % 6];
+        source = check_rand() % (numstates - 1);
+        if (cyclic && in != symbols[0] && out != symbols[0])
+            target = check_rand() % numstates;
+        else
+            target = source + 1 + check_rand() % (numstates - 1 - source);
+        fsm_construct_add_arc(h, source, target, in, out);
+    }
+    fsm_construct_set_final(h, numstates - 1);
+    for (i = 0; i < numstates - 1; i++) {
+        if (check_rand() % 3 == 0)
+            fsm_construct_set_final(h, i);
+    }
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* Every path of an acyclic net comes up about as often as the others */
+static void test_uniform(struct fsm *net) {
+    struct apply_handle *h;
+    char *paths[MAXPATHS], *r;
+    int counts[MAXPATHS], i, j, numpaths, mult, draws;
+    double expected;
+
+    h = apply_init(net);
+    for (numpaths = 0, r = apply_words(h); r != NULL; r = apply_words(h)) {
+        if (numpaths < MAXPATHS)
+            paths[numpaths] = strdup(r);
+        numpaths++;
+    }
+    if (numpaths == 0)
+        CHECK(apply_uniform_words(h) == NULL);
+    if (numpaths == 0 || numpaths > MAXPATHS) {
+        for (i = 0; i < numpaths && i < MAXPATHS; i++)
+            free(paths[i]);
+        apply_clear(h);
+        return;
+    }
+    memset(counts, 0, sizeof(counts));
+    draws = DRAWS * numpaths;
+    apply_set_seed(h, check_rand());
+    for (i = 0; i < draws; i++) {
+        r = apply_uniform_words(h);
+        CHECK(r != NULL);
+        if (r == NULL)
+            break;
+        /* Paths with the same words count together */
+        for (j = 0; j < numpaths && strcmp(paths[j], r) != 0; j++) { }
+        CHECK(j < numpaths);
+        if (j < numpaths)
+            counts[j]++;
+    }
+    for (i = 0; i < numpaths; i++) {
+        for (j = 0, mult = 0; j < numpaths; j++)
+            mult += strcmp(paths[i], paths[j]) == 0;
+        for (j = 0; j < i && strcmp(paths[i], paths[j]) != 0; j++) { }
+        if (j < i)
+            continue;
+        /* Within six standard deviations or so */
+        expected = (double) draws * mult / numpaths;
+        CHECK((counts[i] - expected) * (counts[i] - expected) <= 36 * expected);
+    }
+    for (i = 0; i < numpaths; i++)
+        free(paths[i]);
+    apply_clear(h);
+}
+
+/* Drawn words are words of the net, and a seed fixes the draws.  A */
+/* random walk only ends at a final state, so cyclic nets are        */
+/* minimized first, which leaves no cycle it can't get out of        */
+static void test_draws(struct fsm *net) {
+    struct apply_handle *h, *h2, *lookup;
+    char *r, *r2, *w;
+    int i, j, up, has_words;
+    char *(*draw[4])(struct apply_handle *) = { apply_uniform_upper, apply_uniform_lower, apply_random_upper, apply_random_lower };
+
+    h = apply_init(net);
+    h2 = apply_init(net);
+    lookup = apply_init(net);
+    has_words = apply_words(lookup) != NULL;
+    apply_reset_enumerator(lookup);
+    apply_set_sample_length(h, 8);
+    apply_set_sample_length(h2, 8);
+    for (i = 0; i < 4; i++) {
+        up = i % 2;
+        apply_set_seed(h, 1000 + i);
+        apply_set_seed(h2, 1000 + i);
+        for (j = 0; j < 20; j++) {
+            r = draw[i](h);
+            r2 = draw[i](h2);
+            CHECK((r != NULL) == has_words);
+            CHECK((r == NULL) == (r2 == NULL));
+            if (r == NULL || r2 == NULL)
+                break;
+            CHECK(strcmp(r, r2) == 0);
+            w = strdup(r);
+            CHECK((up ? apply_up(lookup, w) : apply_down(lookup, w)) != NULL);
+            free(w);
+        }
+    }
+    apply_clear(h);
+    apply_clear(h2);
+    apply_clear(lookup);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(14);
+    for (i = 0; i < 200; i++) {
+        net = net_sample(6, 3 + i % 8, 0);
+        test_uniform(net);
+        test_draws(net);
+        fsm_destroy(net);
+        net = fsm_minimize(net_sample(6, 3 + i % 12, 1));
+        test_draws(net);
+        fsm_destroy(net);
+    }
+    return(check_done("sample"));
+}
@@ -0,0 +1,291 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_down_scan() and apply_up_scan() find the matches that       */
+/* looking up every span of the text between symbol boundaries finds, */
+/* the longest from each start or all of them                        */
+
+#include "check.h"
+
+#define NUMWORDS 30
+#define MAXBOUNDS 512
+
+struct scan_output {
+    char **matches;
+    int count;
+    int size;
+    int lastoffset;
+    int ordered;        /* Cleared if offsets ever go down */
+    int stop_after;     /* Ask to stop after this many matches, 0 = never */
+};
+
+static void scan_add(struct scan_output *o, int offset, int length, char *output) {
+    char *m;
+    if (o->count == o->size) {
+        o->size = o->size ? o->size * 2 : 16;
+        o->matches = realloc(o->matches, sizeof(char *) * o->size);
+    }
+    m = malloc(strlen(output) + 32);
+    sprintf(m, "%i:%i:%s", offset, length, output);
+    o->matches[o->count++] = m;
+}
+
+static int scan_visit(int offset, int length, char *output, void *userdata) {
+    struct scan_output *o = userdata;
+    if (offset < o->lastoffset)
+        o->ordered = 0;
+    o->lastoffset = offset;
+    scan_add(o, offset, length, output);
+    return(o->stop_after && o->count == o->stop_after);
+}
+
+static int scan_cmp(const void *a, const void *b) {
+    return(strcmp(*(char **) a, *(char **) b));
+}
+
+/* The distinct matches, sorted and joined.  A search that runs on */
+/* past the end of a span can take an epsilon cycle a different    */
+/* number of times, so only the set of matches is the same.        */
+static char *scan_join(struct scan_output *o) {
+    char *s;
+    int i, n;
+    if (o->count > 0)
+        qsort(o->matches, o->count, sizeof(char *), scan_cmp);
+    for (i = n = 0; i < o->count; i++) {
+        if (n > 0 && strcmp(o->matches[n-1], o->matches[i]) == 0)
+            free(o->matches[i]);
+        else
+            o->matches[n++] = o->matches[i];
+    }
+    s = check_join(o->matches, n);
+    for (i = 0; i < n; i++)
+        free(o->matches[i]);
+    free(o->matches);
+    memset(o, 0, sizeof(*o));
+    o->ordered = 1;
+    return(s);
+}
+
+/* The byte offsets where the symbols of text begin, as apply splits */
+/* it, and its length at the end; returns the number of symbols       */
+static int scan_bounds(struct fsm *net, char *text, int *bounds) {
+    struct sigma *sig;
+    int n, pos, len, bestlen;
+    for (n = 0, pos = 0; text[pos] != '\0' && n < MAXBOUNDS - 1; n++) {
+        bounds[n] = pos;
+        bestlen = 0;
+        for (sig = net->sigma; sig != NULL && sig->number != -1; sig = sig->next) {
+            if (sig->number <= IDENTITY)
+                continue;
+            len = strlen(sig->symbol);
+            if (len > bestlen && strncmp(text + pos, sig->symbol, len) == 0)
+                bestlen = len;
+        }
+        if (bestlen == 0)
+            for (bestlen = 1; (text[pos+bestlen] & 0xc0) == 0x80; bestlen++)
+                ;
+        pos += bestlen;
+    }
+    bounds[n] = pos;
+    return(n);
+}
+
+/* Adds the results of looking up text[bounds[i]..bounds[j]], and */
+/* returns how many there were                                    */
+static int scan_span(struct apply_handle *h, char *text, int *bounds, int i, int j, int up, struct scan_output *o) {
+    char *span, *r;
+    int n;
+    span = strndup(text + bounds[i], bounds[j] - bounds[i]);
+    for (n = 0, r = up ? apply_up(h, span) : apply_down(h, span); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL), n++)
+        scan_add(o, bounds[i], bounds[j] - bounds[i], r);
+    free(span);
+    return(n);
+}
+
+static char *scan_reference(struct apply_handle *h, struct fsm *net, char *text, int mode, int up) {
+    struct scan_output o;
+    int bounds[MAXBOUNDS];
+    int i, j, n;
+    memset(&o, 0, sizeof(o));
+    n = scan_bounds(net, text, bounds);
+    for (i = 0; i < n; ) {
+        if (mode == APPLY_SCAN_ALL) {
+            for (j = i + 1; j <= n; j++)
+                scan_span(h, text, bounds, i, j, up, &o);
+            i++;
+            continue;
+        }
+        for (j = n; j > i && scan_span(h, text, bounds, i, j, up, &o) == 0; j--)
+            ;
+        i = j > i ? j : i + 1;
+    }
+    return(scan_join(&o));
+}
+
+static int scan_run(struct apply_handle *h, char *text, int mode, int up, int stop_after, struct scan_output *o) {
+    memset(o, 0, sizeof(*o));
+    o->ordered = 1;
+    o->stop_after = stop_after;
+    return(up ? apply_up_scan(h, text, mode, scan_visit, o) : apply_down_scan(h, text, mode, scan_visit, o));
+}
+
+static void test_scan(struct fsm *net, int obey) {
+    static int modes[] = { APPLY_SCAN_LONGEST, APPLY_SCAN_ALL };
+    struct apply_handle *h, *sh;
+    struct scan_output all, first;
+    char **words, text[256], *ref, *got;
+    int i, k, n, mode, up;
+
+    h = apply_init(net);
+    sh = apply_init(net);
+    apply_set_obey_flags(h, obey);
+    apply_set_obey_flags(sh, obey);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        /* A few words run together, now and then with a space */
+        text[0] = '\0';
+        for (k = 1 + check_rand() % 3; k > 0; k--) {
+            if (strlen(text) + strlen(words[(i + k) % NUMWORDS]) + 2 > sizeof(text))
+                break;
+            strcat(text, words[(i + k) % NUMWORDS]);
+            if (check_rand() % 3 == 0)
+                strcat(text, " ");
+        }
+        for (mode = 0; mode < 2; mode++) {
+            for (up = 0; up < 2; up++) {
+                n = scan_run(sh, text, modes[mode], up, 0, &all);
+                CHECK(n == all.count && all.ordered);
+                /* Stopping early gives the first matches */
+                if (all.count >= 2) {
+                    k = 1 + check_rand() % (all.count - 1);
+                    CHECK(scan_run(sh, text, modes[mode], up, k, &first) == k);
+                    for (n = 0; n < k && n < first.count; n++)
+                        CHECK(strcmp(first.matches[n], all.matches[n]) == 0);
+                    free(scan_join(&first));
+                }
+                ref = scan_reference(h, net, text, modes[mode], up);
+                got = scan_join(&all);
+                CHECK(strcmp(got, ref) == 0);
+                free(got);
+                free(ref);
+            }
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(sh);
+}
+
+/* A random net with a few extra arcs: @:@, ?:?, and flags going  */
+/* forward if flags is set, and an epsilon cycle between states 2 */
+/* and 3 if cycle is set. State 5 is final so that the net never  */
+/* comes out empty                                                */
+static struct fsm *net_scan(int cycle, int flags) {
+    static char *extra[] = { "@_IDENTITY_SYMBOL_@", "@_UNKNOWN_SYMBOL_@", "@U.F.x@", "@U.F.y@", "@R.F.x@" };
+    struct fsm_construct_handle *h;
+    struct fsm_state *line;
+    struct fsm *net;
+    char *sym;
+    int i, source, target;
+    net = check_net_random(6, 12, 1);
+    h = fsm_construct_init("scan");
+    fsm_construct_copy_sigma(h, net->sigma);
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1)
+            fsm_construct_add_arc_nums(h, line->state_no, line->target, line->in, line->out);
+        if (line->final_state)
+            fsm_construct_set_final(h, line->state_no);
+    }
+    for (i = 0; i < 3; i++) {
+        sym = extra[check_rand() % (flags ? 5 : 2)];
+        source = check_rand() % 5;
+        target = check_rand() % 6;
+        if (sym[1] != '_' && target <= source)
+            target = source + 1;
+        fsm_construct_add_arc(h, source, target, sym, sym);
+    }
+    if (cycle) {
+        fsm_construct_add_arc(h, 2, 3, EPS, EPS);
+        fsm_construct_add_arc(h, 3, 2, EPS, EPS);
+    }
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    fsm_destroy(net);
+    return(fsm_construct_done(h));
+}
+
+static struct fsm *net_long(char *first) {
+    struct fsm_construct_handle *ch;
+    ch = fsm_construct_init("long");
+    fsm_construct_add_arc(ch, 0, 1, first, first);
+    fsm_construct_add_arc(ch, 1, 1, first, first);
+    fsm_construct_add_arc(ch, 1, 1, "a", "a");
+    fsm_construct_add_arc(ch, 1, 2, "a", "x");
+    fsm_construct_set_final(ch, 2);
+    fsm_construct_set_initial(ch, 0);
+    return(fsm_construct_done(ch));
+}
+
+/* ? (?|a)* a and b (b|a)* a on a long text of b with a c now and   */
+/* then: for the first, the longest match runs from the start to the */
+/* last a, and every a ends a match from every start before it but   */
+/* the a's; for the second, matches only start after the last c      */
+static void test_long(void) {
+    struct apply_handle *h;
+    struct scan_output o;
+    struct fsm *net;
+    char text[2001];
+    int i;
+
+    for (i = 0; i < 2000; i++)
+        text[i] = i % 500 == 250 ? 'a' : i % 500 == 499 ? 'c' : 'b';
+    text[2000] = '\0';
+    net = net_long("@_IDENTITY_SYMBOL_@");
+    h = apply_init(net);
+    CHECK(scan_run(h, text, APPLY_SCAN_LONGEST, 0, 0, &o) == 1);
+    CHECK(o.count == 1 && strncmp(o.matches[0], "0:1751:", 7) == 0);
+    free(scan_join(&o));
+    CHECK(scan_run(h, text, APPLY_SCAN_ALL, 0, 0, &o) == 250 + 749 + 1248 + 1747);
+    free(scan_join(&o));
+    apply_clear(h);
+    fsm_destroy(net);
+    net = net_long("b");
+    h = apply_init(net);
+    CHECK(scan_run(h, text, APPLY_SCAN_LONGEST, 0, 0, &o) == 4);
+    CHECK(o.count == 4 && strncmp(o.matches[3], "1500:251:", 9) == 0);
+    free(scan_join(&o));
+    CHECK(scan_run(h, text, APPLY_SCAN_ALL, 0, 0, &o) == 4 * 250);
+    free(scan_join(&o));
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(17);
+    test_long();
+    net = check_net_words();
+    test_scan(net, 1);
+    fsm_destroy(net);
+    for (i = 0; i < 60; i++) {
+        net = net_scan(i % 2, i % 3 == 0);
+        test_scan(net, i % 4 != 3);
+        fsm_destroy(net);
+    }
+    return(check_done("scan"));
+}
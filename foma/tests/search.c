@@ -0,0 +1,111 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* The vector arc search kernels find the arcs the scalar one and a */
+/* plain scan find, and binary search over a large alphabet gives   */
+/* the reference results                                            */
+
+#include "check.h"
+
+#define MAXARCS 300
+
+static int search_scan(short int *syms, int lo, int hi, int target) {
+    for ( ; lo < hi && syms[lo] < target; lo++)
+        ;
+    return(lo);
+}
+
+static void test_kernels(void) {
+    int (*kernels[3])(short int *syms, int lo, int hi, int target);
+    short int syms[MAXARCS];
+    int i, k, n, numkernels, lo, hi, target, round, step;
+    numkernels = apply_search_kernels(kernels);
+    CHECK(numkernels >= 1);
+    for (round = 0; round < 20000; round++) {
+        /* Sorted runs with repeats, searched over any subrange */
+        n = check_rand() % MAXARCS;
+        step = round % 2 ? 100 : 3;
+        for (i = 0; i < n; i++)
+            syms[i] = (i ? syms[i-1] : 0) + check_rand() % step;
+        lo = n ? check_rand() % n : 0;
+        hi = lo + (n - lo ? check_rand() % (n - lo + 1) : 0);
+        switch (check_rand() % 3) {
+        case 0:
+            target = (lo < hi) ? syms[lo + check_rand() % (hi - lo)] : 0;
+            break;
+        case 1:
+            target = (lo < hi) ? syms[lo + check_rand() % (hi - lo)] + 1 : 1;
+            break;
+        default:
+            target = check_rand() % 32768;
+        }
+        for (k = 0; k < numkernels; k++)
+            CHECK(kernels[k](syms, lo, hi, target) == search_scan(syms, lo, hi, target));
+    }
+}
+
+/* One state with an arc for each of numsyms symbols, and one more */
+/* state that loops back with every other one                      */
+static struct fsm *net_alphabet(int numsyms) {
+    struct fsm_construct_handle *h;
+    char in[16], out[16];
+    int i;
+    h = fsm_construct_init("alphabet");
+    for (i = 0; i < numsyms; i++) {
+        sprintf(in, "s%i", i);
+        sprintf(out, "t%i", i % 7);
+        fsm_construct_add_arc(h, 0, 1, in, out);
+        if (i % 2 == 0)
+            fsm_construct_add_arc(h, 1, 0, in, in);
+    }
+    fsm_construct_set_final(h, 1);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+static void test_alphabet(int numsyms) {
+    struct apply_handle *h;
+    struct fsm *net;
+    char word[64], *s, *r;
+    int i, j, up;
+    net = net_alphabet(numsyms);
+    fsm_sort_arcs(net, 1);
+    h = apply_init(net);
+    for (i = 0; i < 500; i++) {
+        word[0] = '\0';
+        for (j = check_rand() % 4; j >= 0; j--)
+            sprintf(word + strlen(word), "s%i", check_rand() % (numsyms + 5));
+        for (up = 0; up < 2; up++) {
+            s = check_apply(h, word, up);
+            r = check_reference(net, word, up);
+            CHECK(strcmp(s, r) == 0);
+            free(s);
+            free(r);
+        }
+    }
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    check_srand(6);
+    test_kernels();
+    test_alphabet(20);
+    test_alphabet(90);
+    test_alphabet(1000);
+    return(check_done("search"));
+}
@@ -0,0 +1,124 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* Handles on shared tables, used from several threads at once, */
+/* give the results of handles made with apply_init()            */
+
+#include <pthread.h>
+#include "check.h"
+
+#define NUMWORDS 400
+#define NUMTHREADS 4
+
+static char **words;
+static char *expect[NUMWORDS][2];
+
+struct worker {
+    pthread_t thread;
+    struct apply_shared *shared;
+    int mismatches;
+};
+
+static void *shared_work(void *arg) {
+    struct worker *w = arg;
+    struct apply_handle *h;
+    char *s;
+    int i, round, up;
+    h = apply_init_shared(w->shared);
+    for (round = 0; round < 5; round++) {
+        for (i = 0; i < NUMWORDS; i++) {
+            for (up = 0; up < 2; up++) {
+                s = check_apply(h, words[i], up);
+                if (strcmp(s, expect[i][up]) != 0)
+                    w->mismatches++;
+                free(s);
+            }
+        }
+    }
+    apply_clear(h);
+    return(NULL);
+}
+
+static void test_shared_threads(struct fsm *net) {
+    struct apply_handle *h;
+    struct apply_shared *sh;
+    struct worker workers[NUMTHREADS];
+    int i, up;
+
+    h = apply_init(net);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++)
+            expect[i][up] = check_apply(h, words[i], up);
+    }
+    apply_clear(h);
+
+    sh = apply_shared_init(net);
+    for (i = 0; i < NUMTHREADS; i++) {
+        workers[i].shared = sh;
+        workers[i].mismatches = 0;
+        CHECK(pthread_create(&workers[i].thread, NULL, shared_work, &workers[i]) == 0);
+    }
+    for (i = 0; i < NUMTHREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        CHECK(workers[i].mismatches == 0);
+    }
+    apply_shared_clear(sh);
+
+    for (i = 0; i < NUMWORDS; i++) {
+        free(expect[i][0]);
+        free(expect[i][1]);
+    }
+    check_free_list(words, NUMWORDS);
+}
+
+/* Enumeration goes through the same tables */
+static void test_shared_words(struct fsm *net) {
+    struct apply_handle *h, *hs;
+    struct apply_shared *sh;
+    char *r, *s;
+    int n;
+    h = apply_init(net);
+    sh = apply_shared_init(net);
+    hs = apply_init_shared(sh);
+    for (n = 0; (r = apply_words(h)) != NULL; n++) {
+        r = strdup(r);
+        s = apply_words(hs);
+        CHECK(s != NULL && strcmp(r, s) == 0);
+        free(r);
+    }
+    CHECK(n == 1092);
+    CHECK(apply_words(hs) == NULL);
+    apply_clear(hs);
+    apply_shared_clear(sh);
+    apply_clear(h);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(1);
+    for (i = 0; i < 20; i++) {
+        net = check_net_random(8, 24, 1);
+        test_shared_threads(net);
+        fsm_destroy(net);
+    }
+    net = check_net_words();
+    test_shared_words(net);
+    fsm_destroy(net);
+    return(check_done("shared"));
+}
@@ -0,0 +1,99 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+/* fsm_determinize() with g_subset_threads above one builds the same   */
+/* net, line for line, as with one thread                              */
+
+#include "check.h"
+
+extern int g_subset_threads;
+
+/* (a|b)* a (a|b)^n, whose DFA has 2^(n+1) states, next to a chain of */
+/* length states over a and b, to bring the net past the size that is */
+/* worth threading                                                    */
+static struct fsm *net_nth_chain(int n, int length) {
+    struct fsm_construct_handle *h;
+    int i, first;
+    h = fsm_construct_init("nth");
+    fsm_construct_add_arc(h, 0, 1, EPS, EPS);
+    fsm_construct_add_arc(h, 1, 1, "a", "a");
+    fsm_construct_add_arc(h, 1, 1, "b", "b");
+    fsm_construct_add_arc(h, 1, 2, "a", "a");
+    for (i = 2; i < n+2; i++) {
+        fsm_construct_add_arc(h, i, i+1, "a", "a");
+        fsm_construct_add_arc(h, i, i+1, "b", "b");
+    }
+    fsm_construct_set_final(h, n+2);
+    first = n+3;
+    fsm_construct_add_arc(h, 0, first, EPS, EPS);
+    for (i = first; i < first+length; i++) {
+        fsm_construct_add_arc(h, i, i+1, "a", "a");
+        fsm_construct_add_arc(h, i, i+1, i % 3 ? "b" : EPS, "b");
+        if (i % 7 == 0)
+            fsm_construct_add_arc(h, i, first + (i * 13) % length, "b", "a");
+    }
+    fsm_construct_set_final(h, first+length);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* The same net built with threads threads */
+static struct fsm *subset_determinize(struct fsm *net, int threads) {
+    g_subset_threads = threads;
+    net = fsm_determinize(fsm_copy(net));
+    g_subset_threads = 1;
+    return(net);
+}
+
+static int subset_same(struct fsm *a, struct fsm *b) {
+    struct fsm_state *la, *lb;
+    if (a->statecount != b->statecount || a->linecount != b->linecount || a->finalcount != b->finalcount)
+        return(0);
+    for (la = a->states, lb = b->states; la->state_no != -1 && lb->state_no != -1; la++, lb++) {
+        if (la->state_no != lb->state_no || la->in != lb->in || la->out != lb->out || la->target != lb->target || la->final_state != lb->final_state || la->start_state != lb->start_state)
+            return(0);
+    }
+    return(la->state_no == -1 && lb->state_no == -1);
+}
+
+static void test_subset(struct fsm *net) {
+    static int threads[] = { 2, 3, 8, 0 };
+    struct fsm *ref, *out;
+    int i;
+    ref = subset_determinize(net, 1);
+    for (i = 0; i < 4; i++) {
+        out = subset_determinize(net, threads[i]);
+        CHECK(subset_same(out, ref));
+        fsm_destroy(out);
+    }
+    fsm_destroy(ref);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(24);
+    net = net_nth_chain(10, 400);
+    test_subset(net);
+    fsm_destroy(net);
+    for (i = 0; i < 8; i++) {
+        net = check_net_random(300, 900 + 100 * i, 1);
+        CHECK(net->statecount >= 256);
+        test_subset(net);
+        fsm_destroy(net);
+    }
+    return(check_done("subset"));
+}
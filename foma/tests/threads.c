@@ -0,0 +1,126 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+/* Nets compiled on several threads at once come out as they do one at */
+/* a time: the constructions keep their working state per thread       */
+
+#include <pthread.h>
+#include "check.h"
+
+#define NUMTHREADS 4
+#define NUMNETS 40
+
+struct threads_job {
+    struct fsm *in[NUMNETS][2];
+    struct fsm *out[NUMNETS];
+};
+
+/* Arcs from 0 to 1 with each of symbols, and 1 final */
+static struct fsm *net_choice(char **symbols, int n) {
+    struct fsm_construct_handle *h;
+    int i;
+    h = fsm_construct_init("choice");
+    for (i = 0; i < n; i++)
+        fsm_construct_add_arc(h, 0, 1, symbols[i], symbols[i]);
+    fsm_construct_set_final(h, 1);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+/* A random net, every other one between flags that set, require and */
+/* forbid a value, for flag_eliminate() to resolve.  The union with a */
+/* keeps the language from being empty, which trimming can't handle  */
+static struct fsm *net_threads(int flags) {
+    static char *before[] = { "@P.F.x@", EPS };
+    static char *after[] = { "@R.F.x@", "@D.F.x@", "@R.F@" };
+    static char *a[] = { "a" };
+    struct fsm *net;
+    net = fsm_union(check_net_random(8, 20, 1), net_choice(a, 1));
+    if (flags)
+        net = fsm_concat(net_choice(before, 2), fsm_concat(net, net_choice(after, 3)));
+    return(fsm_minimize(net));
+}
+
+/* Composition, epsilon removal, determinization, minimization and */
+/* flag elimination of a and b, which it consumes                  */
+static struct fsm *threads_compile(struct fsm *a, struct fsm *b) {
+    struct fsm *r;
+    r = fsm_compose(fsm_copy(a), fsm_invert(fsm_copy(b)));
+    r = fsm_union(r, fsm_kleene_star(fsm_concat(fsm_lower(fsm_copy(b)), fsm_upper(b))));
+    r = fsm_union(fsm_minimize(fsm_determinize(r)), flag_eliminate(a, NULL));
+    return(fsm_minimize(r));
+}
+
+/* The final states of net, counted from its lines since finalcount */
+/* isn't always kept up to date                                     */
+static int threads_finals(struct fsm *net) {
+    struct fsm_state *line;
+    int n, last;
+    for (n = 0, last = -1, line = net->states; line->state_no != -1; line++) {
+        if (line->state_no != last && line->final_state)
+            n++;
+        last = line->state_no;
+    }
+    return(n);
+}
+
+static void *threads_run(void *arg) {
+    struct threads_job *job;
+    int i;
+    job = arg;
+    for (i = 0; i < NUMNETS; i++)
+        job->out[i] = threads_compile(job->in[i][0], job->in[i][1]);
+    fsm_thread_clear();
+    return(NULL);
+}
+
+int main(int argc, char **argv) {
+    static struct threads_job jobs[NUMTHREADS+1];
+    pthread_t threads[NUMTHREADS];
+    struct fsm *a, *b, *ref, *out;
+    int i, t;
+
+    check_srand(23);
+    for (i = 0; i < NUMNETS; i++) {
+        a = net_threads(i % 2);
+        b = net_threads(0);
+        for (t = 0; t <= NUMTHREADS; t++) {
+            jobs[t].in[i][0] = fsm_copy(a);
+            jobs[t].in[i][1] = fsm_copy(b);
+        }
+        fsm_destroy(a);
+        fsm_destroy(b);
+    }
+    /* The last job is the reference, compiled on this thread alone */
+    threads_run(&jobs[NUMTHREADS]);
+    for (t = 0; t < NUMTHREADS; t++)
+        CHECK(pthread_create(&threads[t], NULL, threads_run, &jobs[t]) == 0);
+    for (t = 0; t < NUMTHREADS; t++)
+        pthread_join(threads[t], NULL);
+    for (i = 0; i < NUMNETS; i++) {
+        ref = jobs[NUMTHREADS].out[i];
+        for (t = 0; t < NUMTHREADS; t++) {
+            out = jobs[t].out[i];
+            CHECK(out->statecount == ref->statecount);
+            CHECK(out->arccount == ref->arccount);
+            CHECK(threads_finals(out) == threads_finals(ref));
+            CHECK(fsm_equivalent(fsm_copy(out), fsm_copy(ref)));
+            fsm_destroy(out);
+        }
+        fsm_destroy(ref);
+    }
+    return(check_done("threads"));
+}
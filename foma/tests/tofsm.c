@@ -0,0 +1,200 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* apply_down_to_fsm() and apply_up_to_fsm() give automata whose words */
+/* are the distinct results of apply_down() and apply_up(), over an    */
+/* alphabet of just the symbols they need                              */
+
+#include "check.h"
+
+#define NUMWORDS 80
+
+static int tofsm_cmp(const void *a, const void *b) {
+    return(strcmp(*(char **) a, *(char **) b));
+}
+
+/* Sorts and joins the distinct strings of list, freeing them */
+static char *tofsm_join(char **list, int n) {
+    char *s;
+    int i, m;
+    if (n > 0)
+        qsort(list, n, sizeof(char *), tofsm_cmp);
+    for (i = m = 0; i < n; i++) {
+        if (m > 0 && strcmp(list[m-1], list[i]) == 0)
+            free(list[i]);
+        else
+            list[m++] = list[i];
+    }
+    s = check_join(list, m);
+    for (i = 0; i < m; i++)
+        free(list[i]);
+    free(list);
+    return(s);
+}
+
+static char *tofsm_results(struct apply_handle *h, char *word, int up) {
+    char **list, *r;
+    int n, size;
+    size = 16;
+    list = malloc(sizeof(char *) * size);
+    for (n = 0, r = up ? apply_up(h, word) : apply_down(h, word); r != NULL; r = up ? apply_up(h, NULL) : apply_down(h, NULL)) {
+        if (n == size) {
+            size *= 2;
+            list = realloc(list, sizeof(char *) * size);
+        }
+        list[n++] = strdup(r);
+    }
+    return(tofsm_join(list, n));
+}
+
+static char *tofsm_words(struct fsm *net) {
+    struct apply_handle *h;
+    char **list, *r;
+    int n, size;
+    size = 16;
+    list = malloc(sizeof(char *) * size);
+    h = apply_init(net);
+    for (n = 0; (r = apply_upper_words(h)) != NULL; ) {
+        if (n == size) {
+            size *= 2;
+            list = realloc(list, sizeof(char *) * size);
+        }
+        list[n++] = strdup(r);
+    }
+    apply_clear(h);
+    return(tofsm_join(list, n));
+}
+
+/* A random net, now and then with an @:@ arc, or a flag that */
+/* forbids what another requires                              */
+static struct fsm *net_tofsm(int kind) {
+    struct fsm_construct_handle *h;
+    struct fsm_state *line;
+    struct fsm *net;
+    net = check_net_random(6, 14, 1);
+    h = fsm_construct_init("tofsm");
+    fsm_construct_copy_sigma(h, net->sigma);
+    for (line = net->states; line->state_no != -1; line++) {
+        if (line->target != -1)
+            fsm_construct_add_arc_nums(h, line->state_no, line->target, line->in, line->out);
+        if (line->final_state)
+            fsm_construct_set_final(h, line->state_no);
+    }
+    if (kind == 1) {
+        fsm_construct_add_arc(h, check_rand() % 6, check_rand() % 6, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@");
+    } else if (kind == 2) {
+        fsm_construct_add_arc(h, 0, 1 + check_rand() % 2, "@P.F.x@", "@P.F.x@");
+        fsm_construct_add_arc(h, 3, 4 + check_rand() % 2, "@D.F.x@", "@D.F.x@");
+        fsm_construct_add_arc(h, 2, 3, "@R.F.x@", "@R.F.x@");
+    }
+    fsm_construct_set_final(h, 5);
+    fsm_construct_set_initial(h, 0);
+    fsm_destroy(net);
+    return(fsm_construct_done(h));
+}
+
+static void test_tofsm(struct fsm *net, int obey) {
+    struct apply_handle *h, *fh;
+    struct fsm *out;
+    char **words, *ref, *got;
+    int i, up;
+
+    h = apply_init(net);
+    fh = apply_init(net);
+    apply_set_obey_flags(h, obey);
+    apply_set_obey_flags(fh, obey);
+    words = check_word_list(net, NUMWORDS);
+    for (i = 0; i < NUMWORDS; i++) {
+        for (up = 0; up < 2; up++) {
+            ref = tofsm_results(h, words[i], up);
+            out = up ? apply_up_to_fsm(fh, words[i]) : apply_down_to_fsm(fh, words[i]);
+            got = tofsm_words(out);
+            CHECK(strcmp(got, ref) == 0);
+            fsm_destroy(out);
+            free(got);
+            free(ref);
+        }
+    }
+    check_free_list(words, NUMWORDS);
+    apply_clear(h);
+    apply_clear(fh);
+}
+
+/* The symbols of a net's sigma, numbered from IDENTITY up */
+static char *tofsm_sigma(struct fsm *net) {
+    static char buf[256];
+    struct sigma *sigma;
+    buf[0] = '\0';
+    for (sigma = net->sigma; sigma != NULL && sigma->number != -1; sigma = sigma->next) {
+        if (sigma->number < IDENTITY)
+            continue;
+        if (buf[0] != '\0')
+            strcat(buf, " ");
+        strcat(buf, sigma->symbol);
+    }
+    return(buf);
+}
+
+/* a:? b c:d: the sigma of the outputs has only the symbols on their */
+/* arcs, and where ? is written it must stay apart from every symbol  */
+/* the net knows                                                      */
+static void test_sigma(void) {
+    struct fsm_construct_handle *ch;
+    struct apply_handle *h;
+    struct fsm *net, *out;
+
+    ch = fsm_construct_init("sigma");
+    fsm_construct_add_arc(ch, 0, 1, "a", "@_UNKNOWN_SYMBOL_@");
+    fsm_construct_add_arc(ch, 0, 1, "b", "b");
+    fsm_construct_add_arc(ch, 0, 1, "c", "d");
+    fsm_construct_set_final(ch, 1);
+    fsm_construct_set_initial(ch, 0);
+    net = fsm_construct_done(ch);
+    h = apply_init(net);
+    out = apply_down_to_fsm(h, "c");
+    CHECK(out->statecount == 2 && out->arccount == 1);
+    CHECK(strcmp(tofsm_sigma(out), "d") == 0);
+    fsm_destroy(out);
+    out = apply_down_to_fsm(h, "b");
+    CHECK(strcmp(tofsm_sigma(out), "b") == 0);
+    fsm_destroy(out);
+    out = apply_down_to_fsm(h, "a");
+    CHECK(out->arccount == 1);
+    CHECK(strcmp(tofsm_sigma(out), "@_IDENTITY_SYMBOL_@ a b c d") == 0);
+    fsm_destroy(out);
+    out = apply_down_to_fsm(h, "z");
+    CHECK(out->finalcount == 0);
+    fsm_destroy(out);
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    struct fsm *net;
+    int i;
+    check_srand(20);
+    test_sigma();
+    net = check_net_words();
+    test_tofsm(net, 1);
+    fsm_destroy(net);
+    for (i = 0; i < 60; i++) {
+        net = net_tofsm(i % 3);
+        test_tofsm(net, i % 4 != 3);
+        fsm_destroy(net);
+    }
+    return(check_done("tofsm"));
+}
@@ -0,0 +1,134 @@
+/*     Foma: a finite-state toolkit and library.                             */
+/*     Copyright © 2008-2011 Mans Hulden                                     */
+
+/*     This file is part of foma.                                            */
+
+/*     Foma is free software: you can redistribute it and/or modify          */
+/*     it under the terms of the GNU General Public License version 2 as     */
+/*     published by the Free Software Foundation.                            */
+
+/*     Foma is distributed in the hope that it will be useful,               */
+/*     but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/*     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/*     GNU General Public License for more details.                          */
+
+/*     You should have received a copy of the GNU General Public License     */
+/*     along with foma.  If not, see <http://www.gnu.org/licenses/>.         */
+
+/* The input tokenizer splits words into the longest symbols of the */
+/* sigma from left to right, as a naive search over the sigma does, */
+/* with and without its ASCII fast path                             */
+
+#include "check.h"
+
+#define MAXSYMS 40
+
+/* Pieces the alphabets and the words are made of: single ASCII    */
+/* bytes, UTF-8 letters, and prefixes of one another               */
+static char *pieces[] = { "a", "b", "c", "s", "1", "2", "+", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "x" };
+
+#define NUMPIECES 11
+
+static struct fsm *net_alphabet(char **symbols, int numsyms) {
+    struct fsm_construct_handle *h;
+    int i;
+    h = fsm_construct_init("alphabet");
+    for (i = 0; i < numsyms; i++)
+        fsm_construct_add_arc(h, 0, 0, symbols[i], symbols[i]);
+    fsm_construct_set_final(h, 0);
+    fsm_construct_set_initial(h, 0);
+    return(fsm_construct_done(h));
+}
+
+static void random_string(char *buf, int maxpieces) {
+    int i, n;
+    buf[0] = '\0';
+    n = 1 + check_rand() % maxpieces;
+    for (i = 0; i < n; i++)
+        strcat(buf, pieces[check_rand() % NUMPIECES]);
+}
+
+static void test_tokenizer(int numsyms, int maxlen) {
+    struct apply_handle *h;
+    struct fsm *net;
+    char *symbols[MAXSYMS], buf[MAXSYMS][32], word[128];
+    int tokens[128], ref[128], lengths[128];
+    int i, j, n, nref, len, same;
+
+    for (i = 0; i < numsyms; i++) {
+        random_string(buf[i], maxlen);
+        symbols[i] = buf[i];
+    }
+    net = net_alphabet(symbols, numsyms);
+    h = apply_init(net);
+    for (i = 0; i < 200; i++) {
+        random_string(word, 12);
+        n = apply_tokenize(h, word, tokens, lengths);
+        nref = check_tokenize(net, word, ref);
+        same = (n == nref);
+        for (j = 0, len = 0; same && j < n; j++) {
+            if (tokens[j] != (ref[j] == -1 ? IDENTITY : ref[j]))
+                same = 0;
+            len += lengths[j];
+        }
+        CHECK(same);
+        CHECK(!same || len == (int) strlen(word));
+    }
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+/* s0 ... s99: nodes with more children than the tokenizer scans */
+static void test_wide(void) {
+    struct apply_handle *h;
+    struct fsm *net;
+    char *symbols[100], buf[100][8], word[16];
+    int tokens[16], lengths[16];
+    int i, n;
+    for (i = 0; i < 100; i++) {
+        sprintf(buf[i], "s%i", i);
+        symbols[i] = buf[i];
+    }
+    net = net_alphabet(symbols, 100);
+    h = apply_init(net);
+    for (i = 0; i < 100; i++) {
+        sprintf(word, "s%i", i);
+        n = apply_tokenize(h, word, tokens, lengths);
+        CHECK(n == 1 && strcmp(sigma_string(tokens[0], net->sigma), word) == 0);
+    }
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+/* Combining marks join the symbol before them into one unknown    */
+/* symbol, and malformed UTF-8 is stepped over a byte at a time    */
+static void test_utf8(void) {
+    struct apply_handle *h;
+    struct fsm *net;
+    char *symbols[] = { "a", "b", "ab" };
+    int tokens[16], lengths[16], n;
+    net = net_alphabet(symbols, 3);
+    h = apply_init(net);
+    n = apply_tokenize(h, "a\xcc\x81" "b", tokens, lengths);
+    CHECK(n == 2 && tokens[0] == IDENTITY && lengths[0] == 3 && lengths[1] == 1);
+    n = apply_tokenize(h, "ab\xcc\x81", tokens, lengths);
+    CHECK(n == 1 && tokens[0] == IDENTITY && lengths[0] == 4);
+    n = apply_tokenize(h, "\xc3", tokens, lengths);
+    CHECK(n == 1 && tokens[0] == IDENTITY && lengths[0] == 1);
+    n = apply_tokenize(h, "b\xe2\x82", tokens, lengths);
+    CHECK(n >= 2 && tokens[0] == sigma_find("b", net->sigma) && lengths[0] == 1 && lengths[1] + (n > 2 ? lengths[2] : 0) == 2);
+    n = apply_tokenize(h, "\x82\x82" "ab", tokens, lengths);
+    CHECK(n == 3 && lengths[0] == 1 && lengths[1] == 1 && tokens[2] == sigma_find("ab", net->sigma));
+    apply_clear(h);
+    fsm_destroy(net);
+}
+
+int main(int argc, char **argv) {
+    int i;
+    check_srand(8);
+    for (i = 0; i < 300; i++)
+        test_tokenizer(1 + i % MAXSYMS, 1 + i % 4);
+    test_wide();
+    test_utf8();
+    return(check_done("tokenize"));
+}